@@ -0,0 +1,76 @@
+#include "bench_keys.hpp"
+
+#include <sharedpp/json.hpp>
+
+#include <roar/utility/sha.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+namespace TunnelBore::Benchmarks
+{
+    // #####################################################################################################################
+    JwtKeyPair generateJwtKeyPair()
+    {
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> context{
+            EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), &EVP_PKEY_CTX_free};
+        EVP_PKEY* rawKey = nullptr;
+        if (!context || EVP_PKEY_keygen_init(context.get()) <= 0 ||
+            EVP_PKEY_CTX_set_rsa_keygen_bits(context.get(), 2048) <= 0 || EVP_PKEY_keygen(context.get(), &rawKey) <= 0)
+        {
+            throw std::runtime_error("Could not generate the jwt key pair.");
+        }
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{rawKey, &EVP_PKEY_free};
+
+        const auto toPem = [&key](bool isPrivate) {
+            std::unique_ptr<BIO, decltype(&BIO_free)> bio{BIO_new(BIO_s_mem()), &BIO_free};
+            const auto written = isPrivate
+                ? PEM_write_bio_PrivateKey(bio.get(), key.get(), nullptr, nullptr, 0, nullptr, nullptr)
+                : PEM_write_bio_PUBKEY(bio.get(), key.get());
+            if (written != 1)
+                throw std::runtime_error("Could not encode the jwt key pair.");
+            char* data = nullptr;
+            const auto size = BIO_get_mem_data(bio.get(), &data);
+            return std::string(data, static_cast<std::size_t>(size));
+        };
+        return {.privateKey = toPem(true), .publicKey = toPem(false)};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void writeFile(std::filesystem::path const& path, std::string const& content)
+    {
+        std::filesystem::create_directories(path.parent_path());
+        std::ofstream writer{path, std::ios_base::binary};
+        if (!writer.good())
+            throw std::runtime_error("Cannot write " + path.string());
+        writer << content;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void writeUsersFile(std::filesystem::path const& path, std::string const& identity, std::string const& password)
+    {
+        const std::string salt = "salt";
+        const std::string pepper = "pepper";
+        const auto hashed = Roar::sha512(password + "_" + salt + "_" + pepper);
+        if (!hashed)
+            throw std::runtime_error("Could not hash the bench password.");
+        writeFile(
+            path,
+            json{
+                {"pepper", pepper},
+                {"publishers",
+                 json::array({json{
+                     {"identity", identity},
+                     {"email", identity + "@localhost"},
+                     {"pass", *hashed},
+                     {"salt", salt},
+                     {"maxServices", 1},
+                 }})},
+            }
+                .dump());
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace TunnelBore::Benchmarks
+{
+    /**
+     * PEM encoded RS256 key pair like the one the broker signs and verifies tokens with.
+     */
+    struct JwtKeyPair
+    {
+        std::string privateKey;
+        std::string publicKey;
+    };
+
+    JwtKeyPair generateJwtKeyPair();
+
+    void writeFile(std::filesystem::path const& path, std::string const& content);
+
+    /**
+     * @brief Writes a broker users.json with a single publisher that authenticates with identity and password.
+     */
+    void writeUsersFile(std::filesystem::path const& path, std::string const& identity, std::string const& password);
+}
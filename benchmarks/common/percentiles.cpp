@@ -0,0 +1,43 @@
+#include "percentiles.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace TunnelBore::Benchmarks
+{
+    // #####################################################################################################################
+    void to_json(json& j, Percentiles const& percentiles)
+    {
+        j = json{
+            {"p50Us", percentiles.p50},
+            {"p99Us", percentiles.p99},
+            {"p999Us", percentiles.p999},
+            {"meanUs", percentiles.mean},
+            {"maxUs", percentiles.max},
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    Percentiles percentilesOf(std::vector<double> samples)
+    {
+        if (samples.empty())
+            return {};
+        std::sort(samples.begin(), samples.end());
+        const auto at = [&samples](double quantile) {
+            const auto index = static_cast<std::size_t>(quantile * static_cast<double>(samples.size()));
+            return samples[std::min(index, samples.size() - 1)];
+        };
+        return Percentiles{
+            .p50 = at(0.5),
+            .p99 = at(0.99),
+            .p999 = at(0.999),
+            .mean = std::accumulate(samples.begin(), samples.end(), 0.) / static_cast<double>(samples.size()),
+            .max = samples.back(),
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    double microsecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+    // #####################################################################################################################
+}
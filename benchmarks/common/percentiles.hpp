@@ -0,0 +1,26 @@
+#pragma once
+
+#include <sharedpp/json.hpp>
+
+#include <chrono>
+#include <vector>
+
+namespace TunnelBore::Benchmarks
+{
+    /**
+     * Distribution of samples in microseconds.
+     */
+    struct Percentiles
+    {
+        double p50;
+        double p99;
+        double p999;
+        double mean;
+        double max;
+    };
+    void to_json(json& j, Percentiles const& percentiles);
+
+    Percentiles percentilesOf(std::vector<double> samples);
+
+    double microsecondsSince(std::chrono::steady_clock::time_point start);
+}
@@ -0,0 +1,605 @@
+/**
+ * End-to-end benchmark: starts a broker and a publisher on loopback in a throwaway home directory, serves an echo
+ * service in this process and measures tunnels through both.
+ *
+ * For 1, 2, 4 ... --max-tunnels concurrent tunnels it measures
+ *  - bulk: every tunnel streams --bulk-mb through the echo service and reads it back,
+ *  - latency: every tunnel does --rounds request/response exchanges of --request-size bytes,
+ * and reports the cpu time the broker and publisher processes spent per GB of tunneled data.
+ *
+ * Results are written as json, to compare builds.
+ */
+
+#include "../common/bench_keys.hpp"
+#include "../common/percentiles.hpp"
+
+#include <sharedpp/json.hpp>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef TUNNEL_BENCH_BROKER
+#    define TUNNEL_BENCH_BROKER "broker"
+#endif
+#ifndef TUNNEL_BENCH_PUBLISHER
+#    define TUNNEL_BENCH_PUBLISHER "publisher"
+#endif
+
+using namespace TunnelBore::Benchmarks;
+using boost::asio::ip::tcp;
+using namespace std::chrono_literals;
+
+namespace
+{
+    constexpr auto StartupTimeout = 30s;
+    constexpr std::size_t BulkChunkSize = 64 * 1024;
+    constexpr double BytesPerGB = 1024. * 1024. * 1024.;
+
+    struct Options
+    {
+        std::string broker;
+        std::string publisher;
+        std::size_t maxTunnels;
+        std::size_t bulkMegabytes;
+        std::size_t rounds;
+        std::size_t requestSize;
+        std::optional<std::string> output;
+        bool keepHome;
+    };
+
+    Options parseOptions(int argc, char** argv)
+    {
+        cxxopts::Options options("tunnel-bench", "Measures tunnels through a broker and publisher on loopback.");
+        options.add_options()(
+            "broker", "Broker executable.", cxxopts::value<std::string>()->default_value(TUNNEL_BENCH_BROKER))(
+            "publisher",
+            "Publisher executable.",
+            cxxopts::value<std::string>()->default_value(TUNNEL_BENCH_PUBLISHER))(
+            "max-tunnels",
+            "Highest number of concurrent tunnels, doubled from 1.",
+            cxxopts::value<std::size_t>()->default_value("16"))(
+            "bulk-mb", "Megabytes streamed through every tunnel.", cxxopts::value<std::size_t>()->default_value("64"))(
+            "rounds",
+            "Request/response exchanges per tunnel.",
+            cxxopts::value<std::size_t>()->default_value("2000"))(
+            "request-size", "Bytes per request and response.", cxxopts::value<std::size_t>()->default_value("64"))(
+            "output", "Write the json results here instead of stdout.", cxxopts::value<std::string>())(
+            "keep-home",
+            "Keep the generated home directory with the logs.",
+            cxxopts::value<bool>()->default_value("false"))("help", "Print usage.");
+
+        const auto result = options.parse(argc, argv);
+        if (result.count("help") != 0)
+        {
+            std::cout << options.help() << "\n";
+            std::exit(0);
+        }
+
+        return Options{
+            .broker = result["broker"].as<std::string>(),
+            .publisher = result["publisher"].as<std::string>(),
+            .maxTunnels = std::max(std::size_t{1}, result["max-tunnels"].as<std::size_t>()),
+            .bulkMegabytes = result["bulk-mb"].as<std::size_t>(),
+            .rounds = std::max(std::size_t{1}, result["rounds"].as<std::size_t>()),
+            .requestSize = std::max(std::size_t{1}, result["request-size"].as<std::size_t>()),
+            .output = result.count("output") != 0 ? std::optional{result["output"].as<std::string>()} : std::nullopt,
+            .keepHome = result["keep-home"].as<bool>(),
+        };
+    }
+
+    // ###################################################################################################################
+    unsigned short freePort()
+    {
+        boost::asio::io_context context;
+        tcp::acceptor acceptor{context, {boost::asio::ip::address_v4::loopback(), 0}};
+        return acceptor.local_endpoint().port();
+    }
+
+    tcp::endpoint loopback(unsigned short port)
+    {
+        return {boost::asio::ip::address_v4::loopback(), port};
+    }
+
+    // ###################################################################################################################
+    /**
+     * Home directory with configs, keys and users for one broker and one publisher, both without ssl.
+     */
+    struct BenchHome
+    {
+        std::filesystem::path root;
+        unsigned short brokerPort;
+        unsigned short publicPort;
+        unsigned short hiddenPort;
+
+        BenchHome(unsigned short hiddenPort)
+            : root{std::filesystem::temp_directory_path() / ("tunnel-bench-" + std::to_string(::getpid()))}
+            , brokerPort{freePort()}
+            , publicPort{freePort()}
+            , hiddenPort{hiddenPort}
+        {
+            const auto tbore = root / ".tbore";
+            const auto keys = generateJwtKeyPair();
+            writeFile(tbore / "broker" / "jwt" / "private.key", keys.privateKey);
+            writeFile(tbore / "broker" / "jwt" / "public.key", keys.publicKey);
+
+            const std::string password = "bench";
+            writeUsersFile(tbore / "broker" / "users.json", "bench", password);
+
+            writeFile(
+                tbore / "broker" / "config.json",
+                json{
+                    {"bind", {{"iface", "127.0.0.1"}, {"port", brokerPort}}},
+                    {"ssl", false},
+                }
+                    .dump());
+
+            // The publisher picks its config name by build type.
+            const auto publisherConfig = json{
+                {"identity", "bench"},
+                {"passHashed", password},
+                {"host", "127.0.0.1"},
+                {"port", brokerPort},
+                {"authorityHost", "127.0.0.1"},
+                {"authorityPort", brokerPort},
+                {"ssl", false},
+                {"services",
+                 json::array({json{
+                     {"name", "echo"},
+                     {"socketType", "tcp"},
+                     {"hiddenPort", hiddenPort},
+                     {"publicPort", publicPort},
+                     {"hiddenHost", "127.0.0.1"},
+                 }})},
+            }
+                                             .dump();
+            writeFile(tbore / "publisher" / "config.json", publisherConfig);
+            writeFile(tbore / "publisher" / "configDev.json", publisherConfig);
+            std::filesystem::create_directories(root / "www");
+        }
+    };
+
+    // ###################################################################################################################
+    /**
+     * A child process with HOME pointed at the bench home. Interrupted and reaped on destruction.
+     */
+    class ChildProcess
+    {
+      public:
+        ChildProcess(
+            std::string const& executable,
+            std::vector<std::string> const& arguments,
+            std::filesystem::path const& home,
+            std::filesystem::path const& logFile)
+            : pid_{-1}
+        {
+            // Everything the child needs is prepared here, between fork and exec only exec safe calls are allowed.
+            std::vector<std::string> environment;
+            for (char** variable = environ; *variable != nullptr; ++variable)
+            {
+                if (!std::string_view{*variable}.starts_with("HOME="))
+                    environment.emplace_back(*variable);
+            }
+            environment.push_back("HOME=" + home.string());
+            std::vector<char*> envp;
+            for (auto& variable : environment)
+                envp.push_back(variable.data());
+            envp.push_back(nullptr);
+
+            std::vector<char*> argv;
+            argv.push_back(const_cast<char*>(executable.c_str()));
+            for (auto const& argument : arguments)
+                argv.push_back(const_cast<char*>(argument.c_str()));
+            argv.push_back(nullptr);
+
+            const int log = ::open(logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            pid_ = ::fork();
+            if (pid_ < 0)
+                throw std::runtime_error("Could not start " + executable);
+            if (pid_ != 0)
+            {
+                if (log >= 0)
+                    ::close(log);
+                return;
+            }
+
+            if (log >= 0)
+            {
+                ::dup2(log, STDOUT_FILENO);
+                ::dup2(log, STDERR_FILENO);
+            }
+            ::execve(executable.c_str(), argv.data(), envp.data());
+            ::_exit(127);
+        }
+        ~ChildProcess()
+        {
+            ::kill(pid_, SIGINT);
+            for (int i = 0; i != 50; ++i)
+            {
+                if (::waitpid(pid_, nullptr, WNOHANG) == pid_)
+                    return;
+                std::this_thread::sleep_for(100ms);
+            }
+            ::kill(pid_, SIGKILL);
+            ::waitpid(pid_, nullptr, 0);
+        }
+        ChildProcess(ChildProcess const&) = delete;
+        ChildProcess& operator=(ChildProcess const&) = delete;
+
+        bool running() const
+        {
+            return ::waitpid(pid_, nullptr, WNOHANG) == 0;
+        }
+
+        /**
+         * User and system time of all threads so far, from /proc.
+         */
+        double cpuSeconds() const
+        {
+            std::ifstream reader{"/proc/" + std::to_string(pid_) + "/stat"};
+            std::string stat{std::istreambuf_iterator<char>{reader}, {}};
+            const auto afterName = stat.rfind(')');
+            if (afterName == std::string::npos)
+                return 0.;
+
+            // Fields after the name start with the state (3), utime and stime are 14 and 15.
+            std::istringstream fields{stat.substr(afterName + 2)};
+            std::string field;
+            unsigned long long utime = 0;
+            unsigned long long stime = 0;
+            for (int index = 3; index <= 15 && fields >> field; ++index)
+            {
+                if (index == 14)
+                    utime = std::stoull(field);
+                if (index == 15)
+                    stime = std::stoull(field);
+            }
+            return static_cast<double>(utime + stime) / static_cast<double>(::sysconf(_SC_CLK_TCK));
+        }
+
+      private:
+        pid_t pid_;
+    };
+
+    // ###################################################################################################################
+    /**
+     * The hidden service: echoes everything, one thread per connection.
+     */
+    class EchoServer
+    {
+      public:
+        EchoServer()
+            : context_{}
+            , acceptor_{context_, loopback(0)}
+            , stopped_{false}
+            , connectionsGuard_{}
+            , connections_{}
+            , acceptThread_{[this]() {
+                acceptLoop();
+            }}
+        {}
+        ~EchoServer()
+        {
+            stopped_ = true;
+            boost::system::error_code ignore;
+            {
+                // Closing the acceptor does not wake a blocking accept, a connection does.
+                tcp::socket wakeUp{context_};
+                wakeUp.connect(loopback(port()), ignore);
+                acceptThread_.join();
+            }
+            acceptor_.close(ignore);
+            std::scoped_lock lock{connectionsGuard_};
+            for (auto& connection : connections_)
+            {
+                connection.socket->shutdown(tcp::socket::shutdown_both, ignore);
+                connection.thread.join();
+            }
+        }
+        EchoServer(EchoServer const&) = delete;
+        EchoServer& operator=(EchoServer const&) = delete;
+
+        unsigned short port() const
+        {
+            return acceptor_.local_endpoint().port();
+        }
+
+      private:
+        void acceptLoop()
+        {
+            while (!stopped_)
+            {
+                auto socket = std::make_shared<tcp::socket>(context_);
+                boost::system::error_code ec;
+                acceptor_.accept(*socket, ec);
+                if (ec)
+                    continue;
+                socket->set_option(tcp::no_delay{true}, ec);
+
+                std::scoped_lock lock{connectionsGuard_};
+                connections_.push_back(Connection{socket, std::thread{[socket]() {
+                                                      std::vector<char> buffer(BulkChunkSize);
+                                                      boost::system::error_code ec;
+                                                      while (true)
+                                                      {
+                                                          const auto read =
+                                                              socket->read_some(boost::asio::buffer(buffer), ec);
+                                                          if (ec)
+                                                              return;
+                                                          boost::asio::write(
+                                                              *socket, boost::asio::buffer(buffer.data(), read), ec);
+                                                          if (ec)
+                                                              return;
+                                                      }
+                                                  }}});
+            }
+        }
+
+      private:
+        struct Connection
+        {
+            std::shared_ptr<tcp::socket> socket;
+            std::thread thread;
+        };
+
+        boost::asio::io_context context_;
+        tcp::acceptor acceptor_;
+        std::atomic_bool stopped_;
+        std::mutex connectionsGuard_;
+        std::vector<Connection> connections_;
+        std::thread acceptThread_;
+    };
+
+    // ###################################################################################################################
+    /**
+     * Opens a tunnel and waits until the echo answers, which includes the broker asking the publisher for its side.
+     * @return The time until the first echo.
+     */
+    double openTunnel(tcp::socket& socket, unsigned short publicPort)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        socket.connect(loopback(publicPort));
+        socket.set_option(tcp::no_delay{true});
+        char probe = 'p';
+        boost::asio::write(socket, boost::asio::buffer(&probe, 1));
+        boost::asio::read(socket, boost::asio::buffer(&probe, 1));
+        return microsecondsSince(start);
+    }
+
+    /**
+     * Retries until the publisher registered its service and a tunnel works end to end.
+     */
+    void waitForTunnels(unsigned short publicPort, ChildProcess const& broker, ChildProcess const& publisher)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + StartupTimeout;
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            if (!broker.running() || !publisher.running())
+                throw std::runtime_error("Broker or publisher exited during startup, see the logs in the home.");
+            try
+            {
+                boost::asio::io_context context;
+                tcp::socket socket{context};
+                openTunnel(socket, publicPort);
+                return;
+            }
+            catch (std::exception const&)
+            {
+                std::this_thread::sleep_for(200ms);
+            }
+        }
+        throw std::runtime_error("Tunnels did not come up in time.");
+    }
+
+    struct Cpu
+    {
+        ChildProcess const& broker;
+        ChildProcess const& publisher;
+
+        std::pair<double, double> now() const
+        {
+            return {broker.cpuSeconds(), publisher.cpuSeconds()};
+        }
+    };
+
+    json runBulk(unsigned short publicPort, std::size_t tunnels, std::size_t bytesPerTunnel, Cpu const& cpu)
+    {
+        boost::asio::io_context context;
+        std::vector<tcp::socket> sockets;
+        for (std::size_t i = 0; i != tunnels; ++i)
+        {
+            sockets.emplace_back(context);
+            openTunnel(sockets.back(), publicPort);
+        }
+
+        std::atomic_bool failed{false};
+        const auto [brokerBefore, publisherBefore] = cpu.now();
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (auto& socket : sockets)
+        {
+            threads.emplace_back([&socket, bytesPerTunnel, &failed]() {
+                const std::vector<char> chunk(BulkChunkSize, 'x');
+                boost::system::error_code ec;
+                for (std::size_t sent = 0; sent < bytesPerTunnel && !ec;)
+                {
+                    const auto size = std::min(BulkChunkSize, bytesPerTunnel - sent);
+                    sent += boost::asio::write(socket, boost::asio::buffer(chunk.data(), size), ec);
+                }
+                if (ec)
+                    failed = true;
+            });
+            threads.emplace_back([&socket, bytesPerTunnel, &failed]() {
+                std::vector<char> chunk(BulkChunkSize);
+                boost::system::error_code ec;
+                for (std::size_t received = 0; received < bytesPerTunnel && !ec;)
+                    received += socket.read_some(
+                        boost::asio::buffer(chunk.data(), std::min(BulkChunkSize, bytesPerTunnel - received)), ec);
+                if (ec)
+                    failed = true;
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto [brokerAfter, publisherAfter] = cpu.now();
+
+        // Every byte crosses both tunnel directions, through broker and publisher twice each.
+        const auto tunneledBytes = static_cast<double>(bytesPerTunnel * tunnels * 2);
+        const auto gigabytes = tunneledBytes / BytesPerGB;
+        return json{
+            {"failed", failed.load()},
+            {"bytesPerTunnel", bytesPerTunnel},
+            {"tunneledBytes", tunneledBytes},
+            {"seconds", seconds},
+            {"megabytesPerSecond", tunneledBytes / (1024. * 1024.) / seconds},
+            {"brokerCpuSecondsPerGB", (brokerAfter - brokerBefore) / gigabytes},
+            {"publisherCpuSecondsPerGB", (publisherAfter - publisherBefore) / gigabytes},
+        };
+    }
+
+    json runLatency(unsigned short publicPort, std::size_t tunnels, std::size_t rounds, std::size_t requestSize)
+    {
+        boost::asio::io_context context;
+        std::vector<tcp::socket> sockets;
+        std::vector<double> setup;
+        for (std::size_t i = 0; i != tunnels; ++i)
+        {
+            sockets.emplace_back(context);
+            setup.push_back(openTunnel(sockets.back(), publicPort));
+        }
+
+        std::atomic_bool failed{false};
+        std::mutex samplesGuard;
+        std::vector<double> samples;
+        samples.reserve(tunnels * rounds);
+        std::vector<std::thread> threads;
+        const auto start = std::chrono::steady_clock::now();
+        for (auto& socket : sockets)
+        {
+            threads.emplace_back([&, &socket = socket]() {
+                std::vector<char> request(requestSize, 'r');
+                std::vector<double> local;
+                local.reserve(rounds);
+                boost::system::error_code ec;
+                for (std::size_t round = 0; round != rounds; ++round)
+                {
+                    const auto sent = std::chrono::steady_clock::now();
+                    boost::asio::write(socket, boost::asio::buffer(request), ec);
+                    if (!ec)
+                        boost::asio::read(socket, boost::asio::buffer(request), ec);
+                    if (ec)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    local.push_back(microsecondsSince(sent));
+                }
+                std::scoped_lock lock{samplesGuard};
+                samples.insert(samples.end(), local.begin(), local.end());
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        return json{
+            {"failed", failed.load()},
+            {"samples", samples.size()},
+            {"requestsPerSecond", static_cast<double>(samples.size()) / seconds},
+            {"roundTrip", percentilesOf(std::move(samples))},
+            {"tunnelSetup", percentilesOf(std::move(setup))},
+        };
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const auto options = parseOptions(argc, argv);
+
+    EchoServer echo;
+    BenchHome home{echo.port()};
+    std::cerr << "Bench home is '" << home.root.string() << "'.\n";
+
+    json results;
+    {
+        ChildProcess broker{
+            options.broker,
+            {"--config",
+             (home.root / ".tbore" / "broker" / "config.json").string(),
+             "--served-directory",
+             (home.root / "www").string()},
+            home.root,
+            home.root / "broker.log"};
+        ChildProcess publisher{options.publisher, {}, home.root, home.root / "publisher.log"};
+
+        waitForTunnels(home.publicPort, broker, publisher);
+        const Cpu cpu{broker, publisher};
+
+        std::vector<std::size_t> tunnelCounts;
+        for (std::size_t tunnels = 1; tunnels < options.maxTunnels; tunnels *= 2)
+            tunnelCounts.push_back(tunnels);
+        tunnelCounts.push_back(options.maxTunnels);
+
+        json runs = json::array();
+        for (auto tunnels : tunnelCounts)
+        {
+            std::cerr << "Measuring " << tunnels << " tunnel(s).\n";
+            runs.push_back(json{
+                {"tunnels", tunnels},
+                {"bulk", runBulk(home.publicPort, tunnels, options.bulkMegabytes * 1024 * 1024, cpu)},
+                {"latency", runLatency(home.publicPort, tunnels, options.rounds, options.requestSize)},
+            });
+        }
+
+        results = json{
+            {"benchmark", "tunnel-bench"},
+            {"timestamp",
+             std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+                 .count()},
+            {"hardwareThreads", std::thread::hardware_concurrency()},
+            {"options",
+             {
+                 {"maxTunnels", options.maxTunnels},
+                 {"bulkMegabytes", options.bulkMegabytes},
+                 {"rounds", options.rounds},
+                 {"requestSize", options.requestSize},
+             }},
+            {"runs", std::move(runs)},
+        };
+    }
+
+    if (!options.keepHome)
+    {
+        std::error_code ignore;
+        std::filesystem::remove_all(home.root, ignore);
+    }
+
+    if (options.output)
+        std::ofstream{*options.output} << results.dump(4) << "\n";
+    else
+        std::cout << results.dump(4) << "\n";
+}
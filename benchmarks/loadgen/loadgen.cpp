@@ -0,0 +1,664 @@
+/**
+ * Load generator for a running broker: opens connections to a public service port at a fixed rate and keeps up
+ * to --connections of them open, to reproduce connection storms and large idle fan-in.
+ *
+ * Every connection first sends one probe byte and waits for it to come back, which only happens once the broker
+ * linked it to a tunnel of the publisher, so the hidden service has to echo (see --echo-port). After that it
+ *  - idle: holds the connection without traffic,
+ *  - request: does --request-size request/response exchanges with --think-ms between them,
+ *  - drip: sends a single byte every --drip-ms and reads it back.
+ * With --lifetime connections are closed after that many seconds and replaced, which makes it a churn test.
+ *
+ * Reported are the connect (accept) latency, the time until the tunnel is linked, failures by reason and, with
+ * --broker-pid, the resident memory of the broker per open connection. Results are written as json.
+ */
+
+#include "../common/percentiles.hpp"
+
+#include <sharedpp/json.hpp>
+
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+using namespace TunnelBore::Benchmarks;
+using boost::asio::ip::tcp;
+using namespace std::chrono_literals;
+
+namespace
+{
+    constexpr auto LaunchTick = 10ms;
+    constexpr auto ReportInterval = 1s;
+
+    enum class Behavior
+    {
+        Idle,
+        Request,
+        Drip
+    };
+
+    struct Options
+    {
+        std::string host;
+        unsigned short port;
+        std::size_t connections;
+        double rate;
+        Behavior behavior;
+        std::chrono::seconds duration;
+        std::chrono::milliseconds lifetime;
+        std::size_t requestSize;
+        std::chrono::milliseconds think;
+        std::chrono::milliseconds drip;
+        std::chrono::seconds connectTimeout;
+        std::chrono::seconds linkTimeout;
+        std::vector<std::string> sources;
+        std::optional<int> brokerPid;
+        std::optional<unsigned short> echoPort;
+        std::size_t threads;
+        std::optional<std::string> output;
+    };
+
+    Behavior behaviorFromString(std::string const& name)
+    {
+        if (name == "idle")
+            return Behavior::Idle;
+        if (name == "request")
+            return Behavior::Request;
+        if (name == "drip")
+            return Behavior::Drip;
+        throw std::invalid_argument("Unknown behavior '" + name + "', expected idle, request or drip.");
+    }
+
+    std::vector<std::string> splitList(std::string const& list)
+    {
+        std::vector<std::string> result;
+        std::istringstream stream{list};
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            if (!item.empty())
+                result.push_back(item);
+        }
+        return result;
+    }
+
+    Options parseOptions(int argc, char** argv)
+    {
+        cxxopts::Options options("tunnel-loadgen", "Opens many connections to a broker service port.");
+        options.add_options()(
+            "host", "Broker host.", cxxopts::value<std::string>()->default_value("127.0.0.1"))(
+            "port", "Public port of the service.", cxxopts::value<unsigned short>())(
+            "connections",
+            "Highest number of concurrent connections.",
+            cxxopts::value<std::size_t>()->default_value("1000"))(
+            "rate", "New connections per second.", cxxopts::value<double>()->default_value("1000"))(
+            "behavior", "idle, request or drip.", cxxopts::value<std::string>()->default_value("idle"))(
+            "duration", "Seconds to run.", cxxopts::value<int>()->default_value("60"))(
+            "lifetime",
+            "Seconds after which a connection is closed and replaced, 0 keeps it until the end.",
+            cxxopts::value<double>()->default_value("0"))(
+            "request-size", "Bytes per request and response.", cxxopts::value<std::size_t>()->default_value("64"))(
+            "think-ms", "Pause between requests.", cxxopts::value<int>()->default_value("100"))(
+            "drip-ms", "Pause between dripped bytes.", cxxopts::value<int>()->default_value("1000"))(
+            "connect-timeout", "Seconds until a connect fails.", cxxopts::value<int>()->default_value("10"))(
+            "link-timeout",
+            "Seconds until a connection that did not echo the probe fails.",
+            cxxopts::value<int>()->default_value("10"))(
+            "sources",
+            "Comma separated local addresses to connect from, each has its own ephemeral ports.",
+            cxxopts::value<std::string>()->default_value(""))(
+            "broker-pid", "Samples the resident memory of this process.", cxxopts::value<int>())(
+            "echo-port",
+            "Serves the echo the hidden service has to be on this port.",
+            cxxopts::value<unsigned short>())(
+            "threads", "Io threads, 0 for one per core.", cxxopts::value<std::size_t>()->default_value("0"))(
+            "output", "Write the json results here instead of stdout.", cxxopts::value<std::string>())(
+            "help", "Print usage.");
+
+        const auto result = options.parse(argc, argv);
+        if (result.count("help") != 0 || result.count("port") == 0)
+        {
+            std::cout << options.help() << "\n";
+            std::exit(result.count("help") != 0 ? 0 : 1);
+        }
+
+        const auto threads = result["threads"].as<std::size_t>();
+        return Options{
+            .host = result["host"].as<std::string>(),
+            .port = result["port"].as<unsigned short>(),
+            .connections = std::max(std::size_t{1}, result["connections"].as<std::size_t>()),
+            .rate = std::max(1., result["rate"].as<double>()),
+            .behavior = behaviorFromString(result["behavior"].as<std::string>()),
+            .duration = std::chrono::seconds{std::max(1, result["duration"].as<int>())},
+            .lifetime = std::chrono::milliseconds{static_cast<long long>(result["lifetime"].as<double>() * 1000.)},
+            .requestSize = std::max(std::size_t{1}, result["request-size"].as<std::size_t>()),
+            .think = std::chrono::milliseconds{std::max(0, result["think-ms"].as<int>())},
+            .drip = std::chrono::milliseconds{std::max(1, result["drip-ms"].as<int>())},
+            .connectTimeout = std::chrono::seconds{std::max(1, result["connect-timeout"].as<int>())},
+            .linkTimeout = std::chrono::seconds{std::max(1, result["link-timeout"].as<int>())},
+            .sources = splitList(result["sources"].as<std::string>()),
+            .brokerPid = result.count("broker-pid") != 0 ? std::optional{result["broker-pid"].as<int>()} : std::nullopt,
+            .echoPort =
+                result.count("echo-port") != 0 ? std::optional{result["echo-port"].as<unsigned short>()} : std::nullopt,
+            .threads = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency()),
+            .output = result.count("output") != 0 ? std::optional{result["output"].as<std::string>()} : std::nullopt,
+        };
+    }
+
+    /**
+     * Hundreds of thousands of sockets need more descriptors than the usual soft limit.
+     */
+    void raiseDescriptorLimit(std::size_t wanted)
+    {
+        rlimit limit{};
+        if (::getrlimit(RLIMIT_NOFILE, &limit) != 0)
+            return;
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < wanted + 64)
+        {
+            std::cerr << "Only " << limit.rlim_cur << " file descriptors are allowed, connections beyond that fail.\n";
+        }
+    }
+
+    /**
+     * Resident set size of a process in kilobytes, from /proc.
+     */
+    std::optional<std::size_t> residentKilobytes(int pid)
+    {
+        std::ifstream reader{"/proc/" + std::to_string(pid) + "/status"};
+        std::string line;
+        while (std::getline(reader, line))
+        {
+            if (line.starts_with("VmRSS:"))
+                return std::stoull(line.substr(6));
+        }
+        return std::nullopt;
+    }
+
+    // ###################################################################################################################
+    /**
+     * Shared by all connections, every field is updated from the io threads.
+     */
+    class Stats
+    {
+      public:
+        void connected(double microseconds)
+        {
+            std::scoped_lock lock{guard_};
+            connectUs_.push_back(microseconds);
+        }
+        void linked(double microseconds)
+        {
+            ++linkedNow;
+            std::scoped_lock lock{guard_};
+            linkUs_.push_back(microseconds);
+        }
+        void failed(std::string const& reason)
+        {
+            ++failures;
+            std::scoped_lock lock{guard_};
+            ++failureReasons_[reason];
+        }
+        void exchanged(double microseconds)
+        {
+            std::scoped_lock lock{guard_};
+            roundTripUs_.push_back(microseconds);
+        }
+
+        json toJson()
+        {
+            std::scoped_lock lock{guard_};
+            return json{
+                {"opened", opened.load()},
+                {"linked", linkUs_.size()},
+                {"failed", failures.load()},
+                {"closedByLifetime", recycled.load()},
+                {"peakOpen", peakOpen.load()},
+                {"accept", percentilesOf(connectUs_)},
+                {"timeToLink", percentilesOf(linkUs_)},
+                {"roundTrip", percentilesOf(roundTripUs_)},
+                {"failureReasons", failureReasons_},
+            };
+        }
+
+        std::atomic_size_t opened{0};
+        std::atomic_size_t open{0};
+        std::atomic_size_t peakOpen{0};
+        std::atomic_size_t linkedNow{0};
+        std::atomic_size_t failures{0};
+        std::atomic_size_t recycled{0};
+
+      private:
+        std::mutex guard_;
+        std::vector<double> connectUs_;
+        std::vector<double> linkUs_;
+        std::vector<double> roundTripUs_;
+        std::map<std::string, std::size_t> failureReasons_;
+    };
+
+    // ###################################################################################################################
+    /**
+     * One client connection. All handlers run on its strand, so the timer can close the socket safely.
+     */
+    class Connection : public std::enable_shared_from_this<Connection>
+    {
+      public:
+        Connection(boost::asio::io_context& context, Options const& options, Stats& stats)
+            : strand_{boost::asio::make_strand(context)}
+            , socket_{strand_}
+            , timer_{strand_}
+            , pauseTimer_{strand_}
+            , options_{options}
+            , stats_{stats}
+            , buffer_(options.requestSize, 'r')
+            , start_{std::chrono::steady_clock::now()}
+            , phase_{"connect"}
+            , linked_{false}
+            , done_{false}
+        {}
+        ~Connection()
+        {
+            if (linked_)
+                --stats_.linkedNow;
+            --stats_.open;
+        }
+        Connection(Connection const&) = delete;
+        Connection(Connection&&) = delete;
+        Connection& operator=(Connection const&) = delete;
+        Connection& operator=(Connection&&) = delete;
+
+        void start(tcp::endpoint const& target, std::optional<boost::asio::ip::address> const& source)
+        {
+            boost::asio::dispatch(strand_, [self = shared_from_this(), target, source]() {
+                self->connect(target, source);
+            });
+        }
+
+      private:
+        void connect(tcp::endpoint const& target, std::optional<boost::asio::ip::address> const& source)
+        {
+            boost::system::error_code ec;
+            socket_.open(target.protocol(), ec);
+            if (!ec && source)
+                socket_.bind(tcp::endpoint{*source, 0}, ec);
+            if (ec)
+                return fail(ec);
+
+            arm(options_.connectTimeout);
+            socket_.async_connect(target, [self = shared_from_this()](boost::system::error_code ec) {
+                if (ec)
+                    return self->fail(ec);
+                self->stats_.connected(microsecondsSince(self->start_));
+                self->socket_.set_option(tcp::no_delay{true}, ec);
+                self->probe();
+            });
+        }
+
+        /**
+         * The echo of the probe proves the broker linked this connection to a publisher tunnel.
+         */
+        void probe()
+        {
+            phase_ = "link";
+            arm(options_.linkTimeout);
+            buffer_[0] = 'p';
+            boost::asio::async_write(
+                socket_,
+                boost::asio::buffer(buffer_.data(), 1),
+                [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                    if (ec)
+                        return self->fail(ec);
+                    boost::asio::async_read(
+                        self->socket_,
+                        boost::asio::buffer(self->buffer_.data(), 1),
+                        [self](boost::system::error_code ec, std::size_t) {
+                            if (ec)
+                                return self->fail(ec);
+                            self->linked_ = true;
+                            self->stats_.linked(microsecondsSince(self->start_));
+                            self->holdFor(self->options_.lifetime);
+                            self->behave();
+                        });
+                });
+        }
+
+        void behave()
+        {
+            phase_ = "hold";
+            switch (options_.behavior)
+            {
+                case Behavior::Idle:
+                    return watchForClose();
+                case Behavior::Request:
+                    return exchange(options_.requestSize, options_.think);
+                case Behavior::Drip:
+                    return exchange(1, options_.drip);
+            }
+        }
+
+        /**
+         * An idle connection only reads, to notice when the broker drops it.
+         */
+        void watchForClose()
+        {
+            socket_.async_read_some(
+                boost::asio::buffer(buffer_), [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                    if (ec)
+                        return self->fail(ec);
+                    self->watchForClose();
+                });
+        }
+
+        void exchange(std::size_t size, std::chrono::milliseconds pause)
+        {
+            pauseTimer_.expires_after(pause);
+            pauseTimer_.async_wait([self = shared_from_this(), size, pause](boost::system::error_code ec) {
+                if (ec || self->done_)
+                    return;
+                const auto sent = std::chrono::steady_clock::now();
+                boost::asio::async_write(
+                    self->socket_,
+                    boost::asio::buffer(self->buffer_.data(), size),
+                    [self, size, pause, sent](boost::system::error_code ec, std::size_t) {
+                        if (ec)
+                            return self->fail(ec);
+                        boost::asio::async_read(
+                            self->socket_,
+                            boost::asio::buffer(self->buffer_.data(), size),
+                            [self, size, pause, sent](boost::system::error_code ec, std::size_t) {
+                                if (ec)
+                                    return self->fail(ec);
+                                self->stats_.exchanged(microsecondsSince(sent));
+                                self->exchange(size, pause);
+                            });
+                    });
+            });
+        }
+
+        /**
+         * Times out the current phase, or ends the connection after its lifetime once linked.
+         */
+        void arm(std::chrono::steady_clock::duration timeout)
+        {
+            timer_.expires_after(timeout);
+            timer_.async_wait([self = shared_from_this(), phase = phase_](boost::system::error_code ec) {
+                if (ec || self->done_)
+                    return;
+                self->done_ = true;
+                self->stats_.failed(std::string{phase} + ": timeout");
+                self->close();
+            });
+        }
+
+        void holdFor(std::chrono::milliseconds lifetime)
+        {
+            timer_.cancel();
+            if (lifetime.count() == 0)
+                return;
+            timer_.expires_after(lifetime);
+            timer_.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+                if (ec || self->done_)
+                    return;
+                self->done_ = true;
+                ++self->stats_.recycled;
+                self->close();
+            });
+        }
+
+        void fail(boost::system::error_code ec)
+        {
+            if (done_)
+                return;
+            done_ = true;
+            const auto reason = ec == boost::asio::error::eof ? "closed by broker" : ec.message();
+            stats_.failed(std::string{phase_} + ": " + reason);
+            close();
+        }
+
+        void close()
+        {
+            boost::system::error_code ignore;
+            timer_.cancel();
+            pauseTimer_.cancel();
+            socket_.shutdown(tcp::socket::shutdown_both, ignore);
+            socket_.close(ignore);
+        }
+
+      private:
+        boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+        tcp::socket socket_;
+        boost::asio::steady_timer timer_;
+        boost::asio::steady_timer pauseTimer_;
+        Options const& options_;
+        Stats& stats_;
+        std::string buffer_;
+        std::chrono::steady_clock::time_point start_;
+        char const* phase_;
+        bool linked_;
+        bool done_;
+    };
+
+    // ###################################################################################################################
+    /**
+     * Echoes everything, asynchronously so it scales with the connections.
+     */
+    class EchoServer
+    {
+      public:
+        EchoServer(boost::asio::io_context& context, unsigned short port)
+            : context_{context}
+            , acceptor_{context, tcp::endpoint{boost::asio::ip::address_v4::loopback(), port}}
+        {
+            acceptor_.listen(boost::asio::socket_base::max_listen_connections);
+            acceptOnce();
+        }
+
+      private:
+        struct Session : std::enable_shared_from_this<Session>
+        {
+            explicit Session(tcp::socket socket)
+                : socket{std::move(socket)}
+            {}
+
+            void echoOnce()
+            {
+                socket.async_read_some(
+                    boost::asio::buffer(buffer),
+                    [self = shared_from_this()](boost::system::error_code ec, std::size_t n) {
+                        if (ec)
+                            return;
+                        boost::asio::async_write(
+                            self->socket,
+                            boost::asio::buffer(self->buffer.data(), n),
+                            [self](boost::system::error_code ec, std::size_t) {
+                                if (!ec)
+                                    self->echoOnce();
+                            });
+                    });
+            }
+
+            tcp::socket socket;
+            std::array<char, 4096> buffer{};
+        };
+
+        void acceptOnce()
+        {
+            acceptor_.async_accept(
+                boost::asio::make_strand(context_), [this](boost::system::error_code ec, tcp::socket socket) {
+                    if (ec == boost::asio::error::operation_aborted)
+                        return;
+                    if (!ec)
+                        std::make_shared<Session>(std::move(socket))->echoOnce();
+                    acceptOnce();
+                });
+        }
+
+      private:
+        boost::asio::io_context& context_;
+        tcp::acceptor acceptor_;
+    };
+
+    // ###################################################################################################################
+    /**
+     * Memory of the broker over time. The growth at the most linked connections, divided by them, is the cost of a
+     * connection including its tunnel to the publisher.
+     */
+    struct MemorySamples
+    {
+        std::optional<std::size_t> baselineKb;
+        std::size_t peakLinked = 0;
+        std::size_t kbAtPeakLinked = 0;
+        json timeline = json::array();
+
+        json toJson() const
+        {
+            if (!baselineKb)
+                return nullptr;
+            const auto grownKb = kbAtPeakLinked - std::min(kbAtPeakLinked, *baselineKb);
+            const auto perConnection =
+                peakLinked == 0 ? 0. : static_cast<double>(grownKb) * 1024. / static_cast<double>(peakLinked);
+            return json{
+                {"baselineKb", *baselineKb},
+                {"peakLinked", peakLinked},
+                {"kbAtPeakLinked", kbAtPeakLinked},
+                {"bytesPerConnection", perConnection},
+                {"timeline", timeline},
+            };
+        }
+    };
+}
+
+int main(int argc, char** argv)
+{
+    const auto options = parseOptions(argc, argv);
+    raiseDescriptorLimit(options.connections);
+
+    // Outlives the io context, the last connections report to it when the context drops them.
+    Stats stats;
+    boost::asio::io_context context;
+    auto work = boost::asio::make_work_guard(context);
+    std::optional<EchoServer> echo;
+    if (options.echoPort)
+        echo.emplace(context, *options.echoPort);
+
+    const tcp::endpoint target{boost::asio::ip::make_address(options.host), options.port};
+    std::vector<boost::asio::ip::address> sources;
+    for (auto const& source : options.sources)
+        sources.push_back(boost::asio::ip::make_address(source));
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i != options.threads; ++i)
+        threads.emplace_back([&context]() {
+            context.run();
+        });
+
+    MemorySamples memory;
+    if (options.brokerPid)
+        memory.baselineKb = residentKilobytes(*options.brokerPid);
+
+    // Launches on this thread, paced by the rate and capped by the concurrent connections.
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + options.duration;
+    auto nextReport = start + ReportInterval;
+    std::size_t launched = 0;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto due = static_cast<std::size_t>(elapsed * options.rate);
+        while (launched < due && stats.open.load() < options.connections)
+        {
+            ++stats.opened;
+            const auto open = ++stats.open;
+            stats.peakOpen = std::max(stats.peakOpen.load(), open);
+            auto connection = std::make_shared<Connection>(context, options, stats);
+            connection->start(
+                target, sources.empty() ? std::nullopt : std::optional{sources[launched % sources.size()]});
+            ++launched;
+        }
+        // Connections that could not be opened because of the cap are not made up for later.
+        launched = std::max(launched, due);
+
+        if (std::chrono::steady_clock::now() >= nextReport)
+        {
+            nextReport += ReportInterval;
+            const auto linkedNow = stats.linkedNow.load();
+            json sample{
+                {"second", static_cast<int>(elapsed)},
+                {"open", stats.open.load()},
+                {"linked", linkedNow},
+                {"failed", stats.failures.load()},
+            };
+            if (options.brokerPid)
+            {
+                if (const auto kb = residentKilobytes(*options.brokerPid); kb)
+                {
+                    sample["brokerKb"] = *kb;
+                    if (linkedNow >= memory.peakLinked)
+                    {
+                        memory.peakLinked = linkedNow;
+                        memory.kbAtPeakLinked = *kb;
+                    }
+                }
+                memory.timeline.push_back(sample);
+            }
+            std::cerr << sample.dump() << "\n";
+        }
+        std::this_thread::sleep_for(LaunchTick);
+    }
+
+    const auto results = json{
+        {"benchmark", "tunnel-loadgen"},
+        {"timestamp",
+         std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+             .count()},
+        {"options",
+         {
+             {"connections", options.connections},
+             {"rate", options.rate},
+             {"behavior", options.behavior == Behavior::Idle ? "idle"
+                  : options.behavior == Behavior::Request    ? "request"
+                                                             : "drip"},
+             {"durationSeconds", options.duration.count()},
+             {"lifetimeMs", options.lifetime.count()},
+             {"requestSize", options.requestSize},
+             {"sources", options.sources},
+         }},
+        {"connections", stats.toJson()},
+        {"brokerMemory", memory.toJson()},
+    };
+
+    // Dropping the handlers closes the remaining connections.
+    work.reset();
+    context.stop();
+    for (auto& thread : threads)
+        thread.join();
+
+    if (options.output)
+        std::ofstream{*options.output} << results.dump(4) << "\n";
+    else
+        std::cout << results.dump(4) << "\n";
+}
@@ -0,0 +1,110 @@
+#include "allocation_counter.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> bytes{0};
+
+    void* countedAllocate(std::size_t size)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        if (auto* memory = std::malloc(size == 0 ? 1 : size))
+            return memory;
+        throw std::bad_alloc{};
+    }
+
+    void* countedAllocate(std::size_t size, std::align_val_t alignment)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        const auto align = static_cast<std::size_t>(alignment);
+        // aligned_alloc wants a multiple of the alignment.
+        if (auto* memory = std::aligned_alloc(align, (size + align - 1) / align * align))
+            return memory;
+        throw std::bad_alloc{};
+    }
+}
+
+// The replaceable allocation functions, the nothrow and array forms forward to these.
+void* operator new(std::size_t size)
+{
+    return countedAllocate(size);
+}
+void* operator new[](std::size_t size)
+{
+    return countedAllocate(size);
+}
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return countedAllocate(size, alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return countedAllocate(size, alignment);
+}
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace TunnelBore::Benchmarks
+{
+    // #####################################################################################################################
+    std::uint64_t allocationCount()
+    {
+        return allocations.load(std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::uint64_t allocatedBytes()
+    {
+        return bytes.load(std::memory_order_relaxed);
+    }
+    // #####################################################################################################################
+    AllocationCounter::AllocationCounter(benchmark::State& state)
+        : state_{state}
+        , startCount_{allocationCount()}
+        , startBytes_{allocatedBytes()}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    AllocationCounter::~AllocationCounter()
+    {
+        state_.counters["allocsPerOp"] = benchmark::Counter(
+            static_cast<double>(allocationCount() - startCount_), benchmark::Counter::kAvgIterations);
+        state_.counters["allocBytesPerOp"] = benchmark::Counter(
+            static_cast<double>(allocatedBytes() - startBytes_), benchmark::Counter::kAvgIterations);
+    }
+    // #####################################################################################################################
+}
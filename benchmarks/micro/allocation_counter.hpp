@@ -0,0 +1,35 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+namespace TunnelBore::Benchmarks
+{
+    /// Calls of the global operator new since the process started, from all threads.
+    std::uint64_t allocationCount();
+    /// Bytes requested through the global operator new since the process started.
+    std::uint64_t allocatedBytes();
+
+    /**
+     * Reports the allocations made while it lives as "allocsPerOp" and "allocBytesPerOp", averaged over the
+     * iterations of the benchmark. Construct it right before the timed loop.
+     *
+     * Allocations of other threads are included, so work done by an io thread for the benchmark is counted too.
+     */
+    class AllocationCounter
+    {
+      public:
+        explicit AllocationCounter(benchmark::State& state);
+        ~AllocationCounter();
+        AllocationCounter(AllocationCounter const&) = delete;
+        AllocationCounter(AllocationCounter&&) = delete;
+        AllocationCounter& operator=(AllocationCounter const&) = delete;
+        AllocationCounter& operator=(AllocationCounter&&) = delete;
+
+      private:
+        benchmark::State& state_;
+        std::uint64_t startCount_;
+        std::uint64_t startBytes_;
+    };
+}
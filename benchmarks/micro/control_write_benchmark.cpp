@@ -0,0 +1,59 @@
+#include "allocation_counter.hpp"
+
+#include <brokerpp/control/control_session.hpp>
+#include <sharedpp/wire_encoding.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+using namespace TunnelBore;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    /**
+     * What ControlSession::writeJson builds for every tunnel.
+     */
+    json makeNewTunnel(std::size_t i)
+    {
+        return json{
+            {"type", "NewTunnel"},
+            {"serviceId", "6f1d1c4e-3a3e-4a53-9e54-5b0b4a7f7d11"},
+            {"tunnelId", "0b3c9e0c-a7b2-4c1f-8d9b-" + std::to_string(100000000000 + i)},
+            {"publicPort", 24321},
+            {"hiddenPort", 8080},
+            {"connectPort", 24321},
+            {"socketType", "tcp"},
+        };
+    }
+
+    /**
+     * The serialization writeJson and writeOnce do, without the websocket: building the message, encoding it
+     * into the pending queue and taking frames from the queue like the session does.
+     * Argument: messages per flush, 1 is an unbatched session.
+     */
+    void writeJson(benchmark::State& state, WireEncoding encoding)
+    {
+        const auto messagesPerFlush = static_cast<std::size_t>(state.range(0));
+        std::size_t frameBytes = 0;
+
+        AllocationCounter allocations{state};
+        for (auto _ : state)
+        {
+            std::vector<EncodedMessage> pending;
+            for (std::size_t i = 0; i != messagesPerFlush; ++i)
+                pending.push_back({encodeMessage(makeNewTunnel(i), encoding), encoding});
+
+            while (!pending.empty())
+                frameBytes += takeFrame(pending, Broker::ControlSession::MaxBatchBytes, true).data.size();
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(messagesPerFlush));
+        state.SetBytesProcessed(static_cast<std::int64_t>(frameBytes));
+    }
+}
+
+BENCHMARK_CAPTURE(writeJson, json, WireEncoding::Json)->Arg(1)->Arg(100);
+BENCHMARK_CAPTURE(writeJson, cbor, WireEncoding::Cbor)->Arg(1)->Arg(100);
+BENCHMARK_CAPTURE(writeJson, msgpack, WireEncoding::MessagePack)->Arg(1)->Arg(100);
@@ -0,0 +1,82 @@
+#include "allocation_counter.hpp"
+
+#include <brokerpp/control/dispatcher.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace TunnelBore::Broker;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    json makeHandshake(int services)
+    {
+        json serviceList = json::array();
+        for (int i = 0; i < services; ++i)
+        {
+            serviceList.push_back(json{
+                {"name", "service_" + std::to_string(i)},
+                {"publicPort", 10000 + i},
+                {"hiddenPort", 8000 + i},
+                {"hiddenHost", "localhost"},
+            });
+        }
+        return json{{"type", "Handshake"}, {"ref", "Handshake"}, {"services", serviceList}};
+    }
+
+    json makeMessage(int which)
+    {
+        switch (which)
+        {
+            case 0:
+                return json{{"type", "Ping"}, {"ref", "Ping"}};
+            case 1:
+                return makeHandshake(16);
+            default:
+                return json{{"type", "Metrics"}, {"ref", "Metrics"}};
+        }
+    }
+
+    /**
+     * A dispatcher set up like ControlSession does it.
+     */
+    Dispatcher makeDispatcher()
+    {
+        Dispatcher dispatcher;
+        dispatcher.on<PingMessage>([](PingMessage const& message, std::string const&) {
+            benchmark::DoNotOptimize(message);
+            return true;
+        });
+        dispatcher.on<HandshakeMessage>([](HandshakeMessage const& message, std::string const&) {
+            benchmark::DoNotOptimize(message);
+            return true;
+        });
+        dispatcher.on<NewTunnelFailedMessage>([](NewTunnelFailedMessage const& message, std::string const&) {
+            benchmark::DoNotOptimize(message);
+            return true;
+        });
+        dispatcher.onUnknown("Metrics", [](json const& message, std::string const&) {
+            benchmark::DoNotOptimize(message);
+            return true;
+        });
+        return dispatcher;
+    }
+}
+
+/**
+ * Argument: 0 = Ping, 1 = Handshake with 16 services, 2 = type without a ControlMessageType (string lookup).
+ */
+static void Dispatcher_Dispatch(benchmark::State& state)
+{
+    auto dispatcher = makeDispatcher();
+    const auto message = makeMessage(static_cast<int>(state.range(0)));
+    const auto ref = message["ref"].get<std::string>();
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(dispatcher.dispatch(message, ref));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(Dispatcher_Dispatch)->DenseRange(0, 2);
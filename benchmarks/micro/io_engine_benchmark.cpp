@@ -0,0 +1,198 @@
+#include "allocation_counter.hpp"
+
+#include <sharedpp/io_engine.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/write.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <latch>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using namespace TunnelBore;
+using namespace TunnelBore::Benchmarks;
+using boost::asio::ip::tcp;
+
+namespace
+{
+    constexpr std::size_t MessageSize = 64;
+    constexpr std::size_t RoundsPerIteration = 100;
+
+    /**
+     * A connected loopback pair, standing in for the two sides of a tunnel.
+     */
+    struct Pair
+    {
+        tcp::socket client;
+        tcp::socket server;
+        std::array<char, MessageSize> clientBuffer{};
+        std::array<char, MessageSize> serverBuffer{};
+        std::size_t remaining{0};
+    };
+
+    std::size_t threadCount()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<std::unique_ptr<Pair>>
+    connectPairs(std::function<boost::asio::any_io_executor(std::size_t)> const& executorFor, std::size_t count)
+    {
+        boost::asio::io_context setup;
+        tcp::acceptor acceptor{setup, {boost::asio::ip::address_v4::loopback(), 0}};
+
+        std::vector<std::unique_ptr<Pair>> pairs;
+        for (std::size_t i = 0; i != count; ++i)
+        {
+            const auto executor = executorFor(i);
+            auto pair = std::make_unique<Pair>(tcp::socket{executor}, tcp::socket{executor});
+            pair->client.connect(acceptor.local_endpoint());
+            acceptor.accept(pair->server);
+            pair->client.set_option(tcp::no_delay{true});
+            pair->server.set_option(tcp::no_delay{true});
+            pairs.push_back(std::move(pair));
+        }
+        return pairs;
+    }
+
+    void serveEcho(Pair& pair)
+    {
+        boost::asio::async_read(
+            pair.server, boost::asio::buffer(pair.serverBuffer), [&pair](boost::system::error_code ec, std::size_t) {
+                if (ec)
+                    return;
+                boost::asio::async_write(
+                    pair.server,
+                    boost::asio::buffer(pair.serverBuffer),
+                    [&pair](boost::system::error_code ec, std::size_t) {
+                        if (!ec)
+                            serveEcho(pair);
+                    });
+            });
+    }
+
+    void pingOnce(Pair& pair, std::latch& done)
+    {
+        boost::asio::async_write(
+            pair.client,
+            boost::asio::buffer(pair.clientBuffer),
+            [&pair, &done](boost::system::error_code ec, std::size_t) {
+                if (ec)
+                    return done.count_down();
+                boost::asio::async_read(
+                    pair.client,
+                    boost::asio::buffer(pair.clientBuffer),
+                    [&pair, &done](boost::system::error_code ec, std::size_t) {
+                        if (ec || --pair.remaining == 0)
+                            return done.count_down();
+                        pingOnce(pair, done);
+                    });
+            });
+    }
+
+    /**
+     * Every pair does RoundsPerIteration sequential round trips per iteration, all pairs run concurrently.
+     */
+    void runPingPong(
+        benchmark::State& state,
+        std::function<boost::asio::any_io_executor(std::size_t)> const& executorFor,
+        std::function<void()> const& stop)
+    {
+        const auto pairCount = static_cast<std::size_t>(state.range(0));
+        auto pairs = connectPairs(executorFor, pairCount);
+        for (auto& pair : pairs)
+            boost::asio::post(pair->server.get_executor(), [&pair = *pair]() {
+                serveEcho(pair);
+            });
+
+        double roundTripSeconds = 0.;
+        std::optional<AllocationCounter> allocations{std::in_place, state};
+        for (auto _ : state)
+        {
+            std::latch done{static_cast<std::ptrdiff_t>(pairCount)};
+            const auto start = std::chrono::steady_clock::now();
+            for (auto& pair : pairs)
+                boost::asio::post(pair->client.get_executor(), [&pair = *pair, &done]() {
+                    pair.remaining = RoundsPerIteration;
+                    pingOnce(pair, done);
+                });
+            done.wait();
+            roundTripSeconds +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / RoundsPerIteration;
+        }
+        allocations.reset();
+
+        for (auto& pair : pairs)
+        {
+            std::promise<void> closed;
+            boost::asio::post(pair->client.get_executor(), [&pair = *pair, &closed]() {
+                boost::system::error_code ignore;
+                pair.client.close(ignore);
+                pair.server.close(ignore);
+                closed.set_value();
+            });
+            closed.get_future().wait();
+        }
+        stop();
+
+        state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * pairCount * RoundsPerIteration));
+        state.SetBytesProcessed(
+            static_cast<std::int64_t>(state.iterations() * pairCount * RoundsPerIteration * MessageSize * 2));
+        state.counters["roundTripUs"] =
+            benchmark::Counter(roundTripSeconds * 1e6 / static_cast<double>(state.iterations()));
+    }
+}
+
+static void IoEngine_SharedPool(benchmark::State& state)
+{
+    boost::asio::thread_pool pool{threadCount()};
+    runPingPong(
+        state,
+        [&pool](std::size_t) -> boost::asio::any_io_executor {
+            return pool.get_executor();
+        },
+        [&pool]() {
+            pool.stop();
+            pool.join();
+        });
+}
+BENCHMARK(IoEngine_SharedPool)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+
+static void IoEngine_Sharded(benchmark::State& state)
+{
+    IoEngine engine{{.threads = threadCount()}};
+    runPingPong(
+        state,
+        [&engine](std::size_t pair) {
+            return engine.executor(pair);
+        },
+        [&engine]() {
+            engine.stop();
+        });
+}
+BENCHMARK(IoEngine_Sharded)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+
+static void IoEngine_ShardedPinned(benchmark::State& state)
+{
+    IoEngine engine{{.threads = threadCount(), .pinThreads = true}};
+    runPingPong(
+        state,
+        [&engine](std::size_t pair) {
+            return engine.executor(pair);
+        },
+        [&engine]() {
+            engine.stop();
+        });
+}
+BENCHMARK(IoEngine_ShardedPinned)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
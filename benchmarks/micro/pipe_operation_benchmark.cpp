@@ -0,0 +1,113 @@
+#include "allocation_counter.hpp"
+
+#include <sharedpp/pipe_operation.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace TunnelBore;
+using namespace TunnelBore::Benchmarks;
+using boost::asio::local::stream_protocol;
+
+namespace
+{
+    /**
+     * The least a PipeOperation needs from a side of a tunnel.
+     */
+    class Side
+    {
+      public:
+        explicit Side(boost::asio::io_context& context)
+            : socket_{context}
+        {}
+
+        stream_protocol::socket& socket()
+        {
+            return socket_;
+        }
+        void close()
+        {
+            boost::system::error_code ignore;
+            socket_.close(ignore);
+        }
+        void resetTimer()
+        {}
+        std::string remoteAddress() const
+        {
+            return "socketpair";
+        }
+
+      private:
+        stream_protocol::socket socket_;
+    };
+
+    /**
+     * client -> [source | PipeOperation | sink] -> server, the relay runs on its own io thread while this thread
+     * plays both ends with blocking calls.
+     */
+    struct Relay
+    {
+        boost::asio::io_context relayContext;
+        boost::asio::io_context endpointContext;
+        std::shared_ptr<Side> source = std::make_shared<Side>(relayContext);
+        std::shared_ptr<Side> sink = std::make_shared<Side>(relayContext);
+        stream_protocol::socket client{endpointContext};
+        stream_protocol::socket server{endpointContext};
+        std::shared_ptr<PipeOperation<Side>> pipe;
+        std::thread relayThread;
+
+        Relay()
+        {
+            boost::asio::local::connect_pair(client, source->socket());
+            boost::asio::local::connect_pair(sink->socket(), server);
+            pipe = std::make_shared<PipeOperation<Side>>(source, sink);
+            pipe->doPipe();
+            relayThread = std::thread{[this]() {
+                relayContext.run();
+            }};
+        }
+        ~Relay()
+        {
+            boost::system::error_code ignore;
+            client.close(ignore);
+            relayThread.join();
+            pipe.reset();
+        }
+        Relay(Relay const&) = delete;
+        Relay(Relay&&) = delete;
+        Relay& operator=(Relay const&) = delete;
+        Relay& operator=(Relay&&) = delete;
+    };
+}
+
+/**
+ * Writes a chunk into one end and reads it from the other, one chunk in flight at a time.
+ */
+static void PipeOperation_Relay(benchmark::State& state)
+{
+    spdlog::set_level(spdlog::level::off);
+    const auto chunkSize = static_cast<std::size_t>(state.range(0));
+    const std::string chunk(chunkSize, 'x');
+    std::string received(chunkSize, '\0');
+
+    Relay relay;
+    {
+        AllocationCounter allocations{state};
+        for (auto _ : state)
+        {
+            boost::asio::write(relay.client, boost::asio::buffer(chunk));
+            boost::asio::read(relay.server, boost::asio::buffer(received));
+        }
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * chunkSize));
+}
+BENCHMARK(PipeOperation_Relay)->RangeMultiplier(8)->Range(64, 1 << 16)->UseRealTime();
@@ -0,0 +1,140 @@
+#include "allocation_counter.hpp"
+
+#include <sharedpp/stream_compression.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <string>
+#include <string_view>
+
+using namespace TunnelBore;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    constexpr std::size_t chunkSize = 4096;
+    /// Larger than the compression window, so that chunks do not compress against their own earlier copies.
+    constexpr std::size_t corpusSize = 512 * 1024;
+
+    /**
+     * json api responses, which is what compression is meant for.
+     */
+    std::string makeJsonCorpus(std::size_t size)
+    {
+        std::string chunk;
+        std::mt19937 random{42};
+        for (int i = 0; chunk.size() < size; ++i)
+        {
+            chunk += json{
+                {"id", i},
+                {"user", "user_" + std::to_string(random() % 1000)},
+                {"status", random() % 2 ? "active" : "suspended"},
+                {"score", random() % 10000},
+            }
+                         .dump();
+            chunk += '\n';
+        }
+        chunk.resize(size);
+        return chunk;
+    }
+
+    std::string makeRandomCorpus(std::size_t size)
+    {
+        std::string chunk(size, '\0');
+        std::mt19937 random{42};
+        for (auto& c : chunk)
+            c = static_cast<char>(random());
+        return chunk;
+    }
+
+    /**
+     * The next pipe read worth of the corpus.
+     */
+    std::string_view nextChunk(std::string const& corpus, std::size_t& offset)
+    {
+        const auto chunk = std::string_view{corpus}.substr(offset, chunkSize);
+        offset = (offset + chunkSize) % corpus.size();
+        return chunk;
+    }
+}
+
+/**
+ * Cost per pipe read on the compressing side, range(0) is the level. Sets the ratio as counter.
+ */
+static void StreamCompressor_JsonChunk(benchmark::State& state)
+{
+    if (supportedStreamCompressions().empty())
+        return state.SkipWithError("Built without compression.");
+
+    const auto corpus = makeJsonCorpus(corpusSize);
+    std::size_t offset = 0;
+    auto stats = std::make_shared<CompressionStats>();
+    StreamCompressor compressor{StreamCompression::Zstd, static_cast<int>(state.range(0)), stats};
+    std::string output;
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        output.clear();
+        benchmark::DoNotOptimize(compressor.compress(nextChunk(corpus, offset), output));
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * chunkSize));
+    state.counters["ratio"] = stats->toJson()["ratio"].get<double>();
+}
+BENCHMARK(StreamCompressor_JsonChunk)->Arg(1)->Arg(3)->Arg(9);
+
+/**
+ * Incompressible data, which the compressor stops compressing after the first probe.
+ */
+static void StreamCompressor_RandomChunk(benchmark::State& state)
+{
+    if (supportedStreamCompressions().empty())
+        return state.SkipWithError("Built without compression.");
+
+    const auto corpus = makeRandomCorpus(corpusSize);
+    std::size_t offset = 0;
+    auto stats = std::make_shared<CompressionStats>();
+    StreamCompressor compressor{StreamCompression::Zstd, defaultCompressionLevel, stats};
+    std::string output;
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        output.clear();
+        benchmark::DoNotOptimize(compressor.compress(nextChunk(corpus, offset), output));
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * chunkSize));
+    state.counters["ratio"] = stats->toJson()["ratio"].get<double>();
+}
+BENCHMARK(StreamCompressor_RandomChunk);
+
+/**
+ * Cost per pipe read on the decompressing side.
+ */
+static void StreamDecompressor_JsonChunk(benchmark::State& state)
+{
+    if (supportedStreamCompressions().empty())
+        return state.SkipWithError("Built without compression.");
+
+    const auto corpus = makeJsonCorpus(corpusSize);
+    std::size_t offset = 0;
+    StreamCompressor compressor{StreamCompression::Zstd, defaultCompressionLevel, std::make_shared<CompressionStats>()};
+    StreamDecompressor decompressor{StreamCompression::Zstd, std::make_shared<CompressionStats>()};
+    std::string framed;
+    std::string output;
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        // The decompressor needs the whole stream, so compressing is part of the loop but excluded from the time.
+        state.PauseTiming();
+        framed.clear();
+        compressor.compress(nextChunk(corpus, offset), framed);
+        output.clear();
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(decompressor.decompress(framed, output));
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * chunkSize));
+}
+BENCHMARK(StreamDecompressor_JsonChunk);
@@ -0,0 +1,121 @@
+#include "allocation_counter.hpp"
+
+#include <brokerpp/control/stream_parser.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <string_view>
+
+using namespace TunnelBore::Broker;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    std::string makeHandshake(int services)
+    {
+        json serviceList = json::array();
+        for (int i = 0; i < services; ++i)
+        {
+            serviceList.push_back(json{
+                {"name", "service_" + std::to_string(i)},
+                {"publicPort", 10000 + i},
+                {"hiddenPort", 8000 + i},
+                {"hiddenHost", "localhost"},
+            });
+        }
+        return json{
+            {"type", "Handshake"},
+            {"ref", "Handshake"},
+            {"identity", "benchmark-publisher"},
+            {"services", serviceList},
+        }
+            .dump();
+    }
+
+    /**
+     * Pings, with a handshake every handshakeEvery messages (never if 0).
+     */
+    std::string makeBatch(std::size_t messages, std::size_t handshakeEvery)
+    {
+        const auto ping = json{{"type", "Ping"}, {"ref", "Ping"}}.dump();
+        const auto handshake = makeHandshake(16);
+
+        std::string batch;
+        for (std::size_t i = 0; i < messages; ++i)
+        {
+            if (handshakeEvery != 0 && i % handshakeEvery == 0)
+                batch += handshake;
+            else
+                batch += ping;
+        }
+        return batch;
+    }
+
+    /**
+     * Feeds the batch in websocket sized chunks and drains after each of them, like ControlSession::onRead.
+     * Allocations are per batch, not per message.
+     */
+    void feedBatch(benchmark::State& state, std::string const& batch, std::size_t chunkSize)
+    {
+        std::size_t messages = 0;
+        AllocationCounter allocations{state};
+        for (auto _ : state)
+        {
+            StreamParser parser;
+            const auto view = std::string_view{batch};
+            for (std::size_t offset = 0; offset < view.size(); offset += chunkSize)
+            {
+                parser.feed(view.substr(offset, chunkSize));
+                messages += parser.drain([](json const& message) {
+                    benchmark::DoNotOptimize(message);
+                });
+            }
+        }
+        state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * batch.size()));
+        state.SetItemsProcessed(static_cast<std::int64_t>(messages));
+    }
+}
+
+static void StreamParser_PingBatch(benchmark::State& state)
+{
+    const auto batch = makeBatch(static_cast<std::size_t>(state.range(0)), 0);
+    feedBatch(state, batch, 4096);
+}
+BENCHMARK(StreamParser_PingBatch)->RangeMultiplier(10)->Range(10, 100000);
+
+static void StreamParser_HandshakeBatch(benchmark::State& state)
+{
+    const auto batch = makeBatch(static_cast<std::size_t>(state.range(0)), 1);
+    feedBatch(state, batch, 4096);
+}
+BENCHMARK(StreamParser_HandshakeBatch)->RangeMultiplier(10)->Range(10, 10000);
+
+static void StreamParser_MixedBatch(benchmark::State& state)
+{
+    const auto batch = makeBatch(static_cast<std::size_t>(state.range(0)), 101);
+    feedBatch(state, batch, static_cast<std::size_t>(state.range(1)));
+}
+BENCHMARK(StreamParser_MixedBatch)->ArgsProduct({{1000, 100000}, {512, 4096, 65536}});
+
+/**
+ * One message per feed, popped right away: the steady state of a quiet control session.
+ * Argument: 0 = Ping, 1 = Handshake with 16 services
+ */
+static void StreamParser_FeedPop(benchmark::State& state)
+{
+    const auto message = static_cast<int>(state.range(0)) == 0 ? json{{"type", "Ping"}, {"ref", "Ping"}}.dump()
+                                                                : makeHandshake(16);
+    StreamParser parser;
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        parser.feed(message);
+        auto popped = parser.popMessage();
+        benchmark::DoNotOptimize(popped);
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * message.size()));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(StreamParser_FeedPop)->Arg(0)->Arg(1);
@@ -0,0 +1,120 @@
+#include "allocation_counter.hpp"
+#include "../common/bench_keys.hpp"
+
+#include <brokerpp/authority.hpp>
+#include <brokerpp/publisher/publisher_token.hpp>
+
+#include <benchmark/benchmark.h>
+#include <spdlog/spdlog.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+using namespace TunnelBore::Broker;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    const std::string Identity = "bench";
+    const std::string Password = "bench";
+
+    /**
+     * Keys and a users file in a throwaway HOME, so Authority finds its users where the broker would.
+     * Created once for all token benchmarks, key generation takes longer than the benchmarks themselves.
+     */
+    struct TokenHome
+    {
+        std::filesystem::path root;
+        JwtKeyPair keys;
+
+        TokenHome()
+            : root{std::filesystem::temp_directory_path() / ("token-benchmark-" + std::to_string(::getpid()))}
+            , keys{generateJwtKeyPair()}
+        {
+            writeUsersFile(root / ".tbore" / "broker" / "users.json", Identity, Password);
+            ::setenv("HOME", root.c_str(), 1);
+            spdlog::set_level(spdlog::level::off);
+        }
+        ~TokenHome()
+        {
+            std::error_code ignore;
+            std::filesystem::remove_all(root, ignore);
+        }
+        TokenHome(TokenHome const&) = delete;
+        TokenHome(TokenHome&&) = delete;
+        TokenHome& operator=(TokenHome const&) = delete;
+        TokenHome& operator=(TokenHome&&) = delete;
+    };
+
+    TokenHome& tokenHome()
+    {
+        static TokenHome home;
+        return home;
+    }
+}
+
+/**
+ * Password check and RS256 signature, what every publisher login costs the broker.
+ */
+static void Authority_AuthenticateThenSign(benchmark::State& state)
+{
+    Authority authority{tokenHome().keys.privateKey};
+    const auto claims = json{{"maxServices", 1}};
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        auto token = authority.authenticateThenSign(Identity, Password, claims);
+        if (!token)
+            return state.SkipWithError("Authentication failed.");
+        benchmark::DoNotOptimize(token);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(Authority_AuthenticateThenSign);
+
+/**
+ * Signature check and claim extraction, done for every control session.
+ */
+static void PublisherToken_Verify(benchmark::State& state)
+{
+    auto& home = tokenHome();
+    Authority authority{home.keys.privateKey};
+    const auto token = authority.authenticateThenSign(Identity, Password, json{{"maxServices", 1}});
+    if (!token)
+        return state.SkipWithError("Authentication failed.");
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+    {
+        auto verified = verifyPublisherToken(*token, home.keys.publicKey);
+        if (!verified)
+            return state.SkipWithError("Verification failed.");
+        benchmark::DoNotOptimize(verified);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(PublisherToken_Verify);
+
+/**
+ * A token signed with another key, the path an attacker can make the broker take.
+ */
+static void PublisherToken_VerifyForeign(benchmark::State& state)
+{
+    auto& home = tokenHome();
+    const auto foreignKeys = generateJwtKeyPair();
+    Authority authority{foreignKeys.privateKey};
+    const auto token = authority.authenticateThenSign(Identity, Password);
+    if (!token)
+        return state.SkipWithError("Authentication failed.");
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(verifyPublisherToken(*token, home.keys.publicKey));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(PublisherToken_VerifyForeign);
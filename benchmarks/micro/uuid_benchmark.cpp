@@ -0,0 +1,21 @@
+#include "allocation_counter.hpp"
+
+#include <sharedpp/uuid_generator.hpp>
+
+#include <benchmark/benchmark.h>
+
+using namespace TunnelBore::Benchmarks;
+
+/**
+ * Every tunnel gets a fresh id, this is the cost on the accept path.
+ */
+static void UuidGenerator_GenerateId(benchmark::State& state)
+{
+    uuid_generator generator;
+
+    AllocationCounter allocations{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(generator.generate_id());
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(UuidGenerator_GenerateId);
@@ -0,0 +1,104 @@
+#include "allocation_counter.hpp"
+
+#include <sharedpp/wire_encoding.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace TunnelBore;
+using namespace TunnelBore::Benchmarks;
+
+namespace
+{
+    json makeNewTunnel()
+    {
+        return json{
+            {"type", "NewTunnel"},
+            {"serviceId", "6f1d1c4e-3a3e-4a53-9e54-5b0b4a7f7d11"},
+            {"tunnelId", "0b3c9e0c-a7b2-4c1f-8d9b-2f7dc1a1e0aa"},
+            {"publicPort", 24321},
+            {"hiddenPort", 8080},
+            {"socketType", "tcp"},
+        };
+    }
+
+    json makeHandshake()
+    {
+        json services = json::array();
+        for (int i = 0; i < 16; ++i)
+        {
+            services.push_back(json{
+                {"name", "service_" + std::to_string(i)},
+                {"publicPort", 10000 + i},
+                {"hiddenPort", 8000 + i},
+                {"hiddenHost", "localhost"},
+            });
+        }
+        return json{{"type", "Handshake"}, {"identity", "benchmark-publisher"}, {"services", services}};
+    }
+
+    json makeMessage(int which)
+    {
+        switch (which)
+        {
+            case 0:
+                return json{{"type", "Ping"}, {"ref", "Ping"}};
+            case 1:
+                return makeNewTunnel();
+            default:
+                return makeHandshake();
+        }
+    }
+
+    /**
+     * Encode on one side, decode on the other, which is the cpu a message costs on the control channel.
+     * The bytes_per_message counter is the size on the wire.
+     */
+    void roundTrip(benchmark::State& state, WireEncoding encoding)
+    {
+        const auto message = makeMessage(static_cast<int>(state.range(0)));
+        std::size_t bytes = 0;
+        AllocationCounter allocations{state};
+        for (auto _ : state)
+        {
+            const auto encoded = encodeMessage(message, encoding);
+            bytes = encoded.size();
+            auto decoded = decodeMessage(encoded, encoding);
+            benchmark::DoNotOptimize(decoded);
+        }
+        state.counters["bytes_per_message"] = static_cast<double>(bytes);
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void batchRoundTrip(benchmark::State& state, WireEncoding encoding)
+    {
+        const auto message = makeNewTunnel();
+        const auto batchSize = static_cast<std::size_t>(state.range(0));
+        std::size_t bytes = 0;
+        AllocationCounter allocations{state};
+        for (auto _ : state)
+        {
+            std::vector<std::string> batch;
+            batch.reserve(batchSize);
+            for (std::size_t i = 0; i != batchSize; ++i)
+                batch.push_back(encodeMessage(message, encoding));
+            const auto frame = joinEncodedMessages(std::move(batch), encoding);
+            bytes = frame.size();
+            forEachMessageInFrame(frame, encoding, [](json const& decoded) {
+                benchmark::DoNotOptimize(decoded);
+            });
+        }
+        state.counters["bytes_per_message"] = static_cast<double>(bytes) / static_cast<double>(batchSize);
+        state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(batchSize));
+    }
+}
+
+// Argument: 0 = Ping, 1 = NewTunnel, 2 = Handshake with 16 services
+BENCHMARK_CAPTURE(roundTrip, json, WireEncoding::Json)->DenseRange(0, 2);
+BENCHMARK_CAPTURE(roundTrip, cbor, WireEncoding::Cbor)->DenseRange(0, 2);
+BENCHMARK_CAPTURE(roundTrip, msgpack, WireEncoding::MessagePack)->DenseRange(0, 2);
+
+BENCHMARK_CAPTURE(batchRoundTrip, json, WireEncoding::Json)->Arg(100);
+BENCHMARK_CAPTURE(batchRoundTrip, cbor, WireEncoding::Cbor)->Arg(100);
+BENCHMARK_CAPTURE(batchRoundTrip, msgpack, WireEncoding::MessagePack)->Arg(100);
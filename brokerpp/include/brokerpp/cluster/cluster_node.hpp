@@ -0,0 +1,103 @@
+#pragma once
+
+#include <brokerpp/cluster/cluster_registry.hpp>
+#include <brokerpp/config.hpp>
+#include <sharedpp/io_engine.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/leaf.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    class PageAndControlProvider;
+
+    /**
+     * One broker of a cluster. Announces the publishers it holds to all peers and keeps the registry of what the
+     * peers hold. For every service of a publisher held elsewhere, it listens on the public port and relays the
+     * connections to the owning node.
+     *
+     * Peers talk over a single relay port: registry updates from a peer and relayed client connections both start
+     * with a hello frame that proves knowledge of the shared secret by answering a challenge of the accepting node.
+     */
+    class ClusterNode : public std::enable_shared_from_this<ClusterNode>
+    {
+      public:
+        /// Delay between attempts to reach a peer that is down.
+        constexpr static std::chrono::seconds PeerRetryInterval{2};
+        /// Relay connections that do not challenge or introduce themselves within this time are dropped.
+        constexpr static std::chrono::seconds HelloTimeout{10};
+
+        ClusterNode(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            ClusterConfig config,
+            std::weak_ptr<PageAndControlProvider> pageAndControl);
+        ~ClusterNode();
+        ClusterNode(ClusterNode const&) = delete;
+        ClusterNode(ClusterNode&&) = delete;
+        ClusterNode& operator=(ClusterNode const&) = delete;
+        ClusterNode& operator=(ClusterNode&&) = delete;
+
+        /**
+         * @brief Listens on the relay port and starts connecting to the peers.
+         */
+        boost::leaf::result<void> start();
+
+        /**
+         * @brief Stops relaying and forwarding. Has to be called before the node is released.
+         */
+        void stop();
+
+        /**
+         * @brief Announces that this node holds the publisher with these services. No services releases it.
+         */
+        void claim(std::string const& identity, std::vector<ServiceInfo> const& services);
+
+        ClusterRegistry const& registry() const;
+        std::string const& nodeId() const;
+
+      private:
+        struct Forwarder;
+
+        void acceptOnce();
+        void onHello(std::shared_ptr<boost::asio::ip::tcp::socket> socket, json hello, std::string const& challenge);
+        void readRegistry(
+            std::shared_ptr<boost::asio::ip::tcp::socket> socket,
+            std::string peerNodeId,
+            std::uint64_t generation);
+
+        void connectPeer(std::size_t peerIndex);
+        /**
+         * @brief Answers the challenge of the peer and sends it the claims of this node.
+         */
+        void registerAtPeer(
+            std::size_t peerIndex,
+            std::shared_ptr<boost::asio::ip::tcp::socket> const& socket,
+            std::string const& challenge);
+        void writeToPeer(std::size_t peerIndex);
+        void retryPeer(
+            std::size_t peerIndex,
+            std::shared_ptr<boost::asio::ip::tcp::socket> const& socket,
+            boost::system::error_code ec);
+        void broadcast(std::string frame);
+
+        void reconcileForwarders();
+        void forwardOnce(std::shared_ptr<Forwarder> const& forwarder);
+        void relay(
+            std::shared_ptr<boost::asio::ip::tcp::socket> client,
+            std::string const& identity,
+            unsigned short publicPort,
+            std::string const& ownerNodeId);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
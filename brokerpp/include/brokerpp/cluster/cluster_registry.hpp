@@ -0,0 +1,73 @@
+#pragma once
+
+#include <brokerpp/publisher/service_info.hpp>
+#include <sharedpp/json.hpp>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * A node announcing that it holds the control session of a publisher, and with it the services.
+     */
+    struct PublisherClaim
+    {
+        std::string identity;
+        std::string nodeId;
+        std::vector<ServiceInfo> services;
+        /// One above the highest generation the claiming node knew for the publisher. If a publisher moved, the
+        /// claim with the highest generation wins, ties go to the higher node id. Clocks of the nodes do not matter.
+        std::uint64_t generation = 0;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(PublisherClaim, identity, nodeId, services, generation)
+
+    /**
+     * Which node holds which publisher. Every node is the authority for its own claims and spreads them to its
+     * peers, so there is no coordination beyond that. Thread safe.
+     */
+    class ClusterRegistry
+    {
+      public:
+        /**
+         * @brief Adds or replaces the claim of claim.nodeId for claim.identity. A claim without services releases.
+         */
+        void update(PublisherClaim claim);
+
+        /**
+         * @brief Replaces everything known about a node, used when a node (re)connects.
+         */
+        void replaceNode(std::string const& nodeId, std::vector<PublisherClaim> const& claims);
+
+        /**
+         * @brief Forgets a node, its publishers reconnect somewhere else.
+         */
+        void dropNode(std::string const& nodeId);
+
+        /**
+         * @brief The newest claim for a publisher, if any node holds it.
+         */
+        std::optional<PublisherClaim> owner(std::string const& identity) const;
+
+        /**
+         * @brief The generation a new claim for the publisher takes to win over all known ones.
+         */
+        std::uint64_t nextGeneration(std::string const& identity) const;
+
+        std::vector<PublisherClaim> claimsOf(std::string const& nodeId) const;
+
+        /**
+         * @brief The newest claim of every publisher.
+         */
+        std::vector<PublisherClaim> owners() const;
+
+      private:
+        mutable std::mutex guard_;
+        /// identity -> nodeId -> claim
+        std::map<std::string, std::map<std::string, PublisherClaim>> claims_;
+    };
+}
@@ -1,24 +1,144 @@
-#pragma once
-
-#include <sharedpp/json.hpp>
-
-namespace TunnelBore::Broker
-{
-    struct ServerConfig
-    {
-        std::string iface;
-        unsigned short port;
-    };
-    struct Config
-    {
-        ServerConfig bind;
-        bool ssl = true;
-    };
-
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ServerConfig, iface, port)
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Config, bind, ssl)
-
-    Config loadConfig();
-    void saveConfig(Config const& config);
-
+#pragma once
+
+#include <sharedpp/json.hpp>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    struct ServerConfig
+    {
+        std::string iface;
+        unsigned short port = 0;
+    };
+    struct ClusterPeer
+    {
+        std::string nodeId;
+        std::string host;
+        unsigned short relayPort = 0;
+    };
+    /**
+     * Several brokers sharing which node holds which publisher. Client connections to any node are relayed to the
+     * node holding the publisher.
+     */
+    struct ClusterConfig
+    {
+        bool enabled = false;
+        std::string nodeId;
+        std::string relayIface = "::";
+        unsigned short relayPort = 0;
+        /// Shared by all nodes, peers that do not know it are refused.
+        std::string secret;
+        std::vector<ClusterPeer> peers;
+        /// Added to every public port bound by this node, so that several nodes can run on one host.
+        unsigned short publicPortOffset = 0;
+    };
+    /**
+     * A listener shared by many services, each connection is routed by the host it asks for. Services on it do not
+     * need a public port of their own.
+     */
+    struct RoutingListenerConfig
+    {
+        bool enabled = false;
+        std::string iface = "::";
+        unsigned short port = 0;
+    };
+    /**
+     * Lets the broker answer the HTTP/1.1 requests of services routed by host itself, over tunnels to the publisher
+     * that are kept open and shared by all clients, instead of a tunnel per client connection.
+     */
+    struct HttpProxyConfig
+    {
+        bool enabled = false;
+        /// Tunnels per service open at once, further requests wait for one of them.
+        std::size_t maxUpstreams = 32;
+        /// Unused tunnels kept per service, more are closed after their response.
+        std::size_t maxIdleUpstreams = 8;
+        /// Unused tunnels are closed after this long.
+        int upstreamIdleSeconds = 60;
+        /// Client connections waiting this long for their next request are closed.
+        int keepAliveSeconds = 15;
+        /// Client connections are closed after this many requests, 0 for no limit.
+        std::size_t maxKeepAliveRequests = 1000;
+    };
+    struct Config
+    {
+        ServerConfig bind;
+        bool ssl = true;
+        /// Control sessions that send nothing for this long are closed. Raised to fit the publishers heartbeat.
+        int controlTimeoutSeconds = 60;
+        /// Services and tunnels of a publisher that lost its control line are kept this long for it to come back.
+        int controlGraceSeconds = 30;
+        /// Clients of a publisher without control line wait this long for it instead of being refused, 0 refuses them.
+        int holdConnectionsSeconds = 10;
+        /// Keeps the publishers and their services in broker/state.json, to bind their ports right after a restart.
+        /// Not used by cluster nodes.
+        bool stateSnapshot = true;
+        /// Threads serving tunnel connections, each with its own io_context. 0 for one per hardware thread.
+        std::size_t ioThreads = 0;
+        bool pinIoThreads = false;
+        ClusterConfig cluster;
+        /// Tunnel setups taking longer are logged with the time of every stage, 0 disables the log.
+        int slowTunnelSetupMs = 0;
+        /// Users allowed to inspect the broker through /api/admin, none by default.
+        std::vector<std::string> adminIdentities;
+        /// Lets publishers encrypt their tunnel connections with the certificate of the api, needs ssl.
+        bool dataLinkTls = true;
+        /// Publisher logins and control line handshakes in progress at once, more are asked to retry. 0 for no limit.
+        std::size_t maxConcurrentHandshakes = 64;
+        /// Routes HTTP/1.x requests to the services naming their Host in httpHosts.
+        RoutingListenerConfig httpRouting;
+        /// Routes TLS connections to the services naming the server name of their ClientHello in tlsServerNames.
+        /// The connections are passed on still encrypted.
+        RoutingListenerConfig tlsRouting;
+        /// Terminates HTTP for the services routed by httpRouting, see HttpProxyConfig.
+        HttpProxyConfig httpProxy;
+    };
+
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ServerConfig, iface, port)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ClusterPeer, nodeId, host, relayPort)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+        ClusterConfig,
+        enabled,
+        nodeId,
+        relayIface,
+        relayPort,
+        secret,
+        peers,
+        publicPortOffset)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(RoutingListenerConfig, enabled, iface, port)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+        HttpProxyConfig,
+        enabled,
+        maxUpstreams,
+        maxIdleUpstreams,
+        upstreamIdleSeconds,
+        keepAliveSeconds,
+        maxKeepAliveRequests)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+        Config,
+        bind,
+        ssl,
+        controlTimeoutSeconds,
+        controlGraceSeconds,
+        holdConnectionsSeconds,
+        stateSnapshot,
+        ioThreads,
+        pinIoThreads,
+        cluster,
+        slowTunnelSetupMs,
+        adminIdentities,
+        dataLinkTls,
+        maxConcurrentHandshakes,
+        httpRouting,
+        tlsRouting,
+        httpProxy)
+
+    Config loadConfig();
+    /// Loads a config file outside of the home directory.
+    Config loadConfig(std::filesystem::path const& path);
+    void saveConfig(Config const& config);
+
 }
\ No newline at end of file
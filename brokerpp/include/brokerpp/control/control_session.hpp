@@ -1,58 +1,118 @@
-#pragma once
-
-#include <brokerpp/publisher/publisher_token.hpp>
-#include <sharedpp/json.hpp>
-#include <brokerpp/control/subscription.hpp>
-#include <roar/websocket/websocket_session.hpp>
-
-#include <boost/asio/ip/tcp.hpp>
-
-#include <memory>
-
-namespace TunnelBore::Broker
-{
-    class PageAndControlProvider;
-    class Publisher;
-
-    class ControlSession : public std::enable_shared_from_this<ControlSession>
-    {
-      public:
-        ControlSession(
-            std::string sessionId,
-            std::weak_ptr<PageAndControlProvider> controller,
-            std::shared_ptr<Roar::WebsocketSession> ws,
-            std::function<void()> endSelf,
-            std::string publicJwtKey);
-        ~ControlSession();
-        ControlSession(ControlSession&&) = delete;
-        ControlSession(ControlSession const&) = delete;
-        ControlSession& operator=(ControlSession&&) = delete;
-        ControlSession& operator=(ControlSession const&) = delete;
-        std::optional<PublisherToken> verifyPublisherIdentity(std::string const& token) const;
-
-        void writeJson(json const& j);
-        std::string identity() const;
-
-        // TODO: still right approach?
-        void setup(std::string const& identity);
-        void informAboutConnection(std::string const& serviceId, std::string const& tunnelId);
-
-        void subscribe(
-            std::string const& type,
-            std::function<bool(Subscription::ParameterType const&, std::string const&)> const& callback);
-        boost::asio::ip::tcp::endpoint remoteEndpoint() const;
-        void respondWithError(std::string const& ref, std::string const& msg);
-        void respond(std::string const& ref, json const& j);
-
-      private:
-        void onRead(Roar::WebsocketReadResult const& readResult);
-        void doRead();
-        void onJson(json const& j, std::string const& ref);
-        std::shared_ptr<Publisher> getAssociatedPublisher();
-        void writeOnce();
-
-      private:
-        struct Implementation;
-        std::unique_ptr<Implementation> impl_;
-    };
+#pragma once
+
+#include <brokerpp/publisher/publisher_token.hpp>
+#include <brokerpp/publisher/service_info.hpp>
+#include <sharedpp/json.hpp>
+#include <sharedpp/wire_encoding.hpp>
+#include <brokerpp/control/dispatcher.hpp>
+#include <roar/websocket/websocket_session.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <chrono>
+
+#include <memory>
+
+namespace TunnelBore::Broker
+{
+    class PageAndControlProvider;
+    class Publisher;
+
+    class ControlSession : public std::enable_shared_from_this<ControlSession>
+    {
+      public:
+        /// Upper bound for the time a message waits to be batched with following ones.
+        constexpr static std::chrono::microseconds MaxBatchDelay{500};
+        /// Frames are not grown beyond this, unless a single message is larger.
+        constexpr static std::size_t MaxBatchBytes = 64 * 1024;
+
+        ControlSession(
+            boost::asio::any_io_executor executor,
+            std::string sessionId,
+            std::weak_ptr<PageAndControlProvider> controller,
+            std::shared_ptr<Roar::WebsocketSession> ws,
+            std::function<void(ControlSession const& session)> endSelf,
+            std::string publicJwtKey,
+            std::chrono::seconds idleTimeout);
+        ~ControlSession();
+        ControlSession(ControlSession&&) = delete;
+        ControlSession(ControlSession const&) = delete;
+        ControlSession& operator=(ControlSession&&) = delete;
+        ControlSession& operator=(ControlSession const&) = delete;
+        std::optional<PublisherToken> verifyPublisherIdentity(std::string const& token) const;
+
+        void writeJson(json const& j);
+
+        /**
+         * @brief Allows multiple messages to be sent as one newline delimited frame.
+         * Only to be enabled when the publisher announced that it can split them.
+         */
+        void enableBatching(bool enable);
+
+        /**
+         * @brief Switches the encoding of the messages written from now on and of received binary frames.
+         * Messages that are already queued keep the encoding they were written with.
+         */
+        void setEncoding(WireEncoding encoding);
+
+        /**
+         * @brief Publishers only ping when their line is idle for the announced interval.
+         * The idle timeout is raised so that a few of these pings can be missed before the session is dropped.
+         */
+        void expectHeartbeat(std::chrono::seconds interval);
+
+        /**
+         * @brief Keeps the handshake counted as in progress until releaseHandshakePermit or the end of the session.
+         */
+        void holdHandshakePermit(std::shared_ptr<void> permit);
+        void releaseHandshakePermit();
+        std::string identity() const;
+
+        /**
+         * @brief The publisher this session controls. The identity, followed by the instance if the publisher named
+         * one, so that several instances may log in with the same identity.
+         */
+        std::string publisherName() const;
+
+        // TODO: still right approach?
+        void setup(std::string const& identity, std::string const& publisherName);
+
+        /**
+         * @param serviceInfo As announced by this publisher, the hidden port to connect the tunnel to.
+         * @param connectPort The port the publisher connects the tunnel to.
+         */
+        void informAboutConnection(
+            std::string const& serviceId,
+            ServiceInfo const& serviceInfo,
+            unsigned short connectPort,
+            std::string const& tunnelId);
+
+        /**
+         * @brief Sets the handler for a message type. Handlers have to be set before setup starts reading.
+         */
+        template <typename MessageT>
+        void on(Dispatcher::HandlerType<MessageT> handler)
+        {
+            dispatcher().on<MessageT>(std::move(handler));
+        }
+        boost::asio::ip::tcp::endpoint remoteEndpoint() const;
+        void respondWithError(std::string const& ref, std::string const& msg);
+        void respond(std::string const& ref, json const& j);
+
+      private:
+        void onRead(Roar::WebsocketReadResult const& readResult);
+        void doRead();
+        void onMessage(json const& message);
+        void onJson(json const& j, std::string const& ref);
+        std::shared_ptr<Publisher> getAssociatedPublisher();
+        void writeOnce();
+        void scheduleBatch();
+        void armIdleTimer();
+        Dispatcher& dispatcher();
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
 }
\ No newline at end of file
@@ -1,32 +1,57 @@
 #pragma once
 
-#include "subscription.hpp"
+#include <brokerpp/control/messages.hpp>
 
 #include <sharedpp/json.hpp>
 
-#include <memory>
-#include <mutex>
+#include <array>
+#include <functional>
 #include <string>
 #include <unordered_map>
-#include <optional>
 
 namespace TunnelBore::Broker
 {
+    /**
+     * Routes control messages to their handlers.
+     *
+     * Known message types are looked up in a table indexed by ControlMessageType and decoded into their
+     * message struct before the handler is called. Other types go through a string keyed fallback.
+     * Handlers must be installed before the first dispatch, dispatching itself does not lock.
+     */
     class Dispatcher final
     {
       public:
-        [[nodiscard]] std::shared_ptr<Subscription> subscribe(
-            std::string const& type,
-            std::function<bool(Subscription::ParameterType const&, std::string const&)> const& callback);
+        template <typename MessageT>
+        using HandlerType = std::function<bool(MessageT const&, std::string const& ref)>;
+        using GenericHandlerType = std::function<bool(json const&, std::string const& ref)>;
 
-        [[nodiscard]] std::shared_ptr<Subscription> subscribe(
-            std::string const& type,
-            std::function<void(Subscription::ParameterType const&, std::string const&)> const& callback);
+        /**
+         * @brief Installs the handler for a known message type, replacing the previous one.
+         */
+        template <typename MessageT>
+        void on(HandlerType<MessageT> handler)
+        {
+            m_handlers[static_cast<std::size_t>(MessageT::messageType)] =
+                [handler = std::move(handler)](json const& msg, std::string const& ref) {
+                    return handler(msg.get<MessageT>(), ref);
+                };
+        }
 
-        void dispatch(json const& msg, std::string const& ref);
+        /**
+         * @brief Installs a handler for a type that has no entry in ControlMessageType.
+         */
+        void onUnknown(std::string const& type, GenericHandlerType handler);
+
+        /**
+         * @brief Calls the handler for the message.
+         *
+         * @throws json::exception if the message does not decode into its message struct.
+         * @return The result of the handler or false if there is none.
+         */
+        bool dispatch(json const& msg, std::string const& ref);
 
       private:
-        std::unordered_multimap<std::string, std::weak_ptr<Subscription>> m_subscribers;
-        std::mutex m_subscriberGuard;
+        std::array<GenericHandlerType, controlMessageTypeCount> m_handlers;
+        std::unordered_map<std::string, GenericHandlerType> m_fallbackHandlers;
     };
-}
\ No newline at end of file
+}
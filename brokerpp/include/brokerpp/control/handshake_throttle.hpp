@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * Bounds the publisher logins and control line handshakes in progress, so that a mass reconnect after a network
+     * outage is spread out over time instead of being answered all at once.
+     */
+    class HandshakeThrottle : public std::enable_shared_from_this<HandshakeThrottle>
+    {
+      public:
+        /// Rejected publishers are told to retry within this, picked at random to spread them.
+        constexpr static std::chrono::seconds MaxRetryAfter{10};
+
+        /**
+         * @param maxConcurrent Handshakes beyond this are rejected, 0 for no limit.
+         */
+        explicit HandshakeThrottle(std::size_t maxConcurrent);
+
+        /**
+         * @return A permit that counts as handshake in progress until it is destroyed, nullptr if there are too many.
+         */
+        std::shared_ptr<void> tryAcquire();
+
+        /**
+         * @brief The time a rejected publisher should wait before it tries again.
+         */
+        std::chrono::seconds retryAfter() const;
+
+        std::size_t inProgress() const;
+        std::size_t rejected() const;
+
+      private:
+        std::size_t maxConcurrent_;
+        std::atomic<std::size_t> inProgress_;
+        std::atomic<std::size_t> rejected_;
+    };
+}
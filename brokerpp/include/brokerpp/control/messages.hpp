@@ -0,0 +1,129 @@
+#pragma once
+
+#include <brokerpp/publisher/service_info.hpp>
+#include <sharedpp/json.hpp>
+#include <sharedpp/tunnel_trace.hpp>
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * All message types the broker understands on the control connection.
+     * Used to index the dispatch table, so keep Count last.
+     */
+    enum class ControlMessageType : std::size_t
+    {
+        Handshake,
+        Ping,
+        NewTunnelFailed,
+        TunnelTrace,
+        ServicesUpdate,
+        Count
+    };
+
+    constexpr std::size_t controlMessageTypeCount = static_cast<std::size_t>(ControlMessageType::Count);
+
+    constexpr std::array<std::string_view, controlMessageTypeCount> controlMessageTypeNames{
+        "Handshake",
+        "Ping",
+        "NewTunnelFailed",
+        "TunnelTrace",
+        "ServicesUpdate",
+    };
+
+    constexpr std::optional<ControlMessageType> controlMessageTypeFromString(std::string_view name)
+    {
+        for (std::size_t i = 0; i != controlMessageTypeNames.size(); ++i)
+        {
+            if (controlMessageTypeNames[i] == name)
+                return static_cast<ControlMessageType>(i);
+        }
+        return std::nullopt;
+    }
+
+    constexpr std::string_view toString(ControlMessageType type)
+    {
+        return controlMessageTypeNames[static_cast<std::size_t>(type)];
+    }
+
+    static_assert(controlMessageTypeFromString("Ping") == ControlMessageType::Ping);
+    static_assert(!controlMessageTypeFromString("Pong"));
+
+    struct HandshakeMessage
+    {
+        constexpr static auto messageType = ControlMessageType::Handshake;
+
+        std::vector<ServiceInfo> services;
+        /// Publisher can split newline delimited frames.
+        bool batching = false;
+        /// Wire encodings the publisher can speak, most preferred first.
+        std::vector<std::string> encodings;
+        /// Longest time the publisher stays silent before it pings, 0 if it did not say.
+        int heartbeatIntervalSeconds = 0;
+        /// Publisher reports its side of every tunnel setup with a TunnelTrace message.
+        bool tunnelTraces = false;
+    };
+    inline void from_json(json const& j, HandshakeMessage& message)
+    {
+        j.at("services").get_to(message.services);
+        message.batching = j.value("batching", false);
+        message.encodings = j.value("encodings", std::vector<std::string>{});
+        message.heartbeatIntervalSeconds = j.value("heartbeatIntervalSeconds", 0);
+        message.tunnelTraces = j.value("tunnelTraces", false);
+    }
+
+    struct PingMessage
+    {
+        constexpr static auto messageType = ControlMessageType::Ping;
+    };
+    inline void from_json(json const&, PingMessage&)
+    {}
+
+    struct NewTunnelFailedMessage
+    {
+        constexpr static auto messageType = ControlMessageType::NewTunnelFailed;
+
+        std::string serviceId;
+        std::string tunnelId;
+        std::string reason;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_EX(NewTunnelFailedMessage, serviceId, tunnelId, reason)
+
+    /**
+     * The stages the publisher went through to set up a tunnel, see TunnelTrace.
+     */
+    struct TunnelTraceMessage
+    {
+        constexpr static auto messageType = ControlMessageType::TunnelTrace;
+
+        TunnelTrace trace{"", TunnelStage::NewTunnelReceived};
+    };
+    inline void from_json(json const& j, TunnelTraceMessage& message)
+    {
+        j.at("trace").get_to(message.trace);
+    }
+
+    /**
+     * Services the publisher added, changed or removed since its handshake, without reconnecting.
+     */
+    struct ServicesUpdateMessage
+    {
+        constexpr static auto messageType = ControlMessageType::ServicesUpdate;
+
+        /// New services and services with a changed config, matched by public port.
+        std::vector<ServiceInfo> added;
+        /// Public ports of the services that are gone.
+        std::vector<unsigned short> removed;
+    };
+    inline void from_json(json const& j, ServicesUpdateMessage& message)
+    {
+        message.added = j.value("added", std::vector<ServiceInfo>{});
+        message.removed = j.value("removed", std::vector<unsigned short>{});
+    }
+}
\ No newline at end of file
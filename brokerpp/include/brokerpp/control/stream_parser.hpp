@@ -3,22 +3,51 @@
 #include <sharedpp/json.hpp>
 
 #include <string>
+#include <string_view>
 #include <optional>
 
 namespace TunnelBore::Broker
 {
+    /**
+     * Splits a stream of concatenated json objects into single messages.
+     *
+     * Consumed bytes are only skipped over and the storage is compacted lazily on the next feed,
+     * so popped messages are parsed directly out of the buffer without copying them first.
+     */
     class StreamParser
     {
       public:
         void feed(std::string_view txt);
         std::optional<json> popMessage();
 
+        /**
+         * @brief Pops every complete message that is currently buffered.
+         *
+         * @param consumer Called with each message in order, may throw to abort draining.
+         * @return The amount of messages that were handed to the consumer.
+         */
+        template <typename FunctionT>
+        std::size_t drain(FunctionT&& consumer)
+        {
+            std::size_t count = 0;
+            while (auto message = popMessage())
+            {
+                ++count;
+                consumer(std::move(*message));
+            }
+            return count;
+        }
+
+        /// Bytes that were fed, but not yet consumed as a message.
+        std::size_t bufferedBytes() const;
+
       private:
-        std::string::const_iterator findCompleteObjectEnd();
-        std::string consumeObject(std::string::const_iterator end);
+        std::optional<std::string_view> nextObject();
+        void compact();
 
       private:
         std::string m_buffer;
+        std::size_t m_readOffset = 0;
         struct FindMemoizer
         {
             int m_curlyCount = 0;
@@ -27,4 +56,4 @@ namespace TunnelBore::Broker
             std::size_t m_offset = 0;
         } m_findState;
     };
-}
\ No newline at end of file
+}
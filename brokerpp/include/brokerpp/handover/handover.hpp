@@ -0,0 +1,69 @@
+#pragma once
+
+#include <brokerpp/handover/handover_state.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    class PageAndControlProvider;
+
+    /**
+     * What the new process receives: the state and the sockets it refers to by index.
+     * The descriptors are owned by the receiver.
+     */
+    struct ReceivedHandover
+    {
+        HandoverState state;
+        std::vector<int> descriptors;
+    };
+
+    /// Where a running broker waits for its successor. Cluster nodes sharing a host each have their own.
+    std::filesystem::path handoverSocketPath(std::string const& nodeId = {});
+
+    /**
+     * @brief Connects to the running broker and takes over its listeners and tunnels.
+     * The old broker stops accepting, hands everything over and exits afterwards.
+     *
+     * @throws std::runtime_error if there is no broker to take over from or the transfer fails.
+     */
+    ReceivedHandover receiveHandover(std::filesystem::path const& socketPath);
+
+    /**
+     * Waits on a unix socket for a successor process and hands the brokers state over to it.
+     * Only supported on linux.
+     */
+    class HandoverListener : public std::enable_shared_from_this<HandoverListener>
+    {
+      public:
+        HandoverListener(
+            boost::asio::any_io_executor executor,
+            std::filesystem::path socketPath,
+            std::weak_ptr<PageAndControlProvider> pageAndControl);
+        ~HandoverListener();
+        HandoverListener(HandoverListener const&) = delete;
+        HandoverListener(HandoverListener&&) = delete;
+        HandoverListener& operator=(HandoverListener const&) = delete;
+        HandoverListener& operator=(HandoverListener&&) = delete;
+
+        /**
+         * @brief Starts listening.
+         * @param onHandedOver Called after a successor took over, the process should exit then.
+         */
+        void start(std::function<void()> onHandedOver);
+        void stop();
+
+      private:
+        void acceptOnce();
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
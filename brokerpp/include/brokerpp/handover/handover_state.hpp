@@ -0,0 +1,100 @@
+#pragma once
+
+#include <brokerpp/publisher/service_info.hpp>
+#include <sharedpp/json.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * A linked tunnel whose pipes were suspended. Sockets are referenced by their index in the descriptor list
+     * that accompanies the state.
+     */
+    struct TunnelPairHandover
+    {
+        std::string clientTunnelId;
+        std::string publisherTunnelId;
+        std::size_t clientSocket;
+        std::size_t publisherSocket;
+        /// Read from the client, but not yet written to the publisher side.
+        std::string clientToPublisher;
+        /// Read from the publisher side, but not yet written to the client.
+        std::string publisherToClient;
+    };
+    inline void to_json(json& j, TunnelPairHandover const& tunnel)
+    {
+        const auto toBinary = [](std::string const& data) {
+            return json::binary(std::vector<std::uint8_t>{data.begin(), data.end()});
+        };
+        j = json{
+            {"clientTunnelId", tunnel.clientTunnelId},
+            {"publisherTunnelId", tunnel.publisherTunnelId},
+            {"clientSocket", tunnel.clientSocket},
+            {"publisherSocket", tunnel.publisherSocket},
+            {"clientToPublisher", toBinary(tunnel.clientToPublisher)},
+            {"publisherToClient", toBinary(tunnel.publisherToClient)},
+        };
+    }
+    inline void from_json(json const& j, TunnelPairHandover& tunnel)
+    {
+        const auto fromBinary = [](json const& data) {
+            auto const& bytes = data.get_binary();
+            return std::string{bytes.begin(), bytes.end()};
+        };
+        j.at("clientTunnelId").get_to(tunnel.clientTunnelId);
+        j.at("publisherTunnelId").get_to(tunnel.publisherTunnelId);
+        j.at("clientSocket").get_to(tunnel.clientSocket);
+        j.at("publisherSocket").get_to(tunnel.publisherSocket);
+        tunnel.clientToPublisher = fromBinary(j.at("clientToPublisher"));
+        tunnel.publisherToClient = fromBinary(j.at("publisherToClient"));
+    }
+
+    struct ServiceHandover
+    {
+        std::string serviceId;
+        ServiceInfo info;
+        std::size_t listenerSocket;
+        std::vector<TunnelPairHandover> tunnels;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ServiceHandover, serviceId, info, listenerSocket, tunnels)
+
+    struct PublisherHandover
+    {
+        std::string identity;
+        std::vector<ServiceHandover> services;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(PublisherHandover, identity, services)
+
+    /**
+     * The listener of a RoutingListener, the successor binds nothing for it.
+     */
+    struct RoutingHandover
+    {
+        /// "http" or "tls", see RoutedProtocol.
+        std::string protocol;
+        std::size_t listenerSocket;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(RoutingHandover, protocol, listenerSocket)
+
+    struct HandoverState
+    {
+        std::vector<PublisherHandover> publishers;
+        std::vector<RoutingHandover> routers = {};
+    };
+    inline void to_json(json& j, HandoverState const& state)
+    {
+        j = json{
+            {"publishers", state.publishers},
+            {"routers", state.routers},
+        };
+    }
+    inline void from_json(json const& j, HandoverState& state)
+    {
+        j.at("publishers").get_to(state.publishers);
+        // Not sent by brokers that bound the routing ports again after a takeover.
+        state.routers = j.value("routers", std::vector<RoutingHandover>{});
+    }
+}
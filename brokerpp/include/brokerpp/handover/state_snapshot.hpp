@@ -0,0 +1,41 @@
+#pragma once
+
+#include <brokerpp/publisher/service_info.hpp>
+#include <sharedpp/json.hpp>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    struct PublisherSnapshot
+    {
+        std::string identity;
+        std::vector<ServiceInfo> services;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(PublisherSnapshot, identity, services)
+
+    /**
+     * The publishers the broker served and their services, kept on disk so that a cold start can bind their ports
+     * before the publishers are back.
+     */
+    struct StateSnapshot
+    {
+        std::vector<PublisherSnapshot> publishers;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(StateSnapshot, publishers)
+
+    /// Where the snapshot is kept.
+    std::filesystem::path stateSnapshotPath();
+
+    /**
+     * @return The snapshot, empty if there is none or it cannot be read.
+     */
+    StateSnapshot loadStateSnapshot(std::filesystem::path const& path);
+
+    /**
+     * @brief Replaces the snapshot, a crash in between leaves the previous one intact.
+     */
+    void saveStateSnapshot(std::filesystem::path const& path, StateSnapshot const& snapshot);
+}
@@ -1,13 +1,17 @@
-#pragma once
-
-#include <string>
-
-namespace TunnelBore::Broker
-{
-    struct ProgramOptions
-    {
-        std::string servedDirectory;
-    };
-
-    ProgramOptions parseProgramOptions(int argc, char** argv);
+#pragma once
+
+#include <optional>
+#include <string>
+
+namespace TunnelBore::Broker
+{
+    struct ProgramOptions
+    {
+        std::string servedDirectory;
+        bool takeover;
+        /// Instead of the config in the home directory, for running several cluster nodes on one host.
+        std::optional<std::string> configFile;
+    };
+
+    ProgramOptions parseProgramOptions(int argc, char** argv);
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <brokerpp/config.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace TunnelBore::Broker
+{
+    class Service;
+    class TunnelSession;
+
+    /**
+     * Terminates HTTP/1.1 for a service. Requests of all clients are written to a pool of tunnels to the publishers,
+     * one after the other on each, so that short requests do not wait for a tunnel to be set up. The tunnels are
+     * ordinary ones to the hidden service, the publisher does not know the difference.
+     * Upgrades and HTTP/1.0 clients get a tunnel of their own like without the proxy, see Service::tunnelConnection.
+     */
+    class HttpProxy : public std::enable_shared_from_this<HttpProxy>
+    {
+      public:
+        /// Tunnels that did not connect by then count as failed.
+        constexpr static std::chrono::seconds UpstreamSetupTimeout{10};
+        /// A request or response making no progress for this long is aborted.
+        constexpr static std::chrono::seconds TransferTimeout{30};
+        /// Bodies are passed on in pieces of this size.
+        constexpr static std::size_t ChunkSize = 16 * 1024;
+
+        /**
+         * @param executor For the timers of the pool.
+         */
+        HttpProxy(boost::asio::any_io_executor executor, std::weak_ptr<Service> service, HttpProxyConfig config);
+        ~HttpProxy();
+        HttpProxy(HttpProxy const&) = delete;
+        HttpProxy(HttpProxy&&) = delete;
+        HttpProxy& operator=(HttpProxy const&) = delete;
+        HttpProxy& operator=(HttpProxy&&) = delete;
+
+        /**
+         * @brief Answers the requests of the client until it or the keep-alive limits end the connection.
+         *
+         * @param initialData Read from the client already, the start of its first request.
+         */
+        void serve(boost::asio::ip::tcp::socket&& socket, std::string initialData);
+
+        /**
+         * @brief A tunnel asked for by Service::openUpstream is linked to the publisher.
+         */
+        void upstreamConnected(std::string const& tunnelId, std::shared_ptr<TunnelSession> session);
+
+        /**
+         * @brief A tunnel asked for by Service::openUpstream will not connect.
+         */
+        void upstreamFailed(std::string const& tunnelId);
+
+        /**
+         * @brief Closes the unused tunnels and fails the requests waiting for one. Requests in flight finish, their
+         * tunnels are closed instead of pooled. Proxied clients are not handed over, a takeover cuts them off.
+         */
+        void stop();
+
+      private:
+        struct Upstream;
+        struct Exchange;
+        using Waiter = std::function<void(std::shared_ptr<Upstream>)>;
+
+        /// Calls the waiter with a tunnel, or with null if none could be opened or the proxy is stopped.
+        void acquire(std::shared_ptr<Exchange> const& exchange, Waiter waiter);
+        /// Pools the tunnel or hands it to the next waiter, closes it if it is not reusable or the proxy is stopped.
+        void release(std::shared_ptr<Upstream> upstream, bool reusable);
+        /// The exchange is closed, it no longer waits for a tunnel.
+        void dropWaiter(Exchange const& exchange);
+        /// Opens tunnels for the waiters that no tunnel being opened will serve, as far as the limit allows.
+        void openForWaiters();
+        void openUpstream();
+        void expireIdle();
+
+        void readRequest(std::shared_ptr<Exchange> const& exchange);
+        void onRequestHeader(std::shared_ptr<Exchange> const& exchange);
+        /// Sends the request on a tunnel from the pool, once there is one.
+        void forward(std::shared_ptr<Exchange> const& exchange);
+        void sendRequest(std::shared_ptr<Exchange> const& exchange);
+        void readResponse(std::shared_ptr<Exchange> const& exchange);
+        void onResponseHeader(std::shared_ptr<Exchange> const& exchange);
+        /// The tunnel failed before the response started, retries or answers with a 502.
+        void upstreamBroke(std::shared_ptr<Exchange> const& exchange);
+        /// Hands the client over to a tunnel of its own.
+        void tunnel(std::shared_ptr<Exchange> const& exchange);
+        void arm(std::shared_ptr<Exchange> const& exchange, std::chrono::seconds timeout);
+        /// Answers with a canned response and closes the client.
+        void refuse(std::shared_ptr<Exchange> const& exchange, std::string_view response);
+        void finish(std::shared_ptr<Exchange> const& exchange);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
@@ -3,36 +3,148 @@
 #include <brokerpp/control/dispatcher.hpp>
 #include <brokerpp/publisher/service_info.hpp>
 #include <brokerpp/control/control_session.hpp>
+#include <brokerpp/handover/handover_state.hpp>
+#include <brokerpp/publisher/tunnel_registry.hpp>
+#include <sharedpp/io_engine.hpp>
+#include <sharedpp/tunnel_trace.hpp>
 
+#include <boost/asio/ssl/context.hpp>
+
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <vector>
 
 namespace TunnelBore::Broker
 {
     class Service;
+    class ServiceDirectory;
+
+    /**
+     * The services and control session of a publisher at one moment, for readers that must not wait for it.
+     */
+    struct PublisherView
+    {
+        std::vector<std::shared_ptr<Service>> services;
+        std::weak_ptr<ControlSession> controlSession;
+    };
 
     class Publisher : public std::enable_shared_from_this<Publisher>
     {
       public:
-        Publisher(boost::asio::any_io_executor executor, std::string identity);
+        /**
+         * @param setupStats Receives the traces of the tunnel setups of both sides.
+         * @param tunnelRegistry Linked tunnels of all services are registered here.
+         * @param serviceDirectory Shared by all publishers, services on a public port served already are joined as a
+         * replica. Null to always bind.
+         * @param dataLinkTls Offered to the publisher for encrypting its tunnel connections, null to not offer it.
+         * @param controlGracePeriod Services are kept this long after the control session ended, see
+         * detachControlSession.
+         * @param holdTimeout Clients of services without control session wait this long for it, see Service.
+         * @param publicPortOffset Added to the public port of every service when binding, see ClusterConfig.
+         */
+        Publisher(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::string identity,
+            std::shared_ptr<TunnelSetupStats> setupStats,
+            std::shared_ptr<TunnelRegistry> tunnelRegistry,
+            std::shared_ptr<ServiceDirectory> serviceDirectory,
+            std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+            std::chrono::seconds controlGracePeriod,
+            std::chrono::seconds holdTimeout,
+            unsigned short publicPortOffset = 0);
         ~Publisher();
         Publisher(Publisher const&) = delete;
         Publisher(Publisher&&);
         Publisher& operator=(Publisher const&) = delete;
         Publisher& operator=(Publisher&&);
 
+        /**
+         * @brief Attaches a control session, services kept from the previous one are taken over by it.
+         */
         void setCurrentControlSession(std::weak_ptr<ControlSession> controlSession);
         std::weak_ptr<ControlSession> getCurrentControlSession();
-        void detachControlSession(bool eraseServices);
 
-        Service* getService(std::string const& id);
+        /**
+         * @brief Called when the current control session ended. Listeners and linked tunnels are kept for the grace
+         * period, the services are only cleared when no new control session was attached by then.
+         * Does nothing if a newer control session is attached already.
+         */
+        void detachControlSession();
+
+        std::string identity() const;
+        /// The identity of the token, without the instance.
+        std::string account() const;
+        std::shared_ptr<Service> getService(std::string const& id);
+        std::shared_ptr<Service> findServiceByPublicPort(unsigned short publicPort);
         std::vector<std::string> getServiceIds() const;
+        std::vector<std::shared_ptr<Service>> getServices() const;
+
+        /**
+         * @brief Lock free, republished whenever the services or the control session change. Used by the admin
+         * listing, which must not wait for a publisher busy with its services.
+         */
+        std::shared_ptr<PublisherView const> view() const;
         std::size_t removeService(std::string const& id);
 
+        /**
+         * @brief Starts the service, or keeps it if one with the same public port and config is running already.
+         * A running one with a different config is replaced. Joins the service of another publisher on the same
+         * public port, if its compression matches.
+         */
         bool addService(ServiceInfo serviceInfo);
 
+        /**
+         * @brief Applies a ServicesUpdate of the publisher, services that did not change keep their listeners and
+         * tunnels.
+         *
+         * @param added New services and services with a changed config, matched by public port.
+         * @param removed Public ports of the services to close.
+         */
+        void updateServices(std::vector<ServiceInfo> const& added, std::vector<unsigned short> const& removed);
+
+        /**
+         * @brief Called with the services announced in a handshake or resulting from an update before they are
+         * started, and with none once the services are cleared. Lets the cluster know where this publisher lives.
+         */
+        void onServicesChanged(std::function<void(std::vector<ServiceInfo> const&)> handler);
+
+        /**
+         * @brief Releases all services and their tunnels for another broker process, see Service::prepareHandover.
+         */
+        PublisherHandover prepareHandover(std::vector<int>& descriptors);
+
+        /**
+         * @brief Recreates the services released by another broker process. They are kept for the grace period
+         * until the publisher reconnects its control line.
+         */
+        void restore(PublisherHandover const& handover, std::vector<int> const& descriptors);
+
+        /**
+         * @brief Binds the services known from a state snapshot before the publisher connected. Clients are held
+         * until it is back, services it does not announce again are closed with its handshake.
+         */
+        void prebind(std::vector<ServiceInfo> const& services);
+
       private:
+        /// Reconciles the services of a handshake with the running ones, see changeServices.
         void addServices(std::vector<ServiceInfo> const& services);
+        void changeServices(std::vector<ServiceInfo> const& added, std::vector<unsigned short> const& removed);
+        bool startService(ServiceInfo const& serviceInfo, std::shared_ptr<Service> const& existing);
         void clearServices();
+        /// Stops the service, unless other publishers still serve it.
+        void leaveService(Service& service);
+        /// The service as this publisher announced it, it may have joined one announced differently.
+        ServiceInfo announcedInfo(Service& service);
+        /// Whether clients reach the service through a routing listener instead of its public port.
+        bool isRouted(ServiceInfo const& serviceInfo) const;
+        /// @return false if the service could not get all of its hosts.
+        bool claimRoutes(std::shared_ptr<Service> const& service);
+        void releaseHeldConnections();
+        /// Clears the services unless a control session is attached within the grace period.
+        void startGracePeriod();
+        std::shared_ptr<Service> makeService(ServiceInfo const& serviceInfo, std::string serviceId);
 
       private:
         struct Implementation;
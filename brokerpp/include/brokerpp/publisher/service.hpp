@@ -2,36 +2,53 @@
 
 #include "service_info.hpp"
 
+#include <brokerpp/handover/handover_state.hpp>
+#include <brokerpp/publisher/tunnel_registry.hpp>
+#include <sharedpp/io_engine.hpp>
+#include <sharedpp/tunnel_trace.hpp>
+
 #include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
 #include <boost/leaf.hpp>
 
+#include <chrono>
 #include <memory>
-
-namespace boost::asio
-{
-    class io_context;
-}
-namespace boost::asio::ip
-{
-    class tcp;
-    template <typename T>
-    class basic_endpoint;
-}
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace TunnelBore::Broker
 {
 
     class Publisher;
+    class TunnelSession;
+    struct HttpProxyConfig;
 
     class Service : public std::enable_shared_from_this<Service>
     {
       public:
+        /// Upper bound for a linked tunnel to finish its read or write in flight when handed over.
+        constexpr static std::chrono::seconds HandoverSuspendTimeout{5};
+        /// Clients beyond this are refused while the publisher is away, each held one costs a descriptor.
+        constexpr static std::size_t MaxHeldConnections = 512;
+
+        /**
+         * @param dataLinkTls Publishers may encrypt their side of the tunnels with it, null to only accept plain ones.
+         * @param holdTimeout Clients arriving while the publisher has no control line wait this long for it, see
+         * releaseHeldConnections. 0 refuses them.
+         */
         Service(
             boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
             ServiceInfo const& info,
             boost::asio::ip::basic_endpoint<boost::asio::ip::tcp> const& bindEndpoint,
             std::weak_ptr<Publisher> publisher,
-            std::string serviceId);
+            std::string serviceId,
+            std::shared_ptr<TunnelSetupStats> setupStats,
+            std::shared_ptr<TunnelRegistry> tunnelRegistry,
+            std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+            std::chrono::seconds holdTimeout);
         ~Service();
         Service(Service const&) = delete;
         Service(Service&&);
@@ -44,12 +61,163 @@ namespace TunnelBore::Broker
         void stop();
         ServiceInfo info() const;
 
-        void connectTunnels(std::string const& idForClientTunnel, std::string const& idForPublisherTunnel);
+        /**
+         * @brief Links both sides of a tunnel. The publisher side is moved onto the shard of the client side first,
+         * so that both directions of the pipe are served by the same thread.
+         *
+         * @param publisherIdentity Of the token the publisher side presented, must be the replica the tunnel was
+         * offered to.
+         */
+        void connectTunnels(
+            std::string const& idForClientTunnel,
+            std::string const& idForPublisherTunnel,
+            std::string const& publisherIdentity);
+
+        /**
+         * @brief Adds a publisher serving the same public port, or updates its info if it already is one.
+         * The first replica is the publisher that created the service.
+         */
+        void addReplica(std::weak_ptr<Publisher> publisher, ServiceInfo const& info);
+
+        /**
+         * @brief Tunnels offered to the publisher and not linked yet are offered to the other replicas.
+         *
+         * @return The replicas left, the service should be stopped when there are none.
+         */
+        std::size_t removeReplica(Publisher const& publisher);
+
+        /**
+         * @return The service as announced by this replica, nothing if it is none.
+         */
+        std::optional<ServiceInfo> replicaInfo(Publisher const& publisher);
+
+        /**
+         * @return The identities of the replicas still alive, see Publisher::identity.
+         */
+        std::vector<std::string> replicaIdentities();
+
+        /**
+         * @return Whether the publisher is the oldest replica left, it is the one to hand the service over.
+         */
+        bool isPrimary(Publisher const& publisher);
+
+        /**
+         * @brief Asks the replica with the fewest outstanding tunnels, weighted by its setup latency, to connect
+         * the publisher side of a client tunnel.
+         *
+         * @return false if no replica has a control line.
+         */
+        bool offerTunnel(std::string const& tunnelId);
+
+        /**
+         * @brief The replica could not reach its hidden service, another one gets to try before the client is
+         * closed.
+         */
+        void tunnelFailed(std::string const& tunnelId, Publisher const& publisher);
+
+        /**
+         * @brief The control line of a replica dropped, its unlinked tunnels are offered to the others.
+         */
+        void replicaDetached(Publisher const& publisher);
 
         std::string serviceId() const;
 
+        /**
+         * @brief Compression, level and the stats of both directions, null if the tunnels are not compressed.
+         */
+        json compressionStats() const;
+
+        /**
+         * @brief The port clients and the publisher connect to. Differs from info().publicPort by the port offset of
+         * cluster nodes sharing a host.
+         */
+        unsigned short boundPort() const;
+
+        /**
+         * @brief Treats the socket like a connection accepted by the service. Used for client connections relayed by
+         * another cluster node or routed by a RoutingListener.
+         *
+         * @param initialData Read from a client already, it is sent to the publisher first. Empty if nothing was
+         * read, whether the connection is a client is found out by peeking then.
+         * @return false if the service cannot take connections right now, the socket is left untouched then.
+         */
+        bool acceptConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData = {});
+
+        /**
+         * @brief Like acceptConnection, but the client gets a tunnel of its own also when HTTP is proxied.
+         */
+        bool tunnelConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData);
+
+        /**
+         * @brief Answers the requests of routed clients through a pool of tunnels instead of a tunnel per client,
+         * see HttpProxy. Has to be called before start or adopt, compressed services are not proxied.
+         */
+        void proxyHttp(HttpProxyConfig const& config);
+
+        /**
+         * @brief Asks a replica for a tunnel that is handed to the HTTP proxy once connected, instead of being linked
+         * to a client. The proxy is told through HttpProxy::upstreamFailed if it does not connect.
+         *
+         * @return false if no replica has a control line.
+         */
+        bool openUpstream(std::string const& tunnelId);
+
+        /**
+         * @brief Gives up on a tunnel asked for by openUpstream, it is closed if it still connects.
+         */
+        void cancelUpstream(std::string const& tunnelId);
+
+        /**
+         * @brief Lets the clients that arrived while the publisher had no control line in, once it is back.
+         */
+        void releaseHeldConnections();
+
+        /**
+         * @brief Releases the listener and all linked tunnels for another broker process.
+         * Tunnels that are not linked yet, compressed or encrypted in userspace are closed, they would not survive the
+         * takeover anyway.
+         *
+         * @param descriptors Released sockets are appended here, the handover refers to them by index.
+         * @return Nothing if the listener could not be released, the service is unchanged then.
+         */
+        std::optional<ServiceHandover> prepareHandover(std::vector<int>& descriptors);
+
+        /**
+         * @brief Instead of start, takes over the listener and tunnels released by another broker process.
+         * Takes ownership of all descriptors the handover refers to.
+         */
+        boost::leaf::result<void> adopt(ServiceHandover const& handover, std::vector<int> const& descriptors);
+
       private:
         void acceptOnce();
+        /**
+         * @param proxy Whether routed HTTP clients go to the proxy, if there is one.
+         */
+        bool admitConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData, bool proxy);
+        void holdConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData, bool proxy);
+        void expireHeldConnections();
+        void registerTunnel(
+            TunnelSession& client,
+            TunnelSession const& publisher,
+            std::string const& publisherIdentity);
+        /**
+         * @param except Replica not to offer it to.
+         * @param attempts Replicas the tunnel was offered to before, gives up when all had their chance.
+         */
+        bool offerTunnel(std::string const& tunnelId, Publisher const* except, std::size_t attempts);
+        void dropPendingTunnel(std::string const& tunnelId);
+        /**
+         * @brief Takes the offer of the tunnel, if it was made to the replica with this identity.
+         * @return The identity of the replica, empty if the tunnel was not offered to it.
+         */
+        std::string takeOffer(std::string const& tunnelId, std::string const& publisherIdentity);
+        /**
+         * @return false if the tunnel was not asked for by the HTTP proxy.
+         */
+        bool connectUpstream(
+            std::string const& tunnelId,
+            std::string const& idForPublisherTunnel,
+            std::string const& publisherIdentity);
 
       private:
         struct Implementation;
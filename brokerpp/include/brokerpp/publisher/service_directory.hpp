@@ -0,0 +1,75 @@
+#pragma once
+
+#include <brokerpp/config.hpp>
+#include <brokerpp/routing/route_table.hpp>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace TunnelBore::Broker
+{
+    class Service;
+
+    /**
+     * The services of all publishers by public port. A publisher announcing a port that is served already joins the
+     * service as a replica instead of binding the port again, see Service::addReplica.
+     * Services reached through a shared HTTP or TLS listener are found by host instead.
+     */
+    class ServiceDirectory
+    {
+      public:
+        /**
+         * @param httpRouting Whether the shared HTTP listener runs. Services naming HTTP hosts do not bind their
+         * public port then.
+         * @param tlsRouting Same for the shared TLS listener and services naming TLS server names.
+         * @param httpProxy For the services reached through the shared HTTP listener.
+         */
+        explicit ServiceDirectory(bool httpRouting = false, bool tlsRouting = false, HttpProxyConfig httpProxy = {});
+        ServiceDirectory(ServiceDirectory const&) = delete;
+        ServiceDirectory& operator=(ServiceDirectory const&) = delete;
+
+        /**
+         * @brief Returns the service on the public port, or the one made by make if there is none yet.
+         *
+         * @param make Creates and starts the service, returns null if it could not. Called under the lock of the
+         * directory, so that two publishers announcing the same port at once do not both bind it.
+         * @param created Set to whether make was called and succeeded.
+         */
+        std::shared_ptr<Service> obtain(
+            unsigned short publicPort,
+            std::function<std::shared_ptr<Service>()> const& make,
+            bool& created);
+
+        /**
+         * @brief Forgets the service, if it is still the one on its public port.
+         */
+        void remove(unsigned short publicPort, Service const& service);
+
+        bool httpRouting() const;
+
+        /**
+         * @brief Hosts of the shared HTTP listener, see RoutingListener.
+         */
+        RouteTable& httpRoutes();
+
+        bool tlsRouting() const;
+
+        /**
+         * @brief Server names of the shared TLS listener, see RoutingListener.
+         */
+        RouteTable& tlsRoutes();
+
+        HttpProxyConfig const& httpProxy() const;
+
+      private:
+        std::mutex guard_;
+        std::unordered_map<unsigned short, std::weak_ptr<Service>> services_;
+        bool httpRouting_;
+        RouteTable httpRoutes_;
+        bool tlsRouting_;
+        RouteTable tlsRoutes_;
+        HttpProxyConfig httpProxy_;
+    };
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <sharedpp/json.hpp>
+#include <sharedpp/stream_compression.hpp>
 
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace TunnelBore::Broker
 {
@@ -12,7 +14,42 @@ namespace TunnelBore::Broker
         std::optional<std::string> name;
         unsigned short publicPort;
         unsigned short hiddenPort;
+        /// Compression of the tunnels between publisher and broker, see StreamCompression. Nothing for none.
+        std::optional<std::string> compression = std::nullopt;
+        int compressionLevel = defaultCompressionLevel;
+        /// Reached through the shared HTTP listener by these hosts, the public port only tells services apart then.
+        std::vector<std::string> httpHosts = {};
+        /// Same for the shared TLS listener and the server names of the ClientHello.
+        std::vector<std::string> tlsServerNames = {};
+        /// Publishers of other identities may serve the public port as replicas, if they set it too.
+        bool shareable = false;
+
+        bool operator==(ServiceInfo const&) const = default;
     };
 
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ServiceInfo, name, publicPort, hiddenPort)
-}
\ No newline at end of file
+    inline void to_json(json& j, ServiceInfo const& info)
+    {
+        j = json{
+            {"name", info.name},
+            {"publicPort", info.publicPort},
+            {"hiddenPort", info.hiddenPort},
+            {"compression", info.compression},
+            {"compressionLevel", info.compressionLevel},
+            {"httpHosts", info.httpHosts},
+            {"tlsServerNames", info.tlsServerNames},
+            {"shareable", info.shareable},
+        };
+    }
+    inline void from_json(json const& j, ServiceInfo& info)
+    {
+        j.at("name").get_to(info.name);
+        j.at("publicPort").get_to(info.publicPort);
+        j.at("hiddenPort").get_to(info.hiddenPort);
+        // Not sent by older publishers.
+        info.compression = j.value("compression", std::optional<std::string>{});
+        info.compressionLevel = j.value("compressionLevel", defaultCompressionLevel);
+        info.httpHosts = j.value("httpHosts", std::vector<std::string>{});
+        info.tlsServerNames = j.value("tlsServerNames", std::vector<std::string>{});
+        info.shareable = j.value("shareable", false);
+    }
+}
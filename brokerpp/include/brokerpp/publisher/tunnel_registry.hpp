@@ -0,0 +1,112 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * What one side of a tunnel received. Written by its pipe with relaxed atomics only, so that reading it never
+     * holds up the data plane.
+     */
+    class TunnelTraffic
+    {
+      public:
+        TunnelTraffic();
+
+        void count(std::size_t bytes);
+
+        std::uint64_t bytesReceived() const;
+        std::chrono::steady_clock::time_point lastReceived() const;
+
+      private:
+        std::atomic<std::uint64_t> bytesReceived_;
+        std::atomic<std::chrono::steady_clock::rep> lastReceived_;
+    };
+
+    /**
+     * A linked tunnel as the registry knows it. Immutable apart from the traffic counters.
+     */
+    struct TunnelEntry
+    {
+        std::string tunnelId;
+        std::string publisherIdentity;
+        std::string serviceId;
+        std::string remoteAddress;
+        std::chrono::steady_clock::time_point linkedAt;
+        std::shared_ptr<TunnelTraffic const> fromClient;
+        std::shared_ptr<TunnelTraffic const> fromPublisher;
+    };
+
+    /**
+     * A tunnel with its throughput over the last sample interval, in bytes per second.
+     */
+    struct TunnelSample
+    {
+        std::shared_ptr<TunnelEntry const> entry;
+        double throughputFromClient;
+        double throughputFromPublisher;
+    };
+
+    /**
+     * Live tunnels of all publishers for inspection. Tunnels are added and removed when they are linked and closed,
+     * a timer samples them once per interval and publishes an immutable snapshot. Readers only load that snapshot,
+     * they never touch a lock of a tunnel or service.
+     */
+    class TunnelRegistry : public std::enable_shared_from_this<TunnelRegistry>
+    {
+      public:
+        constexpr static std::chrono::seconds SampleInterval{1};
+
+        explicit TunnelRegistry(boost::asio::any_io_executor executor);
+        TunnelRegistry(TunnelRegistry const&) = delete;
+        TunnelRegistry& operator=(TunnelRegistry const&) = delete;
+
+        void add(TunnelEntry entry);
+        void remove(std::string const& tunnelId);
+
+        /**
+         * @brief Starts sampling, until the registry is destroyed.
+         */
+        void start();
+
+        /**
+         * @brief The tunnels as of the last sample, at most one interval old. Never null.
+         */
+        std::shared_ptr<std::vector<TunnelSample> const> snapshot() const;
+
+      private:
+        void sample();
+        void scheduleSample();
+
+      private:
+        struct Tracked
+        {
+            std::shared_ptr<TunnelEntry const> entry;
+            std::uint64_t lastFromClient;
+            std::uint64_t lastFromPublisher;
+        };
+
+        boost::asio::steady_timer timer_;
+
+        std::mutex pendingGuard_;
+        std::vector<std::shared_ptr<TunnelEntry const>> added_;
+        std::vector<std::string> removed_;
+
+        // Only touched by the sampler.
+        std::unordered_map<std::string, Tracked> tracked_;
+        std::chrono::steady_clock::time_point lastSample_;
+
+        std::atomic<std::shared_ptr<std::vector<TunnelSample> const>> snapshot_;
+    };
+}
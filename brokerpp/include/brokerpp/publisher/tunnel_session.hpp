@@ -1,9 +1,13 @@
 #pragma once
 
+#include <sharedpp/data_link_tls.hpp>
 #include <sharedpp/pipe_operation.hpp>
+#include <sharedpp/tunnel_trace.hpp>
 #include <brokerpp/authority.hpp>
+#include <brokerpp/publisher/tunnel_registry.hpp>
 #include <boost/asio/ip/tcp.hpp>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <chrono>
@@ -31,6 +35,11 @@ namespace TunnelBore::Broker
 
         void close();
         void link(TunnelSession& other);
+
+        /**
+         * @brief Rebinds the socket and timer to another executor. Must not be called while a read or write is pending.
+         */
+        void moveToExecutor(boost::asio::any_io_executor executor);
         void peek();
         [[nodiscard]] std::shared_ptr<PipeOperation<TunnelSession>> pipeTo(TunnelSession& other);
         boost::asio::ip::tcp::socket& socket();
@@ -41,6 +50,66 @@ namespace TunnelBore::Broker
         void resetTimer();
         void cancelTimer();
 
+        /**
+         * @brief Data that is written to the other side before piping starts, when linked.
+         * Used for tunnels taken over from another broker process.
+         */
+        void setPendingData(std::string data);
+
+        /**
+         * @brief Everything read from this side, including data read before linking, passes the transform before it
+         * is written to the other side. Has to be set before link.
+         */
+        void setReadTransform(PipeTransform transform);
+
+        /**
+         * @brief Lets a publisher encrypt this side with the context, see DataLinkTls. Has to be set before peek.
+         */
+        void acceptDataLinkTls(std::shared_ptr<boost::asio::ssl::context> context);
+
+        /**
+         * @brief The TLS of this side if it is encrypted in userspace, null if it is plain or encrypted by the kernel.
+         */
+        std::shared_ptr<DataLinkTls> userspaceTls() const;
+
+        /**
+         * @brief Attaches the trace of the tunnel setup, the stages this side goes through are marked on it.
+         */
+        void setTrace(std::shared_ptr<TunnelTrace> trace);
+        std::shared_ptr<TunnelTrace> trace() const;
+
+        /**
+         * @brief Lists the tunnel in the registry until this side closes, also if the service is gone by then.
+         * Nothing is listed if it is closed already.
+         */
+        void registerIn(std::shared_ptr<TunnelRegistry> registry, TunnelEntry entry);
+
+        /**
+         * @brief Called by the pipe for everything read from this side.
+         */
+        void countReceived(std::size_t bytes);
+        std::shared_ptr<TunnelTraffic const> traffic() const;
+
+        /**
+         * @brief Whether this side is linked and its pipe is running.
+         */
+        bool isPiping() const;
+
+        /**
+         * @brief Stops the pipe from this side to the other for a handover, see PipeOperation::suspend.
+         * Has to be called on the sockets executor. Reports the pipe as ended right away if it is closed already.
+         */
+        void suspend(std::function<void(std::string unsent, bool ended)> onSuspended);
+
+        /**
+         * @brief Gives up the socket without closing the connection. The session is closed afterwards.
+         * @return The native handle, or -1 if it could not be released.
+         */
+        int releaseSocket();
+
+      private:
+        void startDataLinkTls();
+
       private:
         struct Implementation;
         std::unique_ptr<Implementation> impl_;
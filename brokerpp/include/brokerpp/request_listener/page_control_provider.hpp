@@ -1,67 +1,154 @@
-#pragma once
-
-#include <roar/routing/request_listener.hpp>
-#include <roar/detail/pimpl_special_functions.hpp>
-
-#include <boost/asio/any_io_executor.hpp>
-#include <boost/describe/class.hpp>
-
-#include <memory>
-#include <string>
-
-using namespace Roar::Literals;
-
-namespace TunnelBore::Broker
-{
-    class Publisher;
-
-    class PageAndControlProvider : public std::enable_shared_from_this<PageAndControlProvider>
-    {
-      public:
-        PageAndControlProvider(
-            boost::asio::any_io_executor executor,
-            std::string publicJwt,
-            std::filesystem::path directory);
-        ROAR_PIMPL_SPECIAL_FUNCTIONS(PageAndControlProvider);
-
-        std::shared_ptr<Publisher> obtainPublisher(std::string const& identity);
-        std::filesystem::path getServedDirectory() const;
-
-      private:
-        ROAR_MAKE_LISTENER(PageAndControlProvider);
-
-        ROAR_GET(status)
-        ({
-            .path = "/api/status",
-        });
-        ROAR_SERVE(serve)
-        (Roar::ServeInfo<PageAndControlProvider>{
-            .path = "/",
-            .routeOptions = {.allowUnsecure = false},
-            .serveOptions = {
-                .allowDownload = true,
-                .allowListing = false,
-                .pathProvider = &PageAndControlProvider::getServedDirectory,
-            }});
-        ROAR_GET(publisher)
-        ({
-            .path = "/api/ws/publisher",
-            .routeOptions = {.expectUpgrade = true},
-        });
-        ROAR_GET(redirect1)("/login");
-        ROAR_GET(redirect2)("/stats/.*"_rgx);
-        ROAR_GET(redirect3)("/settings/.*"_rgx);
-
-      private:
-        struct Implementation;
-        std::unique_ptr<Implementation> impl_;
-
-      private:
-        BOOST_DESCRIBE_CLASS(
-            PageAndControlProvider,
-            (),
-            (),
-            (),
-            (roar_serve, roar_publisher, roar_status, roar_redirect1, roar_redirect2, roar_redirect3));
-    };
+#pragma once
+
+#include <brokerpp/config.hpp>
+#include <brokerpp/control/handshake_throttle.hpp>
+#include <brokerpp/handover/handover_state.hpp>
+#include <brokerpp/handover/state_snapshot.hpp>
+#include <sharedpp/io_engine.hpp>
+
+#include <roar/routing/request_listener.hpp>
+#include <roar/detail/pimpl_special_functions.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/describe/class.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace Roar::Literals;
+
+namespace TunnelBore::Broker
+{
+    class Publisher;
+    class ClusterNode;
+    class RoutingListener;
+    class ServiceDirectory;
+
+    class PageAndControlProvider : public std::enable_shared_from_this<PageAndControlProvider>
+    {
+      public:
+        PageAndControlProvider(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::string publicJwt,
+            Config config,
+            std::filesystem::path directory,
+            std::shared_ptr<HandshakeThrottle> handshakeThrottle);
+        ROAR_PIMPL_SPECIAL_FUNCTIONS(PageAndControlProvider);
+
+        std::shared_ptr<Publisher> obtainPublisher(std::string const& identity);
+
+        /**
+         * @brief Like obtainPublisher, but does not create one.
+         */
+        std::shared_ptr<Publisher> findPublisher(std::string const& identity);
+
+        /**
+         * @brief The services of all publishers, by public port and by host.
+         */
+        std::shared_ptr<ServiceDirectory> serviceDirectory() const;
+
+        /**
+         * @brief Lets the cluster know about the publishers of this node. Has to be set before publishers connect.
+         */
+        void setClusterNode(std::weak_ptr<ClusterNode> clusterNode);
+
+        /**
+         * @brief Hands the listener over together with the services, and takes the one of a predecessor in restore.
+         * Has to be added before restore.
+         */
+        void addRoutingListener(std::weak_ptr<RoutingListener> routingListener);
+        std::filesystem::path getServedDirectory() const;
+
+        /**
+         * @brief Releases the listeners and tunnels of all publishers and the routing listeners for another broker
+         * process.
+         * Control sessions are not handed over, publishers reconnect to the successor.
+         */
+        HandoverState prepareHandover(std::vector<int>& descriptors);
+
+        /**
+         * @brief Takes back what prepareHandover released when the successor could not take it, and keeps the state
+         * snapshot up to date again.
+         */
+        void abortHandover(HandoverState const& state, std::vector<int> const& descriptors);
+
+        /**
+         * @brief Recreates publishers, services and tunnels released by another broker process.
+         */
+        void restore(HandoverState const& state, std::vector<int> const& descriptors);
+
+        /**
+         * @brief Binds the services of all publishers in the snapshot, for a cold start. See Publisher::prebind.
+         */
+        void prebind(StateSnapshot const& snapshot);
+
+      private:
+        /**
+         * @brief Remembers the services of a publisher for the state snapshot, which is written shortly after.
+         */
+        void recordServices(std::string const& identity, std::vector<ServiceInfo> const& services);
+        void writeStateSnapshot();
+
+      private:
+        ROAR_MAKE_LISTENER(PageAndControlProvider);
+
+        ROAR_GET(status)
+        ({
+            .path = "/api/status",
+        });
+        /// Latency histograms of the tunnel setup stages of broker and publishers.
+        ROAR_GET(tunnelSetup)
+        ({
+            .path = "/api/metrics/tunnel-setup",
+        });
+        /// Ratio and cpu time of the compressed services, per direction.
+        ROAR_GET(compression)
+        ({
+            .path = "/api/metrics/compression",
+        });
+        /// Live publishers, services and tunnels. Takes sort=throughput|bytes|age|idle and top=N for the tunnels.
+        ROAR_GET(adminTunnels)
+        ({
+            .path = "/api/admin/tunnels",
+        });
+        ROAR_SERVE(serve)
+        (Roar::ServeInfo<PageAndControlProvider>{
+            .path = "/",
+            .routeOptions = {.allowUnsecure = false},
+            .serveOptions = {
+                .allowDownload = true,
+                .allowListing = false,
+                .pathProvider = &PageAndControlProvider::getServedDirectory,
+            }});
+        ROAR_GET(publisher)
+        ({
+            .path = "/api/ws/publisher",
+            .routeOptions = {.expectUpgrade = true},
+        });
+        ROAR_GET(redirect1)("/login");
+        ROAR_GET(redirect2)("/stats/.*"_rgx);
+        ROAR_GET(redirect3)("/settings/.*"_rgx);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+
+      private:
+        BOOST_DESCRIBE_CLASS(
+            PageAndControlProvider,
+            (),
+            (),
+            (),
+            (roar_serve,
+             roar_publisher,
+             roar_status,
+             roar_tunnelSetup,
+             roar_compression,
+             roar_adminTunnels,
+             roar_redirect1,
+             roar_redirect2,
+             roar_redirect3));
+    };
 }
\ No newline at end of file
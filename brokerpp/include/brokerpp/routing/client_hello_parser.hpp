@@ -0,0 +1,50 @@
+#pragma once
+
+#include <brokerpp/routing/http_host_parser.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    /**
+     * Finds the server name a TLS connection is meant for, from the SNI extension of its ClientHello. The ClientHello
+     * may arrive in any number of reads and span several records. Nothing is decrypted or answered.
+     *
+     * Records behind the ClientHello are not looked at, like a ChangeCipherSpec or early data of a 0-RTT client.
+     */
+    class ClientHelloParser
+    {
+      public:
+        /// ClientHellos that did not complete within this many bytes are refused, what follows them does not count.
+        /// Large ones carry post-quantum key shares, so this leaves room for them.
+        constexpr static std::size_t MaxHelloBytes = 32 * 1024;
+
+        /**
+         * @brief Continues with the bytes buffered so far. Call again with the same buffer grown by the bytes read
+         * since, complete records are not looked at again.
+         */
+        HostParseResult feed(std::string_view buffered);
+
+        /**
+         * @brief Normalized, see normalizeHostName. Valid once feed returned Found.
+         */
+        std::string const& host() const;
+
+      private:
+        /// Parses the hello once the complete records hold all of it.
+        HostParseResult parseHandshake(std::string_view buffered);
+        HostParseResult parseHello(std::string_view hello);
+
+      private:
+        /// Where the next record starts in the buffer.
+        std::size_t recordStart_ = 0;
+        /// Offset and size of the handshake bytes in each complete record.
+        std::vector<std::pair<std::size_t, std::size_t>> fragments_{};
+        std::size_t handshakeBytes_ = 0;
+        std::string host_{};
+    };
+}
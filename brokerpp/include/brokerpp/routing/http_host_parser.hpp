@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace TunnelBore::Broker
+{
+    enum class HostParseResult
+    {
+        /// The host is not in the buffered bytes yet.
+        NeedMore,
+        Found,
+        /// Not the protocol expected, or it does not name a host.
+        Invalid
+    };
+
+    /**
+     * Finds the host a HTTP/1.x request is meant for, from the request target in absolute form or the Host header.
+     * Only the head is looked at, as far as needed.
+     */
+    class HttpHostParser
+    {
+      public:
+        /// Requests that did not name their host within this many bytes are refused.
+        constexpr static std::size_t MaxHeadBytes = 16 * 1024;
+
+        /**
+         * @brief Continues with the bytes buffered so far. Call again with the same buffer grown by the bytes read
+         * since, lines that were complete before are not looked at again.
+         */
+        HostParseResult feed(std::string_view buffered);
+
+        /**
+         * @brief Normalized, see normalizeHostName. Valid once feed returned Found.
+         */
+        std::string const& host() const;
+
+      private:
+        HostParseResult onLine(std::string_view line);
+
+      private:
+        std::size_t lineStart_ = 0;
+        /// Offset up to which the buffer was searched for the end of the current line.
+        std::size_t scanned_ = 0;
+        bool requestLineSeen_ = false;
+        std::string host_{};
+    };
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    class Service;
+
+    /**
+     * @return The host name lower cased and without a trailing dot, the form routes are kept in.
+     */
+    std::string normalizeHostName(std::string_view host);
+
+    /**
+     * Host names of a shared listener to the services behind them. Looked up for every routed connection, so
+     * lookups only take a shared lock.
+     */
+    class RouteTable
+    {
+      public:
+        RouteTable();
+        RouteTable(RouteTable const&) = delete;
+        RouteTable& operator=(RouteTable const&) = delete;
+
+        /**
+         * @brief Routes all hosts to the service.
+         *
+         * @return false if one of them is routed to another service already, none are routed then.
+         */
+        bool claim(std::vector<std::string> const& hosts, std::shared_ptr<Service> const& service);
+
+        /**
+         * @brief Forgets the hosts that are still routed to the service.
+         */
+        void release(std::vector<std::string> const& hosts, Service const& service);
+
+        /**
+         * @param host Has to be normalized, see normalizeHostName.
+         * @return The service, null if there is none for the host.
+         */
+        std::shared_ptr<Service> find(std::string const& host) const;
+
+      private:
+        mutable std::shared_mutex guard_;
+        std::unordered_map<std::string, std::weak_ptr<Service>> routes_;
+    };
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <brokerpp/config.hpp>
+#include <brokerpp/handover/handover_state.hpp>
+#include <sharedpp/io_engine.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/leaf.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace TunnelBore::Broker
+{
+    class ServiceDirectory;
+
+    enum class RoutedProtocol
+    {
+        /// Routed by the Host of the first request, see HttpHostParser and ServiceDirectory::httpRoutes.
+        Http,
+        /// Routed by the server name of the ClientHello, see ClientHelloParser and ServiceDirectory::tlsRoutes.
+        Tls
+    };
+
+    std::string_view toString(RoutedProtocol protocol);
+
+    /**
+     * One listener for many services. Reads the start of every connection until it names its host, then hands the
+     * connection and the bytes read so far to the service with that host. The bytes are passed on unchanged, TLS is
+     * not terminated.
+     */
+    class RoutingListener : public std::enable_shared_from_this<RoutingListener>
+    {
+      public:
+        /// Connections that did not name their host by then are closed.
+        constexpr static std::chrono::seconds HeadTimeout{10};
+        /// Bytes read at once while looking for the host.
+        constexpr static std::size_t ReadChunk = 4096;
+
+        RoutingListener(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::shared_ptr<ServiceDirectory> directory,
+            RoutedProtocol protocol = RoutedProtocol::Http);
+        ~RoutingListener();
+        RoutingListener(RoutingListener const&) = delete;
+        RoutingListener(RoutingListener&&) = delete;
+        RoutingListener& operator=(RoutingListener const&) = delete;
+        RoutingListener& operator=(RoutingListener&&) = delete;
+
+        boost::leaf::result<void> start(RoutingListenerConfig const& config);
+        void stop();
+
+        RoutedProtocol protocol() const;
+        /// Whether it accepts connections, after start or adopt.
+        bool listening() const;
+
+        /**
+         * @brief Stops accepting and releases the listener for another broker process. Connections that did not
+         * name their host yet stay with this process.
+         *
+         * @return Nothing if it was not listening.
+         */
+        std::optional<RoutingHandover> prepareHandover(std::vector<int>& descriptors);
+
+        /**
+         * @brief Accepts on a listener released by another broker process, instead of binding the port again.
+         * Takes ownership of the descriptor.
+         */
+        boost::leaf::result<void> adopt(RoutingHandover const& handover, std::vector<int> const& descriptors);
+
+      private:
+        struct Connection;
+
+        enum class Refusal
+        {
+            Malformed,
+            UnknownHost,
+            Unavailable
+        };
+
+        void acceptOnce();
+        void readHead(std::shared_ptr<Connection> const& connection);
+        void route(std::shared_ptr<Connection> const& connection);
+        /// Answers in the protocol of the listener, if it has a way to, and closes the connection.
+        void refuse(std::shared_ptr<Connection> const& connection, Refusal refusal);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
@@ -1,5 +1,5 @@
-#pragma once
-
-#ifdef _WIN32
-#    include <winsock2.h>
+#pragma once
+
+#ifdef _WIN32
+#    include <winsock2.h>
 #endif
\ No newline at end of file
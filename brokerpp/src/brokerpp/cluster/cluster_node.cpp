@@ -0,0 +1,998 @@
+#include <brokerpp/cluster/cluster_node.hpp>
+#include <brokerpp/publisher/publisher.hpp>
+#include <brokerpp/publisher/service.hpp>
+#include <brokerpp/request_listener/page_control_provider.hpp>
+#include <sharedpp/pipe_operation.hpp>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace leaf = boost::leaf;
+using boost::asio::ip::tcp;
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        /// A snapshot of thousands of publishers stays far below, anything larger is a broken peer.
+        constexpr std::uint32_t MaxFrameSize = 16 * 1024 * 1024;
+
+        /// Random bytes the accepting node challenges the connecting one with.
+        constexpr std::size_t ChallengeSize = 32;
+
+        /**
+         * Frames are a 4 byte big endian length followed by json. The accepting node opens every relay connection
+         * with {challenge}, the connecting node answers with a hello {kind: "registry" | "tunnel", nodeId, proof},
+         * tunnels add {identity, publicPort}. The proof is the HMAC of the challenge and the rest of the hello under
+         * the secret, so the secret never travels. Registry connections continue with {type: "Snapshot", claims}
+         * and {type: "Claim", claim} frames, tunnels continue with the raw client stream.
+         */
+        std::string makeFrame(json const& message)
+        {
+            const auto payload = message.dump();
+            const auto size = static_cast<std::uint32_t>(payload.size());
+            std::string frame{
+                static_cast<char>((size >> 24) & 0xFF),
+                static_cast<char>((size >> 16) & 0xFF),
+                static_cast<char>((size >> 8) & 0xFF),
+                static_cast<char>(size & 0xFF),
+            };
+            return frame + payload;
+        }
+
+        void closeSocket(tcp::socket& socket)
+        {
+            boost::system::error_code ignore;
+            socket.shutdown(tcp::socket::shutdown_both, ignore);
+            socket.close(ignore);
+        }
+
+        template <typename HandlerT>
+        void readFrame(std::shared_ptr<tcp::socket> const& socket, HandlerT handler)
+        {
+            auto header = std::make_shared<std::array<unsigned char, 4>>();
+            boost::asio::async_read(
+                *socket,
+                boost::asio::buffer(*header),
+                [socket, header, handler = std::move(handler)](boost::system::error_code ec, std::size_t) mutable {
+                    if (ec)
+                        return handler(ec, json{});
+
+                    const auto size = (std::uint32_t{(*header)[0]} << 24) | (std::uint32_t{(*header)[1]} << 16) |
+                        (std::uint32_t{(*header)[2]} << 8) | std::uint32_t{(*header)[3]};
+                    if (size > MaxFrameSize)
+                        return handler(make_error_code(boost::asio::error::message_size), json{});
+
+                    auto payload = std::make_shared<std::string>(size, '\0');
+                    boost::asio::async_read(
+                        *socket,
+                        boost::asio::buffer(*payload),
+                        [payload, handler = std::move(handler)](boost::system::error_code ec, std::size_t) mutable {
+                            if (ec)
+                                return handler(ec, json{});
+                            auto message = json::parse(*payload, nullptr, false);
+                            if (message.is_discarded())
+                                return handler(make_error_code(boost::asio::error::invalid_argument), json{});
+                            handler(ec, std::move(message));
+                        });
+                });
+        }
+
+        std::string toHex(unsigned char const* data, std::size_t size)
+        {
+            constexpr std::string_view digits = "0123456789abcdef";
+            std::string hex;
+            hex.reserve(size * 2);
+            for (std::size_t i = 0; i != size; ++i)
+            {
+                hex.push_back(digits[data[i] >> 4]);
+                hex.push_back(digits[data[i] & 0x0F]);
+            }
+            return hex;
+        }
+
+        std::optional<std::string> makeChallenge()
+        {
+            std::array<unsigned char, ChallengeSize> challenge{};
+            if (RAND_bytes(challenge.data(), static_cast<int>(challenge.size())) != 1)
+                return std::nullopt;
+            return toHex(challenge.data(), challenge.size());
+        }
+
+        /**
+         * @param hello Without the proof.
+         */
+        std::string proofOf(std::string const& secret, std::string const& challenge, json const& hello)
+        {
+            const auto message = challenge + "\n" + hello.dump();
+            std::array<unsigned char, EVP_MAX_MD_SIZE> digest{};
+            unsigned int digestSize = 0;
+            HMAC(
+                EVP_sha256(),
+                secret.data(),
+                static_cast<int>(secret.size()),
+                reinterpret_cast<unsigned char const*>(message.data()),
+                message.size(),
+                digest.data(),
+                &digestSize);
+            return toHex(digest.data(), digestSize);
+        }
+
+        /**
+         * @brief Reads the challenge the accepting node opens a relay connection with, see makeFrame.
+         */
+        template <typename HandlerT>
+        void readChallenge(std::shared_ptr<tcp::socket> const& socket, std::chrono::seconds timeout, HandlerT handler)
+        {
+            auto timer = std::make_shared<boost::asio::steady_timer>(socket->get_executor(), timeout);
+            timer->async_wait([socket](boost::system::error_code ec) {
+                if (ec != boost::asio::error::operation_aborted)
+                    closeSocket(*socket);
+            });
+            readFrame(
+                socket, [timer, handler = std::move(handler)](boost::system::error_code ec, json message) mutable {
+                    timer->cancel();
+                    if (ec)
+                        return handler(ec, std::string{});
+                    if (!message.is_object() || !message.contains("challenge") || !message["challenge"].is_string())
+                        return handler(make_error_code(boost::asio::error::invalid_argument), std::string{});
+                    handler(ec, message["challenge"].get<std::string>());
+                });
+        }
+
+        bool proofMatches(std::string const& expected, std::string const& given)
+        {
+            // Looks at every byte, so the time taken does not tell how much of a guess was right.
+            if (expected.size() != given.size())
+                return false;
+            unsigned char difference = 0;
+            for (std::size_t i = 0; i != expected.size(); ++i)
+                difference |= static_cast<unsigned char>(expected[i] ^ given[i]);
+            return difference == 0;
+        }
+
+        /**
+         * One side of a relayed client connection. Both sides keep each other alive until either closes.
+         * Inactivity is left to the tunnel on the owning node, which closes the relay and with it this pair.
+         */
+        class RelaySide : public std::enable_shared_from_this<RelaySide>
+        {
+          public:
+            explicit RelaySide(tcp::socket&& socket)
+                : closeGuard_{}
+                , socket_{std::move(socket)}
+                , remoteAddress_{[this]() {
+                    boost::system::error_code ec;
+                    const auto endpoint = socket_.remote_endpoint(ec);
+                    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+                }()}
+                , closed_{false}
+                , other_{}
+                , pipe_{}
+            {}
+
+            static void link(std::shared_ptr<RelaySide> const& lhs, std::shared_ptr<RelaySide> const& rhs)
+            {
+                lhs->other_ = rhs;
+                rhs->other_ = lhs;
+                lhs->pipe_ = std::make_shared<PipeOperation<RelaySide>>(lhs, rhs);
+                rhs->pipe_ = std::make_shared<PipeOperation<RelaySide>>(rhs, lhs);
+                lhs->pipe_->doPipe();
+                rhs->pipe_->doPipe();
+            }
+
+            tcp::socket& socket()
+            {
+                return socket_;
+            }
+            std::string remoteAddress() const
+            {
+                return remoteAddress_;
+            }
+            void resetTimer()
+            {}
+            void close()
+            {
+                const auto keepAlive = shared_from_this();
+                std::shared_ptr<RelaySide> other;
+                {
+                    std::scoped_lock lock{closeGuard_};
+                    if (closed_)
+                        return;
+                    closed_ = true;
+                    closeSocket(socket_);
+                    other = std::move(other_);
+                }
+                if (other)
+                    other->close();
+            }
+
+          private:
+            std::recursive_mutex closeGuard_;
+            tcp::socket socket_;
+            std::string remoteAddress_;
+            bool closed_;
+            std::shared_ptr<RelaySide> other_;
+            std::shared_ptr<PipeOperation<RelaySide>> pipe_;
+        };
+    }
+    // #####################################################################################################################
+    /**
+     * Listens on the public port of a service whose publisher is held by another node.
+     */
+    struct ClusterNode::Forwarder
+    {
+        std::mutex guard;
+        tcp::acceptor acceptor;
+        std::string identity;
+        std::string ownerNodeId;
+        unsigned short publicPort;
+
+        Forwarder(boost::asio::any_io_executor executor, unsigned short publicPort)
+            : guard{}
+            , acceptor{std::move(executor)}
+            , identity{}
+            , ownerNodeId{}
+            , publicPort{publicPort}
+        {}
+    };
+    // #####################################################################################################################
+    struct ClusterNode::Implementation
+    {
+        /// Outgoing connection that carries this nodes claims to a peer. Only touched on the strand.
+        struct PeerLink
+        {
+            ClusterPeer peer;
+            std::shared_ptr<tcp::socket> socket;
+            boost::asio::steady_timer retryTimer;
+            std::deque<std::string> queue;
+            bool connected;
+            bool writing;
+        };
+
+        boost::asio::any_io_executor executor;
+        boost::asio::strand<boost::asio::any_io_executor> strand;
+        std::shared_ptr<IoEngine> engine;
+        ClusterConfig config;
+        std::weak_ptr<PageAndControlProvider> pageAndControl;
+        ClusterRegistry registry;
+        tcp::acceptor relayAcceptor;
+        std::vector<std::unique_ptr<PeerLink>> peers;
+
+        std::mutex claimGuard;
+        std::map<std::string, PublisherClaim> localClaims;
+        /// Latest registry connection per peer node, older connections of a node must not drop its claims.
+        std::map<std::string, std::uint64_t> registryGenerations;
+        std::uint64_t nextGeneration;
+
+        std::mutex forwarderGuard;
+        std::map<unsigned short, std::shared_ptr<Forwarder>> forwarders;
+        std::atomic_bool stopped;
+
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            ClusterConfig config,
+            std::weak_ptr<PageAndControlProvider> pageAndControl)
+            : executor{executor}
+            , strand{boost::asio::make_strand(executor)}
+            , engine{std::move(engine)}
+            , config{std::move(config)}
+            , pageAndControl{std::move(pageAndControl)}
+            , registry{}
+            , relayAcceptor{strand}
+            , peers{}
+            , claimGuard{}
+            , localClaims{}
+            , registryGenerations{}
+            , nextGeneration{0}
+            , forwarderGuard{}
+            , forwarders{}
+            , stopped{false}
+        {
+            for (auto const& peer : this->config.peers)
+            {
+                if (peer.nodeId == this->config.nodeId)
+                    continue;
+                peers.push_back(std::make_unique<PeerLink>(PeerLink{
+                    .peer = peer,
+                    .socket = {},
+                    .retryTimer = boost::asio::steady_timer{strand},
+                    .queue = {},
+                    .connected = false,
+                    .writing = false,
+                }));
+            }
+        }
+
+        std::optional<ClusterPeer> findPeer(std::string const& nodeId) const
+        {
+            for (auto const& peer : config.peers)
+            {
+                if (peer.nodeId == nodeId)
+                    return peer;
+            }
+            return std::nullopt;
+        }
+
+        json hello(std::string kind) const
+        {
+            return json{{"kind", std::move(kind)}, {"nodeId", config.nodeId}};
+        }
+
+        std::string helloFrame(json hello, std::string const& challenge) const
+        {
+            hello["proof"] = proofOf(config.secret, challenge, hello);
+            return makeFrame(hello);
+        }
+    };
+    // #####################################################################################################################
+    ClusterNode::ClusterNode(
+        boost::asio::any_io_executor executor,
+        std::shared_ptr<IoEngine> engine,
+        ClusterConfig config,
+        std::weak_ptr<PageAndControlProvider> pageAndControl)
+        : impl_{std::make_unique<Implementation>(
+              std::move(executor),
+              std::move(engine),
+              std::move(config),
+              std::move(pageAndControl))}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    ClusterNode::~ClusterNode() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    ClusterRegistry const& ClusterNode::registry() const
+    {
+        return impl_->registry;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string const& ClusterNode::nodeId() const
+    {
+        return impl_->config.nodeId;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::leaf::result<void> ClusterNode::start()
+    {
+        if (impl_->config.nodeId.empty())
+            return leaf::new_error("Cluster node id must not be empty.");
+        if (impl_->config.secret.empty())
+            return leaf::new_error("Cluster secret must not be empty.");
+
+        boost::system::error_code ec;
+        const auto endpoint = tcp::endpoint{boost::asio::ip::make_address(impl_->config.relayIface, ec), impl_->config.relayPort};
+        if (ec)
+            return leaf::new_error("Invalid relay interface.", ec);
+
+        impl_->relayAcceptor.open(endpoint.protocol(), ec);
+        if (ec)
+            return leaf::new_error("Could not open relay acceptor.", ec);
+        impl_->relayAcceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+        if (ec)
+            return leaf::new_error("Could not configure relay socket to reuse address.", ec);
+        impl_->relayAcceptor.bind(endpoint, ec);
+        if (ec)
+            return leaf::new_error("Could not bind relay socket.", ec);
+        impl_->relayAcceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec)
+            return leaf::new_error("Could not listen on relay socket.", ec);
+
+        spdlog::info(
+            "Cluster node '{}' relays on port {} with {} peer(s).",
+            impl_->config.nodeId,
+            impl_->relayAcceptor.local_endpoint().port(),
+            impl_->peers.size());
+
+        boost::asio::post(impl_->strand, [weak = weak_from_this()]() {
+            auto self = weak.lock();
+            if (!self)
+                return;
+            self->acceptOnce();
+            for (std::size_t i = 0; i != self->impl_->peers.size(); ++i)
+                self->connectPeer(i);
+        });
+        return {};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::stop()
+    {
+        if (impl_->stopped.exchange(true))
+            return;
+
+        {
+            std::scoped_lock lock{impl_->forwarderGuard};
+            for (auto& [port, forwarder] : impl_->forwarders)
+            {
+                std::scoped_lock forwarderLock{forwarder->guard};
+                boost::system::error_code ignore;
+                forwarder->acceptor.close(ignore);
+            }
+            impl_->forwarders.clear();
+        }
+
+        boost::asio::post(impl_->strand, [self = shared_from_this()]() {
+            boost::system::error_code ignore;
+            self->impl_->relayAcceptor.close(ignore);
+            for (auto& link : self->impl_->peers)
+            {
+                link->retryTimer.cancel();
+                if (link->socket)
+                    closeSocket(*link->socket);
+                link->connected = false;
+            }
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::claim(std::string const& identity, std::vector<ServiceInfo> const& services)
+    {
+        PublisherClaim claim{
+            .identity = identity,
+            .nodeId = impl_->config.nodeId,
+            .services = services,
+            .generation = impl_->registry.nextGeneration(identity),
+        };
+        {
+            std::scoped_lock lock{impl_->claimGuard};
+            if (services.empty())
+                impl_->localClaims.erase(identity);
+            else
+                impl_->localClaims[identity] = claim;
+        }
+        spdlog::info(
+            "Cluster node '{}' {} publisher '{}'.",
+            impl_->config.nodeId,
+            services.empty() ? "released" : "claims",
+            identity);
+
+        impl_->registry.update(claim);
+        // Synchronous, so that the publisher can bind ports that were forwarded for a previous owner.
+        reconcileForwarders();
+        broadcast(makeFrame(json{{"type", "Claim"}, {"claim", claim}}));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::acceptOnce()
+    {
+        auto socket = std::make_shared<tcp::socket>(impl_->engine->nextExecutor());
+        impl_->relayAcceptor.async_accept(*socket, [weak = weak_from_this(), socket](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            if (ec)
+            {
+                spdlog::error("Could not accept relay connection: {}", ec.message());
+                return self->acceptOnce();
+            }
+
+            self->acceptOnce();
+
+            auto challenge = makeChallenge();
+            if (!challenge)
+            {
+                spdlog::error("Could not generate a challenge for a relay connection.");
+                return closeSocket(*socket);
+            }
+            socket->set_option(tcp::no_delay{true}, ec);
+            auto helloTimer = std::make_shared<boost::asio::steady_timer>(socket->get_executor(), HelloTimeout);
+            helloTimer->async_wait([socket](boost::system::error_code ec) {
+                if (ec != boost::asio::error::operation_aborted)
+                    closeSocket(*socket);
+            });
+            auto challengeFrame = std::make_shared<std::string>(makeFrame(json{{"challenge", *challenge}}));
+            boost::asio::async_write(
+                *socket,
+                boost::asio::buffer(*challengeFrame),
+                [socket, challengeFrame](boost::system::error_code ec, std::size_t) {
+                    if (ec)
+                        closeSocket(*socket);
+                });
+            readFrame(
+                socket,
+                [weak, socket, helloTimer, challenge = std::move(*challenge)](
+                    boost::system::error_code ec, json hello) {
+                    helloTimer->cancel();
+                    auto self = weak.lock();
+                    if (!self)
+                        return;
+                    if (ec)
+                    {
+                        spdlog::warn("Relay connection did not introduce itself: {}", ec.message());
+                        return closeSocket(*socket);
+                    }
+                    self->onHello(socket, std::move(hello), challenge);
+                });
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::onHello(std::shared_ptr<tcp::socket> socket, json hello, std::string const& challenge)
+    {
+        if (!hello.is_object())
+        {
+            spdlog::warn("Refused relay connection, its hello is not an object.");
+            return closeSocket(*socket);
+        }
+
+        std::string kind;
+        std::string peerNodeId;
+        std::string identity;
+        unsigned short publicPort = 0;
+        bool authentic = false;
+        try
+        {
+            kind = hello.value("kind", std::string{});
+            peerNodeId = hello.value("nodeId", std::string{});
+            const auto proof = hello.value("proof", std::string{});
+            identity = hello.value("identity", std::string{});
+            publicPort = hello.value("publicPort", static_cast<unsigned short>(0));
+            // Dumping the hello for the proof throws for strings that are no valid UTF-8.
+            hello.erase("proof");
+            authentic = proofMatches(proofOf(impl_->config.secret, challenge, hello), proof);
+        }
+        catch (json::exception const& exc)
+        {
+            spdlog::warn("Refused relay connection with a malformed hello: {}", exc.what());
+            return closeSocket(*socket);
+        }
+
+        if (!authentic || peerNodeId.empty())
+        {
+            spdlog::warn("Refused relay connection without a valid proof of the secret.");
+            return closeSocket(*socket);
+        }
+
+        if (kind == "registry")
+        {
+            std::uint64_t generation = 0;
+            {
+                std::scoped_lock lock{impl_->claimGuard};
+                generation = ++impl_->nextGeneration;
+                impl_->registryGenerations[peerNodeId] = generation;
+            }
+            spdlog::info("Cluster peer '{}' connected.", peerNodeId);
+            return readRegistry(std::move(socket), peerNodeId, generation);
+        }
+
+        if (kind != "tunnel")
+        {
+            spdlog::warn("Unknown relay connection kind '{}' from '{}'.", kind, peerNodeId);
+            return closeSocket(*socket);
+        }
+
+        auto pageAndControl = impl_->pageAndControl.lock();
+        auto publisher = pageAndControl ? pageAndControl->findPublisher(identity) : nullptr;
+        auto service = publisher ? publisher->findServiceByPublicPort(publicPort) : nullptr;
+        if (!service || !service->acceptConnection(std::move(*socket)))
+        {
+            spdlog::warn(
+                "Cluster peer '{}' relayed a connection for '{}:{}', which is not served here.",
+                peerNodeId,
+                identity,
+                publicPort);
+            return closeSocket(*socket);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::readRegistry(std::shared_ptr<tcp::socket> socket, std::string peerNodeId, std::uint64_t generation)
+    {
+        readFrame(
+            socket,
+            [weak = weak_from_this(), socket, peerNodeId, generation](boost::system::error_code ec, json message) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                const auto isCurrent = [&self, &peerNodeId, generation]() {
+                    std::scoped_lock lock{self->impl_->claimGuard};
+                    return self->impl_->registryGenerations[peerNodeId] == generation;
+                };
+
+                if (ec)
+                {
+                    closeSocket(*socket);
+                    if (!isCurrent())
+                        return;
+                    // Its publishers reconnect to another node and are claimed there.
+                    spdlog::warn("Cluster peer '{}' disconnected: {}", peerNodeId, ec.message());
+                    self->impl_->registry.dropNode(peerNodeId);
+                    return self->reconcileForwarders();
+                }
+
+                if (isCurrent())
+                {
+                    try
+                    {
+                        const auto type = message.at("type").get<std::string>();
+                        if (type == "Snapshot")
+                            self->impl_->registry.replaceNode(
+                                peerNodeId, message.at("claims").get<std::vector<PublisherClaim>>());
+                        else if (type == "Claim")
+                        {
+                            auto claim = message.at("claim").get<PublisherClaim>();
+                            claim.nodeId = peerNodeId;
+                            self->impl_->registry.update(std::move(claim));
+                        }
+                        self->reconcileForwarders();
+                    }
+                    catch (json::exception const& exc)
+                    {
+                        spdlog::warn("Malformed registry message from cluster peer '{}': {}", peerNodeId, exc.what());
+                    }
+                }
+                self->readRegistry(socket, peerNodeId, generation);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::connectPeer(std::size_t peerIndex)
+    {
+        if (impl_->stopped)
+            return;
+
+        auto& link = *impl_->peers[peerIndex];
+        link.connected = false;
+        link.writing = false;
+        link.queue.clear();
+        link.socket = std::make_shared<tcp::socket>(impl_->strand);
+
+        auto resolver = std::make_shared<tcp::resolver>(impl_->strand);
+        resolver->async_resolve(
+            link.peer.host,
+            std::to_string(link.peer.relayPort),
+            [weak = weak_from_this(), peerIndex, socket = link.socket, resolver](
+                boost::system::error_code ec, tcp::resolver::results_type results) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                if (ec)
+                    return self->retryPeer(peerIndex, socket, ec);
+
+                boost::asio::async_connect(
+                    *socket, results, [weak, peerIndex, socket](boost::system::error_code ec, tcp::endpoint const&) {
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+                        if (ec)
+                            return self->retryPeer(peerIndex, socket, ec);
+
+                        readChallenge(
+                            socket,
+                            HelloTimeout,
+                            [weak, peerIndex, socket](boost::system::error_code ec, std::string const& challenge) {
+                                auto self = weak.lock();
+                                if (!self)
+                                    return;
+                                if (ec)
+                                    return self->retryPeer(peerIndex, socket, ec);
+                                self->registerAtPeer(peerIndex, socket, challenge);
+                            });
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::registerAtPeer(
+        std::size_t peerIndex,
+        std::shared_ptr<tcp::socket> const& socket,
+        std::string const& challenge)
+    {
+        auto& link = *impl_->peers[peerIndex];
+        if (link.socket != socket)
+            return;
+
+        std::vector<PublisherClaim> claims;
+        {
+            std::scoped_lock lock{impl_->claimGuard};
+            for (auto const& [identity, claim] : impl_->localClaims)
+                claims.push_back(claim);
+        }
+        spdlog::info("Connected to cluster peer '{}'.", link.peer.nodeId);
+        link.queue.push_back(impl_->helloFrame(impl_->hello("registry"), challenge));
+        link.queue.push_back(makeFrame(json{{"type", "Snapshot"}, {"claims", claims}}));
+        link.connected = true;
+        writeToPeer(peerIndex);
+
+        // The peer writes nothing after the challenge, a completed read means it is gone.
+        auto sink = std::make_shared<std::array<char, 64>>();
+        socket->async_read_some(
+            boost::asio::buffer(*sink),
+            [weak = weak_from_this(), peerIndex, socket, sink](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                self->retryPeer(peerIndex, socket, ec ? ec : boost::asio::error::eof);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::writeToPeer(std::size_t peerIndex)
+    {
+        auto& link = *impl_->peers[peerIndex];
+        if (link.writing || !link.connected)
+            return;
+        if (link.queue.empty())
+            return;
+
+        link.writing = true;
+        auto frame = std::make_shared<std::string>(std::move(link.queue.front()));
+        link.queue.pop_front();
+        boost::asio::async_write(
+            *link.socket,
+            boost::asio::buffer(*frame),
+            [weak = weak_from_this(), peerIndex, socket = link.socket, frame](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                auto& link = *self->impl_->peers[peerIndex];
+                if (link.socket != socket)
+                    return;
+                link.writing = false;
+                if (ec)
+                    return self->retryPeer(peerIndex, socket, ec);
+                self->writeToPeer(peerIndex);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::retryPeer(
+        std::size_t peerIndex,
+        std::shared_ptr<tcp::socket> const& socket,
+        boost::system::error_code ec)
+    {
+        auto& link = *impl_->peers[peerIndex];
+        // Several operations of the same connection fail, only the first one retries.
+        if (link.socket != socket || impl_->stopped)
+            return;
+
+        if (link.connected)
+            spdlog::warn("Lost cluster peer '{}': {}", link.peer.nodeId, ec.message());
+        else
+            spdlog::debug("Cluster peer '{}' is not reachable: {}", link.peer.nodeId, ec.message());
+
+        closeSocket(*socket);
+        link.socket.reset();
+        link.connected = false;
+        link.retryTimer.expires_after(PeerRetryInterval);
+        link.retryTimer.async_wait([weak = weak_from_this(), peerIndex](boost::system::error_code ec) {
+            if (ec)
+                return;
+            if (auto self = weak.lock(); self)
+                self->connectPeer(peerIndex);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::broadcast(std::string frame)
+    {
+        boost::asio::post(impl_->strand, [weak = weak_from_this(), frame = std::move(frame)]() {
+            auto self = weak.lock();
+            if (!self)
+                return;
+            // Peers that are not connected get everything with the snapshot when they are.
+            for (std::size_t i = 0; i != self->impl_->peers.size(); ++i)
+            {
+                auto& link = *self->impl_->peers[i];
+                if (!link.connected)
+                    continue;
+                link.queue.push_back(frame);
+                self->writeToPeer(i);
+            }
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::reconcileForwarders()
+    {
+        if (impl_->stopped)
+            return;
+
+        std::set<unsigned short> localPorts;
+        {
+            std::scoped_lock lock{impl_->claimGuard};
+            for (auto const& [identity, claim] : impl_->localClaims)
+                for (auto const& service : claim.services)
+                    localPorts.insert(service.publicPort);
+        }
+
+        struct Target
+        {
+            std::string identity;
+            std::string ownerNodeId;
+        };
+        std::map<unsigned short, Target> targets;
+        for (auto const& owner : impl_->registry.owners())
+        {
+            if (owner.nodeId == impl_->config.nodeId)
+                continue;
+            for (auto const& service : owner.services)
+            {
+                // Claimed by nodes that do not leave routed services out yet, their public port is no listener.
+                const bool routed = !service.httpHosts.empty() || !service.tlsServerNames.empty();
+                if (!routed && !localPorts.contains(service.publicPort))
+                    targets[service.publicPort] = Target{owner.identity, owner.nodeId};
+            }
+        }
+
+        std::scoped_lock lock{impl_->forwarderGuard};
+        for (auto iter = impl_->forwarders.begin(); iter != impl_->forwarders.end();)
+        {
+            if (targets.contains(iter->first))
+            {
+                ++iter;
+                continue;
+            }
+            spdlog::info("Stopped forwarding port {}.", iter->first + impl_->config.publicPortOffset);
+            std::scoped_lock forwarderLock{iter->second->guard};
+            boost::system::error_code ignore;
+            iter->second->acceptor.close(ignore);
+            iter = impl_->forwarders.erase(iter);
+        }
+
+        for (auto const& [publicPort, target] : targets)
+        {
+            auto iter = impl_->forwarders.find(publicPort);
+            if (iter != impl_->forwarders.end())
+            {
+                std::scoped_lock forwarderLock{iter->second->guard};
+                iter->second->identity = target.identity;
+                iter->second->ownerNodeId = target.ownerNodeId;
+                continue;
+            }
+
+            auto forwarder = std::make_shared<Forwarder>(impl_->executor, publicPort);
+            forwarder->identity = target.identity;
+            forwarder->ownerNodeId = target.ownerNodeId;
+
+            const auto endpoint = tcp::endpoint{
+                boost::asio::ip::address_v6::any(),
+                static_cast<unsigned short>(publicPort + impl_->config.publicPortOffset)};
+            boost::system::error_code ec;
+            forwarder->acceptor.open(endpoint.protocol(), ec);
+            if (!ec)
+                forwarder->acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+            if (!ec)
+                forwarder->acceptor.bind(endpoint, ec);
+            if (!ec)
+                forwarder->acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+            if (ec)
+            {
+                // Retried with the next registry change.
+                spdlog::warn(
+                    "Could not forward port {} to cluster node '{}': {}",
+                    endpoint.port(),
+                    target.ownerNodeId,
+                    ec.message());
+                continue;
+            }
+
+            spdlog::info(
+                "Forwarding port {} to cluster node '{}' for '{}'.",
+                endpoint.port(),
+                target.ownerNodeId,
+                target.identity);
+            impl_->forwarders[publicPort] = forwarder;
+            forwardOnce(forwarder);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::forwardOnce(std::shared_ptr<Forwarder> const& forwarder)
+    {
+        std::scoped_lock lock{forwarder->guard};
+        if (!forwarder->acceptor.is_open())
+            return;
+
+        // Like a service, the accepted connections are spread over the shards.
+        auto socket = std::make_shared<tcp::socket>(impl_->engine->nextExecutor());
+        forwarder->acceptor.async_accept(
+            *socket,
+            [weak = weak_from_this(), weakForwarder = std::weak_ptr<Forwarder>{forwarder}, socket](
+                boost::system::error_code ec) {
+                if (ec == boost::asio::error::operation_aborted)
+                    return;
+
+                auto self = weak.lock();
+                auto forwarder = weakForwarder.lock();
+                if (!self || !forwarder)
+                    return;
+
+                if (ec)
+                {
+                    spdlog::error("Could not accept connection on forwarded port: {}", ec.message());
+                    return self->forwardOnce(forwarder);
+                }
+
+                std::string identity;
+                std::string ownerNodeId;
+                {
+                    std::scoped_lock lock{forwarder->guard};
+                    identity = forwarder->identity;
+                    ownerNodeId = forwarder->ownerNodeId;
+                }
+                self->relay(socket, identity, forwarder->publicPort, ownerNodeId);
+                self->forwardOnce(forwarder);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterNode::relay(
+        std::shared_ptr<tcp::socket> client,
+        std::string const& identity,
+        unsigned short publicPort,
+        std::string const& ownerNodeId)
+    {
+        const auto owner = impl_->findPeer(ownerNodeId);
+        if (!owner)
+        {
+            spdlog::error("Cluster node '{}' holds '{}', but is not a configured peer.", ownerNodeId, identity);
+            return closeSocket(*client);
+        }
+
+        // The relay shares the shard of the client, so both directions of the pipe stay on one thread.
+        auto relaySocket = std::make_shared<tcp::socket>(client->get_executor());
+        auto resolver = std::make_shared<tcp::resolver>(client->get_executor());
+        auto hello = impl_->hello("tunnel");
+        hello["identity"] = identity;
+        hello["publicPort"] = publicPort;
+
+        resolver->async_resolve(
+            owner->host,
+            std::to_string(owner->relayPort),
+            [weak = weak_from_this(), client, relaySocket, resolver, hello = std::move(hello), ownerNodeId](
+                boost::system::error_code ec, tcp::resolver::results_type results) {
+                if (ec)
+                {
+                    spdlog::warn("Could not resolve cluster node '{}': {}", ownerNodeId, ec.message());
+                    return closeSocket(*client);
+                }
+                boost::asio::async_connect(
+                    *relaySocket,
+                    results,
+                    [weak, client, relaySocket, hello, ownerNodeId](
+                        boost::system::error_code ec, tcp::endpoint const&) {
+                        if (ec)
+                        {
+                            spdlog::warn("Could not relay to cluster node '{}': {}", ownerNodeId, ec.message());
+                            return closeSocket(*client);
+                        }
+                        relaySocket->set_option(tcp::no_delay{true}, ec);
+                        readChallenge(
+                            relaySocket,
+                            HelloTimeout,
+                            [weak, client, relaySocket, hello, ownerNodeId](
+                                boost::system::error_code ec, std::string const& challenge) {
+                                auto self = weak.lock();
+                                if (!self || ec)
+                                {
+                                    spdlog::warn("Cluster node '{}' did not challenge the relay.", ownerNodeId);
+                                    closeSocket(*relaySocket);
+                                    return closeSocket(*client);
+                                }
+                                auto frame = std::make_shared<std::string>(self->impl_->helloFrame(hello, challenge));
+                                boost::asio::async_write(
+                                    *relaySocket,
+                                    boost::asio::buffer(*frame),
+                                    [client, relaySocket, frame](boost::system::error_code ec, std::size_t) {
+                                        if (ec)
+                                        {
+                                            closeSocket(*relaySocket);
+                                            return closeSocket(*client);
+                                        }
+                                        RelaySide::link(
+                                            std::make_shared<RelaySide>(std::move(*client)),
+                                            std::make_shared<RelaySide>(std::move(*relaySocket)));
+                                    });
+                            });
+                    });
+            });
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,117 @@
+#include <brokerpp/cluster/cluster_registry.hpp>
+
+#include <algorithm>
+#include <tuple>
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        std::optional<PublisherClaim> newest(std::map<std::string, PublisherClaim> const& claims)
+        {
+            const auto iter = std::max_element(claims.begin(), claims.end(), [](auto const& lhs, auto const& rhs) {
+                return std::tie(lhs.second.generation, lhs.first) < std::tie(rhs.second.generation, rhs.first);
+            });
+            if (iter == claims.end())
+                return std::nullopt;
+            return iter->second;
+        }
+
+        void eraseNode(std::map<std::string, std::map<std::string, PublisherClaim>>& claims, std::string const& nodeId)
+        {
+            for (auto iter = claims.begin(); iter != claims.end();)
+            {
+                iter->second.erase(nodeId);
+                if (iter->second.empty())
+                    iter = claims.erase(iter);
+                else
+                    ++iter;
+            }
+        }
+    }
+    // #####################################################################################################################
+    void ClusterRegistry::update(PublisherClaim claim)
+    {
+        std::scoped_lock lock{guard_};
+        if (claim.services.empty())
+        {
+            auto iter = claims_.find(claim.identity);
+            if (iter == claims_.end())
+                return;
+            iter->second.erase(claim.nodeId);
+            if (iter->second.empty())
+                claims_.erase(iter);
+            return;
+        }
+        auto& byNode = claims_[claim.identity];
+        byNode[claim.nodeId] = std::move(claim);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterRegistry::replaceNode(std::string const& nodeId, std::vector<PublisherClaim> const& claims)
+    {
+        // In one go, so that nobody sees the publishers of the node gone in between.
+        std::scoped_lock lock{guard_};
+        eraseNode(claims_, nodeId);
+        for (auto claim : claims)
+        {
+            if (claim.services.empty())
+                continue;
+            claim.nodeId = nodeId;
+            auto& byNode = claims_[claim.identity];
+            byNode[nodeId] = std::move(claim);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ClusterRegistry::dropNode(std::string const& nodeId)
+    {
+        std::scoped_lock lock{guard_};
+        eraseNode(claims_, nodeId);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<PublisherClaim> ClusterRegistry::owner(std::string const& identity) const
+    {
+        std::scoped_lock lock{guard_};
+        auto iter = claims_.find(identity);
+        if (iter == claims_.end())
+            return std::nullopt;
+        return newest(iter->second);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::uint64_t ClusterRegistry::nextGeneration(std::string const& identity) const
+    {
+        std::scoped_lock lock{guard_};
+        auto iter = claims_.find(identity);
+        if (iter == claims_.end())
+            return 1;
+        std::uint64_t highest = 0;
+        for (auto const& [nodeId, claim] : iter->second)
+            highest = std::max(highest, claim.generation);
+        return highest + 1;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::vector<PublisherClaim> ClusterRegistry::claimsOf(std::string const& nodeId) const
+    {
+        std::scoped_lock lock{guard_};
+        std::vector<PublisherClaim> result;
+        for (auto const& [identity, byNode] : claims_)
+        {
+            if (auto iter = byNode.find(nodeId); iter != byNode.end())
+                result.push_back(iter->second);
+        }
+        return result;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::vector<PublisherClaim> ClusterRegistry::owners() const
+    {
+        std::scoped_lock lock{guard_};
+        std::vector<PublisherClaim> result;
+        result.reserve(claims_.size());
+        for (auto const& [identity, byNode] : claims_)
+        {
+            if (auto claim = newest(byNode); claim)
+                result.push_back(std::move(*claim));
+        }
+        return result;
+    }
+    // #####################################################################################################################
+}
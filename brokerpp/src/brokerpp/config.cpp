@@ -1,25 +1,35 @@
-#include <brokerpp/config.hpp>
-#include <sharedpp/load_home_file.hpp>
-
-namespace TunnelBore::Broker
-{
-    namespace detail
-    {
-#ifdef NDEBUG
-        constexpr static auto inDev = false;
-#else
-        constexpr static auto inDev = true;
-#endif
-    }
-
-    Config loadConfig()
-    {
-        const auto configString = loadHomeFile(detail::inDev ? "broker/configDev.json" : "broker/config.json");
-        return json::parse(configString).get<Config>();
-    }
-    void saveConfig(Config const& config)
-    {
-        saveHomeFile(detail::inDev ? "broker/configDev.json" : "broker/config.json", json{config}.dump());
-    }
-
+#include <brokerpp/config.hpp>
+#include <sharedpp/load_home_file.hpp>
+
+#include <fstream>
+#include <stdexcept>
+
+namespace TunnelBore::Broker
+{
+    namespace detail
+    {
+#ifdef NDEBUG
+        constexpr static auto inDev = false;
+#else
+        constexpr static auto inDev = true;
+#endif
+    }
+
+    Config loadConfig()
+    {
+        const auto configString = loadHomeFile(detail::inDev ? "broker/configDev.json" : "broker/config.json");
+        return json::parse(configString).get<Config>();
+    }
+    Config loadConfig(std::filesystem::path const& path)
+    {
+        std::ifstream reader{path, std::ios_base::binary};
+        if (!reader.good())
+            throw std::runtime_error("Cannot load config file " + path.string());
+        return json::parse(reader).get<Config>();
+    }
+    void saveConfig(Config const& config)
+    {
+        saveHomeFile(detail::inDev ? "broker/configDev.json" : "broker/config.json", json{config}.dump());
+    }
+
 }
\ No newline at end of file
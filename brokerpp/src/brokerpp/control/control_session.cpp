@@ -1,333 +1,472 @@
-#include <brokerpp/publisher/publisher_token.hpp>
-#include <brokerpp/winsock_first.hpp>
-#include <brokerpp/control/control_session.hpp>
-#include <brokerpp/control/dispatcher.hpp>
-#include <brokerpp/request_listener/page_control_provider.hpp>
-#include <brokerpp/publisher/service.hpp>
-#include <brokerpp/control/stream_parser.hpp>
-#include <brokerpp/publisher/publisher.hpp>
-
-#include <roar/utility/scope_exit.hpp>
-
-#include <spdlog/spdlog.h>
-
-#include <string>
-#include <deque>
-#include <mutex>
-
-namespace TunnelBore::Broker
-{
-    // #####################################################################################################################
-    namespace
-    {
-        struct WriteOperation
-        {
-            std::string payload;
-        };
-    }
-    // #####################################################################################################################
-    struct ControlSession::Implementation
-    {
-        std::string sessionId;
-        std::weak_ptr<PageAndControlProvider> page_and_control;
-        std::shared_ptr<Roar::WebsocketSession> ws;
-        std::string identity;
-        bool authenticated;
-        StreamParser textParser;
-        Dispatcher dispatcher;
-        boost::asio::ip::tcp::endpoint remoteEndpoint;
-        std::function<void()> endSelf;
-        std::string publicJwtKey;
-
-        std::vector<std::shared_ptr<Subscription>> subscriptions;
-
-        std::recursive_mutex writeGuard;
-        std::deque<WriteOperation> pendingMessages;
-        bool writeInProgress;
-
-        Implementation(
-            std::string sessionId,
-            std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
-            std::shared_ptr<Roar::WebsocketSession> ws,
-            std::function<void()> endSelf,
-            std::string publicJwtKey);
-    };
-    //---------------------------------------------------------------------------------------------------------------------
-    ControlSession::Implementation::Implementation(
-        std::string sessionId,
-        std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
-        std::shared_ptr<Roar::WebsocketSession> ws,
-        std::function<void()> endSelf,
-        std::string publicJwtKey)
-        : sessionId{std::move(sessionId)}
-        , page_and_control{std::move(PageAndControlProvider)}
-        , ws{std::move(ws)}
-        , identity{}
-        , authenticated{false}
-        , textParser{}
-        , dispatcher{}
-        , remoteEndpoint{}
-        , endSelf{std::move(endSelf)}
-        , publicJwtKey{std::move(publicJwtKey)}
-        , subscriptions{}
-        , writeGuard{}
-        , pendingMessages{}
-        , writeInProgress{false}
-    {}
-    // #####################################################################################################################
-    ControlSession::ControlSession(
-        std::string sessionId,
-        std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
-        std::shared_ptr<Roar::WebsocketSession> ws,
-        std::function<void()> endSelf,
-        std::string publicJwtKey)
-        : impl_{std::make_unique<Implementation>(
-              std::move(sessionId),
-              std::move(PageAndControlProvider),
-              std::move(ws),
-              std::move(endSelf),
-              std::move(publicJwtKey))}
-    {}
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::doRead()
-    {
-        impl_->ws->read_some()
-            .then([weak = weak_from_this()](Roar::WebsocketReadResult readResult) {
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                self->onRead(readResult);
-            })
-            .fail([weak = weak_from_this()](Roar::Error const& e) {
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                std::visit(
-                    [&e](auto&& arg) {
-                        if constexpr (std::is_same_v<std::decay_t<decltype(arg)>, boost::system::error_code>)
-                        {
-                            if (arg.value() == boost::asio::ssl::error::stream_errors::stream_truncated)
-                                return;
-                        }
-                        spdlog::error("Control session read failed: {}", e.toString());
-                    },
-                    e.error);
-                self->impl_->endSelf();
-            });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::optional<PublisherToken> ControlSession::verifyPublisherIdentity(std::string const& token) const
-    {
-        return verifyPublisherToken(token, impl_->publicJwtKey);
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::setup(std::string const& identity)
-    {
-        impl_->identity = identity;
-        auto publisher = getAssociatedPublisher();
-        publisher->setCurrentControlSession(weak_from_this());
-        doRead();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::string ControlSession::identity() const
-    {
-        return impl_->identity;
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::informAboutConnection(std::string const& serviceId, std::string const& tunnelId)
-    {
-        auto publisher = getAssociatedPublisher();
-        auto service = publisher->getService(serviceId);
-        if (service == nullptr)
-        {
-            spdlog::error("Service with id '{}' not found", serviceId);
-            return; // TODO: handle error
-        }
-
-        auto serviceInfo = service->info();
-
-        spdlog::info("Asking publisher for connection to pipe.");
-        writeJson(json{
-            {"type", "NewTunnel"},
-            {"serviceId", serviceId},
-            {"tunnelId", tunnelId},
-            {"publicPort", serviceInfo.publicPort},
-            {"hiddenPort", serviceInfo.hiddenPort},
-            {"socketType", "tcp"}});
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::onRead(Roar::WebsocketReadResult const& readResult)
-    {
-        spdlog::debug("Control session '{}' received {} bytes.", impl_->identity, readResult.message.size());
-
-        bool abortReading = false;
-        auto readAgain = Roar::ScopeExit{[weak = weak_from_this(), &abortReading]() {
-            if (abortReading)
-                return;
-
-            auto self = weak.lock();
-            if (!self)
-                return;
-
-            // Read again
-            self->doRead();
-        }};
-
-        if (!readResult.isBinary)
-        {
-            impl_->textParser.feed(readResult.message);
-            const auto popped = impl_->textParser.popMessage();
-            if (!popped)
-            {
-                spdlog::info("No message popped from parser.");
-                return;
-            }
-
-            std::string ref = "";
-            if (!popped->contains("ref"))
-                spdlog::warn("Message lacks ref, cannot reply with ref.");
-            else
-                ref = (*popped)["ref"].get<std::string>();
-
-            if (!popped->contains("type"))
-                return respondWithError(ref, "Type missing in message.");
-
-            const auto msgType = (*popped)["type"].get<std::string>();
-            if (msgType != "Ping")
-                spdlog::info("'{}': Message '{}' received", impl_->identity, msgType);
-
-            try
-            {
-                onJson(*popped, ref);
-            }
-            catch (std::exception const& exc)
-            {
-                spdlog::error("Error in json consumer: {}", exc.what());
-                impl_->endSelf();
-                abortReading = true;
-                return;
-            }
-        }
-        else
-        {
-            spdlog::warn("Binary received on control connection, which is ignored.");
-        }
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::shared_ptr<Publisher> ControlSession::getAssociatedPublisher()
-    {
-        auto pac = impl_->page_and_control.lock();
-        if (!pac)
-            return {};
-
-        return pac->obtainPublisher(impl_->identity);
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::onJson(json const& j, std::string const& ref)
-    {
-        if (!j.contains("type") || j["type"].get<std::string>() != "Ping")
-            spdlog::info("Control session '{}' received json message.", impl_->identity);
-        return impl_->dispatcher.dispatch(j, ref);
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::respond(std::string const& ref, json const& j)
-    {
-        std::string type = j.contains("type") ? j["type"].get<std::string>() : "GenericResponse";
-
-        writeJson(json{
-            {"type", type},
-            {"ref", ref},
-            {"payload", j},
-        });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::respondWithError(std::string const& ref, std::string const& msg)
-    {
-        spdlog::info("Responding with error: '{}'.");
-        writeJson(json{
-            {"type", "Error"},
-            {"ref", ref},
-            {"error", msg},
-        });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    ControlSession::~ControlSession()
-    {
-        auto publisher = getAssociatedPublisher();
-        if (publisher)
-            publisher->detachControlSession(true);
-        else
-            spdlog::error("Publisher is gone, cannot detach control session.");
-        spdlog::info("Control session '{}' destroyed.", impl_->identity);
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    boost::asio::ip::tcp::endpoint ControlSession::remoteEndpoint() const
-    {
-        return impl_->remoteEndpoint;
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::writeOnce()
-    {
-        std::scoped_lock writeLock{impl_->writeGuard};
-        if (impl_->pendingMessages.empty())
-        {
-            spdlog::debug("No more messages to write on control session.");
-            impl_->writeInProgress = false;
-            return;
-        }
-        impl_->writeInProgress = true;
-
-        const auto msg = impl_->pendingMessages.front();
-        impl_->pendingMessages.pop_front();
-
-        spdlog::debug(
-            "Writing message to control session: '{}'",
-            msg.payload.substr(0, std::min(msg.payload.size(), static_cast<std::size_t>(100))));
-
-        impl_->ws->send(msg.payload)
-            .then([weak = weak_from_this()](std::size_t) {
-                auto self = weak.lock();
-                if (!self)
-                {
-                    spdlog::error("Control session is gone, cannot send message.");
-                    return;
-                }
-
-                self->writeOnce();
-            })
-            .fail([weak = weak_from_this()](Roar::Error const& error) {
-                auto self = weak.lock();
-                if (!self)
-                {
-                    spdlog::error("Control session is gone, cannot react to send failure.");
-                    return;
-                }
-
-                spdlog::error("Failed to send message: {}", error.toString());
-                self->impl_->endSelf();
-            });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::writeJson(json const& j)
-    {
-        if (!j.contains("type") || j["type"].get<std::string>() != "Pong")
-            spdlog::info("Writing json on control session");
-
-        std::scoped_lock writeLock{impl_->writeGuard};
-        impl_->pendingMessages.push_back({j.dump()});
-
-        if (!impl_->writeInProgress)
-            writeOnce();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void ControlSession::subscribe(
-        std::string const& type,
-        std::function<bool(Subscription::ParameterType const&, std::string const&)> const& callback)
-    {
-        spdlog::info("Subscribing to '{}' on control session.", type);
-        impl_->subscriptions.push_back(impl_->dispatcher.subscribe(type, callback));
-    }
-    // #####################################################################################################################
-}
+#include <brokerpp/publisher/publisher_token.hpp>
+#include <brokerpp/winsock_first.hpp>
+#include <brokerpp/control/control_session.hpp>
+#include <brokerpp/control/dispatcher.hpp>
+#include <brokerpp/request_listener/page_control_provider.hpp>
+#include <brokerpp/publisher/service.hpp>
+#include <brokerpp/control/stream_parser.hpp>
+#include <brokerpp/publisher/publisher.hpp>
+#include <sharedpp/wire_encoding.hpp>
+
+#include <roar/utility/scope_exit.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    struct ControlSession::Implementation
+    {
+        std::string sessionId;
+        std::weak_ptr<PageAndControlProvider> page_and_control;
+        std::shared_ptr<Roar::WebsocketSession> ws;
+        std::string identity;
+        std::string publisherName;
+        bool authenticated;
+        StreamParser textParser;
+        Dispatcher dispatcher;
+        boost::asio::ip::tcp::endpoint remoteEndpoint;
+        std::function<void(ControlSession const& session)> endSelf;
+        std::string publicJwtKey;
+
+        std::recursive_mutex writeGuard;
+        std::vector<EncodedMessage> pendingMessages;
+        WireEncoding encoding;
+        std::size_t pendingBytes;
+        bool writeInProgress;
+        bool batching;
+        bool batchScheduled;
+        boost::asio::deadline_timer batchTimer;
+
+        std::chrono::seconds idleTimeout;
+        boost::asio::deadline_timer idleTimer;
+
+        std::shared_ptr<void> handshakePermit;
+
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::string sessionId,
+            std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
+            std::shared_ptr<Roar::WebsocketSession> ws,
+            std::function<void(ControlSession const& session)> endSelf,
+            std::string publicJwtKey,
+            std::chrono::seconds idleTimeout);
+    };
+    //---------------------------------------------------------------------------------------------------------------------
+    ControlSession::Implementation::Implementation(
+        boost::asio::any_io_executor executor,
+        std::string sessionId,
+        std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
+        std::shared_ptr<Roar::WebsocketSession> ws,
+        std::function<void(ControlSession const& session)> endSelf,
+        std::string publicJwtKey,
+        std::chrono::seconds idleTimeout)
+        : sessionId{std::move(sessionId)}
+        , page_and_control{std::move(PageAndControlProvider)}
+        , ws{std::move(ws)}
+        , identity{}
+        , publisherName{}
+        , authenticated{false}
+        , textParser{}
+        , dispatcher{}
+        , remoteEndpoint{}
+        , endSelf{std::move(endSelf)}
+        , publicJwtKey{std::move(publicJwtKey)}
+        , writeGuard{}
+        , pendingMessages{}
+        , encoding{WireEncoding::Json}
+        , pendingBytes{0}
+        , writeInProgress{false}
+        , batching{false}
+        , batchScheduled{false}
+        , batchTimer{executor}
+        , idleTimeout{idleTimeout}
+        , idleTimer{std::move(executor)}
+        , handshakePermit{}
+    {}
+    // #####################################################################################################################
+    ControlSession::ControlSession(
+        boost::asio::any_io_executor executor,
+        std::string sessionId,
+        std::weak_ptr<PageAndControlProvider> PageAndControlProvider,
+        std::shared_ptr<Roar::WebsocketSession> ws,
+        std::function<void(ControlSession const& session)> endSelf,
+        std::string publicJwtKey,
+        std::chrono::seconds idleTimeout)
+        : impl_{std::make_unique<Implementation>(
+              std::move(executor),
+              std::move(sessionId),
+              std::move(PageAndControlProvider),
+              std::move(ws),
+              std::move(endSelf),
+              std::move(publicJwtKey),
+              idleTimeout)}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::doRead()
+    {
+        impl_->ws->read_some()
+            .then([weak = weak_from_this()](Roar::WebsocketReadResult readResult) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                self->onRead(readResult);
+            })
+            .fail([weak = weak_from_this()](Roar::Error const& e) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                std::visit(
+                    [&e](auto&& arg) {
+                        if constexpr (std::is_same_v<std::decay_t<decltype(arg)>, boost::system::error_code>)
+                        {
+                            if (arg.value() == boost::asio::ssl::error::stream_errors::stream_truncated)
+                                return;
+                        }
+                        spdlog::error("Control session read failed: {}", e.toString());
+                    },
+                    e.error);
+                self->impl_->endSelf(*self);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<PublisherToken> ControlSession::verifyPublisherIdentity(std::string const& token) const
+    {
+        return verifyPublisherToken(token, impl_->publicJwtKey);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::setup(std::string const& identity, std::string const& publisherName)
+    {
+        impl_->identity = identity;
+        impl_->publisherName = publisherName;
+        auto publisher = getAssociatedPublisher();
+        publisher->setCurrentControlSession(weak_from_this());
+        armIdleTimer();
+        doRead();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string ControlSession::identity() const
+    {
+        return impl_->identity;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string ControlSession::publisherName() const
+    {
+        return impl_->publisherName;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::informAboutConnection(
+        std::string const& serviceId,
+        ServiceInfo const& serviceInfo,
+        unsigned short connectPort,
+        std::string const& tunnelId)
+    {
+        spdlog::info("Asking publisher for connection to pipe.");
+        writeJson(json{
+            {"type", "NewTunnel"},
+            {"serviceId", serviceId},
+            {"tunnelId", tunnelId},
+            {"publicPort", serviceInfo.publicPort},
+            {"hiddenPort", serviceInfo.hiddenPort},
+            {"connectPort", connectPort},
+            {"socketType", "tcp"}});
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::onRead(Roar::WebsocketReadResult const& readResult)
+    {
+        spdlog::debug("Control session '{}' received {} bytes.", impl_->identity, readResult.message.size());
+
+        // Any frame proves liveness, pings are only sent by the publisher when nothing else is.
+        armIdleTimer();
+
+        bool abortReading = false;
+        auto readAgain = Roar::ScopeExit{[weak = weak_from_this(), &abortReading]() {
+            if (abortReading)
+                return;
+
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            // Read again
+            self->doRead();
+        }};
+
+        try
+        {
+            if (!readResult.isBinary)
+            {
+                impl_->textParser.feed(readResult.message);
+
+                // A single read can carry several messages, all of them have to be handled now,
+                // because nothing guarantees that another frame arrives to flush the remainder.
+                const auto count = impl_->textParser.drain([this](json const& message) {
+                    onMessage(message);
+                });
+                if (count == 0)
+                    spdlog::info("No message popped from parser.");
+            }
+            else if (isBinary(impl_->encoding))
+            {
+                forEachMessageInFrame(readResult.message, impl_->encoding, [this](json const& message) {
+                    onMessage(message);
+                });
+            }
+            else
+            {
+                spdlog::warn("Binary received on control connection without negotiated encoding, which is ignored.");
+            }
+        }
+        catch (std::exception const& exc)
+        {
+            spdlog::error("Error in json consumer: {}", exc.what());
+            impl_->endSelf(*this);
+            abortReading = true;
+            return;
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::onMessage(json const& message)
+    {
+        std::string ref = "";
+        if (!message.contains("ref"))
+            spdlog::warn("Message lacks ref, cannot reply with ref.");
+        else
+            ref = message["ref"].get<std::string>();
+
+        if (!message.contains("type"))
+            return respondWithError(ref, "Type missing in message.");
+
+        if (message["type"].get_ref<std::string const&>() != "Ping")
+            spdlog::info("'{}': Message '{}' received", impl_->identity, message["type"].get_ref<std::string const&>());
+
+        onJson(message, ref);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Publisher> ControlSession::getAssociatedPublisher()
+    {
+        auto pac = impl_->page_and_control.lock();
+        if (!pac)
+            return {};
+
+        return pac->obtainPublisher(impl_->publisherName);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::onJson(json const& j, std::string const& ref)
+    {
+        if (!j.contains("type") || j["type"].get_ref<std::string const&>() != "Ping")
+            spdlog::info("Control session '{}' received json message.", impl_->identity);
+
+        try
+        {
+            impl_->dispatcher.dispatch(j, ref);
+        }
+        catch (json::exception const& exc)
+        {
+            spdlog::error("Malformed control message: {}", exc.what());
+            respondWithError(ref, std::string{"Malformed message: "} + exc.what());
+        }
+        // Thrown by from_json of messages for values json accepts, like an out of range trace.
+        catch (std::invalid_argument const& exc)
+        {
+            spdlog::error("Malformed control message: {}", exc.what());
+            respondWithError(ref, std::string{"Malformed message: "} + exc.what());
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::respond(std::string const& ref, json const& j)
+    {
+        std::string type = j.contains("type") ? j["type"].get<std::string>() : "GenericResponse";
+
+        writeJson(json{
+            {"type", type},
+            {"ref", ref},
+            {"payload", j},
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::respondWithError(std::string const& ref, std::string const& msg)
+    {
+        spdlog::info("Responding with error: '{}'.");
+        writeJson(json{
+            {"type", "Error"},
+            {"ref", ref},
+            {"error", msg},
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    ControlSession::~ControlSession()
+    {
+        impl_->idleTimer.cancel();
+        auto publisher = getAssociatedPublisher();
+        if (publisher)
+            publisher->detachControlSession();
+        else
+            spdlog::error("Publisher is gone, cannot detach control session.");
+        spdlog::info("Control session '{}' destroyed.", impl_->identity);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::asio::ip::tcp::endpoint ControlSession::remoteEndpoint() const
+    {
+        return impl_->remoteEndpoint;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::writeOnce()
+    {
+        std::scoped_lock writeLock{impl_->writeGuard};
+        if (impl_->pendingMessages.empty())
+        {
+            spdlog::debug("No more messages to write on control session.");
+            impl_->writeInProgress = false;
+            return;
+        }
+        impl_->writeInProgress = true;
+
+        // The encoding changes after the handshake, messages queued before keep theirs.
+        auto frame = takeFrame(impl_->pendingMessages, MaxBatchBytes, impl_->batching);
+        impl_->pendingBytes = 0;
+        for (auto const& pending : impl_->pendingMessages)
+            impl_->pendingBytes += pending.payload.size();
+
+        spdlog::debug("Writing {} message(s) with {} bytes to control session.", frame.messages, frame.data.size());
+
+        impl_->ws->binary(isBinary(frame.encoding));
+        impl_->ws->send(std::move(frame.data))
+            .then([weak = weak_from_this()](std::size_t) {
+                auto self = weak.lock();
+                if (!self)
+                {
+                    spdlog::error("Control session is gone, cannot send message.");
+                    return;
+                }
+
+                self->writeOnce();
+            })
+            .fail([weak = weak_from_this()](Roar::Error const& error) {
+                auto self = weak.lock();
+                if (!self)
+                {
+                    spdlog::error("Control session is gone, cannot react to send failure.");
+                    return;
+                }
+
+                spdlog::error("Failed to send message: {}", error.toString());
+                self->impl_->endSelf(*self);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::scheduleBatch()
+    {
+        // Whatever is written until the timer fires goes out in the same frame.
+        impl_->batchTimer.expires_from_now(boost::posix_time::microseconds{MaxBatchDelay.count()});
+        impl_->batchTimer.async_wait([weak = weak_from_this()](boost::system::error_code const& ec) {
+            if (ec)
+                return;
+
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::scoped_lock writeLock{self->impl_->writeGuard};
+            self->impl_->batchScheduled = false;
+            if (!self->impl_->writeInProgress)
+                self->writeOnce();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::armIdleTimer()
+    {
+        impl_->idleTimer.expires_from_now(boost::posix_time::seconds{impl_->idleTimeout.count()});
+        impl_->idleTimer.async_wait([weak = weak_from_this()](boost::system::error_code const& ec) {
+            if (ec)
+                return;
+
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            spdlog::warn(
+                "Control session '{}' was idle for {}s, closing it.",
+                self->impl_->identity,
+                self->impl_->idleTimeout.count());
+            self->impl_->ws->close();
+            self->impl_->endSelf(*self);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::expectHeartbeat(std::chrono::seconds interval)
+    {
+        impl_->idleTimeout = std::max(impl_->idleTimeout, interval * 3);
+        armIdleTimer();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::holdHandshakePermit(std::shared_ptr<void> permit)
+    {
+        impl_->handshakePermit = std::move(permit);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::releaseHandshakePermit()
+    {
+        impl_->handshakePermit.reset();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::setEncoding(WireEncoding encoding)
+    {
+        std::scoped_lock writeLock{impl_->writeGuard};
+        impl_->encoding = encoding;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::enableBatching(bool enable)
+    {
+        std::scoped_lock writeLock{impl_->writeGuard};
+        impl_->batching = enable;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ControlSession::writeJson(json const& j)
+    {
+        if (!j.contains("type") || j["type"].get_ref<std::string const&>() != "Pong")
+            spdlog::info("Writing json on control session");
+
+        std::scoped_lock writeLock{impl_->writeGuard};
+        auto payload = encodeMessage(j, impl_->encoding);
+        impl_->pendingBytes += payload.size();
+        impl_->pendingMessages.push_back({std::move(payload), impl_->encoding});
+
+        // Messages written while a frame is in flight are batched into the next one anyway.
+        if (impl_->writeInProgress)
+            return;
+
+        if (impl_->batching && impl_->pendingBytes < MaxBatchBytes)
+        {
+            if (!impl_->batchScheduled)
+            {
+                impl_->batchScheduled = true;
+                scheduleBatch();
+            }
+            return;
+        }
+
+        if (impl_->batchScheduled)
+        {
+            impl_->batchScheduled = false;
+            impl_->batchTimer.cancel();
+        }
+        writeOnce();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    Dispatcher& ControlSession::dispatcher()
+    {
+        return impl_->dispatcher;
+    }
+    // #####################################################################################################################
+}
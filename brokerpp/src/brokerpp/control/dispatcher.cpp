@@ -5,49 +5,41 @@
 namespace TunnelBore::Broker
 {
     //#####################################################################################################################
-    void Dispatcher::dispatch(json const& msg, std::string const& ref)
+    bool Dispatcher::dispatch(json const& msg, std::string const& ref)
     {
-        const std::string type = msg["type"];
-
-        std::scoped_lock lock{m_subscriberGuard};
-        auto [begin, end] = m_subscribers.equal_range(type);
-        if (begin == end)
-            spdlog::warn("No subscriber for {}.", type);
+        const auto typeIter = msg.find("type");
+        if (typeIter == msg.end() || !typeIter->is_string())
+        {
+            spdlog::warn("Message without type cannot be dispatched.");
+            return false;
+        }
+        auto const& type = typeIter->get_ref<std::string const&>();
 
-        while (begin != end)
+        if (const auto knownType = controlMessageTypeFromString(type); knownType)
         {
-            if (auto held = begin->second.lock(); held)
+            auto const& handler = m_handlers[static_cast<std::size_t>(*knownType)];
+            if (!handler)
             {
-                if (!std::invoke(*held, msg, ref))
-                    break;
-                ++begin;
+                spdlog::warn("No subscriber for {}.", type);
+                return false;
             }
-            else
-                begin = m_subscribers.erase(begin);
+            return handler(msg, ref);
         }
+
+        auto fallback = m_fallbackHandlers.find(type);
+        if (fallback == m_fallbackHandlers.end())
+        {
+            spdlog::warn("No subscriber for {}.", type);
+            return false;
+        }
+        return fallback->second(msg, ref);
     }
     //---------------------------------------------------------------------------------------------------------------------
-    std::shared_ptr<Subscription> Dispatcher::subscribe(
-        std::string const& messageType,
-        std::function<bool(Subscription::ParameterType const&, std::string const&)> const& callback)
-    {
-        std::scoped_lock lock{m_subscriberGuard};
-        std::shared_ptr<Subscription> subscriber = std::make_shared<Subscription>(callback);
-        m_subscribers.emplace(messageType, subscriber);
-        return subscriber;
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::shared_ptr<Subscription> Dispatcher::subscribe(
-        std::string const& type,
-        std::function<void(Subscription::ParameterType const&, std::string const&)> const& callback)
+    void Dispatcher::onUnknown(std::string const& type, GenericHandlerType handler)
     {
-        return subscribe(
-            type,
-            std::function<bool(Subscription::ParameterType const&, std::string const&)>{
-                [callback](Subscription::ParameterType const& p, std::string const& ref) -> bool {
-                    callback(p, ref);
-                    return true;
-                }});
+        if (controlMessageTypeFromString(type))
+            spdlog::warn("'{}' is a known message type, the generic handler will never be called.", type);
+        m_fallbackHandlers[type] = std::move(handler);
     }
     //#####################################################################################################################
-}
\ No newline at end of file
+}
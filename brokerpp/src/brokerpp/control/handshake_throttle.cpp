@@ -0,0 +1,46 @@
+#include <brokerpp/control/handshake_throttle.hpp>
+
+#include <random>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    HandshakeThrottle::HandshakeThrottle(std::size_t maxConcurrent)
+        : maxConcurrent_{maxConcurrent}
+        , inProgress_{0}
+        , rejected_{0}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<void> HandshakeThrottle::tryAcquire()
+    {
+        const auto inProgress = inProgress_.fetch_add(1, std::memory_order_relaxed);
+        if (maxConcurrent_ != 0 && inProgress >= maxConcurrent_)
+        {
+            inProgress_.fetch_sub(1, std::memory_order_relaxed);
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        // The permit keeps the throttle alive, it may be released after the listener holding the throttle is gone.
+        return std::shared_ptr<void>{nullptr, [self = shared_from_this()](void*) {
+                                         self->inProgress_.fetch_sub(1, std::memory_order_relaxed);
+                                     }};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::chrono::seconds HandshakeThrottle::retryAfter() const
+    {
+        thread_local std::minstd_rand random{std::random_device{}()};
+        return std::chrono::seconds{std::uniform_int_distribution<int>{1, static_cast<int>(MaxRetryAfter.count())}(
+            random)};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::size_t HandshakeThrottle::inProgress() const
+    {
+        return inProgress_.load(std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::size_t HandshakeThrottle::rejected() const
+    {
+        return rejected_.load(std::memory_order_relaxed);
+    }
+    // #####################################################################################################################
+}
@@ -1,57 +1,147 @@
 #include <brokerpp/control/stream_parser.hpp>
 
-#include <iterator>
+#include <cctype>
+#include <cstring>
+
+#if defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
 
 namespace TunnelBore::Broker
 {
+    //#####################################################################################################################
+    namespace
+    {
+        bool isStructural(char c)
+        {
+            return c == '{' || c == '}' || c == '"' || c == '\\';
+        }
+
+        /**
+         * Returns the index of the next character that can change the parser state, or end if there is none.
+         * Everything else (names, values, whitespace) is skipped 16 bytes at a time where SSE2 is available.
+         */
+        std::size_t findNextStructural(char const* data, std::size_t begin, std::size_t end)
+        {
+#if defined(__SSE2__)
+            const auto openCurly = _mm_set1_epi8('{');
+            const auto closeCurly = _mm_set1_epi8('}');
+            const auto quote = _mm_set1_epi8('"');
+            const auto backslash = _mm_set1_epi8('\\');
+            for (; begin + 16 <= end; begin += 16)
+            {
+                __m128i chunk;
+                std::memcpy(&chunk, data + begin, sizeof(chunk));
+                const auto matches = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, openCurly), _mm_cmpeq_epi8(chunk, closeCurly)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+                const auto mask = static_cast<unsigned int>(_mm_movemask_epi8(matches));
+                if (mask != 0)
+                    return begin + static_cast<std::size_t>(__builtin_ctz(mask));
+            }
+#endif
+            for (; begin != end; ++begin)
+            {
+                if (isStructural(data[begin]))
+                    return begin;
+            }
+            return end;
+        }
+    }
     //#####################################################################################################################
     std::optional<json> StreamParser::popMessage()
     {
-        const auto position = findCompleteObjectEnd();
-        if (position == std::end(m_buffer))
+        const auto object = nextObject();
+        if (!object)
             return std::nullopt;
-        return {json::parse(consumeObject(std::next(position)))};
+        return {json::parse(object->begin(), object->end())};
     }
     //---------------------------------------------------------------------------------------------------------------------
-    std::string::const_iterator StreamParser::findCompleteObjectEnd()
+    std::optional<std::string_view> StreamParser::nextObject()
     {
-        for (; m_findState.m_offset != m_buffer.size(); ++m_findState.m_offset)
+        auto& state = m_findState;
+        if (state.m_offset < m_readOffset)
+            state.m_offset = m_readOffset;
+
+        const auto* data = m_buffer.data();
+        const auto size = m_buffer.size();
+        while (state.m_offset != size)
         {
-            auto const& c = m_buffer[m_findState.m_offset];
+            if (state.m_escape)
+            {
+                // The escaped character can be anything, including a quote.
+                state.m_escape = false;
+                ++state.m_offset;
+                continue;
+            }
 
-            if (c == '{' && !m_findState.m_insideString)
-                ++m_findState.m_curlyCount;
-            else if (c == '}' && !m_findState.m_insideString)
+            state.m_offset = findNextStructural(data, state.m_offset, size);
+            if (state.m_offset == size)
+                break;
+
+            const auto c = data[state.m_offset++];
+            if (state.m_insideString)
             {
-                --m_findState.m_curlyCount;
-                if (m_findState.m_curlyCount == 0)
-                    return std::begin(m_buffer) +
-                        static_cast<std::string::const_iterator::difference_type>(m_findState.m_offset);
+                if (c == '\\')
+                    state.m_escape = true;
+                else if (c == '"')
+                    state.m_insideString = false;
+                continue;
+            }
+
+            if (c == '"')
+                state.m_insideString = true;
+            else if (c == '{')
+                ++state.m_curlyCount;
+            else if (c == '}' && --state.m_curlyCount == 0)
+            {
+                auto begin = m_readOffset;
+                for (; begin != state.m_offset && std::isspace(static_cast<unsigned char>(data[begin])) != 0; ++begin)
+                {}
+
+                const auto object = std::string_view{data + begin, state.m_offset - begin};
+                m_readOffset = state.m_offset;
+                state = {};
+                state.m_offset = m_readOffset;
+                return object;
             }
-            else if (c == '"' && !m_findState.m_escape)
-                m_findState.m_insideString = !m_findState.m_insideString;
-            else if (c == '\\')
-                m_findState.m_escape = !m_findState.m_escape;
-            if (c != '\\' && m_findState.m_escape)
-                m_findState.m_escape = false;
         }
-        return std::end(m_buffer);
+        return std::nullopt;
     }
     //---------------------------------------------------------------------------------------------------------------------
-    std::string StreamParser::consumeObject(std::string::const_iterator end)
+    void StreamParser::compact()
     {
-        auto begin = std::cbegin(m_buffer);
-        for (; begin != end && static_cast<bool>(std::isspace(*begin)); ++begin) {}
+        if (m_readOffset == 0)
+            return;
 
-        std::string result{begin, end};
-        m_buffer = std::string{end, std::cend(m_buffer)};
-        m_findState = {};
-        return result;
+        if (m_readOffset == m_buffer.size())
+        {
+            // Common case: every message was drained, keep the capacity for the next read.
+            m_buffer.clear();
+            m_findState.m_offset = 0;
+            m_readOffset = 0;
+            return;
+        }
+
+        // Only move the remainder once it is smaller than what was already consumed to keep this amortized.
+        if (m_readOffset < m_buffer.size() - m_readOffset)
+            return;
+
+        m_buffer.erase(0, m_readOffset);
+        m_findState.m_offset -= m_readOffset;
+        m_readOffset = 0;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::size_t StreamParser::bufferedBytes() const
+    {
+        return m_buffer.size() - m_readOffset;
     }
     //---------------------------------------------------------------------------------------------------------------------
     void StreamParser::feed(std::string_view text)
     {
+        // Views handed out by nextObject stay valid until here.
+        compact();
         m_buffer.append(text.data(), text.size());
     }
     //#####################################################################################################################
-}
\ No newline at end of file
+}
@@ -1,10 +0,0 @@
-#include <brokerpp/control/subscription.hpp>
-
-namespace TunnelBore::Broker
-{
-    //#####################################################################################################################
-    Subscription::Subscription(FunctionType cb)
-        : m_callback{std::move(cb)}
-    {}
-    //#####################################################################################################################
-}
\ No newline at end of file
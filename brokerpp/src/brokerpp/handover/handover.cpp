@@ -0,0 +1,336 @@
+#include <brokerpp/handover/handover.hpp>
+#include <brokerpp/request_listener/page_control_provider.hpp>
+#include <sharedpp/load_home_file.hpp>
+
+#include <roar/utility/scope_exit.hpp>
+
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if __linux__
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+#endif
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        constexpr std::uint64_t HandoverVersion = 1;
+        /// Stays below the kernels limit of descriptors per message (SCM_MAX_FD).
+        constexpr std::size_t MaxDescriptorsPerMessage = 250;
+
+        /**
+         * Sent first, followed by the cbor encoded state and then the descriptors in messages of one byte each.
+         * The receiver acknowledges with a single byte once it holds all descriptors.
+         */
+        struct HandoverHeader
+        {
+            std::uint64_t version;
+            std::uint64_t stateSize;
+            std::uint64_t descriptorCount;
+        };
+
+#if __linux__
+        std::runtime_error systemError(std::string const& what)
+        {
+            return std::runtime_error{what + ": " + std::strerror(errno)};
+        }
+
+        void readExactly(int socket, void* data, std::size_t size)
+        {
+            auto* bytes = static_cast<char*>(data);
+            while (size > 0)
+            {
+                const auto result = ::read(socket, bytes, size);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    throw systemError("Reading handover failed");
+                if (result == 0)
+                    throw std::runtime_error{"Handover connection closed early."};
+                bytes += result;
+                size -= static_cast<std::size_t>(result);
+            }
+        }
+
+        void sendDescriptors(int socket, std::vector<int> const& descriptors)
+        {
+            for (std::size_t offset = 0; offset < descriptors.size(); offset += MaxDescriptorsPerMessage)
+            {
+                const auto count = std::min(MaxDescriptorsPerMessage, descriptors.size() - offset);
+                char marker = 'F';
+                iovec io{.iov_base = &marker, .iov_len = 1};
+                std::vector<cmsghdr> control(CMSG_SPACE(sizeof(int) * count) / sizeof(cmsghdr) + 1);
+
+                msghdr message{};
+                message.msg_iov = &io;
+                message.msg_iovlen = 1;
+                message.msg_control = control.data();
+                message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+                auto* header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+                std::memcpy(CMSG_DATA(header), descriptors.data() + offset, sizeof(int) * count);
+
+                if (::sendmsg(socket, &message, MSG_NOSIGNAL) != 1)
+                    throw systemError("Sending descriptors failed");
+            }
+        }
+
+        std::vector<int> receiveDescriptors(int socket, std::size_t count)
+        {
+            std::vector<int> descriptors;
+            descriptors.reserve(count);
+            while (descriptors.size() < count)
+            {
+                char marker = 0;
+                iovec io{.iov_base = &marker, .iov_len = 1};
+                std::vector<cmsghdr> control(CMSG_SPACE(sizeof(int) * MaxDescriptorsPerMessage) / sizeof(cmsghdr) + 1);
+
+                msghdr message{};
+                message.msg_iov = &io;
+                message.msg_iovlen = 1;
+                message.msg_control = control.data();
+                message.msg_controllen = control.size() * sizeof(cmsghdr);
+
+                const auto received = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+                if (received < 0 && errno == EINTR)
+                    continue;
+                if (received != 1 || (message.msg_flags & MSG_CTRUNC) != 0)
+                {
+                    for (auto descriptor : descriptors)
+                        ::close(descriptor);
+                    throw std::runtime_error{"Receiving descriptors failed."};
+                }
+
+                for (auto* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+                {
+                    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                        continue;
+                    const auto received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const auto offset = descriptors.size();
+                    descriptors.resize(offset + received);
+                    std::memcpy(descriptors.data() + offset, CMSG_DATA(header), sizeof(int) * received);
+                }
+            }
+            return descriptors;
+        }
+
+        bool isSameUser(int socket)
+        {
+            ucred credentials{};
+            socklen_t length = sizeof(credentials);
+            if (::getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+                return false;
+            return credentials.uid == ::getuid();
+        }
+#endif
+    }
+    // #####################################################################################################################
+    std::filesystem::path handoverSocketPath(std::string const& nodeId)
+    {
+        if (!nodeId.empty())
+            return getHomePath() / "broker" / ("handover-" + nodeId + ".sock");
+        return getHomePath() / "broker" / "handover.sock";
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    ReceivedHandover receiveHandover(std::filesystem::path const& socketPath)
+    {
+#if __linux__
+        const int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket < 0)
+            throw systemError("Could not create handover socket");
+        const auto closeSocket = Roar::ScopeExit{[socket]() {
+            ::close(socket);
+        }};
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        const auto path = socketPath.string();
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error{"Handover socket path is too long."};
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        if (::connect(socket, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0)
+            throw systemError("No broker to take over from at '" + path + "'");
+
+        spdlog::info("Connected to running broker, waiting for handover.");
+
+        HandoverHeader header{};
+        readExactly(socket, &header, sizeof(header));
+        if (header.version != HandoverVersion)
+            throw std::runtime_error{"Running broker speaks another handover version."};
+
+        std::vector<std::uint8_t> encodedState(header.stateSize);
+        readExactly(socket, encodedState.data(), encodedState.size());
+        auto descriptors = receiveDescriptors(socket, header.descriptorCount);
+
+        const char acknowledge = 'A';
+        if (::write(socket, &acknowledge, 1) != 1)
+        {
+            for (auto descriptor : descriptors)
+                ::close(descriptor);
+            throw systemError("Could not acknowledge handover");
+        }
+
+        spdlog::info("Received handover with {} socket(s).", descriptors.size());
+        return ReceivedHandover{
+            .state = json::from_cbor(encodedState).get<HandoverState>(),
+            .descriptors = std::move(descriptors),
+        };
+#else
+        (void)socketPath;
+        throw std::runtime_error{"Handover is only supported on linux."};
+#endif
+    }
+    // #####################################################################################################################
+    struct HandoverListener::Implementation
+    {
+        std::filesystem::path socketPath;
+        std::weak_ptr<PageAndControlProvider> pageAndControl;
+        boost::asio::local::stream_protocol::acceptor acceptor;
+        std::function<void()> onHandedOver;
+
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::filesystem::path socketPath,
+            std::weak_ptr<PageAndControlProvider> pageAndControl)
+            : socketPath{std::move(socketPath)}
+            , pageAndControl{std::move(pageAndControl)}
+            , acceptor{std::move(executor)}
+            , onHandedOver{}
+        {}
+    };
+    // #####################################################################################################################
+    HandoverListener::HandoverListener(
+        boost::asio::any_io_executor executor,
+        std::filesystem::path socketPath,
+        std::weak_ptr<PageAndControlProvider> pageAndControl)
+        : impl_{std::make_unique<Implementation>(std::move(executor), std::move(socketPath), std::move(pageAndControl))}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    HandoverListener::~HandoverListener()
+    {
+        stop();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HandoverListener::start(std::function<void()> onHandedOver)
+    {
+#if __linux__
+        impl_->onHandedOver = std::move(onHandedOver);
+
+        // A previous broker may have left its socket file behind.
+        std::error_code removeError;
+        std::filesystem::remove(impl_->socketPath, removeError);
+
+        boost::system::error_code ec;
+        const auto endpoint = boost::asio::local::stream_protocol::endpoint{impl_->socketPath.string()};
+        impl_->acceptor.open(endpoint.protocol(), ec);
+        if (!ec)
+            impl_->acceptor.bind(endpoint, ec);
+        if (!ec)
+            impl_->acceptor.listen(1, ec);
+        if (ec)
+        {
+            spdlog::error("Could not listen for handovers on '{}': {}", impl_->socketPath.string(), ec.message());
+            return;
+        }
+        std::filesystem::permissions(
+            impl_->socketPath,
+            std::filesystem::perms::owner_read | std::filesystem::perms::owner_write,
+            removeError);
+
+        spdlog::info("Waiting for handovers on '{}'.", impl_->socketPath.string());
+        acceptOnce();
+#else
+        (void)onHandedOver;
+        spdlog::info("Handover is only supported on linux.");
+#endif
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HandoverListener::stop()
+    {
+        boost::system::error_code ignore;
+        impl_->acceptor.close(ignore);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HandoverListener::acceptOnce()
+    {
+#if __linux__
+        impl_->acceptor.async_accept([weak = weak_from_this()](
+                                         boost::system::error_code ec,
+                                         boost::asio::local::stream_protocol::socket socket) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            if (ec)
+            {
+                spdlog::error("Could not accept handover connection: {}", ec.message());
+                return self->acceptOnce();
+            }
+
+            if (!isSameUser(socket.native_handle()))
+            {
+                spdlog::warn("Handover was requested by another user, which is refused.");
+                return self->acceptOnce();
+            }
+
+            auto pageAndControl = self->impl_->pageAndControl.lock();
+            if (!pageAndControl)
+                return;
+
+            spdlog::info("Successor broker connected, handing over.");
+            std::vector<int> descriptors;
+            auto state = pageAndControl->prepareHandover(descriptors);
+            try
+            {
+                const auto encodedState = json::to_cbor(json(state));
+                const HandoverHeader header{
+                    .version = HandoverVersion,
+                    .stateSize = encodedState.size(),
+                    .descriptorCount = descriptors.size(),
+                };
+                boost::asio::write(socket, boost::asio::buffer(&header, sizeof(header)));
+                boost::asio::write(socket, boost::asio::buffer(encodedState));
+                sendDescriptors(socket.native_handle(), descriptors);
+
+                char acknowledge = 0;
+                boost::asio::read(socket, boost::asio::buffer(&acknowledge, 1));
+            }
+            catch (std::exception const& exc)
+            {
+                // Nothing was lost yet, the released sockets are taken back.
+                spdlog::error("Handover failed, resuming: {}", exc.what());
+                pageAndControl->abortHandover(state, descriptors);
+                return self->acceptOnce();
+            }
+
+            // The successor holds duplicates of all descriptors now.
+            for (auto descriptor : descriptors)
+                ::close(descriptor);
+
+            spdlog::info("Handed over {} socket(s) to the successor.", descriptors.size());
+            if (self->impl_->onHandedOver)
+                self->impl_->onHandedOver();
+        });
+#endif
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,56 @@
+#include <brokerpp/handover/state_snapshot.hpp>
+#include <sharedpp/load_home_file.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <fstream>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    std::filesystem::path stateSnapshotPath()
+    {
+        return getHomePath() / "broker" / "state.json";
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    StateSnapshot loadStateSnapshot(std::filesystem::path const& path)
+    {
+        std::ifstream reader{path, std::ios_base::binary};
+        if (!reader.good())
+            return {};
+        try
+        {
+            return json::parse(reader).get<StateSnapshot>();
+        }
+        catch (std::exception const& exc)
+        {
+            spdlog::error("Could not read state snapshot '{}': {}", path.string(), exc.what());
+            return {};
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void saveStateSnapshot(std::filesystem::path const& path, StateSnapshot const& snapshot)
+    {
+        auto temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream writer{temporary, std::ios_base::binary | std::ios_base::trunc};
+            if (!writer.good())
+            {
+                spdlog::error("Could not write state snapshot '{}'.", temporary.string());
+                return;
+            }
+            writer << json(snapshot).dump();
+            if (!writer.good())
+            {
+                spdlog::error("Could not write state snapshot '{}'.", temporary.string());
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        if (ec)
+            spdlog::error("Could not replace state snapshot '{}': {}", path.string(), ec.message());
+    }
+    // #####################################################################################################################
+}
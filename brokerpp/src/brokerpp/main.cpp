@@ -2,9 +2,15 @@
 #include <brokerpp/winsock_first.hpp>
 // #include <brokerpp/controller.hpp>
 #include <sharedpp/load_home_file.hpp>
+#include <sharedpp/io_engine.hpp>
 #include <brokerpp/config.hpp>
+#include <brokerpp/handover/handover.hpp>
+#include <brokerpp/handover/state_snapshot.hpp>
+#include <brokerpp/cluster/cluster_node.hpp>
+#include <brokerpp/control/handshake_throttle.hpp>
 #include <brokerpp/request_listener/authenticator.hpp>
 #include <brokerpp/request_listener/page_control_provider.hpp>
+#include <brokerpp/routing/routing_listener.hpp>
 
 #include <roar/server.hpp>
 #include <roar/ssl/make_ssl_context.hpp>
@@ -18,11 +24,14 @@
 
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/thread_pool.hpp>
+#include <openssl/ssl.h>
 
+#include <csignal>
 #include <iostream>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <thread>
 // Missing support for some systems:
 // #include <stacktrace>
 
@@ -31,7 +40,12 @@
 #    include <cstdlib>
 #endif
 
-constexpr static auto IoContextThreadPoolSize = 16;
+/// Only serves http, websockets and the control line. Tunnels run on the io engine.
+constexpr static auto ControlThreadPoolSize = 4;
+/// Long enough to cover network outages, tickets do not survive a restart of the broker anyway.
+constexpr static long ControlSessionTicketLifetimeSeconds = 24 * 60 * 60;
+/// How long a successor waits for the previous broker to free the http port.
+constexpr static auto TakeoverBindTimeout = std::chrono::seconds{10};
 
 int main(int argc, char** argv)
 {
@@ -62,7 +76,7 @@ int main(int argc, char** argv)
 
     setupHome();
 
-    boost::asio::thread_pool pool{IoContextThreadPoolSize};
+    boost::asio::thread_pool pool{ControlThreadPoolSize};
     const auto shutdownPool = Roar::ScopeExit{[&pool]() {
         pool.stop();
         pool.join();
@@ -72,24 +86,111 @@ int main(int argc, char** argv)
 
     const auto privateJwt = loadHomeFile("broker/jwt/private.key");
     const auto publicJwt = loadHomeFile("broker/jwt/public.key");
-    const auto config = loadConfig();
+    const auto config = programOptions.configFile ? loadConfig(*programOptions.configFile) : loadConfig();
 
     if (!config.ssl)
         spdlog::warn("SSL is disabled! This is only for testing purposes!");
 
+    auto engine = std::make_shared<IoEngine>(IoEngine::Options{
+        .threads = config.ioThreads,
+        .pinThreads = config.pinIoThreads,
+    });
+
     Roar::Server server(
         {.executor = pool.executor(), .sslContext = [&config]() -> std::optional<boost::asio::ssl::context> {
              if (!config.ssl)
                  return std::nullopt;
-             return Roar::makeSslContext(getHomePath() / "broker/cert.pem", getHomePath() / "broker/key.pem");
+             auto context =
+                 Roar::makeSslContext(getHomePath() / "broker/cert.pem", getHomePath() / "broker/key.pem");
+             // Reconnecting publishers resume their session with a ticket instead of a full handshake.
+             SSL_CTX_clear_options(context.native_handle(), SSL_OP_NO_TICKET);
+             SSL_CTX_set_timeout(context.native_handle(), ControlSessionTicketLifetimeSeconds);
+             return context;
          }()});
 
     auto authority = std::make_shared<Authority>(privateJwt);
-
-    server.installRequestListener<Authenticator>(authority);
-    server.installRequestListener<PageAndControlProvider>(pool.executor(), publicJwt, programOptions.servedDirectory);
-
-    server.start(config.bind.port, config.bind.iface);
+    auto handshakeThrottle = std::make_shared<HandshakeThrottle>(config.maxConcurrentHandshakes);
+
+    server.installRequestListener<Authenticator>(authority, handshakeThrottle);
+    auto pageAndControl = server.installRequestListener<PageAndControlProvider>(
+        pool.executor(), engine, publicJwt, config, programOptions.servedDirectory, handshakeThrottle);
+
+    std::shared_ptr<ClusterNode> clusterNode;
+    if (config.cluster.enabled)
+    {
+        clusterNode = std::make_shared<ClusterNode>(pool.executor(), engine, config.cluster, pageAndControl);
+        pageAndControl->setClusterNode(clusterNode);
+        if (!clusterNode->start())
+        {
+            spdlog::error("Could not start cluster node '{}'.", config.cluster.nodeId);
+            return 1;
+        }
+    }
+    // Created before a takeover, so that they can take over the listeners of the previous broker.
+    std::shared_ptr<RoutingListener> httpRouter;
+    if (config.httpRouting.enabled)
+    {
+        httpRouter = std::make_shared<RoutingListener>(pool.executor(), engine, pageAndControl->serviceDirectory());
+        pageAndControl->addRoutingListener(httpRouter);
+    }
+    std::shared_ptr<RoutingListener> tlsRouter;
+    if (config.tlsRouting.enabled)
+    {
+        tlsRouter = std::make_shared<RoutingListener>(
+            pool.executor(), engine, pageAndControl->serviceDirectory(), RoutedProtocol::Tls);
+        pageAndControl->addRoutingListener(tlsRouter);
+    }
+    const auto handoverPath = handoverSocketPath(config.cluster.enabled ? config.cluster.nodeId : std::string{});
+
+    if (programOptions.takeover)
+    {
+        // The previous broker stops accepting, hands everything over and exits.
+        auto handover = receiveHandover(handoverPath);
+        pageAndControl->restore(handover.state, handover.descriptors);
+
+        // The http listener belongs to the server and is freed when the previous broker has exited.
+        const auto deadline = std::chrono::steady_clock::now() + TakeoverBindTimeout;
+        while (true)
+        {
+            try
+            {
+                server.start(config.bind.port, config.bind.iface);
+                break;
+            }
+            catch (std::exception const& exc)
+            {
+                if (std::chrono::steady_clock::now() > deadline)
+                    throw;
+                spdlog::info("Waiting for the previous broker to exit: {}", exc.what());
+                std::this_thread::sleep_for(std::chrono::milliseconds{100});
+            }
+        }
+    }
+    else
+    {
+        // Clients of known publishers are held instead of refused until their publisher is back.
+        if (config.stateSnapshot && !config.cluster.enabled)
+            pageAndControl->prebind(loadStateSnapshot(stateSnapshotPath()));
+        server.start(config.bind.port, config.bind.iface);
+    }
+
+    // Bound here, unless the listeners were taken over from the previous broker.
+    if (httpRouter && !httpRouter->listening() && !httpRouter->start(config.httpRouting))
+    {
+        spdlog::error("Could not start routing HTTP requests on port {}.", config.httpRouting.port);
+        return 1;
+    }
+    if (tlsRouter && !tlsRouter->listening() && !tlsRouter->start(config.tlsRouting))
+    {
+        spdlog::error("Could not start routing TLS connections on port {}.", config.tlsRouting.port);
+        return 1;
+    }
+
+    auto handoverListener = std::make_shared<HandoverListener>(pool.executor(), handoverPath, pageAndControl);
+    handoverListener->start([]() {
+        // Exits through the same path as a manual shutdown.
+        std::raise(SIGINT);
+    });
 
     // Notify terminal user and wait.
     spdlog::info("Bound on [{}]:'{}'", config.bind.iface, server.getLocalEndpoint().port());
@@ -98,4 +199,11 @@ int main(int argc, char** argv)
     Roar::shutdownBarrier.wait();
 
     spdlog::info("Shutting down...");
+    handoverListener->stop();
+    if (httpRouter)
+        httpRouter->stop();
+    if (tlsRouter)
+        tlsRouter->stop();
+    if (clusterNode)
+        clusterNode->stop();
 }
\ No newline at end of file
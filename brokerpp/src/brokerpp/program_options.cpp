@@ -1,21 +1,32 @@
-#include <brokerpp/program_options.hpp>
-#include <roar/filesystem/special_paths.hpp>
-
-#include <cxxopts.hpp>
-
-namespace TunnelBore::Broker
-{
-    ProgramOptions parseProgramOptions(int argc, char** argv)
-    {
-        cxxopts::Options options("connection broker", "Establishes connections between hidden servers and clients.");
-
-        options.add_options()(
-            "served-directory",
-            "Directory to serve.",
-            cxxopts::value<std::string>()->default_value(Roar::resolvePath("~/httpdocs").string()));
-
-        const auto result = options.parse(argc, argv);
-
-        return ProgramOptions{.servedDirectory = result["served-directory"].as<std::string>()};
-    }
+#include <brokerpp/program_options.hpp>
+#include <roar/filesystem/special_paths.hpp>
+
+#include <cxxopts.hpp>
+
+namespace TunnelBore::Broker
+{
+    ProgramOptions parseProgramOptions(int argc, char** argv)
+    {
+        cxxopts::Options options("connection broker", "Establishes connections between hidden servers and clients.");
+
+        options.add_options()(
+            "served-directory",
+            "Directory to serve.",
+            cxxopts::value<std::string>()->default_value(Roar::resolvePath("~/httpdocs").string()))(
+            "takeover",
+            "Take over listeners and tunnels from the running broker, which exits afterwards.",
+            cxxopts::value<bool>()->default_value("false"))(
+            "config",
+            "Config file to use instead of the one in the home directory.",
+            cxxopts::value<std::string>());
+
+        const auto result = options.parse(argc, argv);
+
+        return ProgramOptions{
+            .servedDirectory = result["served-directory"].as<std::string>(),
+            .takeover = result["takeover"].as<bool>(),
+            .configFile = result.count("config") != 0 ? std::optional{result["config"].as<std::string>()}
+                                                      : std::nullopt,
+        };
+    }
 }
\ No newline at end of file
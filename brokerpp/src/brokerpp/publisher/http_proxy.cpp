@@ -0,0 +1,818 @@
+#include <brokerpp/publisher/http_proxy.hpp>
+#include <brokerpp/publisher/service.hpp>
+#include <brokerpp/publisher/tunnel_session.hpp>
+#include <brokerpp/routing/http_host_parser.hpp>
+#include <sharedpp/uuid_generator.hpp>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http.hpp>
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+namespace http = boost::beast::http;
+using boost::asio::ip::tcp;
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        constexpr std::string_view BadRequest =
+            "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        constexpr std::string_view BadGateway =
+            "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        constexpr std::string_view Continue = "HTTP/1.1 100 Continue\r\n\r\n";
+
+        template <typename Buffer, typename Buffers>
+        Buffer firstBuffer(Buffers const& buffers)
+        {
+            for (auto iter = boost::asio::buffer_sequence_begin(buffers);
+                 iter != boost::asio::buffer_sequence_end(buffers);
+                 ++iter)
+            {
+                Buffer buffer = *iter;
+                if (buffer.size() > 0)
+                    return buffer;
+            }
+            return Buffer{};
+        }
+
+        /**
+         * The publisher side of a tunnel as a stream for Beast. Reads and writes go through its TLS, if it is
+         * encrypted in userspace.
+         */
+        class UpstreamStream
+        {
+          public:
+            using executor_type = boost::asio::any_io_executor;
+
+            explicit UpstreamStream(std::shared_ptr<TunnelSession> session)
+                : session_{std::move(session)}
+            {}
+
+            executor_type get_executor()
+            {
+                return session_->socket().get_executor();
+            }
+
+            template <typename MutableBuffers, typename Handler>
+            void async_read_some(MutableBuffers const& buffers, Handler&& handler)
+            {
+                if (auto tls = session_->userspaceTls(); tls)
+                {
+                    return tls->asyncReadSome(
+                        session_->socket(),
+                        firstBuffer<boost::asio::mutable_buffer>(buffers),
+                        std::forward<Handler>(handler));
+                }
+                session_->socket().async_read_some(buffers, std::forward<Handler>(handler));
+            }
+
+            template <typename ConstBuffers, typename Handler>
+            void async_write_some(ConstBuffers const& buffers, Handler&& handler)
+            {
+                if (auto tls = session_->userspaceTls(); tls)
+                {
+                    return tls->asyncWrite(
+                        session_->socket(),
+                        firstBuffer<boost::asio::const_buffer>(buffers),
+                        std::forward<Handler>(handler));
+                }
+                session_->socket().async_write_some(buffers, std::forward<Handler>(handler));
+            }
+
+          private:
+            std::shared_ptr<TunnelSession> session_;
+        };
+
+        /**
+         * Removes the fields that only concern one connection, the proxy has its own on either side.
+         */
+        template <typename Fields>
+        void removeHopByHopFields(Fields& fields)
+        {
+            const auto connection = std::string{fields[http::field::connection]};
+            for (auto const& token : http::token_list{connection})
+            {
+                // The framing of the message is kept.
+                if (boost::beast::iequals(token, "transfer-encoding") || boost::beast::iequals(token, "content-length"))
+                    continue;
+                fields.erase(token);
+            }
+            fields.erase(http::field::connection);
+            fields.erase(http::field::keep_alive);
+            fields.erase(http::field::proxy_connection);
+            fields.erase(http::field::te);
+            fields.erase(http::field::upgrade);
+        }
+
+        /**
+         * Passes the body of a message on, once its header is written. Like the relay example of Beast, piece by
+         * piece through the chunk, so that bodies of any size stream through.
+         *
+         * @param progress Called after every piece written.
+         * @param done Called with the error, if any, and whether it occurred reading.
+         */
+        template <bool isRequest, typename In, typename Out, typename Progress, typename Done>
+        void relayBody(
+            In* in,
+            boost::beast::flat_buffer* inBuffer,
+            http::parser<isRequest, http::buffer_body>* parser,
+            Out* out,
+            http::serializer<isRequest, http::buffer_body>* serializer,
+            boost::asio::mutable_buffer chunk,
+            Progress progress,
+            Done done)
+        {
+            if (serializer->is_done())
+                return done(boost::system::error_code{}, false);
+
+            auto onWritten = [in, inBuffer, parser, out, serializer, chunk, progress, done](
+                                 boost::system::error_code ec, std::size_t) mutable {
+                if (ec == http::error::need_buffer)
+                    ec = {};
+                if (ec)
+                    return done(ec, false);
+                progress();
+                relayBody(in, inBuffer, parser, out, serializer, chunk, std::move(progress), std::move(done));
+            };
+
+            auto& body = parser->get().body();
+            if (parser->is_done())
+            {
+                body.data = nullptr;
+                body.size = 0;
+                body.more = false;
+                return http::async_write(*out, *serializer, std::move(onWritten));
+            }
+
+            body.data = chunk.data();
+            body.size = chunk.size();
+            http::async_read(
+                *in,
+                *inBuffer,
+                *parser,
+                [parser, out, serializer, chunk, onWritten = std::move(onWritten), done](
+                    boost::system::error_code ec, std::size_t) mutable {
+                    if (ec == http::error::need_buffer)
+                        ec = {};
+                    if (ec)
+                        return done(ec, true);
+                    auto& body = parser->get().body();
+                    body.size = chunk.size() - body.size;
+                    body.data = chunk.data();
+                    body.more = !parser->is_done();
+                    http::async_write(*out, *serializer, std::move(onWritten));
+                });
+        }
+    }
+    // #####################################################################################################################
+    struct HttpProxy::Upstream
+    {
+        std::shared_ptr<TunnelSession> session;
+        UpstreamStream stream;
+        /// Read from the tunnel, but not part of a response yet.
+        boost::beast::flat_buffer buffer;
+        std::chrono::steady_clock::time_point idleSince;
+        /// Was kept for another request, the hidden service may have closed it since.
+        bool reused;
+
+        explicit Upstream(std::shared_ptr<TunnelSession> tunnel)
+            : session{tunnel}
+            , stream{std::move(tunnel)}
+            , buffer{}
+            , idleSince{}
+            , reused{false}
+        {}
+    };
+    // #####################################################################################################################
+    /**
+     * A client connection and the request it is at.
+     */
+    struct HttpProxy::Exchange
+    {
+        tcp::socket client;
+        std::string remoteAddress;
+        boost::beast::flat_buffer clientBuffer;
+        boost::asio::steady_timer timer;
+        std::optional<http::request_parser<http::buffer_body>> request;
+        std::optional<http::request_serializer<http::buffer_body>> requestWriter;
+        std::optional<http::response_parser<http::buffer_body>> response;
+        std::optional<http::response_serializer<http::buffer_body>> responseWriter;
+        std::shared_ptr<Upstream> upstream;
+        std::array<char, ChunkSize> chunk;
+        std::size_t requests;
+        /// Whether the client connection is kept after the current response.
+        bool keepAlive;
+        /// Whether the upstream is kept after the current response.
+        bool upstreamReusable;
+        /// Whether the request may be sent on another tunnel, if the first one broke before the response.
+        bool retryable;
+        bool retried;
+        bool closed;
+
+        explicit Exchange(tcp::socket&& socket)
+            : client{std::move(socket)}
+            , remoteAddress{}
+            , clientBuffer{}
+            , timer{client.get_executor()}
+            , request{}
+            , requestWriter{}
+            , response{}
+            , responseWriter{}
+            , upstream{}
+            , chunk{}
+            , requests{0}
+            , keepAlive{false}
+            , upstreamReusable{false}
+            , retryable{false}
+            , retried{false}
+            , closed{false}
+        {
+            boost::system::error_code ec;
+            remoteAddress = client.remote_endpoint(ec).address().to_string();
+        }
+    };
+    // #####################################################################################################################
+    struct HttpProxy::Implementation
+    {
+        boost::asio::any_io_executor executor;
+        std::weak_ptr<Service> service;
+        HttpProxyConfig config;
+        std::mutex guard;
+        uuid_generator uuidGenerator;
+        /// Unused tunnels, the one used last at the back.
+        std::deque<std::shared_ptr<Upstream>> idle;
+        struct WaitingExchange
+        {
+            /// Only to find the waiter again, the waiter holds the exchange.
+            Exchange const* exchange;
+            Waiter waiter;
+        };
+        std::deque<WaitingExchange> waiters;
+        /// Tunnels asked for that did not connect yet, with their setup timeouts.
+        std::unordered_map<std::string, std::shared_ptr<boost::asio::steady_timer>> opening;
+        /// Connected tunnels, idle or in use, and the ones being opened.
+        std::size_t open;
+        boost::asio::steady_timer idleTimer;
+        bool idleTimerArmed;
+        /// Nothing is pooled or handed out anymore.
+        bool stopped;
+
+        Implementation(boost::asio::any_io_executor executor, std::weak_ptr<Service> service, HttpProxyConfig config)
+            : executor{executor}
+            , service{std::move(service)}
+            , config{std::move(config)}
+            , guard{}
+            , uuidGenerator{}
+            , idle{}
+            , waiters{}
+            , opening{}
+            , open{0}
+            , idleTimer{executor}
+            , idleTimerArmed{false}
+            , stopped{false}
+        {}
+
+        std::chrono::seconds upstreamIdleTimeout() const
+        {
+            return std::chrono::seconds{config.upstreamIdleSeconds};
+        }
+    };
+    // #####################################################################################################################
+    HttpProxy::HttpProxy(boost::asio::any_io_executor executor, std::weak_ptr<Service> service, HttpProxyConfig config)
+        : impl_{std::make_unique<Implementation>(std::move(executor), std::move(service), std::move(config))}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    HttpProxy::~HttpProxy() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::serve(tcp::socket&& socket, std::string initialData)
+    {
+        auto exchange = std::make_shared<Exchange>(std::move(socket));
+        auto buffer = exchange->clientBuffer.prepare(initialData.size());
+        boost::asio::buffer_copy(buffer, boost::asio::buffer(initialData));
+        exchange->clientBuffer.commit(initialData.size());
+        readRequest(exchange);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::stop()
+    {
+        std::deque<std::shared_ptr<Upstream>> idle;
+        std::deque<Implementation::WaitingExchange> waiters;
+        {
+            std::scoped_lock lock{impl_->guard};
+            impl_->stopped = true;
+            idle.swap(impl_->idle);
+            waiters.swap(impl_->waiters);
+            for (auto const& [tunnelId, timer] : impl_->opening)
+                timer->cancel();
+            impl_->open -= idle.size() + impl_->opening.size();
+            impl_->opening.clear();
+            impl_->idleTimer.cancel();
+        }
+        for (auto const& upstream : idle)
+            upstream->session->close();
+        for (auto const& waiting : waiters)
+            waiting.waiter(nullptr);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::acquire(std::shared_ptr<Exchange> const& exchange, Waiter waiter)
+    {
+        std::shared_ptr<Upstream> upstream;
+        {
+            std::scoped_lock lock{impl_->guard};
+            if (impl_->stopped)
+                return waiter(nullptr);
+            // The one used last, so that the others age out when fewer are needed.
+            if (!impl_->idle.empty())
+            {
+                upstream = std::move(impl_->idle.back());
+                impl_->idle.pop_back();
+            }
+            else
+                impl_->waiters.push_back({exchange.get(), std::move(waiter)});
+        }
+        if (upstream)
+            return waiter(std::move(upstream));
+        openForWaiters();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::release(std::shared_ptr<Upstream> upstream, bool reusable)
+    {
+        Waiter waiter;
+        {
+            std::scoped_lock lock{impl_->guard};
+            // Stopping closed the pool, tunnels in use close when their request is done.
+            if (impl_->stopped)
+                reusable = false;
+            if (reusable && !impl_->waiters.empty())
+            {
+                waiter = std::move(impl_->waiters.front().waiter);
+                impl_->waiters.pop_front();
+            }
+            else if (reusable && impl_->idle.size() < impl_->config.maxIdleUpstreams)
+            {
+                upstream->reused = true;
+                upstream->idleSince = std::chrono::steady_clock::now();
+                impl_->idle.push_back(std::move(upstream));
+                if (!impl_->idleTimerArmed)
+                {
+                    impl_->idleTimerArmed = true;
+                    impl_->idleTimer.expires_after(impl_->upstreamIdleTimeout());
+                    impl_->idleTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+                        if (ec)
+                            return;
+                        if (auto self = weak.lock(); self)
+                            self->expireIdle();
+                    });
+                }
+                return;
+            }
+            else
+                --impl_->open;
+        }
+        if (waiter)
+        {
+            upstream->reused = true;
+            return waiter(std::move(upstream));
+        }
+        upstream->session->close();
+        openForWaiters();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::dropWaiter(Exchange const& exchange)
+    {
+        std::scoped_lock lock{impl_->guard};
+        std::erase_if(impl_->waiters, [&exchange](auto const& waiting) {
+            return waiting.exchange == &exchange;
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::expireIdle()
+    {
+        std::vector<std::shared_ptr<Upstream>> expired;
+        {
+            std::scoped_lock lock{impl_->guard};
+            impl_->idleTimerArmed = false;
+            const auto now = std::chrono::steady_clock::now();
+            // Released in order, so the front is always idle the longest.
+            while (!impl_->idle.empty() && impl_->idle.front()->idleSince + impl_->upstreamIdleTimeout() <= now)
+            {
+                expired.push_back(std::move(impl_->idle.front()));
+                impl_->idle.pop_front();
+            }
+            impl_->open -= expired.size();
+            if (!impl_->idle.empty())
+            {
+                impl_->idleTimerArmed = true;
+                impl_->idleTimer.expires_at(impl_->idle.front()->idleSince + impl_->upstreamIdleTimeout());
+                impl_->idleTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+                    if (ec)
+                        return;
+                    if (auto self = weak.lock(); self)
+                        self->expireIdle();
+                });
+            }
+        }
+        for (auto const& upstream : expired)
+            upstream->session->close();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::openForWaiters()
+    {
+        std::size_t toOpen = 0;
+        {
+            std::scoped_lock lock{impl_->guard};
+            while (impl_->waiters.size() > impl_->opening.size() + toOpen &&
+                   impl_->open + toOpen < impl_->config.maxUpstreams)
+            {
+                ++toOpen;
+            }
+            impl_->open += toOpen;
+        }
+        for (; toOpen > 0; --toOpen)
+            openUpstream();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::openUpstream()
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(impl_->executor);
+        std::string tunnelId;
+        {
+            std::scoped_lock lock{impl_->guard};
+            tunnelId = impl_->uuidGenerator.generate_id();
+            timer->expires_after(UpstreamSetupTimeout);
+            timer->async_wait([weak = weak_from_this(), tunnelId, timer](boost::system::error_code ec) {
+                if (ec)
+                    return;
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                spdlog::warn("Tunnel '{}' for proxied requests did not connect in time.", tunnelId);
+                if (auto service = self->impl_->service.lock(); service)
+                    service->cancelUpstream(tunnelId);
+                self->upstreamFailed(tunnelId);
+            });
+            impl_->opening[tunnelId] = timer;
+        }
+
+        auto service = impl_->service.lock();
+        if (!service || !service->openUpstream(tunnelId))
+            upstreamFailed(tunnelId);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::upstreamConnected(std::string const& tunnelId, std::shared_ptr<TunnelSession> session)
+    {
+        Waiter waiter;
+        {
+            std::scoped_lock lock{impl_->guard};
+            auto entry = impl_->opening.find(tunnelId);
+            // Timed out or stopped in the meantime.
+            if (entry == impl_->opening.end())
+                return session->close();
+            entry->second->cancel();
+            impl_->opening.erase(entry);
+            if (!impl_->waiters.empty())
+            {
+                waiter = std::move(impl_->waiters.front().waiter);
+                impl_->waiters.pop_front();
+            }
+        }
+        auto upstream = std::make_shared<Upstream>(std::move(session));
+        if (waiter)
+            return waiter(std::move(upstream));
+        release(std::move(upstream), true);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::upstreamFailed(std::string const& tunnelId)
+    {
+        Waiter waiter;
+        {
+            std::scoped_lock lock{impl_->guard};
+            auto entry = impl_->opening.find(tunnelId);
+            if (entry == impl_->opening.end())
+                return;
+            entry->second->cancel();
+            impl_->opening.erase(entry);
+            --impl_->open;
+            if (!impl_->waiters.empty())
+            {
+                waiter = std::move(impl_->waiters.front().waiter);
+                impl_->waiters.pop_front();
+            }
+        }
+        if (waiter)
+            waiter(nullptr);
+        openForWaiters();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::readRequest(std::shared_ptr<Exchange> const& exchange)
+    {
+        exchange->request.emplace();
+        exchange->request->header_limit(static_cast<std::uint32_t>(HttpHostParser::MaxHeadBytes));
+        exchange->request->body_limit(boost::none);
+        arm(exchange,
+            exchange->requests == 0 ? TransferTimeout : std::chrono::seconds{impl_->config.keepAliveSeconds});
+        http::async_read_header(
+            exchange->client,
+            exchange->clientBuffer,
+            *exchange->request,
+            [weak = weak_from_this(), exchange](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || exchange->closed)
+                    return;
+                // Closing or breaking the connection between requests is no error, only a malformed request is.
+                const bool malformed = ec && ec != http::error::end_of_stream &&
+                    ec.category() == http::make_error_code(http::error::end_of_stream).category();
+                if (ec && !malformed)
+                    return self->finish(exchange);
+                if (ec)
+                    return self->refuse(exchange, BadRequest);
+                self->onRequestHeader(exchange);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::onRequestHeader(std::shared_ptr<Exchange> const& exchange)
+    {
+        auto& request = exchange->request->get();
+        if (request.version() != 11 || exchange->request->upgrade())
+            return tunnel(exchange);
+
+        ++exchange->requests;
+        exchange->keepAlive = exchange->request->keep_alive() &&
+            (impl_->config.maxKeepAliveRequests == 0 || exchange->requests < impl_->config.maxKeepAliveRequests);
+        exchange->retryable = exchange->request->is_done() &&
+            (request.method() == http::verb::get || request.method() == http::verb::head ||
+             request.method() == http::verb::options);
+        exchange->retried = false;
+
+        const bool expectsContinue = boost::beast::iequals(request[http::field::expect], "100-continue");
+        if (expectsContinue)
+            request.erase(http::field::expect);
+        removeHopByHopFields(request);
+        // The hidden service only ever sees the publisher connecting.
+        const auto forwardedFor = std::string{request["X-Forwarded-For"]};
+        request.set(
+            "X-Forwarded-For",
+            forwardedFor.empty() ? exchange->remoteAddress : forwardedFor + ", " + exchange->remoteAddress);
+
+        if (!expectsContinue || exchange->request->is_done())
+            return forward(exchange);
+
+        // Answered by the proxy, the body is read from the client only once a tunnel is there to take it anyway.
+        boost::asio::async_write(
+            exchange->client,
+            boost::asio::buffer(Continue.data(), Continue.size()),
+            [weak = weak_from_this(), exchange](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || exchange->closed)
+                    return;
+                if (ec)
+                    return self->finish(exchange);
+                self->forward(exchange);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::forward(std::shared_ptr<Exchange> const& exchange)
+    {
+        acquire(exchange, [weak = weak_from_this(), exchange](std::shared_ptr<Upstream> upstream) {
+            // Continues on the shard of the client, the tunnel is moved there as well.
+            boost::asio::post(
+                exchange->client.get_executor(), [weak, exchange, upstream = std::move(upstream)]() mutable {
+                    auto self = weak.lock();
+                    if (!self)
+                    {
+                        if (upstream)
+                            upstream->session->close();
+                        return;
+                    }
+                    if (exchange->closed)
+                    {
+                        if (upstream)
+                            self->release(std::move(upstream), true);
+                        return;
+                    }
+                    if (!upstream)
+                    {
+                        spdlog::warn("No tunnel for the proxied request of '{}'.", exchange->remoteAddress);
+                        return self->refuse(exchange, BadGateway);
+                    }
+                    upstream->session->moveToExecutor(exchange->client.get_executor());
+                    exchange->upstream = std::move(upstream);
+                    self->sendRequest(exchange);
+                });
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::sendRequest(std::shared_ptr<Exchange> const& exchange)
+    {
+        exchange->requestWriter.emplace(exchange->request->get());
+        arm(exchange, TransferTimeout);
+        http::async_write_header(
+            exchange->upstream->stream,
+            *exchange->requestWriter,
+            [weak = weak_from_this(), exchange](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || exchange->closed)
+                    return;
+                if (ec)
+                    return self->upstreamBroke(exchange);
+
+                relayBody(
+                    &exchange->client,
+                    &exchange->clientBuffer,
+                    &*exchange->request,
+                    &exchange->upstream->stream,
+                    &*exchange->requestWriter,
+                    boost::asio::buffer(exchange->chunk),
+                    [weak, exchange]() {
+                        if (auto self = weak.lock(); self)
+                            self->arm(exchange, TransferTimeout);
+                    },
+                    [weak, exchange](boost::system::error_code ec, bool readFailed) {
+                        auto self = weak.lock();
+                        if (!self || exchange->closed)
+                            return;
+                        if (ec && readFailed)
+                            return self->finish(exchange);
+                        if (ec)
+                            return self->upstreamBroke(exchange);
+                        self->readResponse(exchange);
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::readResponse(std::shared_ptr<Exchange> const& exchange)
+    {
+        exchange->response.emplace();
+        exchange->response->body_limit(boost::none);
+        if (exchange->request->get().method() == http::verb::head)
+            exchange->response->skip(true);
+        arm(exchange, TransferTimeout);
+        http::async_read_header(
+            exchange->upstream->stream,
+            exchange->upstream->buffer,
+            *exchange->response,
+            [weak = weak_from_this(), exchange](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || exchange->closed)
+                    return;
+                if (ec)
+                    return self->upstreamBroke(exchange);
+                self->onResponseHeader(exchange);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::onResponseHeader(std::shared_ptr<Exchange> const& exchange)
+    {
+        auto& parser = *exchange->response;
+        auto& response = parser.get();
+        // Interim responses, like 103 Early Hints, are passed on and followed by the final one.
+        const bool interim = response.result_int() / 100 == 1;
+        if (!interim)
+        {
+            const bool closeDelimited = !parser.is_done() && !parser.chunked() && !parser.content_length();
+            exchange->upstreamReusable = parser.keep_alive() && !closeDelimited;
+            if (closeDelimited)
+                exchange->keepAlive = false;
+        }
+        removeHopByHopFields(response);
+        if (!interim)
+            response.keep_alive(exchange->keepAlive);
+
+        exchange->responseWriter.emplace(response);
+        arm(exchange, TransferTimeout);
+        http::async_write_header(
+            exchange->client,
+            *exchange->responseWriter,
+            [weak = weak_from_this(), exchange, interim](boost::system::error_code ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || exchange->closed)
+                    return;
+                if (ec)
+                    return self->finish(exchange);
+                if (interim)
+                    return self->readResponse(exchange);
+
+                relayBody(
+                    &exchange->upstream->stream,
+                    &exchange->upstream->buffer,
+                    &*exchange->response,
+                    &exchange->client,
+                    &*exchange->responseWriter,
+                    boost::asio::buffer(exchange->chunk),
+                    [weak, exchange]() {
+                        if (auto self = weak.lock(); self)
+                            self->arm(exchange, TransferTimeout);
+                    },
+                    [weak, exchange](boost::system::error_code ec, bool) {
+                        auto self = weak.lock();
+                        if (!self || exchange->closed)
+                            return;
+                        // Part of the response is out already, there is nothing to save.
+                        if (ec)
+                            return self->finish(exchange);
+
+                        // Bytes beyond the response would be taken for the next one.
+                        const bool reusable = exchange->upstreamReusable && exchange->upstream->buffer.size() == 0;
+                        self->release(std::move(exchange->upstream), reusable);
+                        if (!exchange->keepAlive)
+                            return self->finish(exchange);
+                        self->readRequest(exchange);
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::upstreamBroke(std::shared_ptr<Exchange> const& exchange)
+    {
+        auto upstream = std::move(exchange->upstream);
+        // A tunnel that was idle may have been closed by the hidden service, the request most likely never got there.
+        const bool retry = exchange->retryable && !exchange->retried && upstream && upstream->reused;
+        if (upstream)
+            release(std::move(upstream), false);
+        if (!retry)
+        {
+            spdlog::warn("Tunnel for the proxied request of '{}' broke.", exchange->remoteAddress);
+            return refuse(exchange, BadGateway);
+        }
+        exchange->retried = true;
+        forward(exchange);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::tunnel(std::shared_ptr<Exchange> const& exchange)
+    {
+        // The head is written again as it was read, the rest of the connection follows through the tunnel as is.
+        std::ostringstream head;
+        head << exchange->request->get().base();
+        auto data = head.str();
+        const auto buffered = exchange->clientBuffer.data();
+        data.append(static_cast<char const*>(buffered.data()), buffered.size());
+
+        exchange->closed = true;
+        exchange->timer.cancel();
+        auto service = impl_->service.lock();
+        if (!service || !service->tunnelConnection(std::move(exchange->client), std::move(data)))
+        {
+            boost::system::error_code ignore;
+            exchange->client.close(ignore);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::arm(std::shared_ptr<Exchange> const& exchange, std::chrono::seconds timeout)
+    {
+        exchange->timer.expires_after(timeout);
+        exchange->timer.async_wait(
+            [weak = weak_from_this(), weakExchange = std::weak_ptr<Exchange>{exchange}](boost::system::error_code ec) {
+                if (ec)
+                    return;
+                auto self = weak.lock();
+                auto exchange = weakExchange.lock();
+                if (self && exchange)
+                    self->finish(exchange);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::refuse(std::shared_ptr<Exchange> const& exchange, std::string_view response)
+    {
+        exchange->closed = true;
+        exchange->timer.cancel();
+        dropWaiter(*exchange);
+        if (exchange->upstream)
+            release(std::move(exchange->upstream), false);
+        boost::asio::async_write(
+            exchange->client,
+            boost::asio::buffer(response.data(), response.size()),
+            [exchange](boost::system::error_code, std::size_t) {
+                boost::system::error_code ignore;
+                exchange->client.shutdown(tcp::socket::shutdown_both, ignore);
+                exchange->client.close(ignore);
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void HttpProxy::finish(std::shared_ptr<Exchange> const& exchange)
+    {
+        if (exchange->closed)
+            return;
+        exchange->closed = true;
+        exchange->timer.cancel();
+        // Timed out waiting for a tunnel, it would otherwise take one that a later request waits for.
+        dropWaiter(*exchange);
+        boost::system::error_code ignore;
+        exchange->client.shutdown(tcp::socket::shutdown_both, ignore);
+        exchange->client.close(ignore);
+        // Closing it fails what is in flight on it.
+        if (exchange->upstream)
+            release(std::move(exchange->upstream), false);
+    }
+    // #####################################################################################################################
+}
@@ -1,41 +1,124 @@
 #include <brokerpp/winsock_first.hpp>
 #include <brokerpp/publisher/publisher.hpp>
 #include <brokerpp/publisher/service.hpp>
+#include <brokerpp/publisher/service_directory.hpp>
+#include <brokerpp/control/messages.hpp>
 #include <sharedpp/json.hpp>
 #include <roar/dns/resolve.hpp>
 #include <sharedpp/uuid_generator.hpp>
+#include <sharedpp/wire_encoding.hpp>
 
+#include <boost/asio/steady_timer.hpp>
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <mutex>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std::literals;
 
 namespace TunnelBore::Broker
 {
+    namespace
+    {
+        /**
+         * @param identity Of a publisher, the instance is appended after a '#', which instance names cannot contain.
+         */
+        std::string accountOf(std::string const& identity)
+        {
+            return identity.substr(0, identity.rfind('#'));
+        }
+    }
     // #####################################################################################################################
     struct Publisher::Implementation
     {
         boost::asio::any_io_executor executor;
+        std::shared_ptr<IoEngine> engine;
         uuid_generator uuidGenerator;
         std::string identity;
         std::recursive_mutex serviceGuard;
         std::map<std::string, std::shared_ptr<Service>> services;
         std::weak_ptr<ControlSession> controlSession;
+        unsigned short publicPortOffset;
+        std::function<void(std::vector<ServiceInfo> const&)> onServicesChanged;
+        std::shared_ptr<TunnelSetupStats> setupStats;
+        std::shared_ptr<TunnelRegistry> tunnelRegistry;
+        std::shared_ptr<ServiceDirectory> serviceDirectory;
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls;
+        std::chrono::seconds controlGracePeriod;
+        std::chrono::seconds holdTimeout;
+        boost::asio::steady_timer graceTimer;
+        std::atomic<std::shared_ptr<PublisherView const>> view;
 
-        Implementation(boost::asio::any_io_executor executor, std::string identity)
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::string identity,
+            std::shared_ptr<TunnelSetupStats> setupStats,
+            std::shared_ptr<TunnelRegistry> tunnelRegistry,
+            std::shared_ptr<ServiceDirectory> serviceDirectory,
+            std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+            std::chrono::seconds controlGracePeriod,
+            std::chrono::seconds holdTimeout,
+            unsigned short publicPortOffset)
             : executor{std::move(executor)}
+            , engine{std::move(engine)}
             , uuidGenerator{}
             , identity{std::move(identity)}
             , services{}
             , controlSession{}
+            , publicPortOffset{publicPortOffset}
+            , onServicesChanged{}
+            , setupStats{std::move(setupStats)}
+            , tunnelRegistry{std::move(tunnelRegistry)}
+            , serviceDirectory{std::move(serviceDirectory)}
+            , dataLinkTls{std::move(dataLinkTls)}
+            , controlGracePeriod{controlGracePeriod}
+            , holdTimeout{holdTimeout}
+            , graceTimer{this->executor}
+            , view{std::make_shared<PublisherView const>()}
         {}
+
+        /**
+         * @brief Republishes the view after the services or the control session changed, serviceGuard is held.
+         */
+        void publishView()
+        {
+            auto next = std::make_shared<PublisherView>();
+            next->services.reserve(services.size());
+            for (auto const& [serviceId, service] : services)
+                next->services.push_back(service);
+            next->controlSession = controlSession;
+            view.store(std::move(next));
+        }
     };
     // #####################################################################################################################
-    Publisher::Publisher(boost::asio::any_io_executor executor, std::string identity)
-        : impl_{std::make_unique<Implementation>(executor, std::move(identity))}
+    Publisher::Publisher(
+        boost::asio::any_io_executor executor,
+        std::shared_ptr<IoEngine> engine,
+        std::string identity,
+        std::shared_ptr<TunnelSetupStats> setupStats,
+        std::shared_ptr<TunnelRegistry> tunnelRegistry,
+        std::shared_ptr<ServiceDirectory> serviceDirectory,
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+        std::chrono::seconds controlGracePeriod,
+        std::chrono::seconds holdTimeout,
+        unsigned short publicPortOffset)
+        : impl_{std::make_unique<Implementation>(
+              executor,
+              std::move(engine),
+              std::move(identity),
+              std::move(setupStats),
+              std::move(tunnelRegistry),
+              std::move(serviceDirectory),
+              std::move(dataLinkTls),
+              controlGracePeriod,
+              holdTimeout,
+              publicPortOffset)}
     {}
     //---------------------------------------------------------------------------------------------------------------------
     Publisher::~Publisher()
@@ -49,7 +132,7 @@ namespace TunnelBore::Broker
     //---------------------------------------------------------------------------------------------------------------------
     std::weak_ptr<ControlSession> Publisher::getCurrentControlSession()
     {
-        return impl_->controlSession;
+        return impl_->view.load()->controlSession;
     }
     //---------------------------------------------------------------------------------------------------------------------
     void Publisher::setCurrentControlSession(std::weak_ptr<ControlSession> controlSession)
@@ -61,11 +144,18 @@ namespace TunnelBore::Broker
             return;
         }
 
-        impl_->controlSession = controlSession;
+        {
+            std::scoped_lock lock{impl_->serviceGuard};
+            if (impl_->graceTimer.cancel() > 0)
+                spdlog::info("Publisher '{}' is back, keeping its services.", impl_->identity);
+            impl_->controlSession = controlSession;
+            impl_->publishView();
+        }
 
         // Note to myself: dont capture session here, or it would be indefinitely kept alive.
-        session->subscribe(
-            "Handshake", [weak = weak_from_this(), controlSession = session->weak_from_this()](json const& j, std::string const& ref) {
+        session->on<HandshakeMessage>(
+            [weak = weak_from_this(), controlSession = session->weak_from_this()](
+                HandshakeMessage const& handshake, std::string const& ref) {
                 spdlog::info("Publisher handshake received.");
 
                 auto shared = weak.lock();
@@ -81,49 +171,129 @@ namespace TunnelBore::Broker
                     return true;
                 }
 
-                if (!j.contains("services"))
-                {
-                    spdlog::error("Handshake should contain services.");
-                    return session->respondWithError(ref, "Services missing on handshake."), false;
-                }
+                // The acceptance itself is still json, everything after it uses the selected encoding.
+                const auto encoding = selectWireEncoding(handshake.encodings);
+                session->enableBatching(handshake.batching);
+                session->writeJson(json{
+                    {"type", "HandshakeAccepted"},
+                    {"batching", handshake.batching},
+                    {"encoding", toString(encoding)},
+                    {"tunnelTraces", handshake.tunnelTraces},
+                    {"compressions", supportedStreamCompressions()},
+                    {"dataLinkTls", shared->impl_->dataLinkTls != nullptr},
+                    {"servicesUpdate", true},
+                });
+                session->setEncoding(encoding);
+                if (handshake.heartbeatIntervalSeconds > 0)
+                    session->expectHeartbeat(std::chrono::seconds{handshake.heartbeatIntervalSeconds});
 
                 try
                 {
-                    auto services = j["services"].get<std::vector<ServiceInfo>>();
-                    shared->addServices(services);
+                    shared->addServices(handshake.services);
                 }
                 catch (std::exception const& exc)
                 {
-                    spdlog::error("Exception during handshake parsing: {}", exc.what());
-                    return session->respondWithError(ref, "Exception during handshake parsing: "s + exc.what()), false;
+                    spdlog::error("Exception during handshake processing: {}", exc.what());
+                    session->releaseHandshakePermit();
+                    return session->respondWithError(ref, "Exception during handshake processing: "s + exc.what()),
+                           false;
                 }
+                session->releaseHandshakePermit();
+                // Clients that came while the publisher was away, its services are known to it again now.
+                shared->releaseHeldConnections();
                 return true;
             });
 
-        session->subscribe(
-            "Ping", [weak = weak_from_this(), controlSession = session->weak_from_this(), pingCounter = 0](json const&, std::string const& ref) mutable{
-                if (pingCounter == 0)
+        session->on<ServicesUpdateMessage>(
+            [weak = weak_from_this(), controlSession = session->weak_from_this()](
+                ServicesUpdateMessage const& update, std::string const& ref) {
+                auto shared = weak.lock();
+                if (!shared)
+                    return true;
+                auto session = controlSession.lock();
+                if (!session)
+                    return true;
+
+                spdlog::info(
+                    "Publisher '{}' added or changed {} and removed {} service(s).",
+                    shared->impl_->identity,
+                    update.added.size(),
+                    update.removed.size());
+                try
+                {
+                    shared->updateServices(update.added, update.removed);
+                }
+                catch (std::exception const& exc)
                 {
-                    spdlog::info("Ping received first or a thousandth time.");
+                    spdlog::error("Exception during services update: {}", exc.what());
+                    return session->respondWithError(ref, "Exception during services update: "s + exc.what()), false;
                 }
-                ++pingCounter;
-                if (pingCounter % 1000 == 0)
-                    pingCounter = 0;
+                // Added services may have clients waiting since before the handshake.
+                shared->releaseHeldConnections();
+                return true;
+            });
+
+        session->on<PingMessage>([weak = weak_from_this(), controlSession = session->weak_from_this(), pingCounter = 0](
+                                     PingMessage const&, std::string const&) mutable {
+            if (pingCounter == 0)
+            {
+                spdlog::info("Ping received first or a thousandth time.");
+            }
+            ++pingCounter;
+            if (pingCounter % 1000 == 0)
+                pingCounter = 0;
+
+            auto shared = weak.lock();
+            if (!shared)
+            {
+                spdlog::info("Publisher is not alive anymore. Discarding ping.");
+                return true;
+            }
+            auto session = controlSession.lock();
+            if (!session)
+            {
+                spdlog::info("Control session is not alive anymore. Discarding ping.");
+                return true;
+            }
+
+            // The publisher only looks at the type, so the pong is not wrapped like other responses.
+            static const auto pong = json{{"type", "Pong"}};
+            return session->writeJson(pong), true;
+        });
 
+        session->on<NewTunnelFailedMessage>([weak = weak_from_this()](
+                                                NewTunnelFailedMessage const& failure, std::string const&) {
+            auto shared = weak.lock();
+            if (!shared)
+                return true;
+
+            spdlog::warn(
+                "Publisher '{}' could not create tunnel '{}': {}",
+                shared->impl_->identity,
+                failure.tunnelId,
+                failure.reason);
+
+            // Another replica may reach its hidden service, the client would otherwise wait for the inactivity timeout.
+            // Held for the call, the service may be removed concurrently.
+            if (auto service = shared->getService(failure.serviceId); service)
+                service->tunnelFailed(failure.tunnelId, *shared);
+            return true;
+        });
+
+        session->on<TunnelTraceMessage>(
+            [weak = weak_from_this()](TunnelTraceMessage const& message, std::string const&) {
                 auto shared = weak.lock();
                 if (!shared)
-                {
-                    spdlog::info("Publisher is not alive anymore. Discarding ping.");
                     return true;
-                }
-                auto session = controlSession.lock();
-                if (!session)
+
+                if (message.trace.origin() != TunnelStage::NewTunnelReceived || !message.trace.isOneSided())
                 {
-                    spdlog::info("Control session is not alive anymore. Discarding ping.");
+                    spdlog::warn("Publisher '{}' sent a trace that is not from its side.", shared->impl_->identity);
                     return true;
                 }
-
-                return session->respond(ref, json{{"type", "Pong"}}), true;
+                if (shared->impl_->setupStats)
+                    shared->impl_->setupStats->record(message.trace);
+                return true;
             });
     }
     //---------------------------------------------------------------------------------------------------------------------
@@ -137,26 +307,137 @@ namespace TunnelBore::Broker
         return result;
     }
     //---------------------------------------------------------------------------------------------------------------------
+    std::vector<std::shared_ptr<Service>> Publisher::getServices() const
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        std::vector<std::shared_ptr<Service>> result;
+        result.reserve(impl_->services.size());
+        for (auto const& [serviceId, service] : impl_->services)
+            result.push_back(service);
+        return result;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<PublisherView const> Publisher::view() const
+    {
+        return impl_->view.load();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
     std::size_t Publisher::removeService(std::string const& id)
     {
         std::scoped_lock lock{impl_->serviceGuard};
         auto iter = impl_->services.find(id);
         if (iter == impl_->services.end())
             return 0;
-        iter->second->stop();
-        return impl_->services.erase(iter), 1;
+        auto service = std::move(iter->second);
+        impl_->services.erase(iter);
+        impl_->publishView();
+        leaveService(*service);
+        return 1;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::leaveService(Service& service)
+    {
+        // The listener stays open while other publishers serve the port.
+        if (service.removeReplica(*this) > 0)
+            return;
+        service.stop();
+        if (impl_->serviceDirectory)
+        {
+            impl_->serviceDirectory->remove(service.info().publicPort, service);
+            impl_->serviceDirectory->httpRoutes().release(service.info().httpHosts, service);
+            impl_->serviceDirectory->tlsRoutes().release(service.info().tlsServerNames, service);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Publisher::isRouted(ServiceInfo const& serviceInfo) const
+    {
+        auto const& directory = impl_->serviceDirectory;
+        if (!directory)
+            return false;
+        return (!serviceInfo.httpHosts.empty() && directory->httpRouting()) ||
+            (!serviceInfo.tlsServerNames.empty() && directory->tlsRouting());
     }
     //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::detachControlSession(bool eraseServices)
+    bool Publisher::claimRoutes(std::shared_ptr<Service> const& service)
     {
-        impl_->controlSession.reset();
-        if (eraseServices)
-            clearServices();
+        const auto serviceInfo = service->info();
+        if (!isRouted(serviceInfo))
+            return true;
+        auto& directory = *impl_->serviceDirectory;
+        const bool http = directory.httpRouting();
+        const bool tls = directory.tlsRouting();
+        if (!http || directory.httpRoutes().claim(serviceInfo.httpHosts, service))
+        {
+            if (!tls || directory.tlsRoutes().claim(serviceInfo.tlsServerNames, service))
+                return true;
+            if (http)
+                directory.httpRoutes().release(serviceInfo.httpHosts, *service);
+        }
+        spdlog::error(
+            "Service for '{}' with public port '{}' names a HTTP host or TLS server name that another service has "
+            "already.",
+            impl_->identity,
+            serviceInfo.publicPort);
+        return false;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    ServiceInfo Publisher::announcedInfo(Service& service)
+    {
+        return service.replicaInfo(*this).value_or(service.info());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::detachControlSession()
+    {
+        std::vector<std::shared_ptr<Service>> services;
+        {
+            std::scoped_lock lock{impl_->serviceGuard};
+            // The old session of a reconnected publisher often ends after the new one is attached.
+            if (!impl_->controlSession.expired())
+                return;
+            impl_->controlSession.reset();
+            impl_->publishView();
+            spdlog::info("Publisher '{}' lost its control line.", impl_->identity);
+            startGracePeriod();
+            for (auto const& [serviceId, service] : impl_->services)
+                services.push_back(service);
+        }
+        // Tunnels offered to this publisher and not connected yet are taken over by other replicas.
+        for (auto const& service : services)
+            service->replicaDetached(*this);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::startGracePeriod()
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        if (impl_->controlGracePeriod.count() <= 0)
+            return clearServices();
+
+        spdlog::info(
+            "Keeping the services of '{}' for {} seconds.", impl_->identity, impl_->controlGracePeriod.count());
+        impl_->graceTimer.expires_after(impl_->controlGracePeriod);
+        impl_->graceTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::scoped_lock lock{self->impl_->serviceGuard};
+            if (!self->impl_->controlSession.expired())
+                return;
+            spdlog::info("Publisher '{}' did not come back, closing its services.", self->impl_->identity);
+            self->clearServices();
+        });
     }
     //---------------------------------------------------------------------------------------------------------------------
     bool Publisher::addService(ServiceInfo serviceInfo)
     {
-        spdlog::info("Adding service for '{}' with public port '{}'.", impl_->identity, serviceInfo.publicPort);
+        std::scoped_lock lock{impl_->serviceGuard};
+        return startService(serviceInfo, findServiceByPublicPort(serviceInfo.publicPort));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Publisher::startService(ServiceInfo const& serviceInfo, std::shared_ptr<Service> const& existing)
+    {
         auto returnResult = [this](bool result) {
             if (auto controlSession = impl_->controlSession.lock(); controlSession)
                 controlSession->writeJson(json{{"type", "ServiceStartResult"}, {"result", result}});
@@ -164,73 +445,310 @@ namespace TunnelBore::Broker
         };
 
         std::scoped_lock lock{impl_->serviceGuard};
-        std::vector<std::string> recreatedServices;
-        for (auto const& [serviceId, service] : impl_->services)
+        if (existing)
         {
-            if (serviceInfo.publicPort == service->info().publicPort)
+            // Its listener and tunnels are kept, clients do not notice the publisher reconnecting.
+            if (announcedInfo(*existing) == serviceInfo)
+                return returnResult(true);
+
+            spdlog::info(
+                "Service for '{}' with public port '{}' changed, recreating it.",
+                impl_->identity,
+                serviceInfo.publicPort);
+            removeService(existing->serviceId());
+        }
+
+        spdlog::info("Adding service for '{}' with public port '{}'.", impl_->identity, serviceInfo.publicPort);
+        auto make = [this, &serviceInfo]() -> std::shared_ptr<Service> {
+            auto service = makeService(serviceInfo, impl_->uuidGenerator.generate_id());
+            if (!service->start())
+                return nullptr;
+            if (!claimRoutes(service))
+                return service->stop(), nullptr;
+            return service;
+        };
+        bool created = true;
+        auto service = impl_->serviceDirectory ? impl_->serviceDirectory->obtain(serviceInfo.publicPort, make, created)
+                                               : make();
+        if (!service)
+        {
+            spdlog::error(
+                "Could not start service for '{}' with public port '{}'", impl_->identity, serviceInfo.publicPort);
+            return returnResult(false);
+        }
+
+        if (!created)
+        {
+            // Otherwise anyone could announce a port served already and be offered the clients of others.
+            const auto identities = service->replicaIdentities();
+            const auto account = this->account();
+            const bool sameAccount =
+                std::all_of(identities.begin(), identities.end(), [&account](auto const& identity) {
+                    return accountOf(identity) == account;
+                });
+            const auto servedInfo = service->info();
+            if (!sameAccount && !(servedInfo.shareable && serviceInfo.shareable))
             {
-                // TODO: This does not change service config changes. How to handle this?
-                spdlog::info(
-                    "Service for '{}' with public port '{}' already existed, recreate.",
+                spdlog::error(
+                    "Service for '{}' with public port '{}' cannot join the one served by another identity, both have "
+                    "to be shareable.",
                     impl_->identity,
                     serviceInfo.publicPort);
-                recreatedServices.push_back(serviceId);
-                return returnResult(true);
+                return returnResult(false);
+            }
+
+            // Both replicas pipe through the same listener, so the stream has to look the same from either.
+            if (servedInfo.compression != serviceInfo.compression ||
+                servedInfo.compressionLevel != serviceInfo.compressionLevel ||
+                servedInfo.httpHosts != serviceInfo.httpHosts ||
+                servedInfo.tlsServerNames != serviceInfo.tlsServerNames)
+            {
+                spdlog::error(
+                    "Service for '{}' with public port '{}' cannot join the one served already, its compression or "
+                    "routed host names differ.",
+                    impl_->identity,
+                    serviceInfo.publicPort);
+                return returnResult(false);
             }
+            service->addReplica(weak_from_this(), serviceInfo);
+            spdlog::info(
+                "Joined service for '{}' with public port '{}' as a replica.", impl_->identity, serviceInfo.publicPort);
         }
+        else
+            spdlog::info("Added service for '{}' with public port '{}'.", impl_->identity, serviceInfo.publicPort);
+        impl_->services[service->serviceId()] = service;
+        impl_->publishView();
+        return returnResult(true);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::changeServices(std::vector<ServiceInfo> const& added, std::vector<unsigned short> const& removed)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        std::unordered_map<unsigned short, std::shared_ptr<Service>> byPublicPort;
+        for (auto const& [serviceId, service] : impl_->services)
+            byPublicPort[service->info().publicPort] = service;
 
-        std::size_t eraseCounter = 0;
-        for (auto const& serviceId : recreatedServices)
+        // Removed first, a service may move to a port that was freed by the same change.
+        for (auto publicPort : removed)
         {
-            eraseCounter += removeService(serviceId);
+            auto iter = byPublicPort.find(publicPort);
+            if (iter == byPublicPort.end())
+                continue;
+            spdlog::info("Removing service for '{}' with public port '{}'.", impl_->identity, publicPort);
+            removeService(iter->second->serviceId());
+            byPublicPort.erase(iter);
         }
-        if (eraseCounter != recreatedServices.size())
+        for (auto const& serviceInfo : added)
         {
-            spdlog::error(
-                "Could not erase all services for '{}' with public port '{}'", impl_->identity, serviceInfo.publicPort);
-            return returnResult(false);
+            auto iter = byPublicPort.find(serviceInfo.publicPort);
+            startService(serviceInfo, iter == byPublicPort.end() ? nullptr : iter->second);
         }
-
-        const auto serviceId = impl_->uuidGenerator.generate_id();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> Publisher::makeService(ServiceInfo const& serviceInfo, std::string serviceId)
+    {
+        // Only the publisher connects to routed services directly, any free port does.
+        const auto bindPort =
+            isRouted(serviceInfo) ? 0 : static_cast<unsigned short>(serviceInfo.publicPort + impl_->publicPortOffset);
         auto service = std::make_shared<Service>(
             impl_->executor,
+            impl_->engine,
             serviceInfo,
             Roar::Dns::resolveSingle(
-                impl_->executor, "::", serviceInfo.publicPort, false, boost::asio::ip::resolver_base::flags::passive),
+                impl_->executor,
+                "::",
+                static_cast<unsigned short>(bindPort),
+                false,
+                boost::asio::ip::resolver_base::flags::passive),
             weak_from_this(),
-            serviceId);
-        auto result = service->start();
-        if (!result)
+            std::move(serviceId),
+            impl_->setupStats,
+            impl_->tunnelRegistry,
+            impl_->dataLinkTls,
+            impl_->holdTimeout);
+
+        auto const& directory = impl_->serviceDirectory;
+        if (directory && directory->httpRouting() && directory->httpProxy().enabled && !serviceInfo.httpHosts.empty())
+            service->proxyHttp(directory->httpProxy());
+        return service;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    PublisherHandover Publisher::prepareHandover(std::vector<int>& descriptors)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        PublisherHandover handover{.identity = impl_->identity, .services = {}};
+        for (auto const& [serviceId, service] : impl_->services)
         {
-            spdlog::error(
-                "Could not start service for '{}' with public port '{}'", impl_->identity, serviceInfo.publicPort);
-            return returnResult(false);
+            // Replicas reconnect to the successor and join the service again.
+            if (!service->isPrimary(*this))
+                continue;
+            if (auto serviceHandover = service->prepareHandover(descriptors); serviceHandover)
+                handover.services.push_back(std::move(*serviceHandover));
         }
-        spdlog::info("Added service for '{}' with public port '{}'.", impl_->identity, serviceInfo.publicPort);
-        impl_->services[serviceId] = service;
-        return returnResult(true);
+        // What is left of the services is closed, the listeners belong to the successor now. The replicas are not
+        // removed, so that the other publishers of a service do not hand it over again.
+        impl_->services.clear();
+        impl_->publishView();
+        if (impl_->onServicesChanged)
+            impl_->onServicesChanged({});
+        return handover;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::restore(PublisherHandover const& handover, std::vector<int> const& descriptors)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        for (auto const& serviceHandover : handover.services)
+        {
+            auto adopt = [this, &serviceHandover, &descriptors]() -> std::shared_ptr<Service> {
+                auto service = makeService(serviceHandover.info, serviceHandover.serviceId);
+                if (!service->adopt(serviceHandover, descriptors))
+                    return nullptr;
+                if (!claimRoutes(service))
+                    return service->stop(), nullptr;
+                return service;
+            };
+            bool created = true;
+            auto service = impl_->serviceDirectory
+                ? impl_->serviceDirectory->obtain(serviceHandover.info.publicPort, adopt, created)
+                : adopt();
+            if (!service || !created)
+            {
+                spdlog::error(
+                    "Could not take over service for '{}' with public port '{}'.",
+                    impl_->identity,
+                    serviceHandover.info.publicPort);
+                continue;
+            }
+            impl_->services[serviceHandover.serviceId] = std::move(service);
+        }
+        impl_->publishView();
+        spdlog::info("Took over {} service(s) for '{}'.", handover.services.size(), impl_->identity);
+        // The publisher still has to reconnect its control line to this process. Without a grace period, restored
+        // services are kept until then.
+        if (impl_->controlSession.expired() && impl_->controlGracePeriod.count() > 0)
+            startGracePeriod();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::prebind(std::vector<ServiceInfo> const& services)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        // Replicas of a service find it bound by the first of them.
+        for (auto const& serviceInfo : services)
+        {
+            if (!startService(serviceInfo, nullptr))
+            {
+                spdlog::error(
+                    "Could not bind service for '{}' with public port '{}' ahead of time.",
+                    impl_->identity,
+                    serviceInfo.publicPort);
+            }
+        }
+        spdlog::info("Bound {} service(s) for '{}' ahead of time.", impl_->services.size(), impl_->identity);
+        if (impl_->controlSession.expired() && impl_->controlGracePeriod.count() > 0)
+            startGracePeriod();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::releaseHeldConnections()
+    {
+        std::vector<std::shared_ptr<Service>> services;
+        {
+            std::scoped_lock lock{impl_->serviceGuard};
+            for (auto const& [serviceId, service] : impl_->services)
+                services.push_back(service);
+        }
+        for (auto const& service : services)
+            service->releaseHeldConnections();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onServicesChanged(std::function<void(std::vector<ServiceInfo> const&)> handler)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        impl_->onServicesChanged = std::move(handler);
     }
     //---------------------------------------------------------------------------------------------------------------------
     void Publisher::addServices(std::vector<ServiceInfo> const& services)
     {
         std::scoped_lock lock{impl_->serviceGuard};
+        // Announced first, other cluster nodes stop listening on these ports for a previous owner.
+        if (impl_->onServicesChanged)
+            impl_->onServicesChanged(services);
+
+        // Only the difference to the services kept from the last control session is applied.
+        std::unordered_set<unsigned short> announced;
         for (auto const& serviceInfo : services)
-            addService(serviceInfo);
+            announced.insert(serviceInfo.publicPort);
+        std::vector<unsigned short> removed;
+        for (auto const& [serviceId, service] : impl_->services)
+        {
+            if (!announced.contains(service->info().publicPort))
+                removed.push_back(service->info().publicPort);
+        }
+        changeServices(services, removed);
     }
     //---------------------------------------------------------------------------------------------------------------------
-    Service* Publisher::getService(std::string const& id)
+    void Publisher::updateServices(std::vector<ServiceInfo> const& added, std::vector<unsigned short> const& removed)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        if (impl_->onServicesChanged)
+        {
+            std::map<unsigned short, ServiceInfo> resulting;
+            for (auto const& [serviceId, service] : impl_->services)
+                resulting[service->info().publicPort] = announcedInfo(*service);
+            for (auto publicPort : removed)
+                resulting.erase(publicPort);
+            for (auto const& serviceInfo : added)
+                resulting[serviceInfo.publicPort] = serviceInfo;
+
+            std::vector<ServiceInfo> services;
+            services.reserve(resulting.size());
+            for (auto const& [publicPort, serviceInfo] : resulting)
+                services.push_back(serviceInfo);
+            impl_->onServicesChanged(services);
+        }
+        changeServices(added, removed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string Publisher::identity() const
+    {
+        return impl_->identity;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string Publisher::account() const
+    {
+        return accountOf(impl_->identity);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> Publisher::getService(std::string const& id)
     {
         std::scoped_lock lock{impl_->serviceGuard};
         auto iter = impl_->services.find(id);
         if (iter == impl_->services.end())
             return nullptr;
         else
-            return &*iter->second;
+            return iter->second;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> Publisher::findServiceByPublicPort(unsigned short publicPort)
+    {
+        std::scoped_lock lock{impl_->serviceGuard};
+        for (auto const& [serviceId, service] : impl_->services)
+        {
+            if (service->info().publicPort == publicPort)
+                return service;
+        }
+        return nullptr;
     }
     //---------------------------------------------------------------------------------------------------------------------
     void Publisher::clearServices()
     {
+        std::scoped_lock lock{impl_->serviceGuard};
+        auto services = std::move(impl_->services);
         impl_->services.clear();
+        impl_->publishView();
+        for (auto const& [serviceId, service] : services)
+            leaveService(*service);
+        if (impl_->onServicesChanged)
+            impl_->onServicesChanged({});
     }
     // #####################################################################################################################
 }
\ No newline at end of file
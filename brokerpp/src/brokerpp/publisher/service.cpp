@@ -1,63 +1,215 @@
 
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <brokerpp/publisher/service.hpp>
+#include <brokerpp/publisher/http_proxy.hpp>
 #include <brokerpp/publisher/publisher.hpp>
 #include <brokerpp/publisher/tunnel_session.hpp>
+#include <brokerpp/control/control_session.hpp>
+#include <sharedpp/stream_compression.hpp>
 #include <sharedpp/uuid_generator.hpp>
 #include <spdlog/spdlog.h>
 
 #include <roar/utility/scope_exit.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <future>
 #include <mutex>
+#include <unordered_set>
+
+#include <unistd.h>
 
 namespace leaf = boost::leaf;
 
 namespace TunnelBore::Broker
 {
+    namespace
+    {
+        /**
+         * The compression the publisher asked for, if this build supports it. The publisher only compresses when
+         * the broker listed it in the handshake acceptance, so both sides come to the same result.
+         */
+        std::optional<StreamCompression> agreedCompression(ServiceInfo const& info)
+        {
+            if (!info.compression)
+                return std::nullopt;
+            const auto supported = supportedStreamCompressions();
+            if (std::find(supported.begin(), supported.end(), *info.compression) == supported.end())
+                return std::nullopt;
+            const auto compression = streamCompressionFromString(*info.compression);
+            if (!compression || *compression == StreamCompression::None)
+                return std::nullopt;
+            return compression;
+        }
+
+        /// Replicas without a measured setup latency count as this fast, so that they are tried early.
+        constexpr std::chrono::microseconds MinSetupLatency{1000};
+    }
+    // #####################################################################################################################
+    struct HeldConnection
+    {
+        boost::asio::ip::tcp::socket socket;
+        std::chrono::steady_clock::time_point until;
+        /// Read by a routing listener already.
+        std::string initialData;
+        /// Whether it may go to the HTTP proxy, see admitConnection.
+        bool proxy;
+    };
+
+    struct Replica
+    {
+        std::weak_ptr<Publisher> publisher;
+        /// As announced by this publisher, the hidden port may differ between replicas.
+        ServiceInfo info;
+        /// Tunnels offered to it that are not linked yet.
+        std::size_t outstanding;
+        /// Moving average of the time from offering a tunnel to linking it, 0 until the first one.
+        std::chrono::microseconds setupLatency;
+    };
+
+    struct PendingTunnel
+    {
+        std::weak_ptr<Publisher> replica;
+        std::chrono::steady_clock::time_point offeredAt;
+        /// Replicas the tunnel was offered to so far.
+        std::size_t attempts;
+    };
     // #####################################################################################################################
     struct Service::Implementation
     {
         boost::asio::ip::tcp::acceptor acceptor;
+        std::shared_ptr<IoEngine> engine;
         std::recursive_mutex acceptorStopGuard;
         std::unordered_map<std::string, std::shared_ptr<TunnelSession>> sessions;
+        /// Linked tunnels, client side id to publisher side id.
+        std::unordered_map<std::string, std::string> links;
         ServiceInfo info;
         boost::asio::ip::tcp::endpoint bindEndpoint;
-        std::weak_ptr<Publisher> publisher;
+        std::mutex replicaGuard;
+        /// The publisher that created the service first, then the ones that joined it.
+        std::vector<Replica> replicas;
+        std::unordered_map<std::string, PendingTunnel> pending;
         uuid_generator uuidGenerator;
         std::recursive_mutex sessionGuard;
         std::string serviceId;
+        std::shared_ptr<TunnelSetupStats> setupStats;
+        std::shared_ptr<TunnelRegistry> tunnelRegistry;
+        std::optional<StreamCompression> compression;
+        std::shared_ptr<CompressionStats> towardsPublisher;
+        std::shared_ptr<CompressionStats> fromPublisher;
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls;
+        std::chrono::seconds holdTimeout;
+        std::mutex heldGuard;
+        std::deque<HeldConnection> held;
+        boost::asio::steady_timer holdTimer;
+        std::shared_ptr<HttpProxy> httpProxy;
+        /// Tunnels asked for by the HTTP proxy that did not connect yet.
+        std::unordered_set<std::string> upstreams;
 
         Implementation(
             boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
             ServiceInfo const& info,
             boost::asio::ip::tcp::endpoint bindEndpoint,
             std::weak_ptr<Publisher> publisher,
-            std::string serviceId)
+            std::string serviceId,
+            std::shared_ptr<TunnelSetupStats> setupStats,
+            std::shared_ptr<TunnelRegistry> tunnelRegistry,
+            std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+            std::chrono::seconds holdTimeout)
             : acceptor{std::move(executor)}
+            , engine{std::move(engine)}
             , acceptorStopGuard{}
             , sessions{}
+            , links{}
             , info{info}
             , bindEndpoint{bindEndpoint}
-            , publisher{std::move(publisher)}
+            , replicaGuard{}
+            , replicas{Replica{
+                  .publisher = std::move(publisher),
+                  .info = info,
+                  .outstanding = 0,
+                  .setupLatency = std::chrono::microseconds{0},
+              }}
+            , pending{}
             , uuidGenerator{}
             , sessionGuard{}
             , serviceId{std::move(serviceId)}
+            , setupStats{std::move(setupStats)}
+            , tunnelRegistry{std::move(tunnelRegistry)}
+            , compression{agreedCompression(info)}
+            , towardsPublisher{std::make_shared<CompressionStats>()}
+            , fromPublisher{std::make_shared<CompressionStats>()}
+            , dataLinkTls{std::move(dataLinkTls)}
+            , holdTimeout{holdTimeout}
+            , heldGuard{}
+            , held{}
+            , holdTimer{acceptor.get_executor()}
+            , httpProxy{}
+            , upstreams{}
         {}
+
+        /// Call with replicaGuard held.
+        Replica* findReplica(Publisher const& publisher)
+        {
+            for (auto& replica : replicas)
+            {
+                if (replica.publisher.lock().get() == &publisher)
+                    return &replica;
+            }
+            return nullptr;
+        }
+
+        /**
+         * @param replica Only takes the tunnel if it was offered to this replica, any replica if null.
+         */
+        std::optional<PendingTunnel> takePendingTunnel(std::string const& tunnelId, Publisher const* replica)
+        {
+            std::scoped_lock lock{replicaGuard};
+            auto entry = pending.find(tunnelId);
+            if (entry == pending.end())
+                return std::nullopt;
+            auto publisher = entry->second.replica.lock();
+            if (replica != nullptr && publisher.get() != replica)
+                return std::nullopt;
+
+            if (publisher)
+            {
+                if (auto* offeredTo = findReplica(*publisher); offeredTo != nullptr)
+                    --offeredTo->outstanding;
+            }
+            auto result = std::move(entry->second);
+            pending.erase(entry);
+            return result;
+        }
     };
     // #####################################################################################################################
     Service::Service(
         boost::asio::any_io_executor executor,
+        std::shared_ptr<IoEngine> engine,
         ServiceInfo const& info,
         boost::asio::ip::basic_endpoint<boost::asio::ip::tcp> const& bindEndpoint,
         std::weak_ptr<Publisher> publisher,
-        std::string serviceId)
+        std::string serviceId,
+        std::shared_ptr<TunnelSetupStats> setupStats,
+        std::shared_ptr<TunnelRegistry> tunnelRegistry,
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls,
+        std::chrono::seconds holdTimeout)
         : impl_{std::make_unique<Implementation>(
               std::move(executor),
+              std::move(engine),
               info,
               bindEndpoint,
               std::move(publisher),
-              std::move(serviceId))}
+              std::move(serviceId),
+              std::move(setupStats),
+              std::move(tunnelRegistry),
+              std::move(dataLinkTls),
+              holdTimeout)}
     {}
     //---------------------------------------------------------------------------------------------------------------------
     Service::~Service()
@@ -76,8 +228,26 @@ namespace TunnelBore::Broker
         return impl_->serviceId;
     }
     //---------------------------------------------------------------------------------------------------------------------
-    void Service::connectTunnels(std::string const& idForClientTunnel, std::string const& idForPublisherTunnel)
+    json Service::compressionStats() const
+    {
+        if (!impl_->compression)
+            return nullptr;
+        return json{
+            {"compression", toString(*impl_->compression)},
+            {"level", impl_->info.compressionLevel},
+            {"towardsPublisher", impl_->towardsPublisher->toJson()},
+            {"fromPublisher", impl_->fromPublisher->toJson()},
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::connectTunnels(
+        std::string const& idForClientTunnel,
+        std::string const& idForPublisherTunnel,
+        std::string const& publisherIdentity)
     {
+        if (connectUpstream(idForClientTunnel, idForPublisherTunnel, publisherIdentity))
+            return;
+
         std::scoped_lock lock{impl_->sessionGuard};
         auto clientTunnel = impl_->sessions.find(idForClientTunnel);
         auto publisherTunnel = impl_->sessions.find(idForPublisherTunnel);
@@ -95,8 +265,95 @@ namespace TunnelBore::Broker
             return;
         }
 
+        // Only the replica the tunnel was offered to may link it.
+        const auto replicaName = takeOffer(idForClientTunnel, publisherIdentity);
+        if (replicaName.empty())
+        {
+            spdlog::warn(
+                "Tunnel '{}' was not offered to '{}', closing its publisher side.",
+                idForClientTunnel,
+                publisherIdentity);
+            closeTunnelSide(idForPublisherTunnel);
+            return;
+        }
+
         spdlog::info("Linking tunnels '{}' and '{}'.", idForClientTunnel, idForPublisherTunnel);
+        const auto trace = clientTunnel->second->trace();
+        if (trace)
+            trace->mark(TunnelStage::PublisherArrived);
+
+        publisherTunnel->second->moveToExecutor(clientTunnel->second->socket().get_executor());
+        if (impl_->compression)
+        {
+            clientTunnel->second->setReadTransform(compressingTransform(
+                *impl_->compression, impl_->info.compressionLevel, impl_->towardsPublisher));
+            publisherTunnel->second->setReadTransform(
+                decompressingTransform(*impl_->compression, impl_->fromPublisher));
+        }
+        impl_->links[idForClientTunnel] = idForPublisherTunnel;
         clientTunnel->second->link(*publisherTunnel->second);
+        registerTunnel(*clientTunnel->second, *publisherTunnel->second, replicaName);
+
+        if (trace)
+        {
+            trace->mark(TunnelStage::Linked);
+            if (impl_->setupStats)
+                impl_->setupStats->record(*trace);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string Service::takeOffer(std::string const& tunnelId, std::string const& publisherIdentity)
+    {
+        std::scoped_lock lock{impl_->replicaGuard};
+        auto pending = impl_->pending.find(tunnelId);
+        auto replica = pending == impl_->pending.end() ? nullptr : pending->second.replica.lock();
+        auto controlSession = replica ? replica->getCurrentControlSession().lock() : nullptr;
+        if (!controlSession || controlSession->identity() != publisherIdentity)
+            return {};
+
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - pending->second.offeredAt);
+        if (auto* entry = impl_->findReplica(*replica); entry != nullptr)
+        {
+            --entry->outstanding;
+            entry->setupLatency = entry->setupLatency.count() == 0 ? latency : (entry->setupLatency * 7 + latency) / 8;
+        }
+        impl_->pending.erase(pending);
+        return replica->identity();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::connectUpstream(
+        std::string const& tunnelId,
+        std::string const& idForPublisherTunnel,
+        std::string const& publisherIdentity)
+    {
+        std::shared_ptr<TunnelSession> upstream;
+        {
+            std::scoped_lock lock{impl_->sessionGuard};
+            if (impl_->upstreams.erase(tunnelId) == 0)
+                return false;
+
+            auto publisherTunnel = impl_->sessions.find(idForPublisherTunnel);
+            if (publisherTunnel != std::end(impl_->sessions) && !takeOffer(tunnelId, publisherIdentity).empty())
+                upstream = publisherTunnel->second;
+            else
+            {
+                spdlog::warn("Tunnel '{}' for the HTTP proxy was not offered to '{}'.", tunnelId, publisherIdentity);
+                dropPendingTunnel(tunnelId);
+                closeTunnelSide(idForPublisherTunnel);
+            }
+        }
+        if (!upstream)
+        {
+            impl_->httpProxy->upstreamFailed(tunnelId);
+            return true;
+        }
+
+        spdlog::info("[Service '{}']: Tunnel '{}' joins the HTTP proxy pool.", impl_->serviceId, tunnelId);
+        // Idle in the pool for longer than the inactivity timeout, the proxy closes it when it is not needed anymore.
+        upstream->cancelTimer();
+        impl_->httpProxy->upstreamConnected(tunnelId, std::move(upstream));
+        return true;
     }
     //---------------------------------------------------------------------------------------------------------------------
     Service::Service(Service&&) = default;
@@ -132,6 +389,13 @@ namespace TunnelBore::Broker
     {
         std::scoped_lock lock{impl_->sessionGuard};
         spdlog::info("[Service '{}']: Closing tunnel side '{}'.", impl_->serviceId, id);
+        // Asked for by the HTTP proxy, there is no client side.
+        if (impl_->upstreams.erase(id) > 0)
+        {
+            dropPendingTunnel(id);
+            impl_->httpProxy->upstreamFailed(id);
+            return;
+        }
         auto tunnelSide = impl_->sessions.find(id);
         if (tunnelSide == std::end(impl_->sessions))
         {
@@ -141,6 +405,33 @@ namespace TunnelBore::Broker
         if (!wasPreclosed)
             tunnelSide->second->close();
         impl_->sessions.erase(tunnelSide);
+        dropPendingTunnel(id);
+        std::erase_if(impl_->links, [this, &id](auto const& link) {
+            if (link.first != id && link.second != id)
+                return false;
+            if (impl_->tunnelRegistry)
+                impl_->tunnelRegistry->remove(link.first);
+            return true;
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::registerTunnel(
+        TunnelSession& client,
+        TunnelSession const& publisher,
+        std::string const& publisherIdentity)
+    {
+        if (!impl_->tunnelRegistry)
+            return;
+
+        client.registerIn(impl_->tunnelRegistry, TunnelEntry{
+            .tunnelId = client.id(),
+            .publisherIdentity = publisherIdentity,
+            .serviceId = impl_->serviceId,
+            .remoteAddress = client.remoteAddress(),
+            .linkedAt = std::chrono::steady_clock::now(),
+            .fromClient = client.traffic(),
+            .fromPublisher = publisher.traffic(),
+        });
     }
     //---------------------------------------------------------------------------------------------------------------------
     void Service::acceptOnce()
@@ -152,8 +443,9 @@ namespace TunnelBore::Broker
             return;
         }
 
+        // The acceptor lives on the control pool, accepted connections are spread over the shards.
         std::shared_ptr<boost::asio::ip::tcp::socket> socket =
-            std::make_shared<boost::asio::ip::tcp::socket>(impl_->acceptor.get_executor());
+            std::make_shared<boost::asio::ip::tcp::socket>(impl_->engine->nextExecutor());
         spdlog::info("[Service '{}']: Accepting connection.", impl_->serviceId);
         impl_->acceptor.async_accept(*socket, [weak = weak_from_this(), socket](boost::system::error_code ec) mutable {
             if (ec == boost::asio::error::operation_aborted)
@@ -191,48 +483,609 @@ namespace TunnelBore::Broker
                 if (!self->impl_->acceptor.is_open())
                     return;
 
-                auto publisher = self->impl_->publisher.lock();
-                if (!publisher)
+                if (!socket->is_open())
                 {
                     spdlog::warn(
-                        "[Service '{}']: Publisher is gone, cannot accept new connections.", self->impl_->serviceId);
-                    return;
+                        "[Service '{}']: Socket is not open, but acceptor did not return an error.",
+                        self->impl_->serviceId);
+                    return self->acceptOnce();
                 }
 
-                // cannot accept tunnels, if we cannot communicate with the publisher.
-                auto controlSession = publisher->getCurrentControlSession().lock();
-                if (!controlSession)
-                {
-                    spdlog::warn(
-                        "[Service '{}']: Control session is gone, cannot accept new connections.",
-                        self->impl_->serviceId);
+                if (!self->acceptConnection(std::move(*socket)))
                     return;
+            }
+            self->acceptOnce();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::acceptConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData)
+    {
+        return admitConnection(std::move(socket), std::move(initialData), true);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::tunnelConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData)
+    {
+        return admitConnection(std::move(socket), std::move(initialData), false);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::admitConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData, bool proxy)
+    {
+        // Any control session will do for now, the replica serving the tunnel is picked once it is known to be a
+        // client, see offerTunnel.
+        bool anyPublisher = false;
+        std::shared_ptr<ControlSession> controlSession;
+        {
+            std::scoped_lock lock{impl_->replicaGuard};
+            for (auto const& replica : impl_->replicas)
+            {
+                auto publisher = replica.publisher.lock();
+                if (!publisher)
+                    continue;
+                anyPublisher = true;
+                if (controlSession = publisher->getCurrentControlSession().lock(); controlSession)
+                    break;
+            }
+        }
+        if (!anyPublisher)
+        {
+            spdlog::warn("[Service '{}']: Publisher is gone, cannot accept new connections.", impl_->serviceId);
+            return false;
+        }
+
+        // cannot accept tunnels, if we cannot communicate with the publisher. Keeps accepting for when it is back.
+        if (!controlSession)
+        {
+            holdConnection(std::move(socket), std::move(initialData), proxy);
+            return true;
+        }
+
+        // Only routed clients have sent anything yet, they are the HTTP ones.
+        if (proxy && impl_->httpProxy && !initialData.empty())
+        {
+            impl_->httpProxy->serve(std::move(socket), std::move(initialData));
+            return true;
+        }
+
+        boost::system::error_code ec;
+        const auto tunnelId = impl_->uuidGenerator.generate_id();
+        spdlog::info(
+            "[Service '{}']: New connection accepted '{}' with tunnelId '{}'.",
+            impl_->serviceId,
+            socket.remote_endpoint(ec).address().to_string(),
+            tunnelId);
+
+        std::scoped_lock sessionLock{impl_->sessionGuard};
+        auto tunnelSide = std::make_shared<TunnelSession>(std::move(socket), tunnelId, controlSession, weak_from_this());
+        // Whether this is a client or the publisher is only known after the first read, see TunnelSession::peek.
+        tunnelSide->setTrace(std::make_shared<TunnelTrace>(tunnelId, TunnelStage::Accepted));
+        if (initialData.empty())
+        {
+            if (impl_->dataLinkTls)
+                tunnelSide->acceptDataLinkTls(impl_->dataLinkTls);
+            impl_->sessions[tunnelId] = tunnelSide;
+            tunnelSide->peek();
+            return true;
+        }
+
+        // Only clients are routed, what they sent so far is written to the publisher side as is once linked.
+        tunnelSide->setPendingData(std::move(initialData));
+        tunnelSide->trace()->mark(TunnelStage::ClientRead);
+        tunnelSide->resetTimer();
+        impl_->sessions[tunnelId] = tunnelSide;
+        if (!offerTunnel(tunnelId))
+        {
+            spdlog::warn(
+                "[Service '{}']: No publisher is reachable for routed tunnel '{}'.", impl_->serviceId, tunnelId);
+            tunnelSide->close();
+            return true;
+        }
+        tunnelSide->trace()->mark(TunnelStage::PublisherInformed);
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::holdConnection(boost::asio::ip::tcp::socket&& socket, std::string initialData, bool proxy)
+    {
+        std::scoped_lock lock{impl_->heldGuard};
+        if (impl_->holdTimeout.count() <= 0 || impl_->held.size() >= MaxHeldConnections)
+        {
+            spdlog::warn("[Service '{}']: Control session is gone, refusing connection.", impl_->serviceId);
+            boost::system::error_code ec;
+            socket.close(ec);
+            return;
+        }
+
+        spdlog::info("[Service '{}']: Control session is gone, holding connection.", impl_->serviceId);
+        impl_->held.push_back(HeldConnection{
+            .socket = std::move(socket),
+            .until = std::chrono::steady_clock::now() + impl_->holdTimeout,
+            .initialData = std::move(initialData),
+            .proxy = proxy,
+        });
+        if (impl_->held.size() == 1)
+            expireHeldConnections();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::expireHeldConnections()
+    {
+        // Held in arrival order, so the front always expires first.
+        const auto now = std::chrono::steady_clock::now();
+        while (!impl_->held.empty() && impl_->held.front().until <= now)
+        {
+            boost::system::error_code ec;
+            impl_->held.front().socket.close(ec);
+            impl_->held.pop_front();
+            spdlog::info(
+                "[Service '{}']: Publisher did not come back in time, closed held connection.", impl_->serviceId);
+        }
+        if (impl_->held.empty())
+            return;
+
+        impl_->holdTimer.expires_at(impl_->held.front().until);
+        impl_->holdTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+            std::scoped_lock lock{self->impl_->heldGuard};
+            self->expireHeldConnections();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::addReplica(std::weak_ptr<Publisher> publisher, ServiceInfo const& info)
+    {
+        std::scoped_lock lock{impl_->replicaGuard};
+        if (auto shared = publisher.lock(); shared)
+        {
+            if (auto* replica = impl_->findReplica(*shared); replica != nullptr)
+            {
+                replica->info = info;
+                return;
+            }
+        }
+        impl_->replicas.push_back(Replica{
+            .publisher = std::move(publisher),
+            .info = info,
+            .outstanding = 0,
+            .setupLatency = std::chrono::microseconds{0},
+        });
+        spdlog::info("[Service '{}']: Served by {} replicas now.", impl_->serviceId, impl_->replicas.size());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::size_t Service::removeReplica(Publisher const& publisher)
+    {
+        std::size_t remaining = 0;
+        {
+            std::scoped_lock lock{impl_->replicaGuard};
+            std::erase_if(impl_->replicas, [&publisher](auto const& replica) {
+                auto shared = replica.publisher.lock();
+                return !shared || shared.get() == &publisher;
+            });
+            remaining = impl_->replicas.size();
+        }
+        if (remaining > 0)
+            replicaDetached(publisher);
+        return remaining;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<ServiceInfo> Service::replicaInfo(Publisher const& publisher)
+    {
+        std::scoped_lock lock{impl_->replicaGuard};
+        if (auto* replica = impl_->findReplica(publisher); replica != nullptr)
+            return replica->info;
+        return std::nullopt;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::vector<std::string> Service::replicaIdentities()
+    {
+        std::scoped_lock lock{impl_->replicaGuard};
+        std::vector<std::string> identities;
+        for (auto const& replica : impl_->replicas)
+        {
+            if (auto publisher = replica.publisher.lock(); publisher)
+                identities.push_back(publisher->identity());
+        }
+        return identities;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::isPrimary(Publisher const& publisher)
+    {
+        std::scoped_lock lock{impl_->replicaGuard};
+        return !impl_->replicas.empty() && impl_->replicas.front().publisher.lock().get() == &publisher;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::offerTunnel(std::string const& tunnelId)
+    {
+        return offerTunnel(tunnelId, nullptr, 0);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::offerTunnel(std::string const& tunnelId, Publisher const* except, std::size_t attempts)
+    {
+        std::shared_ptr<ControlSession> controlSession;
+        ServiceInfo info;
+        {
+            std::scoped_lock lock{impl_->replicaGuard};
+            if (attempts >= impl_->replicas.size())
+                return false;
+
+            Replica* best = nullptr;
+            double bestScore = 0.;
+            for (auto& replica : impl_->replicas)
+            {
+                auto publisher = replica.publisher.lock();
+                if (!publisher || publisher.get() == except)
+                    continue;
+                auto session = publisher->getCurrentControlSession().lock();
+                if (!session)
+                    continue;
+
+                const auto score = static_cast<double>(replica.outstanding + 1) *
+                    static_cast<double>(std::max(replica.setupLatency, MinSetupLatency).count());
+                if (best == nullptr || score < bestScore)
+                {
+                    best = &replica;
+                    bestScore = score;
+                    controlSession = std::move(session);
                 }
+            }
+            if (best == nullptr)
+                return false;
 
-                if (!socket->is_open())
+            ++best->outstanding;
+            impl_->pending[tunnelId] = PendingTunnel{
+                .replica = best->publisher,
+                .offeredAt = std::chrono::steady_clock::now(),
+                .attempts = attempts + 1,
+            };
+            info = best->info;
+        }
+        controlSession->informAboutConnection(impl_->serviceId, info, boundPort(), tunnelId);
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::dropPendingTunnel(std::string const& tunnelId)
+    {
+        impl_->takePendingTunnel(tunnelId, nullptr);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::tunnelFailed(std::string const& tunnelId, Publisher const& publisher)
+    {
+        // A late answer for a tunnel that was offered to another replica in the meantime.
+        auto pending = impl_->takePendingTunnel(tunnelId, &publisher);
+        if (!pending)
+            return;
+        if (offerTunnel(tunnelId, &publisher, pending->attempts))
+        {
+            spdlog::info("[Service '{}']: Offered tunnel '{}' to another replica.", impl_->serviceId, tunnelId);
+            return;
+        }
+        closeTunnelSide(tunnelId);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::replicaDetached(Publisher const& publisher)
+    {
+        std::vector<std::string> orphaned;
+        {
+            std::scoped_lock lock{impl_->replicaGuard};
+            // Without another replica, the tunnels wait for the publisher, it may still connect them once it is back.
+            const bool othersReachable =
+                std::any_of(impl_->replicas.begin(), impl_->replicas.end(), [&publisher](auto const& replica) {
+                    auto other = replica.publisher.lock();
+                    return other && other.get() != &publisher && !other->getCurrentControlSession().expired();
+                });
+            if (!othersReachable)
+                return;
+            for (auto const& [tunnelId, pending] : impl_->pending)
+            {
+                auto replica = pending.replica.lock();
+                if (!replica || replica.get() == &publisher)
+                    orphaned.push_back(tunnelId);
+            }
+        }
+        for (auto const& tunnelId : orphaned)
+        {
+            if (!impl_->takePendingTunnel(tunnelId, nullptr))
+                continue;
+            if (!offerTunnel(tunnelId, &publisher, 0))
+                closeTunnelSide(tunnelId);
+        }
+        if (!orphaned.empty())
+        {
+            spdlog::info(
+                "[Service '{}']: Moved {} tunnel(s) of a lost replica to the others.",
+                impl_->serviceId,
+                orphaned.size());
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::proxyHttp(HttpProxyConfig const& config)
+    {
+        if (impl_->compression)
+        {
+            spdlog::warn("[Service '{}']: Compressed services are not proxied, tunneling HTTP.", impl_->serviceId);
+            return;
+        }
+        impl_->httpProxy = std::make_shared<HttpProxy>(impl_->acceptor.get_executor(), weak_from_this(), config);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Service::openUpstream(std::string const& tunnelId)
+    {
+        std::scoped_lock lock{impl_->sessionGuard};
+        if (!impl_->httpProxy || !offerTunnel(tunnelId))
+            return false;
+        impl_->upstreams.insert(tunnelId);
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::cancelUpstream(std::string const& tunnelId)
+    {
+        std::scoped_lock lock{impl_->sessionGuard};
+        if (impl_->upstreams.erase(tunnelId) > 0)
+            dropPendingTunnel(tunnelId);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Service::releaseHeldConnections()
+    {
+        std::deque<HeldConnection> held;
+        {
+            std::scoped_lock lock{impl_->heldGuard};
+            impl_->holdTimer.cancel();
+            held.swap(impl_->held);
+        }
+        if (held.empty())
+            return;
+
+        spdlog::info(
+            "[Service '{}']: Publisher is back, letting {} held connection(s) in.", impl_->serviceId, held.size());
+        for (auto& connection : held)
+            admitConnection(std::move(connection.socket), std::move(connection.initialData), connection.proxy);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    unsigned short Service::boundPort() const
+    {
+        // Services reached through a routing listener bind any free port, only their publisher connects to it.
+        if (impl_->bindEndpoint.port() == 0)
+        {
+            boost::system::error_code ec;
+            return impl_->acceptor.local_endpoint(ec).port();
+        }
+        return impl_->bindEndpoint.port();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<ServiceHandover> Service::prepareHandover(std::vector<int>& descriptors)
+    {
+        ServiceHandover handover{
+            .serviceId = impl_->serviceId,
+            .info = impl_->info,
+            .listenerSocket = descriptors.size(),
+            .tunnels = {},
+        };
+        {
+            std::scoped_lock lock{impl_->acceptorStopGuard};
+            boost::system::error_code ec;
+            const auto listener = impl_->acceptor.release(ec);
+            if (ec)
+            {
+                spdlog::error("[Service '{}']: Could not release listener: {}", impl_->serviceId, ec.message());
+                return std::nullopt;
+            }
+            descriptors.push_back(listener);
+        }
+
+        struct SuspendedPair
+        {
+            int clientSocket;
+            int publisherSocket;
+            std::string clientToPublisher;
+            std::string publisherToClient;
+            /// One of the sides reached its end or failed, there is nothing left to hand over.
+            bool ended;
+        };
+        struct PendingPair
+        {
+            std::string clientTunnelId;
+            std::string publisherTunnelId;
+            std::future<SuspendedPair> suspended;
+            /// Set by whoever comes first, the shard releasing the sockets or the timeout giving up on the pair.
+            std::shared_ptr<std::atomic_flag> claimed;
+        };
+        std::vector<PendingPair> pending;
+        std::vector<std::string> unlinked;
+        {
+            std::scoped_lock lock{impl_->sessionGuard};
+            for (auto const& [clientId, publisherId] : impl_->links)
+            {
+                auto client = impl_->sessions.find(clientId);
+                auto publisher = impl_->sessions.find(publisherId);
+                if (client == impl_->sessions.end() || publisher == impl_->sessions.end())
+                    continue;
+                if (!client->second->isPiping() || !publisher->second->isPiping())
+                    continue;
+                // The state of the codecs and of TLS in userspace cannot be handed over. Kernel TLS stays
+                // with the socket.
+                if (impl_->compression || publisher->second->userspaceTls())
                 {
-                    spdlog::warn(
-                        "[Service '{}']: Socket is not open, but acceptor did not return an error.",
-                        self->impl_->serviceId);
-                    return self->acceptOnce();
+                    unlinked.push_back(clientId);
+                    unlinked.push_back(publisherId);
+                    continue;
                 }
 
-                const auto tunnelId = self->impl_->uuidGenerator.generate_id();
-                spdlog::info(
-                    "[Service '{}']: New connection accepted '{}' with tunnelId '{}'.",
-                    self->impl_->serviceId,
-                    socket->remote_endpoint(ec).address().to_string(),
-                    tunnelId);
+                auto promise = std::make_shared<std::promise<SuspendedPair>>();
+                auto claimed = std::make_shared<std::atomic_flag>();
+                pending.push_back({clientId, publisherId, promise->get_future(), claimed});
+
+                // Both sides run on the same shard, everything below happens on its thread.
+                boost::asio::post(
+                    client->second->socket().get_executor(),
+                    [client = client->second, publisher = publisher->second, promise, claimed]() {
+                        auto pair = std::make_shared<SuspendedPair>(SuspendedPair{-1, -1, {}, {}, false});
+                        auto remaining = std::make_shared<int>(2);
+                        auto onSuspended = [client, publisher, promise, claimed, pair, remaining]() {
+                            if (--*remaining != 0)
+                                return;
+                            // Timed out, the sessions are closed by prepareHandover.
+                            if (claimed->test_and_set())
+                                return;
+                            if (!pair->ended)
+                            {
+                                pair->clientSocket = client->releaseSocket();
+                                pair->publisherSocket = publisher->releaseSocket();
+                            }
+                            promise->set_value(std::move(*pair));
+                        };
+                        client->suspend([pair, onSuspended](std::string unsent, bool ended) {
+                            pair->clientToPublisher = std::move(unsent);
+                            pair->ended = pair->ended || ended;
+                            onSuspended();
+                        });
+                        publisher->suspend([pair, onSuspended](std::string unsent, bool ended) {
+                            pair->publisherToClient = std::move(unsent);
+                            pair->ended = pair->ended || ended;
+                            onSuspended();
+                        });
+
+                        boost::system::error_code ignore;
+                        client->socket().cancel(ignore);
+                        publisher->socket().cancel(ignore);
+                    });
+            }
+            for (auto const& [id, session] : impl_->sessions)
+            {
+                if (!impl_->links.contains(id) &&
+                    std::none_of(impl_->links.begin(), impl_->links.end(), [&id](auto const& link) {
+                        return link.second == id;
+                    }))
                 {
-                    std::scoped_lock sessionLock{self->impl_->sessionGuard};
-                    auto tunnelSide = std::make_shared<TunnelSession>(
-                        std::move(*socket), tunnelId, controlSession, self->weak_from_this());
-                    self->impl_->sessions[tunnelId] = std::move(tunnelSide);
-                    self->impl_->sessions[tunnelId]->peek();
+                    unlinked.push_back(id);
                 }
             }
-            self->acceptOnce();
-        });
+        }
+
+        // All pairs suspend at once, so they share the deadline.
+        const auto deadline = std::chrono::steady_clock::now() + HandoverSuspendTimeout;
+        std::vector<std::string> dropped;
+        for (auto& pair : pending)
+        {
+            if (pair.suspended.wait_until(deadline) != std::future_status::ready && !pair.claimed->test_and_set())
+            {
+                spdlog::error(
+                    "[Service '{}']: Tunnel '{}' did not suspend in time, it is not handed over.",
+                    impl_->serviceId,
+                    pair.clientTunnelId);
+                dropped.push_back(pair.clientTunnelId);
+                dropped.push_back(pair.publisherTunnelId);
+                continue;
+            }
+
+            auto suspended = pair.suspended.get();
+            if (suspended.clientSocket < 0 || suspended.publisherSocket < 0)
+            {
+                if (suspended.clientSocket >= 0)
+                    ::close(suspended.clientSocket);
+                if (suspended.publisherSocket >= 0)
+                    ::close(suspended.publisherSocket);
+                dropped.push_back(pair.clientTunnelId);
+                dropped.push_back(pair.publisherTunnelId);
+                continue;
+            }
+
+            handover.tunnels.push_back(TunnelPairHandover{
+                .clientTunnelId = pair.clientTunnelId,
+                .publisherTunnelId = pair.publisherTunnelId,
+                .clientSocket = descriptors.size(),
+                .publisherSocket = descriptors.size() + 1,
+                .clientToPublisher = std::move(suspended.clientToPublisher),
+                .publisherToClient = std::move(suspended.publisherToClient),
+            });
+            descriptors.push_back(suspended.clientSocket);
+            descriptors.push_back(suspended.publisherSocket);
+        }
+
+        // Released sessions are closed already, only their entries are left.
+        for (auto const& tunnel : handover.tunnels)
+        {
+            closeTunnelSide(tunnel.clientTunnelId, true);
+            closeTunnelSide(tunnel.publisherTunnelId, true);
+        }
+        for (auto const& id : unlinked)
+            closeTunnelSide(id);
+        for (auto const& id : dropped)
+            closeTunnelSide(id);
+
+        spdlog::info(
+            "[Service '{}']: Prepared handover with {} tunnel(s), closed {} unlinked and {} dropped tunnel side(s).",
+            impl_->serviceId,
+            handover.tunnels.size(),
+            unlinked.size(),
+            dropped.size());
+        return handover;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::leaf::result<void> Service::adopt(ServiceHandover const& handover, std::vector<int> const& descriptors)
+    {
+        const auto protocol = impl_->bindEndpoint.protocol();
+        boost::system::error_code ec;
+        {
+            std::scoped_lock lock{impl_->acceptorStopGuard};
+            impl_->acceptor.assign(protocol, descriptors[handover.listenerSocket], ec);
+        }
+        if (ec)
+        {
+            ::close(descriptors[handover.listenerSocket]);
+            for (auto const& tunnel : handover.tunnels)
+            {
+                ::close(descriptors[tunnel.clientSocket]);
+                ::close(descriptors[tunnel.publisherSocket]);
+            }
+            return leaf::new_error("Could not adopt listener.", ec);
+        }
+        acceptOnce();
+
+        // Handed over services are only ever served by the publisher that created them.
+        std::string handoverIdentity;
+        {
+            std::scoped_lock lock{impl_->replicaGuard};
+            auto publisher = impl_->replicas.empty() ? nullptr : impl_->replicas.front().publisher.lock();
+            if (publisher)
+                handoverIdentity = publisher->identity();
+        }
+        for (auto const& tunnel : handover.tunnels)
+        {
+            const auto executor = impl_->engine->nextExecutor();
+            boost::asio::ip::tcp::socket clientSocket{executor};
+            boost::asio::ip::tcp::socket publisherSocket{executor};
+            clientSocket.assign(protocol, descriptors[tunnel.clientSocket], ec);
+            if (ec)
+                ::close(descriptors[tunnel.clientSocket]);
+            boost::system::error_code publisherEc;
+            publisherSocket.assign(protocol, descriptors[tunnel.publisherSocket], publisherEc);
+            if (publisherEc)
+                ::close(descriptors[tunnel.publisherSocket]);
+            if (ec || publisherEc)
+            {
+                spdlog::error("[Service '{}']: Could not adopt tunnel '{}'.", impl_->serviceId, tunnel.clientTunnelId);
+                continue;
+            }
+
+            auto client = std::make_shared<TunnelSession>(
+                std::move(clientSocket), tunnel.clientTunnelId, std::weak_ptr<ControlSession>{}, weak_from_this());
+            auto publisher = std::make_shared<TunnelSession>(
+                std::move(publisherSocket),
+                tunnel.publisherTunnelId,
+                std::weak_ptr<ControlSession>{},
+                weak_from_this());
+            client->setPendingData(tunnel.clientToPublisher);
+            publisher->setPendingData(tunnel.publisherToClient);
+
+            std::scoped_lock lock{impl_->sessionGuard};
+            impl_->sessions[tunnel.clientTunnelId] = client;
+            impl_->sessions[tunnel.publisherTunnelId] = publisher;
+            impl_->links[tunnel.clientTunnelId] = tunnel.publisherTunnelId;
+            client->link(*publisher);
+            registerTunnel(*client, *publisher, handoverIdentity);
+        }
+        spdlog::info("[Service '{}']: Adopted {} tunnel(s).", impl_->serviceId, handover.tunnels.size());
+        return {};
     }
     //---------------------------------------------------------------------------------------------------------------------
     void Service::stop()
@@ -240,6 +1093,8 @@ namespace TunnelBore::Broker
         std::scoped_lock lock{impl_->acceptorStopGuard};
         spdlog::info("Stopping service '{}' acceptor.", impl_->serviceId);
         impl_->acceptor.close();
+        if (impl_->httpProxy)
+            impl_->httpProxy->stop();
     }
     // #####################################################################################################################
 }
\ No newline at end of file
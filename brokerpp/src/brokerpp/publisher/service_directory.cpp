@@ -0,0 +1,74 @@
+#include <brokerpp/publisher/service_directory.hpp>
+#include <brokerpp/publisher/service.hpp>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    ServiceDirectory::ServiceDirectory(bool httpRouting, bool tlsRouting, HttpProxyConfig httpProxy)
+        : guard_{}
+        , services_{}
+        , httpRouting_{httpRouting}
+        , httpRoutes_{}
+        , tlsRouting_{tlsRouting}
+        , tlsRoutes_{}
+        , httpProxy_{std::move(httpProxy)}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> ServiceDirectory::obtain(
+        unsigned short publicPort,
+        std::function<std::shared_ptr<Service>()> const& make,
+        bool& created)
+    {
+        std::scoped_lock lock{guard_};
+        created = false;
+        if (auto iter = services_.find(publicPort); iter != services_.end())
+        {
+            if (auto service = iter->second.lock(); service)
+                return service;
+        }
+
+        auto service = make();
+        if (!service)
+            return nullptr;
+        created = true;
+        services_[publicPort] = service;
+        return service;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void ServiceDirectory::remove(unsigned short publicPort, Service const& service)
+    {
+        std::scoped_lock lock{guard_};
+        auto iter = services_.find(publicPort);
+        if (iter == services_.end())
+            return;
+        auto current = iter->second.lock();
+        if (!current || current.get() == &service)
+            services_.erase(iter);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool ServiceDirectory::httpRouting() const
+    {
+        return httpRouting_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    RouteTable& ServiceDirectory::httpRoutes()
+    {
+        return httpRoutes_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool ServiceDirectory::tlsRouting() const
+    {
+        return tlsRouting_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    RouteTable& ServiceDirectory::tlsRoutes()
+    {
+        return tlsRoutes_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    HttpProxyConfig const& ServiceDirectory::httpProxy() const
+    {
+        return httpProxy_;
+    }
+    // #####################################################################################################################
+}
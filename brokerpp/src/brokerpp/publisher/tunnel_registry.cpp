@@ -0,0 +1,119 @@
+#include <brokerpp/publisher/tunnel_registry.hpp>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    TunnelTraffic::TunnelTraffic()
+        : bytesReceived_{0}
+        , lastReceived_{std::chrono::steady_clock::now().time_since_epoch().count()}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelTraffic::count(std::size_t bytes)
+    {
+        bytesReceived_.fetch_add(bytes, std::memory_order_relaxed);
+        lastReceived_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::uint64_t TunnelTraffic::bytesReceived() const
+    {
+        return bytesReceived_.load(std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::chrono::steady_clock::time_point TunnelTraffic::lastReceived() const
+    {
+        return std::chrono::steady_clock::time_point{
+            std::chrono::steady_clock::duration{lastReceived_.load(std::memory_order_relaxed)}};
+    }
+    // #####################################################################################################################
+    TunnelRegistry::TunnelRegistry(boost::asio::any_io_executor executor)
+        : timer_{std::move(executor)}
+        , pendingGuard_{}
+        , added_{}
+        , removed_{}
+        , tracked_{}
+        , lastSample_{std::chrono::steady_clock::now()}
+        , snapshot_{std::make_shared<std::vector<TunnelSample> const>()}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelRegistry::add(TunnelEntry entry)
+    {
+        auto shared = std::make_shared<TunnelEntry const>(std::move(entry));
+        std::scoped_lock lock{pendingGuard_};
+        added_.push_back(std::move(shared));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelRegistry::remove(std::string const& tunnelId)
+    {
+        std::scoped_lock lock{pendingGuard_};
+        removed_.push_back(tunnelId);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelRegistry::start()
+    {
+        lastSample_ = std::chrono::steady_clock::now();
+        scheduleSample();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<std::vector<TunnelSample> const> TunnelRegistry::snapshot() const
+    {
+        return snapshot_.load(std::memory_order_acquire);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelRegistry::scheduleSample()
+    {
+        timer_.expires_after(SampleInterval);
+        timer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+            self->sample();
+            self->scheduleSample();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelRegistry::sample()
+    {
+        std::vector<std::shared_ptr<TunnelEntry const>> added;
+        std::vector<std::string> removed;
+        {
+            std::scoped_lock lock{pendingGuard_};
+            added.swap(added_);
+            removed.swap(removed_);
+        }
+        // Tunnels are always linked before they are closed, so adding first cannot resurrect one.
+        for (auto& entry : added)
+        {
+            const auto fromClient = entry->fromClient->bytesReceived();
+            const auto fromPublisher = entry->fromPublisher->bytesReceived();
+            auto tunnelId = entry->tunnelId;
+            tracked_[std::move(tunnelId)] = Tracked{std::move(entry), fromClient, fromPublisher};
+        }
+        for (auto const& tunnelId : removed)
+            tracked_.erase(tunnelId);
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto seconds = std::chrono::duration<double>(now - lastSample_).count();
+        lastSample_ = now;
+
+        auto samples = std::make_shared<std::vector<TunnelSample>>();
+        samples->reserve(tracked_.size());
+        for (auto& [tunnelId, tracked] : tracked_)
+        {
+            const auto fromClient = tracked.entry->fromClient->bytesReceived();
+            const auto fromPublisher = tracked.entry->fromPublisher->bytesReceived();
+            samples->push_back(TunnelSample{
+                .entry = tracked.entry,
+                .throughputFromClient =
+                    seconds > 0. ? static_cast<double>(fromClient - tracked.lastFromClient) / seconds : 0.,
+                .throughputFromPublisher =
+                    seconds > 0. ? static_cast<double>(fromPublisher - tracked.lastFromPublisher) / seconds : 0.,
+            });
+            tracked.lastFromClient = fromClient;
+            tracked.lastFromPublisher = fromPublisher;
+        }
+        snapshot_.store(std::move(samples), std::memory_order_release);
+    }
+    // #####################################################################################################################
+}
@@ -9,6 +9,7 @@
 #include <spdlog/spdlog.h>
 #include <roar/utility/scope_exit.hpp>
 
+#include <array>
 #include <iterator>
 #include <iostream>
 
@@ -50,6 +51,13 @@ namespace TunnelBore::Broker
         std::atomic_bool wasClosed;
         std::string remoteAddress;
         std::shared_ptr<PipeOperation<TunnelSession>> pipeOperation;
+        std::shared_ptr<TunnelTrace> trace;
+        /// Lists this tunnel while it is open, only set on the client side.
+        std::shared_ptr<TunnelRegistry> registry;
+        std::shared_ptr<TunnelTraffic> traffic;
+        PipeTransform readTransform;
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTlsContext;
+        std::shared_ptr<DataLinkTls> dataLinkTls;
 
         Implementation(
             boost::asio::ip::tcp::socket&& socket,
@@ -75,7 +83,46 @@ namespace TunnelBore::Broker
                 return address.to_string() + ":" + std::to_string(port);
             }()}
             , pipeOperation{}
+            , trace{}
+            , registry{}
+            , traffic{std::make_shared<TunnelTraffic>()}
+            , readTransform{}
+            , dataLinkTlsContext{}
+            , dataLinkTls{}
         {}
+
+        std::shared_ptr<DataLinkTls> userspaceTls() const
+        {
+            if (dataLinkTls && !dataLinkTls->offloaded())
+                return dataLinkTls;
+            return nullptr;
+        }
+
+        /**
+         * @brief Writes through the TLS of this side, if it is encrypted in userspace.
+         */
+        template <typename Handler>
+        void asyncWrite(boost::asio::const_buffer buffer, Handler handler)
+        {
+            if (auto tls = userspaceTls(); tls)
+                return tls->asyncWrite(socket, buffer, std::move(handler));
+            boost::asio::async_write(socket, buffer, std::move(handler));
+        }
+
+        /**
+         * @return false if the data read before linking could not be transformed.
+         */
+        bool transformPeekBuffer()
+        {
+            std::scoped_lock lock{peekBufferLock};
+            if (!readTransform || peekBuffer.empty())
+                return true;
+            std::string transformed;
+            if (!readTransform(peekBuffer, transformed))
+                return false;
+            peekBuffer = std::move(transformed);
+            return true;
+        }
     };
     // #####################################################################################################################
     TunnelSession::TunnelSession(
@@ -164,155 +211,193 @@ namespace TunnelBore::Broker
 
         try
         {
-            impl_->socket.async_read_some(
-                boost::asio::buffer(impl_->peekBuffer, impl_->peekBuffer.size()),
-                [weak = weak_from_this()](const boost::system::error_code& ec, std::size_t bytesTransferred) {
-                    auto exitLog = Roar::ScopeExit{[]() {
-                        spdlog::info("Peek read finished.");
-                    }};
+            auto onPeek = [weak = weak_from_this()](const boost::system::error_code& ec, std::size_t bytesTransferred) {
+                auto exitLog = Roar::ScopeExit{[]() {
+                    spdlog::info("Peek read finished.");
+                }};
 
-                    spdlog::info("Peek read for tunnel side of size '{}'.", bytesTransferred);
+                spdlog::info("Peek read for tunnel side of size '{}'.", bytesTransferred);
 
-                    auto self = weak.lock();
-                    if (!self)
-                    {
-                        spdlog::warn("Tunnel is gone in peek read");
-                        return;
-                    }
+                auto self = weak.lock();
+                if (!self)
+                {
+                    spdlog::warn("Tunnel is gone in peek read");
+                    return;
+                }
 
-                    auto service = self->impl_->service.lock();
-                    if (!service)
-                    {
-                        spdlog::warn(
-                            "Missing service for new tunnel session, this will terminate this tunnel '{}'",
-                            self->impl_->remoteAddress);
-                        self->close();
-                        return;
-                    }
+                auto service = self->impl_->service.lock();
+                if (!service)
+                {
+                    spdlog::warn(
+                        "Missing service for new tunnel session, this will terminate this tunnel '{}'",
+                        self->impl_->remoteAddress);
+                    self->close();
+                    return;
+                }
 
-                    auto info = service->info();
+                auto info = service->info();
 
-                    if (ec)
-                    {
-                        spdlog::warn(
-                            "Initial read for tunnel side failed, for service '{}:{}->{}', this will terminate this "
-                            "side "
-                            "of the tunnel '{}': '{}'",
-                            info.name ? *info.name : "noname",
-                            info.publicPort,
-                            info.hiddenPort,
-                            self->impl_->remoteAddress,
-                            ec.message());
-                        self->close();
-                        return;
-                    }
+                if (ec)
+                {
+                    spdlog::warn(
+                        "Initial read for tunnel side failed, for service '{}:{}->{}', this will terminate this "
+                        "side "
+                        "of the tunnel '{}': '{}'",
+                        info.name ? *info.name : "noname",
+                        info.publicPort,
+                        info.hiddenPort,
+                        self->impl_->remoteAddress,
+                        ec.message());
+                    self->close();
+                    return;
+                }
 
-                    auto controlSession = self->impl_->controlSession.lock();
-                    if (!controlSession)
-                    {
-                        spdlog::warn(
-                            "Missing control session for new session, this will terminate this tunnel '{}'",
-                            self->impl_->remoteAddress);
-                        self->close();
-                        return;
-                    }
+                auto controlSession = self->impl_->controlSession.lock();
+                if (!controlSession)
+                {
+                    spdlog::warn(
+                        "Missing control session for new session, this will terminate this tunnel '{}'",
+                        self->impl_->remoteAddress);
+                    self->close();
+                    return;
+                }
 
-                    if (bytesTransferred == 0)
+                if (bytesTransferred == 0)
+                {
+                    spdlog::warn(
+                        "Initial read for tunnel side failed, for service '{}:{}->{}', this will terminate this "
+                        "side "
+                        "of the tunnel '{}': '{}'",
+                        info.name ? *info.name : "noname",
+                        info.publicPort,
+                        info.hiddenPort,
+                        self->impl_->remoteAddress,
+                        "No bytes transferred");
+                    self->close();
+                    return;
+                }
+
+                if (self->impl_->dataLinkTlsContext && !self->impl_->dataLinkTls)
+                {
+                    if (self->impl_->peekBuffer.starts_with(publisherToBrokerTlsPrefix))
+                        return self->startDataLinkTls();
+
+                    // Only peeked at so far, the bytes are still waiting in the socket.
+                    boost::system::error_code consumeEc;
+                    self->impl_->socket.receive(
+                        boost::asio::buffer(self->impl_->peekBuffer, bytesTransferred), 0, consumeEc);
+                    if (consumeEc)
                     {
                         spdlog::warn(
-                            "Initial read for tunnel side failed, for service '{}:{}->{}', this will terminate this "
-                            "side "
-                            "of the tunnel '{}': '{}'",
-                            info.name ? *info.name : "noname",
-                            info.publicPort,
-                            info.hiddenPort,
+                            "Could not read initial data of tunnel '{}': '{}'",
                             self->impl_->remoteAddress,
-                            "No bytes transferred");
+                            consumeEc.message());
                         self->close();
                         return;
                     }
+                }
+                else if (self->impl_->dataLinkTls && !self->impl_->peekBuffer.starts_with(publisherToBrokerPrefix))
+                {
+                    spdlog::warn(
+                        "Encrypted tunnel side '{}' did not start with a publisher token, this will terminate it.",
+                        self->impl_->remoteAddress);
+                    self->close();
+                    return;
+                }
 
-                    if (self->impl_->peekBuffer.starts_with(publisherToBrokerPrefix))
+                if (self->impl_->peekBuffer.starts_with(publisherToBrokerPrefix))
+                {
+                    try
                     {
-                        try
+                        if (self->impl_->peekBuffer.size() < publisherToBrokerPrefix.size() + 1)
                         {
-                            if (self->impl_->peekBuffer.size() < publisherToBrokerPrefix.size() + 1)
-                            {
-                                spdlog::warn(
-                                    "Invalid initial message for tunnel side, this will terminate this side of the "
-                                    "tunnel "
-                                    "'{}'",
-                                    self->impl_->remoteAddress);
-                                self->close();
-                                return;
-                            }
-
-                            self->impl_->peekBuffer = self->impl_->peekBuffer.substr(
-                                publisherToBrokerPrefix.size() + 1,
-                                bytesTransferred - publisherToBrokerPrefix.size() - 1);
-
-                            // {identity, tunnelId, serviceId, hiddenPort, publicPort}
-                            auto token = controlSession->verifyPublisherIdentity(self->impl_->peekBuffer);
-                            self->impl_->peekBuffer.clear();
-
-                            if (!token)
-                            {
-                                spdlog::warn(
-                                    "Invalid publisher identity, this will terminate this tunnel '{}'.",
-                                    self->impl_->remoteAddress);
-                                self->close();
-                                return;
-                            }
-
-                            self->impl_->isPublisherSide = true;
-
-                            if (token->identity() != controlSession->identity())
-                            {
-                                spdlog::warn(
-                                    "Received tunnel info from another remote than the control socket. This is not "
-                                    "allowed. Tunnel identity: '{}', tunnel address: '{}', control identity: '{}'.",
-                                    token->identity(),
-                                    self->impl_->remoteAddress,
-                                    controlSession->identity());
-                                self->close();
-                                return;
-                            }
-
-                            service->connectTunnels(
-                                token->claims()["tunnelId"].get<std::string>(), self->impl_->tunnelId);
+                            spdlog::warn(
+                                "Invalid initial message for tunnel side, this will terminate this side of the "
+                                "tunnel "
+                                "'{}'",
+                                self->impl_->remoteAddress);
+                            self->close();
                             return;
                         }
-                        catch (std::exception const& exc)
+
+                        self->impl_->peekBuffer = self->impl_->peekBuffer.substr(
+                            publisherToBrokerPrefix.size() + 1,
+                            bytesTransferred - publisherToBrokerPrefix.size() - 1);
+
+                        // {identity, tunnelId, serviceId, hiddenPort, publicPort}
+                        auto token = controlSession->verifyPublisherIdentity(self->impl_->peekBuffer);
+                        self->impl_->peekBuffer.clear();
+
+                        if (!token)
                         {
                             spdlog::warn(
-                                "Exception in attempt to parse tunnel '{}' connection from publisher: '{}'",
-                                self->impl_->remoteAddress,
-                                exc.what());
+                                "Invalid publisher identity, this will terminate this tunnel '{}'.",
+                                self->impl_->remoteAddress);
                             self->close();
                             return;
                         }
+
+                        self->impl_->isPublisherSide = true;
+                        // The setup is traced on the client side, see Service::connectTunnels.
+                        self->impl_->trace.reset();
+
+                        // Whether the identity is the one the tunnel was offered to is up to the service, the
+                        // control session of this side may belong to any replica.
+                        service->connectTunnels(
+                            token->claims()["tunnelId"].get<std::string>(), self->impl_->tunnelId, token->identity());
+                        return;
                     }
-                    else
+                    catch (std::exception const& exc)
                     {
-                        self->impl_->peekBuffer.resize(bytesTransferred);
-                        spdlog::info(
-                            "Connection '{}' for service '{}:{}->{}' does not look like publisher side. Bytes received "
-                            "'{}', "
-                            "Starting with '{}'.",
+                        spdlog::warn(
+                            "Exception in attempt to parse tunnel '{}' connection from publisher: '{}'",
                             self->impl_->remoteAddress,
-                            info.name ? *info.name : "noname",
-                            info.publicPort,
-                            info.hiddenPort,
-                            bytesTransferred,
-                            makePrintableString(
-                                self->impl_->peekBuffer.substr(0, std::min(std::size_t{24}, bytesTransferred))));
+                            exc.what());
+                        self->close();
+                        return;
                     }
+                }
+                else
+                {
+                    self->impl_->peekBuffer.resize(bytesTransferred);
+                    spdlog::info(
+                        "Connection '{}' for service '{}:{}->{}' does not look like publisher side. Bytes received "
+                        "'{}', "
+                        "Starting with '{}'.",
+                        self->impl_->remoteAddress,
+                        info.name ? *info.name : "noname",
+                        info.publicPort,
+                        info.hiddenPort,
+                        bytesTransferred,
+                        makePrintableString(
+                            self->impl_->peekBuffer.substr(0, std::min(std::size_t{24}, bytesTransferred))));
+                }
 
-                    // assume this is not json from the publisher side.
-                    self->impl_->isPublisherSide = false;
-                    spdlog::info("Informing publisher about connection");
-                    controlSession->informAboutConnection(service->serviceId(), self->impl_->tunnelId);
-                });
+                // assume this is not json from the publisher side.
+                self->impl_->isPublisherSide = false;
+                if (self->impl_->trace)
+                    self->impl_->trace->mark(TunnelStage::ClientRead);
+                spdlog::info("Informing publisher about connection");
+                if (!service->offerTunnel(self->impl_->tunnelId))
+                {
+                    spdlog::warn(
+                        "No publisher of service '{}' is reachable, this will terminate this tunnel '{}'.",
+                        service->serviceId(),
+                        self->impl_->remoteAddress);
+                    self->close();
+                    return;
+                }
+                if (self->impl_->trace)
+                    self->impl_->trace->mark(TunnelStage::PublisherInformed);
+            };
+
+            const auto buffer = boost::asio::buffer(impl_->peekBuffer, impl_->peekBuffer.size());
+            if (auto tls = userspaceTls(); tls)
+                return tls->asyncReadSome(impl_->socket, buffer, std::move(onPeek));
+            // Only looked at, so that the handshake of an encrypted data link is left to OpenSSL, see startDataLinkTls.
+            if (impl_->dataLinkTlsContext && !impl_->dataLinkTls)
+                return impl_->socket.async_receive(buffer, boost::asio::socket_base::message_peek, std::move(onPeek));
+            impl_->socket.async_read_some(buffer, std::move(onPeek));
         }
         catch (std::exception const& exc)
         {
@@ -321,6 +406,78 @@ namespace TunnelBore::Broker
         }
     }
     //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::startDataLinkTls()
+    {
+        // Exactly the marker is taken from the socket, OpenSSL reads the handshake following it.
+        std::array<char, publisherToBrokerTlsPrefix.size()> marker{};
+        boost::system::error_code ec;
+        boost::asio::read(impl_->socket, boost::asio::buffer(marker), ec);
+        if (ec)
+        {
+            spdlog::warn("Could not read TLS marker of tunnel '{}': '{}'", impl_->remoteAddress, ec.message());
+            close();
+            return;
+        }
+
+        try
+        {
+            impl_->dataLinkTls = std::make_shared<DataLinkTls>(impl_->dataLinkTlsContext, DataLinkTls::Role::Server);
+        }
+        catch (std::exception const& exc)
+        {
+            spdlog::error("Could not set up TLS for tunnel '{}': '{}'", impl_->remoteAddress, exc.what());
+            close();
+            return;
+        }
+
+        impl_->dataLinkTls->asyncHandshake(impl_->socket, [weak = weak_from_this()](boost::system::error_code ec) {
+            auto self = weak.lock();
+            if (!self)
+                return;
+            if (ec)
+            {
+                spdlog::warn("TLS handshake of tunnel '{}' failed: '{}'", self->impl_->remoteAddress, ec.message());
+                self->close();
+                return;
+            }
+            spdlog::info(
+                "Tunnel side '{}' is encrypted {}.",
+                self->impl_->remoteAddress,
+                self->impl_->dataLinkTls->offloaded() ? "by the kernel" : "in userspace");
+            // The publisher token follows, now through TLS.
+            self->peek();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::moveToExecutor(boost::asio::any_io_executor executor)
+    {
+        std::scoped_lock lock{impl_->closeLock, impl_->timerGuard};
+        if (impl_->wasClosed || impl_->socket.get_executor() == executor)
+            return;
+
+        boost::system::error_code ec;
+        const auto protocol = impl_->socket.local_endpoint(ec).protocol();
+        if (ec)
+        {
+            spdlog::warn("Cannot move tunnel '{}' to another executor: '{}'.", impl_->remoteAddress, ec.message());
+            return;
+        }
+        const auto handle = impl_->socket.release(ec);
+        if (ec)
+        {
+            spdlog::warn("Cannot move tunnel '{}' to another executor: '{}'.", impl_->remoteAddress, ec.message());
+            return;
+        }
+        impl_->socket = boost::asio::ip::tcp::socket{executor, protocol, handle};
+        // OpenSSL works on the descriptor directly and must never block.
+        if (impl_->dataLinkTls)
+            impl_->socket.non_blocking(true, ec);
+
+        // The pending wait is aborted, the timer is rearmed by the next read.
+        impl_->inactivityTimer.cancel();
+        impl_->inactivityTimer = boost::asio::deadline_timer{std::move(executor)};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
     void TunnelSession::link(TunnelSession& other)
     {
         ServiceInfo info{std::nullopt, 0, 0};
@@ -336,13 +493,20 @@ namespace TunnelBore::Broker
             info.publicPort,
             info.hiddenPort);
 
+        if (!impl_->transformPeekBuffer() || !other.impl_->transformPeekBuffer())
+        {
+            spdlog::warn("Could not transform initial data of tunnel '{}', closing it.", impl_->remoteAddress);
+            close();
+            other.close();
+            return;
+        }
+
         // Self -> Other
         if (!impl_->peekBuffer.empty())
         {
             try
             {
-                boost::asio::async_write(
-                    other.impl_->socket,
+                other.impl_->asyncWrite(
                     boost::asio::buffer(impl_->peekBuffer),
                     [self = shared_from_this(), otherSelf = other.shared_from_this()](auto const& ec, std::size_t) {
                         if (ec)
@@ -372,8 +536,7 @@ namespace TunnelBore::Broker
         {
             try
             {
-                boost::asio::async_write(
-                    impl_->socket,
+                impl_->asyncWrite(
                     boost::asio::buffer(other.impl_->peekBuffer),
                     [self = shared_from_this(), otherSelf = other.shared_from_this()](auto const& ec, std::size_t) {
                         if (ec)
@@ -402,8 +565,8 @@ namespace TunnelBore::Broker
     //---------------------------------------------------------------------------------------------------------------------
     std::shared_ptr<PipeOperation<TunnelSession>> TunnelSession::pipeTo(TunnelSession& other)
     {
-        auto pipeOperation =
-            std::make_shared<PipeOperation<TunnelSession>>(this->weak_from_this(), other.weak_from_this());
+        auto pipeOperation = std::make_shared<PipeOperation<TunnelSession>>(
+            this->weak_from_this(), other.weak_from_this(), impl_->readTransform);
         pipeOperation->doPipe();
         return pipeOperation;
     }
@@ -415,6 +578,90 @@ namespace TunnelBore::Broker
         impl_->timerWasCancelled = true;
     }
     //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::setPendingData(std::string data)
+    {
+        std::scoped_lock lock{impl_->peekBufferLock};
+        impl_->peekBuffer = std::move(data);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::setReadTransform(PipeTransform transform)
+    {
+        impl_->readTransform = std::move(transform);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::acceptDataLinkTls(std::shared_ptr<boost::asio::ssl::context> context)
+    {
+        impl_->dataLinkTlsContext = std::move(context);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<DataLinkTls> TunnelSession::userspaceTls() const
+    {
+        return impl_->userspaceTls();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::setTrace(std::shared_ptr<TunnelTrace> trace)
+    {
+        impl_->trace = std::move(trace);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<TunnelTrace> TunnelSession::trace() const
+    {
+        return impl_->trace;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::registerIn(std::shared_ptr<TunnelRegistry> registry, TunnelEntry entry)
+    {
+        std::scoped_lock lock{impl_->closeLock};
+        if (impl_->wasClosed)
+            return;
+        registry->add(std::move(entry));
+        impl_->registry = std::move(registry);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::countReceived(std::size_t bytes)
+    {
+        impl_->traffic->count(bytes);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<TunnelTraffic const> TunnelSession::traffic() const
+    {
+        return impl_->traffic;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool TunnelSession::isPiping() const
+    {
+        std::scoped_lock lock{impl_->closeLock};
+        return !impl_->wasClosed && impl_->pipeOperation;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSession::suspend(std::function<void(std::string unsent, bool ended)> onSuspended)
+    {
+        {
+            std::scoped_lock lock{impl_->closeLock};
+            if (impl_->pipeOperation)
+                return impl_->pipeOperation->suspend(std::move(onSuspended));
+        }
+        // Closed meanwhile, nothing is left to hand over.
+        onSuspended({}, true);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    int TunnelSession::releaseSocket()
+    {
+        cancelTimer();
+        std::scoped_lock lock{impl_->closeLock};
+        impl_->wasClosed = true;
+        impl_->pipeOperation.reset();
+
+        boost::system::error_code ec;
+        const auto handle = impl_->socket.release(ec);
+        if (ec)
+        {
+            spdlog::error("Could not release socket of tunnel '{}': '{}'.", impl_->remoteAddress, ec.message());
+            return -1;
+        }
+        return handle;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
     void TunnelSession::close()
     {
         cancelTimer();
@@ -426,6 +673,8 @@ namespace TunnelBore::Broker
             impl_->wasClosed = true;
 
             spdlog::info("Closing tunnel session '{}'.", impl_->remoteAddress);
+            if (auto registry = std::exchange(impl_->registry, nullptr); registry)
+                registry->remove(impl_->tunnelId);
 
             boost::system::error_code ignore;
             impl_->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignore);
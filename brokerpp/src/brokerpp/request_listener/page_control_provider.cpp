@@ -1,143 +1,668 @@
-#include <brokerpp/winsock_first.hpp>
-#include <brokerpp/request_listener/page_control_provider.hpp>
-#include <brokerpp/control/control_session.hpp>
-#include <brokerpp/publisher/publisher.hpp>
-#include <brokerpp/publisher/publisher_token.hpp>
-
-#include <roar/utility/base64.hpp>
-#include <sharedpp/jwt.hpp>
-#include <spdlog/spdlog.h>
-
-using namespace boost::beast::http;
-using namespace Roar;
-
-namespace TunnelBore::Broker
-{
-    // #####################################################################################################################
-    struct PageAndControlProvider::Implementation
-    {
-        boost::asio::any_io_executor executor;
-        std::string publicJwt;
-        std::unordered_map<std::string, std::shared_ptr<Publisher>> publishers;
-
-        std::mutex controlSessionMutex;
-        std::unordered_map<std::string, std::shared_ptr<ControlSession>> controlSessions;
-        std::filesystem::path servedDirectory;
-
-        Implementation(boost::asio::any_io_executor executor, std::string publicJwt, std::filesystem::path directory)
-            : executor{std::move(executor)}
-            , publicJwt{std::move(publicJwt)}
-            , publishers{}
-            , controlSessionMutex{}
-            , controlSessions{}
-            , servedDirectory{std::move(directory)}
-        {}
-    };
-    // #####################################################################################################################
-    PageAndControlProvider::PageAndControlProvider(
-        boost::asio::any_io_executor executor,
-        std::string publicJwt,
-        std::filesystem::path directory)
-        : impl_{std::make_unique<Implementation>(std::move(executor), std::move(publicJwt), std::move(directory))}
-    {}
-    //---------------------------------------------------------------------------------------------------------------------
-    ROAR_PIMPL_SPECIAL_FUNCTIONS_IMPL(PageAndControlProvider);
-    //---------------------------------------------------------------------------------------------------------------------
-    Roar::ServeDecision PageAndControlProvider::serve(
-        Roar::Session& /*session*/,
-        Roar::EmptyBodyRequest const& /*request*/,
-        Roar::FileAndStatus const& fileAndStatus,
-        Roar::ServeOptions<PageAndControlProvider>& /*options*/)
-    {
-        spdlog::info("Serving {}", fileAndStatus.file.string());
-        return Roar::ServeDecision::Continue;
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::filesystem::path PageAndControlProvider::getServedDirectory() const
-    {
-        return impl_->servedDirectory;
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void PageAndControlProvider::status(Session& session, EmptyBodyRequest&& req)
-    {
-        session.send<empty_body>(req)->status(status::no_content).commit();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void PageAndControlProvider::redirect1(Session& session, EmptyBodyRequest&& req)
-    {
-        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void PageAndControlProvider::redirect2(Session& session, EmptyBodyRequest&& req)
-    {
-        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void PageAndControlProvider::redirect3(Session& session, EmptyBodyRequest&& req)
-    {
-        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void PageAndControlProvider::publisher(Session& session, EmptyBodyRequest&& req)
-    {
-        auto closeWithFailure = [&session, &req](std::string_view reason) {
-            spdlog::warn("Publisher control socket was rejected: '{}'", reason);
-            session.send<string_body>(req)
-                ->rejectAuthorization("Bearer realm=tunnelBore")
-                .body(reason)
-                .commit()
-                .fail([](auto) {});
-        };
-
-        auto tokenData = req.bearerAuth();
-        if (!tokenData)
-            return closeWithFailure("Missing bearer auth.");
-
-        auto token = verifyPublisherToken(Roar::base64Decode(*tokenData), impl_->publicJwt);
-        if (!token)
-            return closeWithFailure("Token was rejected.");
-
-        spdlog::info("Upgrading to WebSocket session");
-        session.upgrade(req)
-            .then([weak = weak_from_this(), identity = token->identity()](std::shared_ptr<WebsocketSession> ws) {
-                // TODO:
-                spdlog::info("Upgrade complete");
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                auto cs = std::make_shared<ControlSession>(
-                    identity,
-                    weak,
-                    std::move(ws),
-                    [weak, identity]() {
-                        auto self = weak.lock();
-                        if (!self)
-                            return;
-
-                        std::scoped_lock lock{self->impl_->controlSessionMutex};
-                        self->impl_->controlSessions.erase(identity);
-                    },
-                    self->impl_->publicJwt);
-                cs->setup(identity);
-                std::scoped_lock lock{self->impl_->controlSessionMutex};
-                self->impl_->controlSessions[identity] = cs;
-            })
-            .fail([](Error const& e) {
-                spdlog::error("Websocket upgrade failed: '{}'.", e.toString());
-            });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::shared_ptr<Publisher> PageAndControlProvider::obtainPublisher(std::string const& identity)
-    {
-        auto pubIter = impl_->publishers.find(identity);
-        if (pubIter == impl_->publishers.end())
-        {
-            auto publisher = std::make_shared<Publisher>(impl_->executor, identity);
-            impl_->publishers[identity] = publisher;
-            return publisher;
-        }
-        return pubIter->second;
-    }
-    // #####################################################################################################################
+#include <brokerpp/winsock_first.hpp>
+#include <brokerpp/request_listener/page_control_provider.hpp>
+#include <brokerpp/control/control_session.hpp>
+#include <brokerpp/publisher/publisher.hpp>
+#include <brokerpp/publisher/publisher_token.hpp>
+#include <brokerpp/publisher/service.hpp>
+#include <brokerpp/publisher/service_directory.hpp>
+#include <brokerpp/publisher/tunnel_registry.hpp>
+#include <brokerpp/cluster/cluster_node.hpp>
+#include <brokerpp/routing/routing_listener.hpp>
+
+#include <roar/utility/base64.hpp>
+#include <sharedpp/data_link_tls.hpp>
+#include <sharedpp/jwt.hpp>
+#include <sharedpp/load_home_file.hpp>
+#include <spdlog/spdlog.h>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/websocket/rfc6455.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <variant>
+
+#include <unistd.h>
+
+using namespace boost::beast::http;
+using namespace Roar;
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        double secondsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+        {
+            return std::chrono::duration<double>(to - from).count();
+        }
+
+        std::chrono::steady_clock::time_point lastActivity(TunnelEntry const& entry)
+        {
+            return std::max(
+                {entry.linkedAt, entry.fromClient->lastReceived(), entry.fromPublisher->lastReceived()});
+        }
+
+        /**
+         * Orders tunnels so that the most interesting ones come first.
+         */
+        std::optional<std::function<bool(TunnelSample const&, TunnelSample const&)>>
+        tunnelOrdering(std::string_view sort)
+        {
+            using Ordering = std::function<bool(TunnelSample const&, TunnelSample const&)>;
+            if (sort == "throughput")
+                return Ordering{[](auto const& lhs, auto const& rhs) {
+                    return lhs.throughputFromClient + lhs.throughputFromPublisher >
+                        rhs.throughputFromClient + rhs.throughputFromPublisher;
+                }};
+            if (sort == "bytes")
+                return Ordering{[](auto const& lhs, auto const& rhs) {
+                    return lhs.entry->fromClient->bytesReceived() + lhs.entry->fromPublisher->bytesReceived() >
+                        rhs.entry->fromClient->bytesReceived() + rhs.entry->fromPublisher->bytesReceived();
+                }};
+            if (sort == "age")
+                return Ordering{[](auto const& lhs, auto const& rhs) {
+                    return lhs.entry->linkedAt < rhs.entry->linkedAt;
+                }};
+            if (sort == "idle")
+                return Ordering{[](auto const& lhs, auto const& rhs) {
+                    return lastActivity(*lhs.entry) < lastActivity(*rhs.entry);
+                }};
+            return std::nullopt;
+        }
+
+        /**
+         * The context publishers encrypt their tunnel connections with, null if they are kept plain.
+         */
+        std::shared_ptr<boost::asio::ssl::context> makeDataLinkTls(Config const& config)
+        {
+            if (!config.ssl || !config.dataLinkTls)
+                return nullptr;
+            try
+            {
+                auto context =
+                    DataLinkTls::makeServerContext(getHomePath() / "broker/cert.pem", getHomePath() / "broker/key.pem");
+                spdlog::info(
+                    "Publishers may encrypt tunnels, kernel offload is {}.",
+                    DataLinkTls::kernelOffloadSupported() ? "supported" : "not supported by this OpenSSL");
+                return context;
+            }
+            catch (std::exception const& exc)
+            {
+                spdlog::error("Could not load the certificate for encrypted tunnels, they stay plain: {}", exc.what());
+                return nullptr;
+            }
+        }
+
+        /// Instances end up in log lines and the admin listing, so only a plain name is taken.
+        bool isValidInstance(std::string_view instance)
+        {
+            return !instance.empty() && instance.size() <= 64 &&
+                std::all_of(instance.begin(), instance.end(), [](char c) {
+                       return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' ||
+                           c == '_';
+                   });
+        }
+    }
+    // #####################################################################################################################
+    struct PageAndControlProvider::Implementation
+    {
+        boost::asio::any_io_executor executor;
+        std::shared_ptr<IoEngine> engine;
+        std::string publicJwt;
+        Config config;
+        /// Reached from the control sessions, the cluster node and the request handlers on several threads.
+        std::mutex publishersGuard;
+        std::unordered_map<std::string, std::shared_ptr<Publisher>> publishers;
+
+        std::mutex controlSessionMutex;
+        std::unordered_map<std::string, std::shared_ptr<ControlSession>> controlSessions;
+        std::filesystem::path servedDirectory;
+        std::weak_ptr<ClusterNode> clusterNode;
+        std::vector<std::weak_ptr<RoutingListener>> routingListeners;
+        std::shared_ptr<TunnelSetupStats> setupStats;
+        std::shared_ptr<TunnelRegistry> tunnelRegistry;
+        std::shared_ptr<ServiceDirectory> serviceDirectory;
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls;
+        std::shared_ptr<HandshakeThrottle> handshakeThrottle;
+
+        /// Services per publisher identity, as written to the state snapshot.
+        std::mutex snapshotGuard;
+        std::map<std::string, std::vector<ServiceInfo>> snapshot;
+        bool snapshotScheduled;
+        /// Set once handing over, the successor keeps the snapshot from then on.
+        bool snapshotFrozen;
+        boost::asio::steady_timer snapshotTimer;
+
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::string publicJwt,
+            Config config,
+            std::filesystem::path directory,
+            std::shared_ptr<HandshakeThrottle> handshakeThrottle)
+            : executor{std::move(executor)}
+            , engine{std::move(engine)}
+            , publicJwt{std::move(publicJwt)}
+            , config{std::move(config)}
+            , publishersGuard{}
+            , publishers{}
+            , controlSessionMutex{}
+            , controlSessions{}
+            , servedDirectory{std::move(directory)}
+            , clusterNode{}
+            , routingListeners{}
+            , setupStats{
+                  std::make_shared<TunnelSetupStats>(std::chrono::milliseconds{this->config.slowTunnelSetupMs}, true)}
+            , tunnelRegistry{std::make_shared<TunnelRegistry>(this->executor)}
+            , serviceDirectory{std::make_shared<ServiceDirectory>(
+                  this->config.httpRouting.enabled,
+                  this->config.tlsRouting.enabled,
+                  this->config.httpProxy)}
+            , dataLinkTls{makeDataLinkTls(this->config)}
+            , handshakeThrottle{std::move(handshakeThrottle)}
+            , snapshotGuard{}
+            , snapshot{}
+            , snapshotScheduled{false}
+            , snapshotFrozen{false}
+            , snapshotTimer{this->executor}
+        {
+            tunnelRegistry->start();
+        }
+
+        /**
+         * @brief The publishers at this moment, so that they can be iterated without holding publishersGuard.
+         */
+        std::vector<std::pair<std::string, std::shared_ptr<Publisher>>> publishersCopy()
+        {
+            std::scoped_lock lock{publishersGuard};
+            return {publishers.begin(), publishers.end()};
+        }
+
+        /**
+         * @return The identity of the admin the request is authorized for, or the status to reject it with.
+         */
+        std::variant<std::string, status> authorizeAdmin(EmptyBodyRequest const& req) const
+        {
+            auto tokenData = req.bearerAuth();
+            if (!tokenData)
+                return status::unauthorized;
+            auto token = verifyPublisherToken(Roar::base64Decode(*tokenData), publicJwt);
+            if (!token)
+                return status::unauthorized;
+            const auto identity = token->identity();
+            if (std::find(config.adminIdentities.begin(), config.adminIdentities.end(), identity) ==
+                config.adminIdentities.end())
+            {
+                return status::forbidden;
+            }
+            return identity;
+        }
+    };
+    // #####################################################################################################################
+    PageAndControlProvider::PageAndControlProvider(
+        boost::asio::any_io_executor executor,
+        std::shared_ptr<IoEngine> engine,
+        std::string publicJwt,
+        Config config,
+        std::filesystem::path directory,
+        std::shared_ptr<HandshakeThrottle> handshakeThrottle)
+        : impl_{std::make_unique<Implementation>(
+              std::move(executor),
+              std::move(engine),
+              std::move(publicJwt),
+              std::move(config),
+              std::move(directory),
+              std::move(handshakeThrottle))}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    ROAR_PIMPL_SPECIAL_FUNCTIONS_IMPL(PageAndControlProvider);
+    //---------------------------------------------------------------------------------------------------------------------
+    Roar::ServeDecision PageAndControlProvider::serve(
+        Roar::Session& /*session*/,
+        Roar::EmptyBodyRequest const& /*request*/,
+        Roar::FileAndStatus const& fileAndStatus,
+        Roar::ServeOptions<PageAndControlProvider>& /*options*/)
+    {
+        spdlog::info("Serving {}", fileAndStatus.file.string());
+        return Roar::ServeDecision::Continue;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::filesystem::path PageAndControlProvider::getServedDirectory() const
+    {
+        return impl_->servedDirectory;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::status(Session& session, EmptyBodyRequest&& req)
+    {
+        session.send<empty_body>(req)->status(status::no_content).commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::tunnelSetup(Session& session, EmptyBodyRequest&& req)
+    {
+        session.send<string_body>(req)
+            ->status(status::ok)
+            .contentType("application/json")
+            .body(impl_->setupStats->toJson().dump())
+            .commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::compression(Session& session, EmptyBodyRequest&& req)
+    {
+        json services = json::array();
+        for (auto const& [identity, publisher] : impl_->publishersCopy())
+        {
+            for (auto const& service : publisher->view()->services)
+            {
+                auto stats = service->compressionStats();
+                if (stats.is_null())
+                    continue;
+                stats["publisher"] = identity;
+                stats["serviceId"] = service->serviceId();
+                services.push_back(std::move(stats));
+            }
+        }
+        session.send<string_body>(req)
+            ->status(status::ok)
+            .contentType("application/json")
+            .body(json{{"services", std::move(services)}}.dump())
+            .commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::adminTunnels(Session& session, EmptyBodyRequest&& req)
+    {
+        const auto authorization = impl_->authorizeAdmin(req);
+        if (const auto* rejection = std::get_if<status>(&authorization))
+        {
+            spdlog::warn("Admin request for tunnels was rejected.");
+            if (*rejection == status::unauthorized)
+                return (void)session.send<empty_body>(req)->rejectAuthorization("Bearer realm=tunnelBore").commit();
+            return (void)session.send<empty_body>(req)->status(*rejection).commit();
+        }
+
+        const auto& query = req.query();
+        const auto sortParameter = query.find("sort");
+        const auto ordering = tunnelOrdering(sortParameter == query.end() ? "throughput" : sortParameter->second);
+        std::size_t top = std::numeric_limits<std::size_t>::max();
+        if (const auto topParameter = query.find("top"); topParameter != query.end())
+        {
+            auto const& value = topParameter->second;
+            const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), top);
+            if (ec != std::errc{} || end != value.data() + value.size())
+            {
+                return (void)session.send<string_body>(req)
+                    ->status(status::bad_request)
+                    .body("top has to be a number.")
+                    .commit();
+            }
+        }
+        if (!ordering)
+        {
+            return (void)session.send<string_body>(req)
+                ->status(status::bad_request)
+                .body("sort has to be one of throughput, bytes, age or idle.")
+                .commit();
+        }
+
+        // Copies the pointers only, the entries are shared with the snapshot.
+        auto samples = *impl_->tunnelRegistry->snapshot();
+        std::map<std::pair<std::string, std::string>, std::size_t> tunnelsPerService;
+        for (auto const& sample : samples)
+            ++tunnelsPerService[{sample.entry->publisherIdentity, sample.entry->serviceId}];
+
+        json publishers = json::array();
+        for (auto const& [identity, publisher] : impl_->publishersCopy())
+        {
+            const auto view = publisher->view();
+            json services = json::array();
+            for (auto const& service : view->services)
+            {
+                const auto info = service->info();
+                const auto tunnels = tunnelsPerService.find({identity, service->serviceId()});
+                services.push_back({
+                    {"serviceId", service->serviceId()},
+                    {"name", info.name},
+                    {"publicPort", info.publicPort},
+                    {"hiddenPort", info.hiddenPort},
+                    {"boundPort", service->boundPort()},
+                    {"tunnels", tunnels == tunnelsPerService.end() ? 0 : tunnels->second},
+                });
+            }
+            const auto controlSession = view->controlSession.lock();
+            json entry = {
+                {"identity", identity},
+                {"connected", static_cast<bool>(controlSession)},
+                {"services", std::move(services)},
+            };
+            if (controlSession)
+            {
+                const auto endpoint = controlSession->remoteEndpoint();
+                entry["remoteAddress"] = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+            }
+            publishers.push_back(std::move(entry));
+        }
+
+        const auto count = std::min(top, samples.size());
+        std::partial_sort(
+            samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(count), samples.end(), *ordering);
+        const auto now = std::chrono::steady_clock::now();
+        json tunnels = json::array();
+        for (std::size_t i = 0; i != count; ++i)
+        {
+            auto const& sample = samples[i];
+            auto const& entry = *sample.entry;
+            tunnels.push_back({
+                {"tunnelId", entry.tunnelId},
+                {"publisher", entry.publisherIdentity},
+                {"serviceId", entry.serviceId},
+                {"remoteAddress", entry.remoteAddress},
+                {"ageSeconds", secondsBetween(entry.linkedAt, now)},
+                {"idleSeconds", secondsBetween(lastActivity(entry), now)},
+                {"bytesFromClient", entry.fromClient->bytesReceived()},
+                {"bytesFromPublisher", entry.fromPublisher->bytesReceived()},
+                {"throughputFromClient", sample.throughputFromClient},
+                {"throughputFromPublisher", sample.throughputFromPublisher},
+            });
+        }
+
+        const json response = {
+            {"publishers", std::move(publishers)},
+            {"tunnelCount", samples.size()},
+            {"tunnels", std::move(tunnels)},
+        };
+        session.send<string_body>(req)
+            ->status(status::ok)
+            .contentType("application/json")
+            .body(response.dump())
+            .commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::redirect1(Session& session, EmptyBodyRequest&& req)
+    {
+        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::redirect2(Session& session, EmptyBodyRequest&& req)
+    {
+        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::redirect3(Session& session, EmptyBodyRequest&& req)
+    {
+        session.send<empty_body>(req)->status(status::moved_permanently).setHeader(field::location, "/").commit();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::publisher(Session& session, EmptyBodyRequest&& req)
+    {
+        auto closeWithFailure = [&session, &req](std::string_view reason) {
+            spdlog::warn("Publisher control socket was rejected: '{}'", reason);
+            session.send<string_body>(req)
+                ->rejectAuthorization("Bearer realm=tunnelBore")
+                .body(reason)
+                .commit()
+                .fail([](auto) {});
+        };
+
+        auto tokenData = req.bearerAuth();
+        if (!tokenData)
+            return closeWithFailure("Missing bearer auth.");
+
+        // Held until the publisher handshake is processed, verifying the token is the first expensive step.
+        auto permit = impl_->handshakeThrottle->tryAcquire();
+        if (!permit)
+        {
+            spdlog::warn("Too many handshakes in progress, asking a publisher to retry.");
+            return (void)session.send<empty_body>(req)
+                ->status(status::service_unavailable)
+                .setHeader(field::retry_after, std::to_string(impl_->handshakeThrottle->retryAfter().count()))
+                .commit()
+                .fail([](auto) {});
+        }
+
+        auto token = verifyPublisherToken(Roar::base64Decode(*tokenData), impl_->publicJwt);
+        if (!token)
+            return closeWithFailure("Token was rejected.");
+
+        // Several instances of one identity are separate publishers, they may serve the same ports as replicas.
+        auto publisherName = token->identity();
+        const auto& query = req.query();
+        if (const auto instance = query.find("instance"); instance != query.end())
+        {
+            if (!isValidInstance(instance->second))
+                return closeWithFailure("Invalid instance name.");
+            publisherName += "#" + instance->second;
+        }
+
+        // Publishers ask without upgrade to learn why an upgrade was declined, token and capacity are fine here.
+        if (!boost::beast::websocket::is_upgrade(req))
+            return (void)session.send<empty_body>(req)->status(status::no_content).commit().fail([](auto) {});
+
+        spdlog::info("Upgrading to WebSocket session");
+        session.upgrade(req)
+            .then([weak = weak_from_this(),
+                   identity = token->identity(),
+                   publisherName = std::move(publisherName),
+                   permit = std::move(permit)](std::shared_ptr<WebsocketSession> ws) {
+                // TODO:
+                spdlog::info("Upgrade complete");
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                auto cs = std::make_shared<ControlSession>(
+                    self->impl_->executor,
+                    publisherName,
+                    weak,
+                    std::move(ws),
+                    [weak, publisherName](ControlSession const& session) {
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+
+                        // A reconnected publisher may already have replaced this session.
+                        std::scoped_lock lock{self->impl_->controlSessionMutex};
+                        auto iter = self->impl_->controlSessions.find(publisherName);
+                        if (iter != self->impl_->controlSessions.end() && iter->second.get() == &session)
+                            self->impl_->controlSessions.erase(iter);
+                    },
+                    self->impl_->publicJwt,
+                    std::chrono::seconds{self->impl_->config.controlTimeoutSeconds});
+                cs->holdHandshakePermit(permit);
+                cs->setup(identity, publisherName);
+                std::scoped_lock lock{self->impl_->controlSessionMutex};
+                self->impl_->controlSessions[publisherName] = cs;
+            })
+            .fail([](Error const& e) {
+                spdlog::error("Websocket upgrade failed: '{}'.", e.toString());
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Publisher> PageAndControlProvider::obtainPublisher(std::string const& identity)
+    {
+        std::scoped_lock lock{impl_->publishersGuard};
+        auto pubIter = impl_->publishers.find(identity);
+        if (pubIter == impl_->publishers.end())
+        {
+            auto publisher = std::make_shared<Publisher>(
+                impl_->executor,
+                impl_->engine,
+                identity,
+                impl_->setupStats,
+                impl_->tunnelRegistry,
+                impl_->serviceDirectory,
+                impl_->dataLinkTls,
+                std::chrono::seconds{impl_->config.controlGraceSeconds},
+                std::chrono::seconds{impl_->config.holdConnectionsSeconds},
+                impl_->config.cluster.publicPortOffset);
+            publisher->onServicesChanged(
+                [clusterNode = impl_->clusterNode, weak = weak_from_this(), identity](
+                    std::vector<ServiceInfo> const& services) {
+                    if (auto node = clusterNode.lock(); node)
+                    {
+                        // Routed services share the listeners of the routing ports, other nodes cannot forward them
+                        // by public port.
+                        std::vector<ServiceInfo> forwardable;
+                        std::copy_if(
+                            services.begin(), services.end(), std::back_inserter(forwardable), [](auto const& service) {
+                                return service.httpHosts.empty() && service.tlsServerNames.empty();
+                            });
+                        node->claim(identity, forwardable);
+                    }
+                    if (auto self = weak.lock(); self)
+                        self->recordServices(identity, services);
+                });
+            impl_->publishers[identity] = publisher;
+            return publisher;
+        }
+        return pubIter->second;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Publisher> PageAndControlProvider::findPublisher(std::string const& identity)
+    {
+        std::scoped_lock lock{impl_->publishersGuard};
+        auto pubIter = impl_->publishers.find(identity);
+        if (pubIter == impl_->publishers.end())
+            return nullptr;
+        return pubIter->second;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<ServiceDirectory> PageAndControlProvider::serviceDirectory() const
+    {
+        return impl_->serviceDirectory;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::setClusterNode(std::weak_ptr<ClusterNode> clusterNode)
+    {
+        impl_->clusterNode = std::move(clusterNode);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::addRoutingListener(std::weak_ptr<RoutingListener> routingListener)
+    {
+        impl_->routingListeners.push_back(std::move(routingListener));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    HandoverState PageAndControlProvider::prepareHandover(std::vector<int>& descriptors)
+    {
+        {
+            // Releasing the services clears them, which is not what the successor should find in the snapshot.
+            std::scoped_lock lock{impl_->snapshotGuard};
+            impl_->snapshotFrozen = true;
+            impl_->snapshotTimer.cancel();
+        }
+        HandoverState state{};
+        for (auto const& [identity, publisher] : impl_->publishersCopy())
+            state.publishers.push_back(publisher->prepareHandover(descriptors));
+        // Clients keep reaching routed services while the successor starts, instead of being refused by a port that
+        // is bound by nobody.
+        for (auto const& weakListener : impl_->routingListeners)
+        {
+            if (auto listener = weakListener.lock(); listener)
+            {
+                if (auto routing = listener->prepareHandover(descriptors); routing)
+                    state.routers.push_back(std::move(*routing));
+            }
+        }
+        return state;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::abortHandover(HandoverState const& state, std::vector<int> const& descriptors)
+    {
+        {
+            std::scoped_lock lock{impl_->snapshotGuard};
+            impl_->snapshotFrozen = false;
+        }
+        restore(state, descriptors);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::restore(HandoverState const& state, std::vector<int> const& descriptors)
+    {
+        for (auto const& publisherHandover : state.publishers)
+        {
+            obtainPublisher(publisherHandover.identity)->restore(publisherHandover, descriptors);
+            std::vector<ServiceInfo> services;
+            for (auto const& serviceHandover : publisherHandover.services)
+                services.push_back(serviceHandover.info);
+            recordServices(publisherHandover.identity, services);
+        }
+
+        for (auto const& routing : state.routers)
+        {
+            std::shared_ptr<RoutingListener> listener;
+            for (auto const& weakListener : impl_->routingListeners)
+            {
+                auto candidate = weakListener.lock();
+                if (candidate && toString(candidate->protocol()) == routing.protocol && !candidate->listening())
+                    listener = std::move(candidate);
+            }
+            if (!listener)
+            {
+                spdlog::info(
+                    "Closing the taken over {} routing listener, it is disabled in the config.", routing.protocol);
+                ::close(descriptors[routing.listenerSocket]);
+                continue;
+            }
+            if (!listener->adopt(routing, descriptors))
+                spdlog::error("Could not take over the {} routing listener.", routing.protocol);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::prebind(StateSnapshot const& snapshot)
+    {
+        for (auto const& publisherSnapshot : snapshot.publishers)
+        {
+            obtainPublisher(publisherSnapshot.identity)->prebind(publisherSnapshot.services);
+            recordServices(publisherSnapshot.identity, publisherSnapshot.services);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::recordServices(std::string const& identity, std::vector<ServiceInfo> const& services)
+    {
+        if (!impl_->config.stateSnapshot || impl_->config.cluster.enabled)
+            return;
+
+        std::scoped_lock lock{impl_->snapshotGuard};
+        if (impl_->snapshotFrozen)
+            return;
+        if (services.empty())
+            impl_->snapshot.erase(identity);
+        else
+            impl_->snapshot[identity] = services;
+
+        // Publishers reconnecting at once are written together.
+        if (impl_->snapshotScheduled)
+            return;
+        impl_->snapshotScheduled = true;
+        impl_->snapshotTimer.expires_after(std::chrono::seconds{1});
+        impl_->snapshotTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            auto self = weak.lock();
+            if (!self)
+                return;
+            if (ec)
+            {
+                std::scoped_lock lock{self->impl_->snapshotGuard};
+                self->impl_->snapshotScheduled = false;
+                return;
+            }
+            self->writeStateSnapshot();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void PageAndControlProvider::writeStateSnapshot()
+    {
+        StateSnapshot snapshot{};
+        {
+            std::scoped_lock lock{impl_->snapshotGuard};
+            impl_->snapshotScheduled = false;
+            if (impl_->snapshotFrozen)
+                return;
+            for (auto const& [identity, services] : impl_->snapshot)
+                snapshot.publishers.push_back(PublisherSnapshot{.identity = identity, .services = services});
+        }
+        saveStateSnapshot(stateSnapshotPath(), snapshot);
+    }
+    // #####################################################################################################################
 }
\ No newline at end of file
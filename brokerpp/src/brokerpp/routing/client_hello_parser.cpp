@@ -0,0 +1,171 @@
+#include <brokerpp/routing/client_hello_parser.hpp>
+#include <brokerpp/routing/route_table.hpp>
+
+#include <cstdint>
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        constexpr std::uint8_t HandshakeRecord = 0x16;
+        constexpr std::uint8_t ClientHelloMessage = 0x01;
+        constexpr std::uint16_t ServerNameExtension = 0x0000;
+        constexpr std::uint8_t HostNameType = 0x00;
+        constexpr std::size_t RecordHeaderSize = 5;
+        constexpr std::size_t HandshakeHeaderSize = 4;
+        /// Largest plaintext fragment a record may carry.
+        constexpr std::size_t MaxFragmentSize = 16 * 1024;
+
+        /**
+         * Reads big endian fields off the front of a view, every read fails once one did.
+         */
+        class Reader
+        {
+          public:
+            explicit Reader(std::string_view data)
+                : data_{data}
+                , ok_{true}
+            {}
+
+            std::size_t number(std::size_t bytes)
+            {
+                if (!ok_ || data_.size() < bytes)
+                    return ok_ = false, 0;
+                std::size_t result = 0;
+                for (std::size_t i = 0; i != bytes; ++i)
+                    result = (result << 8) | static_cast<std::uint8_t>(data_[i]);
+                data_.remove_prefix(bytes);
+                return result;
+            }
+
+            std::string_view bytes(std::size_t count)
+            {
+                if (!ok_ || data_.size() < count)
+                    return ok_ = false, std::string_view{};
+                const auto result = data_.substr(0, count);
+                data_.remove_prefix(count);
+                return result;
+            }
+
+            /// A vector prefixed by its length in lengthBytes.
+            std::string_view vector(std::size_t lengthBytes)
+            {
+                return bytes(number(lengthBytes));
+            }
+
+            bool ok() const
+            {
+                return ok_;
+            }
+
+            bool empty() const
+            {
+                return data_.empty();
+            }
+
+          private:
+            std::string_view data_;
+            bool ok_;
+        };
+    }
+    // #####################################################################################################################
+    HostParseResult ClientHelloParser::feed(std::string_view buffered)
+    {
+        // Every record is handshake until the hello is complete, it is parsed before the records behind it are read.
+        while (buffered.size() >= recordStart_ + RecordHeaderSize)
+        {
+            Reader header{buffered.substr(recordStart_, RecordHeaderSize)};
+            const auto type = header.number(1);
+            header.number(2);
+            const auto length = header.number(2);
+            if (type != HandshakeRecord || length == 0 || length > MaxFragmentSize)
+                return HostParseResult::Invalid;
+            if (buffered.size() < recordStart_ + RecordHeaderSize + length)
+                break;
+
+            fragments_.emplace_back(recordStart_ + RecordHeaderSize, length);
+            handshakeBytes_ += length;
+            recordStart_ += RecordHeaderSize + length;
+            if (const auto result = parseHandshake(buffered); result != HostParseResult::NeedMore)
+                return result;
+        }
+        // All of it belongs to the hello still.
+        if (buffered.size() > MaxHelloBytes)
+            return HostParseResult::Invalid;
+        return HostParseResult::NeedMore;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    HostParseResult ClientHelloParser::parseHandshake(std::string_view buffered)
+    {
+        if (handshakeBytes_ < HandshakeHeaderSize)
+            return HostParseResult::NeedMore;
+
+        // Nearly always in a single record, which is parsed where it is.
+        std::string joined;
+        std::string_view handshake;
+        if (fragments_.size() == 1)
+            handshake = buffered.substr(fragments_.front().first, fragments_.front().second);
+        else
+        {
+            joined.reserve(handshakeBytes_);
+            for (auto const& [offset, size] : fragments_)
+                joined.append(buffered.substr(offset, size));
+            handshake = joined;
+        }
+
+        Reader reader{handshake};
+        if (reader.number(1) != ClientHelloMessage)
+            return HostParseResult::Invalid;
+        const auto helloSize = reader.number(3);
+        if (HandshakeHeaderSize + helloSize > MaxHelloBytes)
+            return HostParseResult::Invalid;
+        if (handshake.size() < HandshakeHeaderSize + helloSize)
+            return HostParseResult::NeedMore;
+        return parseHello(handshake.substr(HandshakeHeaderSize, helloSize));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string const& ClientHelloParser::host() const
+    {
+        return host_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    HostParseResult ClientHelloParser::parseHello(std::string_view hello)
+    {
+        Reader reader{hello};
+        // legacy_version, random, legacy_session_id, cipher_suites, legacy_compression_methods
+        reader.number(2);
+        reader.bytes(32);
+        reader.vector(1);
+        reader.vector(2);
+        reader.vector(1);
+        Reader extensions{reader.vector(2)};
+        if (!reader.ok())
+            return HostParseResult::Invalid;
+
+        while (!extensions.empty())
+        {
+            const auto type = extensions.number(2);
+            Reader extension{extensions.vector(2)};
+            if (!extensions.ok())
+                return HostParseResult::Invalid;
+            if (type != ServerNameExtension)
+                continue;
+
+            Reader names{extension.vector(2)};
+            while (names.ok() && !names.empty())
+            {
+                const auto nameType = names.number(1);
+                const auto name = names.vector(2);
+                if (names.ok() && nameType == HostNameType && !name.empty())
+                {
+                    host_ = normalizeHostName(name);
+                    return HostParseResult::Found;
+                }
+            }
+            return HostParseResult::Invalid;
+        }
+        // Without a server name there is nothing to route by.
+        return HostParseResult::Invalid;
+    }
+    // #####################################################################################################################
+}
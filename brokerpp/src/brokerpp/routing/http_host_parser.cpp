@@ -0,0 +1,105 @@
+#include <brokerpp/routing/http_host_parser.hpp>
+#include <brokerpp/routing/route_table.hpp>
+
+#include <algorithm>
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        bool equalsIgnoringCase(std::string_view lhs, std::string_view rhs)
+        {
+            return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char l, char r) {
+                return (l | 0x20) == (r | 0x20);
+            });
+        }
+
+        std::string_view trimWhitespace(std::string_view view)
+        {
+            while (!view.empty() && (view.front() == ' ' || view.front() == '\t'))
+                view.remove_prefix(1);
+            while (!view.empty() && (view.back() == ' ' || view.back() == '\t'))
+                view.remove_suffix(1);
+            return view;
+        }
+
+        /**
+         * @return The host of "user@host:port", IPv6 addresses keep their brackets.
+         */
+        std::string_view hostOfAuthority(std::string_view authority)
+        {
+            if (const auto at = authority.rfind('@'); at != std::string_view::npos)
+                authority.remove_prefix(at + 1);
+            if (authority.starts_with('['))
+                return authority.substr(0, authority.find(']') + 1);
+            return authority.substr(0, authority.find(':'));
+        }
+    }
+    // #####################################################################################################################
+    HostParseResult HttpHostParser::feed(std::string_view buffered)
+    {
+        while (true)
+        {
+            const auto end = buffered.find('\n', std::max(lineStart_, scanned_));
+            if (end == std::string_view::npos)
+            {
+                scanned_ = buffered.size();
+                return buffered.size() > MaxHeadBytes ? HostParseResult::Invalid : HostParseResult::NeedMore;
+            }
+
+            auto line = buffered.substr(lineStart_, end - lineStart_);
+            if (line.ends_with('\r'))
+                line.remove_suffix(1);
+            lineStart_ = end + 1;
+            if (lineStart_ > MaxHeadBytes)
+                return HostParseResult::Invalid;
+            if (const auto result = onLine(line); result != HostParseResult::NeedMore)
+                return result;
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string const& HttpHostParser::host() const
+    {
+        return host_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    HostParseResult HttpHostParser::onLine(std::string_view line)
+    {
+        if (!requestLineSeen_)
+        {
+            // Empty lines before the request line are to be ignored.
+            if (line.empty())
+                return HostParseResult::NeedMore;
+
+            const auto methodEnd = line.find(' ');
+            const auto targetEnd = line.rfind(' ');
+            if (methodEnd == std::string_view::npos || targetEnd == methodEnd ||
+                !line.substr(targetEnd + 1).starts_with("HTTP/1."))
+            {
+                return HostParseResult::Invalid;
+            }
+            requestLineSeen_ = true;
+
+            // A target in absolute form overrides the Host header.
+            const auto target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+            const auto scheme = target.find("://");
+            if (scheme == std::string_view::npos || target.find('/') < scheme)
+                return HostParseResult::NeedMore;
+            auto authority = target.substr(scheme + 3);
+            authority = authority.substr(0, std::min(authority.find('/'), authority.find('?')));
+            host_ = normalizeHostName(hostOfAuthority(authority));
+            return host_.empty() ? HostParseResult::Invalid : HostParseResult::Found;
+        }
+
+        // End of the head without a host.
+        if (line.empty())
+            return HostParseResult::Invalid;
+
+        const auto colon = line.find(':');
+        if (colon == std::string_view::npos || !equalsIgnoringCase(line.substr(0, colon), "host"))
+            return HostParseResult::NeedMore;
+        host_ = normalizeHostName(hostOfAuthority(trimWhitespace(line.substr(colon + 1))));
+        return host_.empty() ? HostParseResult::Invalid : HostParseResult::Found;
+    }
+    // #####################################################################################################################
+}
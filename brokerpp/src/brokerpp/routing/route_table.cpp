@@ -0,0 +1,68 @@
+#include <brokerpp/routing/route_table.hpp>
+#include <brokerpp/publisher/service.hpp>
+
+#include <mutex>
+
+namespace TunnelBore::Broker
+{
+    // #####################################################################################################################
+    std::string normalizeHostName(std::string_view host)
+    {
+        if (host.ends_with('.'))
+            host.remove_suffix(1);
+        std::string result(host.size(), '\0');
+        for (std::size_t i = 0; i != host.size(); ++i)
+        {
+            const auto c = host[i];
+            result[i] = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+        return result;
+    }
+    // #####################################################################################################################
+    RouteTable::RouteTable()
+        : guard_{}
+        , routes_{}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    bool RouteTable::claim(std::vector<std::string> const& hosts, std::shared_ptr<Service> const& service)
+    {
+        std::unique_lock lock{guard_};
+        for (auto const& host : hosts)
+        {
+            auto iter = routes_.find(normalizeHostName(host));
+            if (iter == routes_.end())
+                continue;
+            // Services of a broker that handed over are not released, they are gone nonetheless.
+            auto current = iter->second.lock();
+            if (current && current != service)
+                return false;
+        }
+        for (auto const& host : hosts)
+            routes_[normalizeHostName(host)] = service;
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RouteTable::release(std::vector<std::string> const& hosts, Service const& service)
+    {
+        std::unique_lock lock{guard_};
+        for (auto const& host : hosts)
+        {
+            auto iter = routes_.find(normalizeHostName(host));
+            if (iter == routes_.end())
+                continue;
+            auto current = iter->second.lock();
+            if (!current || current.get() == &service)
+                routes_.erase(iter);
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> RouteTable::find(std::string const& host) const
+    {
+        std::shared_lock lock{guard_};
+        auto iter = routes_.find(host);
+        if (iter == routes_.end())
+            return nullptr;
+        return iter->second.lock();
+    }
+    // #####################################################################################################################
+}
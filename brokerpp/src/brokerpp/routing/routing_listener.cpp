@@ -0,0 +1,359 @@
+#include <brokerpp/routing/routing_listener.hpp>
+#include <brokerpp/routing/client_hello_parser.hpp>
+#include <brokerpp/routing/http_host_parser.hpp>
+#include <brokerpp/publisher/service.hpp>
+#include <brokerpp/publisher/service_directory.hpp>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <spdlog/spdlog.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <variant>
+
+namespace leaf = boost::leaf;
+using boost::asio::ip::tcp;
+
+namespace TunnelBore::Broker
+{
+    namespace
+    {
+        constexpr std::string_view BadRequest =
+            "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        constexpr std::string_view NotFound =
+            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        constexpr std::string_view Unavailable =
+            "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+        // Fatal alerts in a plaintext record, as they may be sent before the ServerHello.
+        constexpr std::string_view UnrecognizedNameAlert{"\x15\x03\x01\x00\x02\x02\x70", 7};
+        constexpr std::string_view InternalErrorAlert{"\x15\x03\x01\x00\x02\x02\x50", 7};
+
+        std::variant<HttpHostParser, ClientHelloParser> makeParser(RoutedProtocol protocol)
+        {
+            if (protocol == RoutedProtocol::Tls)
+                return ClientHelloParser{};
+            return HttpHostParser{};
+        }
+    }
+    // #####################################################################################################################
+    struct RoutingListener::Connection
+    {
+        tcp::socket socket;
+        /// Everything read so far, handed to the service as is.
+        std::string buffer;
+        std::variant<HttpHostParser, ClientHelloParser> parser;
+        boost::asio::steady_timer headTimer;
+
+        Connection(tcp::socket&& socket, RoutedProtocol protocol)
+            : socket{std::move(socket)}
+            , buffer{}
+            , parser{makeParser(protocol)}
+            , headTimer{this->socket.get_executor()}
+        {}
+
+        HostParseResult feed()
+        {
+            return std::visit(
+                [this](auto& parser) {
+                    return parser.feed(buffer);
+                },
+                parser);
+        }
+
+        std::string const& host() const
+        {
+            return std::visit(
+                [](auto const& parser) -> std::string const& {
+                    return parser.host();
+                },
+                parser);
+        }
+    };
+    // #####################################################################################################################
+    struct RoutingListener::Implementation
+    {
+        std::shared_ptr<IoEngine> engine;
+        std::shared_ptr<ServiceDirectory> directory;
+        RoutedProtocol protocol;
+        mutable std::mutex acceptorGuard;
+        tcp::acceptor acceptor;
+
+        Implementation(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<IoEngine> engine,
+            std::shared_ptr<ServiceDirectory> directory,
+            RoutedProtocol protocol)
+            : engine{std::move(engine)}
+            , directory{std::move(directory)}
+            , protocol{protocol}
+            , acceptorGuard{}
+            , acceptor{std::move(executor)}
+        {}
+
+        RouteTable& routes()
+        {
+            return protocol == RoutedProtocol::Tls ? directory->tlsRoutes() : directory->httpRoutes();
+        }
+
+        char const* protocolName() const
+        {
+            return protocol == RoutedProtocol::Tls ? "TLS" : "HTTP";
+        }
+    };
+    // #####################################################################################################################
+    std::string_view toString(RoutedProtocol protocol)
+    {
+        switch (protocol)
+        {
+            case RoutedProtocol::Tls:
+                return "tls";
+            case RoutedProtocol::Http:
+            default:
+                return "http";
+        }
+    }
+    // #####################################################################################################################
+    RoutingListener::RoutingListener(
+        boost::asio::any_io_executor executor,
+        std::shared_ptr<IoEngine> engine,
+        std::shared_ptr<ServiceDirectory> directory,
+        RoutedProtocol protocol)
+        : impl_{std::make_unique<Implementation>(
+              std::move(executor),
+              std::move(engine),
+              std::move(directory),
+              protocol)}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    RoutingListener::~RoutingListener() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::leaf::result<void> RoutingListener::start(RoutingListenerConfig const& config)
+    {
+        boost::system::error_code ec;
+        const auto endpoint = tcp::endpoint{boost::asio::ip::make_address(config.iface, ec), config.port};
+        if (ec)
+            return leaf::new_error("Invalid routing interface.", ec);
+
+        {
+            std::scoped_lock lock{impl_->acceptorGuard};
+            impl_->acceptor.open(endpoint.protocol(), ec);
+            if (ec)
+                return leaf::new_error("Could not open routing acceptor.", ec);
+            impl_->acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+            if (ec)
+                return leaf::new_error("Could not configure routing socket to reuse address.", ec);
+            impl_->acceptor.bind(endpoint, ec);
+            if (ec)
+                return leaf::new_error("Could not bind routing socket.", ec);
+            impl_->acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+            if (ec)
+                return leaf::new_error("Could not listen on routing socket.", ec);
+
+            spdlog::info(
+                "Routing {} connections by host on port {}.",
+                impl_->protocolName(),
+                impl_->acceptor.local_endpoint().port());
+        }
+        acceptOnce();
+        return {};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RoutingListener::stop()
+    {
+        std::scoped_lock lock{impl_->acceptorGuard};
+        boost::system::error_code ignore;
+        impl_->acceptor.close(ignore);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    RoutedProtocol RoutingListener::protocol() const
+    {
+        return impl_->protocol;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool RoutingListener::listening() const
+    {
+        std::scoped_lock lock{impl_->acceptorGuard};
+        return impl_->acceptor.is_open();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<RoutingHandover> RoutingListener::prepareHandover(std::vector<int>& descriptors)
+    {
+        std::scoped_lock lock{impl_->acceptorGuard};
+        if (!impl_->acceptor.is_open())
+            return std::nullopt;
+        boost::system::error_code ec;
+        const auto listener = impl_->acceptor.release(ec);
+        if (ec)
+        {
+            spdlog::error("Could not release {} routing listener: {}", impl_->protocolName(), ec.message());
+            return std::nullopt;
+        }
+        descriptors.push_back(listener);
+        return RoutingHandover{
+            .protocol = std::string{toString(impl_->protocol)},
+            .listenerSocket = descriptors.size() - 1,
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::leaf::result<void>
+    RoutingListener::adopt(RoutingHandover const& handover, std::vector<int> const& descriptors)
+    {
+        const auto descriptor = descriptors[handover.listenerSocket];
+        // The config may have changed the interface, the listener keeps the one of the predecessor.
+        sockaddr_storage address{};
+        socklen_t addressLength = sizeof(address);
+        if (::getsockname(descriptor, reinterpret_cast<sockaddr*>(&address), &addressLength) != 0)
+        {
+            ::close(descriptor);
+            return leaf::new_error("Could not read the address of the routing listener.");
+        }
+
+        {
+            std::scoped_lock lock{impl_->acceptorGuard};
+            boost::system::error_code ec;
+            impl_->acceptor.assign(address.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), descriptor, ec);
+            if (ec)
+            {
+                ::close(descriptor);
+                return leaf::new_error("Could not adopt routing listener.", ec);
+            }
+            spdlog::info(
+                "Routing {} connections by host on port {}, taken over.",
+                impl_->protocolName(),
+                impl_->acceptor.local_endpoint(ec).port());
+        }
+        acceptOnce();
+        return {};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RoutingListener::acceptOnce()
+    {
+        std::scoped_lock lock{impl_->acceptorGuard};
+        if (!impl_->acceptor.is_open())
+            return;
+
+        // Accepted connections are spread over the shards, the tunnels stay on them.
+        auto socket = std::make_shared<tcp::socket>(impl_->engine->nextExecutor());
+        impl_->acceptor.async_accept(*socket, [weak = weak_from_this(), socket](boost::system::error_code ec) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            if (ec)
+            {
+                spdlog::error("Could not accept routed connection: {}", ec.message());
+                return self->acceptOnce();
+            }
+
+            auto connection = std::make_shared<Connection>(std::move(*socket), self->impl_->protocol);
+            connection->headTimer.expires_after(HeadTimeout);
+            connection->headTimer.async_wait([connection](boost::system::error_code ec) {
+                if (ec == boost::asio::error::operation_aborted)
+                    return;
+                // Fails the pending read.
+                boost::system::error_code ignore;
+                connection->socket.close(ignore);
+            });
+            self->readHead(connection);
+            self->acceptOnce();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RoutingListener::readHead(std::shared_ptr<Connection> const& connection)
+    {
+        // Read right behind what is buffered, the head is handed to the service in this string as is. Growing it may
+        // reallocate and move the bytes read so far, which is cheap while looking for the host.
+        const auto used = connection->buffer.size();
+        connection->buffer.resize(used + ReadChunk);
+        connection->socket.async_read_some(
+            boost::asio::buffer(connection->buffer.data() + used, ReadChunk),
+            [weak = weak_from_this(), connection, used](boost::system::error_code ec, std::size_t bytesTransferred) {
+                connection->buffer.resize(used + bytesTransferred);
+                auto self = weak.lock();
+                if (!self || ec)
+                {
+                    connection->headTimer.cancel();
+                    boost::system::error_code ignore;
+                    connection->socket.close(ignore);
+                    return;
+                }
+
+                switch (connection->feed())
+                {
+                    case HostParseResult::NeedMore:
+                        return self->readHead(connection);
+                    case HostParseResult::Invalid:
+                        return self->refuse(connection, Refusal::Malformed);
+                    case HostParseResult::Found:
+                        return self->route(connection);
+                }
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RoutingListener::route(std::shared_ptr<Connection> const& connection)
+    {
+        connection->headTimer.cancel();
+        auto service = impl_->routes().find(connection->host());
+        if (!service)
+        {
+            spdlog::info("No service for {} host '{}'.", impl_->protocolName(), connection->host());
+            return refuse(connection, Refusal::UnknownHost);
+        }
+        // TLS is passed through as is, only HTTP may be proxied.
+        const bool accepted = impl_->protocol == RoutedProtocol::Tls
+            ? service->tunnelConnection(std::move(connection->socket), std::move(connection->buffer))
+            : service->acceptConnection(std::move(connection->socket), std::move(connection->buffer));
+        if (!accepted)
+            return refuse(connection, Refusal::Unavailable);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void RoutingListener::refuse(std::shared_ptr<Connection> const& connection, Refusal refusal)
+    {
+        connection->headTimer.cancel();
+        std::string_view response;
+        if (impl_->protocol == RoutedProtocol::Http)
+        {
+            switch (refusal)
+            {
+                case Refusal::Malformed:
+                    response = BadRequest;
+                    break;
+                case Refusal::UnknownHost:
+                    response = NotFound;
+                    break;
+                case Refusal::Unavailable:
+                    response = Unavailable;
+                    break;
+            }
+        }
+        else if (refusal == Refusal::UnknownHost)
+            response = UnrecognizedNameAlert;
+        else if (refusal == Refusal::Unavailable)
+            response = InternalErrorAlert;
+
+        // Anything that is not a ClientHello is not answered at all.
+        if (response.empty())
+        {
+            boost::system::error_code ignore;
+            connection->socket.close(ignore);
+            return;
+        }
+        boost::asio::async_write(
+            connection->socket,
+            boost::asio::buffer(response.data(), response.size()),
+            [connection](boost::system::error_code, std::size_t) {
+                boost::system::error_code ignore;
+                connection->socket.shutdown(tcp::socket::shutdown_both, ignore);
+                connection->socket.close(ignore);
+            });
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,9 @@
+include(FetchContent)
+FetchContent_Declare(
+	benchmark
+	GIT_REPOSITORY https://github.com/google/benchmark.git
+	GIT_TAG        v1.8.3
+)
+set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+FetchContent_MakeAvailable(benchmark)
\ No newline at end of file
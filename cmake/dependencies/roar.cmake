@@ -1,7 +1,7 @@
-include(FetchContent)
-FetchContent_Declare(
-	roar
-	GIT_REPOSITORY https://github.com/5cript/roar.git
-	GIT_TAG        4ac9a877b70fbb821de2edbb7dd3fcad1b0a7f08
-)
+include(FetchContent)
+FetchContent_Declare(
+	roar
+	GIT_REPOSITORY https://github.com/5cript/roar.git
+	GIT_TAG        4ac9a877b70fbb821de2edbb7dd3fcad1b0a7f08
+)
 FetchContent_MakeAvailable(roar)
\ No newline at end of file
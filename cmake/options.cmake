@@ -1 +1,3 @@
-option(ENABLE_SANITIZERS "Enable sanitizers" OFF)
\ No newline at end of file
+option(ENABLE_SANITIZERS "Enable sanitizers" OFF)
+option(ENABLE_BENCHMARKS "Build the benchmark targets" OFF)
+option(ENABLE_COMPRESSION "Support compressing tunnels between publisher and broker, needs libzstd" ON)
\ No newline at end of file
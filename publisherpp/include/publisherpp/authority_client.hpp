@@ -0,0 +1,125 @@
+#pragma once
+
+#include <publisherpp/config.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/beast/http/status.hpp>
+#include <boost/beast/ssl/ssl_stream.hpp>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace TunnelBore::Publisher
+{
+    struct AuthorityResponse
+    {
+        boost::beast::http::status status;
+        std::string body;
+        /// Retry-After of the response, if given in seconds.
+        std::optional<std::chrono::seconds> retryAfter;
+    };
+
+    /**
+     * Talks to the authority without blocking the executor.
+     *
+     * Connections are kept alive and reused, at most MaxInFlight requests are on the wire at the same time.
+     * Further requests wait in a queue. Completion handlers are posted to the executor of the client, outside of its
+     * strand, so they may run concurrently with each other.
+     */
+    class AuthorityClient : public std::enable_shared_from_this<AuthorityClient>
+    {
+      public:
+        using CompletionHandler = std::function<void(boost::system::error_code, AuthorityResponse)>;
+
+        constexpr static std::size_t MaxInFlight = 4;
+        constexpr static std::chrono::seconds RequestTimeout{10};
+
+        AuthorityClient(boost::asio::any_io_executor executor, Config const& cfg);
+        /**
+         * @brief Talks to another server the same way, like the broker.
+         *
+         * @param authorization Sent with requests that do not bring their own.
+         */
+        AuthorityClient(
+            boost::asio::any_io_executor executor,
+            std::string host,
+            std::string port,
+            bool ssl,
+            std::string authorization);
+        ~AuthorityClient();
+        AuthorityClient(AuthorityClient const&) = delete;
+        AuthorityClient& operator=(AuthorityClient const&) = delete;
+        AuthorityClient(AuthorityClient&&) = delete;
+        AuthorityClient& operator=(AuthorityClient&&) = delete;
+
+        /**
+         * @brief Sends a basic authenticated request to the authority.
+         *
+         * @param verb The http method.
+         * @param target The path, like "/api/auth".
+         * @param body A json body, sent when not empty.
+         * @param handler Called with an error code on connection failures, otherwise with the response.
+         */
+        void
+        request(boost::beast::http::verb verb, std::string target, std::string body, CompletionHandler handler);
+
+        /**
+         * @brief Like above, with this authorization header instead of the basic authentication.
+         */
+        void request(
+            boost::beast::http::verb verb,
+            std::string target,
+            std::string body,
+            std::string authorization,
+            CompletionHandler handler);
+
+      private:
+        using Stream = std::variant<boost::beast::tcp_stream, boost::beast::ssl_stream<boost::beast::tcp_stream>>;
+
+        struct PendingRequest
+        {
+            boost::beast::http::verb verb;
+            std::string target;
+            std::string body;
+            /// Empty for the one of the client.
+            std::string authorization;
+            CompletionHandler handler;
+            bool retried;
+        };
+
+        struct Connection;
+
+        void pump();
+        void connect(std::shared_ptr<Connection> connection, PendingRequest request);
+        void write(std::shared_ptr<Connection> connection, PendingRequest request);
+        void finish(
+            std::shared_ptr<Connection> const& connection,
+            PendingRequest request,
+            boost::system::error_code ec,
+            AuthorityResponse response,
+            bool keepAlive);
+
+      private:
+        boost::asio::strand<boost::asio::any_io_executor> strand_;
+        std::string host_;
+        std::string port_;
+        std::string authorization_;
+        std::optional<boost::asio::ssl::context> sslContext_;
+        boost::asio::ip::tcp::resolver resolver_;
+
+        std::deque<PendingRequest> queue_;
+        std::vector<std::shared_ptr<Connection>> idle_;
+        std::size_t inFlight_;
+    };
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <publisherpp/service_info.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TunnelBore::Publisher
+{
+    enum class BalancingPolicy
+    {
+        /// The backend with the fewest tunnels.
+        LeastConnections,
+        /// The backend with the lowest connect latency, weighted by its tunnels.
+        Latency
+    };
+
+    std::optional<BalancingPolicy> balancingPolicyFromString(std::string_view name);
+
+    /**
+     * The hidden backends of a service. Picks one for every tunnel, probes them and ejects the ones that keep
+     * failing to connect for a while.
+     */
+    class BackendPool : public std::enable_shared_from_this<BackendPool>
+    {
+      public:
+        /// A probe that did not connect by then counts as failed.
+        constexpr static std::chrono::seconds ProbeTimeout{2};
+
+        struct Options
+        {
+            BalancingPolicy policy = BalancingPolicy::LeastConnections;
+            /// Time between two probes of every backend, 0 to not probe.
+            std::chrono::seconds healthCheckInterval{10};
+            /// Consecutive connect failures after which a backend is ejected, 0 to never eject.
+            int maxConnectFailures = 3;
+            std::chrono::seconds ejectionTime{30};
+            /// A tunnel gives up on a backend that did not connect by then and tries the next one.
+            std::chrono::seconds connectTimeout{3};
+        };
+
+        struct Pick
+        {
+            std::size_t index;
+            std::string host;
+            int port;
+        };
+
+        BackendPool(boost::asio::any_io_executor executor, std::vector<BackendInfo> backends, Options options);
+        ~BackendPool();
+        BackendPool(BackendPool const&) = delete;
+        BackendPool& operator=(BackendPool const&) = delete;
+        BackendPool(BackendPool&&) = delete;
+        BackendPool& operator=(BackendPool&&) = delete;
+
+        /**
+         * @brief Starts probing the backends, if enabled.
+         */
+        void start();
+
+        /**
+         * @param skip Indices of backends already tried for this tunnel.
+         * @return The backend to connect to, nothing if none is usable.
+         */
+        std::optional<Pick> pick(std::vector<std::size_t> const& skip = {}) const;
+
+        /**
+         * @return Keeps the tunnel counted on the backend while alive.
+         */
+        std::shared_ptr<void> connected(std::size_t index, std::chrono::microseconds latency);
+        void connectFailed(std::size_t index);
+        std::chrono::seconds connectTimeout() const;
+
+        /**
+         * @return Whether any backend is usable.
+         */
+        bool healthy() const;
+
+        /**
+         * @brief Called with the new state, whenever the pool becomes healthy or unhealthy. Calls do not overlap and
+         * come in the order of the changes.
+         */
+        void onHealthChanged(std::function<void(bool)> handler);
+
+      private:
+        struct Backend
+        {
+            BackendInfo info;
+            std::size_t tunnels = 0;
+            /// Moving average of the connect latency, 0 until the first connect.
+            std::chrono::microseconds latency{0};
+            int consecutiveFailures = 0;
+            bool probeHealthy = true;
+            std::chrono::steady_clock::time_point ejectedUntil{};
+            /// Looks at the pool again when the ejection ends.
+            boost::asio::steady_timer ejectionTimer;
+        };
+
+        bool usable(Backend const& backend, std::chrono::steady_clock::time_point now) const;
+        bool healthyLocked(std::chrono::steady_clock::time_point now) const;
+        void recordLatency(Backend& backend, std::chrono::microseconds latency);
+        void probeAll();
+        void probe(std::size_t index);
+        void onProbeResult(std::size_t index, bool success, std::chrono::microseconds latency);
+        /// Notifies the health handler on notifyStrand_ if the state changed since the last notification.
+        void updateHealth();
+
+      private:
+        boost::asio::any_io_executor executor_;
+        Options options_;
+        mutable std::mutex guard_;
+        std::vector<Backend> backends_;
+        bool lastHealthy_;
+        std::function<void(bool)> onHealthChanged_;
+        boost::asio::steady_timer probeTimer_;
+        boost::asio::strand<boost::asio::any_io_executor> notifyStrand_;
+    };
+}
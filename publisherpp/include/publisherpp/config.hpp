@@ -1,24 +1,60 @@
-#pragma once
-
-#include <sharedpp/json.hpp>
-#include <publisherpp/service_info.hpp>
-
-namespace TunnelBore::Publisher
-{
-    struct Config
-    {
-        std::string identity;
-        std::string passHashed;
-        std::string host;
-        int port;
-        std::string authorityHost;
-        int authorityPort;
-        std::vector<ServiceInfo> services;
-        bool ssl = true;
-    };
-
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Config, identity, passHashed, host, port, authorityHost, authorityPort, services, ssl)
-
-    Config loadConfig();
-    void saveConfig(Config const& config);
+#pragma once
+
+#include <sharedpp/json.hpp>
+#include <publisherpp/service_info.hpp>
+
+#include <filesystem>
+
+namespace TunnelBore::Publisher
+{
+    struct Config
+    {
+        std::string identity;
+        /// Tells several publishers with the same identity apart, so that they can serve the same ports as
+        /// replicas. Letters, digits, '-' and '_', at most 64 of them. Empty for a single publisher.
+        std::string instance;
+        std::string passHashed;
+        std::string host;
+        int port = 0;
+        std::string authorityHost;
+        int authorityPort = 0;
+        std::vector<ServiceInfo> services;
+        bool ssl = true;
+        /// A ping is only sent when the control line was idle for this long.
+        int heartbeatIntervalSeconds = 15;
+        /// Reconnect when nothing was received from the broker for this long.
+        int heartbeatTimeoutSeconds = 45;
+        /// Threads serving tunnel connections, each with its own io_context. 0 for one per hardware thread.
+        std::size_t ioThreads = 0;
+        bool pinIoThreads = false;
+        /// Tunnel setups taking longer than this are logged with the time of every stage, 0 disables the log.
+        int slowTunnelSetupMs = 0;
+        /// Encrypts the tunnel connections to the broker if it offers it, needs ssl.
+        bool dataLinkTls = true;
+        /// Services changed in the config file are applied after at most this long, 0 to only read it at start.
+        int configReloadSeconds = 5;
+    };
+
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+        Config,
+        identity,
+        instance,
+        passHashed,
+        host,
+        port,
+        authorityHost,
+        authorityPort,
+        services,
+        ssl,
+        heartbeatIntervalSeconds,
+        heartbeatTimeoutSeconds,
+        ioThreads,
+        pinIoThreads,
+        slowTunnelSetupMs,
+        dataLinkTls,
+        configReloadSeconds)
+
+    std::filesystem::path configPath();
+    Config loadConfig();
+    void saveConfig(Config const& config);
 }
\ No newline at end of file
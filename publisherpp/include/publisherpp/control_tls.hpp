@@ -0,0 +1,33 @@
+#pragma once
+
+#include <boost/asio/ssl/context.hpp>
+
+namespace TunnelBore::Publisher
+{
+    /**
+     * The tls context of the control line, shared by all its connections. Keeps the last session ticket of the
+     * broker, so that a reconnect resumes the session instead of verifying a new certificate signature.
+     */
+    class ControlTls
+    {
+      public:
+        ControlTls();
+        ControlTls(ControlTls const&) = delete;
+        ControlTls& operator=(ControlTls const&) = delete;
+        ControlTls(ControlTls&&) = delete;
+        ControlTls& operator=(ControlTls&&) = delete;
+
+        /**
+         * @brief A context for the next connection, it shares the session tickets with all others made here.
+         */
+        boost::asio::ssl::context makeContext() const;
+
+        /**
+         * @return Whether the next connection can try to resume a session.
+         */
+        bool hasSession() const;
+
+      private:
+        boost::asio::ssl::context context_;
+    };
+}
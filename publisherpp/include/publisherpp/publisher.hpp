@@ -1,77 +1,174 @@
-#pragma once
-
-#include <publisherpp/config.hpp>
-#include <publisherpp/service.hpp>
-#include <roar/websocket/websocket_client.hpp>
-#include <roar/websocket/read_result.hpp>
-
-#include <boost/asio/any_io_executor.hpp>
-#include <boost/asio/deadline_timer.hpp>
-
-#include <chrono>
-#include <string>
-#include <vector>
-#include <deque>
-#include <memory>
-#include <mutex>
-
-namespace TunnelBore::Publisher
-{
-    struct ControlSendOperation
-    {
-        json payload;
-        std::function<void()> callback;
-    };
-
-    class Publisher : public std::enable_shared_from_this<Publisher>
-    {
-      public:
-        Publisher(boost::asio::any_io_executor exec, Config cfg);
-        ~Publisher();
-        Publisher(Publisher const&) = delete;
-        Publisher& operator=(Publisher const&) = delete;
-        Publisher(Publisher&&) = delete;
-        Publisher& operator=(Publisher&&) = delete;
-
-        void authenticate();
-
-      private:
-        void connectToBroker();
-        void retryConnect();
-        void doControlReading();
-        void onControlRead(Roar::WebsocketReadResult message);
-        void sendQueued(json&& j);
-        void sendOnceFromQueue();
-        void startAliveTimer();
-        void stopAliveTimer();
-        void onNewTunnel(
-            std::string const& serviceId,
-            std::string const& tunnelId,
-            int hiddenPort,
-            int publicPort,
-            std::string const& socketType);
-        static std::shared_ptr<Roar::WebsocketClient> createWebsocketClient(boost::asio::any_io_executor exec, Config const& cfg);
-
-      private:
-        const Config cfg_;
-        boost::asio::any_io_executor exec_;
-        std::shared_ptr<Roar::WebsocketClient> ws_;
-        std::vector<std::shared_ptr<Service>> services_;
-        std::string authToken_;
-        std::chrono::system_clock::time_point tokenCreationTime_;
-
-        // reconnect related
-        boost::asio::deadline_timer reconnectTimer_;
-        std::chrono::seconds reconnectTime_;
-        bool isReconnecting_;
-        std::recursive_mutex reconnectMutex_;
-
-        // alive tester
-        boost::asio::deadline_timer pingAliveTimer_;
-
-        // send queue related
-        std::recursive_mutex controlSendQueueMutex_;
-        std::deque<ControlSendOperation> controlSendOperations_;
-        bool sendInProgress_;
-    };
+#pragma once
+
+#include <publisherpp/authority_client.hpp>
+#include <publisherpp/config.hpp>
+#include <publisherpp/control_tls.hpp>
+#include <publisherpp/service.hpp>
+#include <sharedpp/data_link_tls.hpp>
+#include <sharedpp/io_engine.hpp>
+#include <sharedpp/tunnel_trace.hpp>
+#include <sharedpp/wire_encoding.hpp>
+#include <roar/websocket/websocket_client.hpp>
+#include <roar/websocket/read_result.hpp>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+
+namespace TunnelBore::Publisher
+{
+    struct ControlSendOperation
+    {
+        std::string payload;
+        WireEncoding encoding;
+        std::function<void()> callback;
+    };
+
+    class Publisher : public std::enable_shared_from_this<Publisher>
+    {
+      public:
+        /// Upper bound for the time a message waits to be batched with following ones.
+        constexpr static std::chrono::microseconds MaxBatchDelay{500};
+        /// Frames are not grown beyond this, unless a single message is larger.
+        constexpr static std::size_t MaxBatchBytes = 64 * 1024;
+        /// Reconnect delays are picked at random between these, growing with every failed attempt.
+        constexpr static std::chrono::milliseconds MinReconnectDelay{1000};
+        constexpr static std::chrono::milliseconds MaxReconnectDelay{60'000};
+        /// Tokens are reused for reconnecting until this long before they expire.
+        constexpr static std::chrono::hours TokenRenewalMargin{24};
+        /// A reused token is replaced after the broker declined it this often in a row.
+        constexpr static int MaxDeclinedTokenReuses = 2;
+
+        Publisher(boost::asio::any_io_executor exec, std::shared_ptr<IoEngine> engine, Config cfg);
+        ~Publisher();
+        Publisher(Publisher const&) = delete;
+        Publisher& operator=(Publisher const&) = delete;
+        Publisher(Publisher&&) = delete;
+        Publisher& operator=(Publisher&&) = delete;
+
+        /**
+         * @brief Starts watching the services and the config, then connects to the broker.
+         */
+        void start();
+
+        void authenticate();
+
+        /**
+         * @brief Checks the config file for changed services every configReloadSeconds, see reloadServices.
+         */
+        void watchConfig();
+
+        /**
+         * @brief Replaces the services by these. Only the difference is sent to the broker, unchanged services keep
+         * their listeners and tunnels.
+         */
+        void reloadServices(std::vector<ServiceInfo> const& services);
+
+      private:
+        void connectToBroker();
+        /**
+         * @param notBefore Lower bound for the random delay, like the Retry-After of a busy broker.
+         */
+        void retryConnect(std::chrono::milliseconds notBefore = std::chrono::milliseconds{0});
+        /**
+         * @brief Asks the broker again without upgrade to learn whether it declined the token or was busy.
+         */
+        void probeDeclinedUpgrade();
+        std::string controlPath() const;
+        void reconnect();
+        bool tokenReusable() const;
+        void doControlReading();
+        void onControlRead(Roar::WebsocketReadResult message);
+        void sendQueued(json&& j);
+        void sendOnceFromQueue();
+        void scheduleSendBatch();
+        void onControlMessage(json const& j);
+        void startAliveTimer();
+        void stopAliveTimer();
+        void onNewTunnel(
+            std::string const& serviceId,
+            std::string const& tunnelId,
+            int hiddenPort,
+            int publicPort,
+            int connectPort,
+            std::string const& socketType);
+        void onTunnelPiping(TunnelTrace const& trace);
+        void checkConfig();
+        std::shared_ptr<Service> makeService(ServiceInfo const& serviceInfo) const;
+        void watchServiceHealth(std::shared_ptr<Service> const& service);
+        /// Withdraws the service from the broker or announces it again.
+        void onServiceHealthChanged(std::weak_ptr<Service> const& weakService, bool healthy);
+        /**
+         * @return false if the broker does not take ServicesUpdate messages.
+         */
+        bool sendServicesUpdate(json&& added, json&& removed);
+        static std::shared_ptr<Roar::WebsocketClient>
+        createWebsocketClient(boost::asio::any_io_executor exec, std::shared_ptr<ControlTls> const& controlTls);
+
+      private:
+        const Config cfg_;
+        boost::asio::any_io_executor exec_;
+        /// Shared by all connections of the control line to resume their tls session, nullptr without ssl.
+        std::shared_ptr<ControlTls> controlTls_;
+        std::shared_ptr<Roar::WebsocketClient> ws_;
+        std::shared_ptr<AuthorityClient> authorityClient_;
+        /// Plain http requests to the broker, see probeDeclinedUpgrade.
+        std::shared_ptr<AuthorityClient> brokerClient_;
+        std::shared_ptr<IoEngine> engine_;
+        /// Services and the config they were made from, in the same order.
+        std::mutex servicesMutex_;
+        std::vector<ServiceInfo> serviceInfos_;
+        std::vector<std::shared_ptr<Service>> services_;
+        std::string authToken_;
+        std::chrono::system_clock::time_point tokenCreationTime_;
+        std::chrono::system_clock::time_point tokenExpiry_;
+        int declinedTokenReuses_;
+        TunnelSetupStats setupStats_;
+
+        // reconnect related
+        boost::asio::deadline_timer reconnectTimer_;
+        std::chrono::milliseconds reconnectDelay_;
+        std::minstd_rand reconnectRandom_;
+        bool isReconnecting_;
+        std::recursive_mutex reconnectMutex_;
+
+        // alive tester
+        boost::asio::deadline_timer pingAliveTimer_;
+        std::atomic<std::chrono::steady_clock::time_point> lastControlSend_;
+        std::atomic<std::chrono::steady_clock::time_point> lastControlReceive_;
+
+        // send queue related
+        std::recursive_mutex controlSendQueueMutex_;
+        std::deque<ControlSendOperation> controlSendOperations_;
+        std::size_t controlSendBytes_;
+        bool sendInProgress_;
+        bool brokerBatching_;
+        bool brokerTunnelTraces_;
+        std::vector<std::string> brokerCompressions_;
+        /// dataLinkTls_ if the broker offered encrypted tunnels, nullptr otherwise.
+        std::shared_ptr<boost::asio::ssl::context> brokerDataLinkTls_;
+        /// Set once the broker accepted the handshake, whether it takes ServicesUpdate messages.
+        std::optional<bool> brokerServicesUpdates_;
+        bool handshakeSent_;
+        /// A ServicesUpdate was sent before the broker said whether it understands them.
+        bool unconfirmedServicesUpdate_;
+        std::shared_ptr<boost::asio::ssl::context> dataLinkTls_;
+        WireEncoding controlEncoding_;
+        bool sendBatchScheduled_;
+        boost::asio::deadline_timer sendBatchTimer_;
+
+        // config reload related
+        boost::asio::deadline_timer configWatchTimer_;
+        std::filesystem::file_time_type configWriteTime_;
+    };
 }
\ No newline at end of file
@@ -1,63 +1,177 @@
-#pragma once
-
-#include <publisherpp/service_session.hpp>
-
-#include <sharedpp/json.hpp>
-#include <boost/asio/any_io_executor.hpp>
-
-#include <unordered_map>
-
-namespace TunnelBore::Publisher
-{
-    class Service : public std::enable_shared_from_this<Service>
-    {
-        struct ServiceSessionPair
-        {
-            std::shared_ptr<ServiceSession> inward;
-            std::shared_ptr<ServiceSession> outward;
-            std::shared_ptr<PipeOperation<ServiceSession>> inwardPipe;
-            std::shared_ptr<PipeOperation<ServiceSession>> outwardPipe;
-        };
-
-      public:
-        Service(
-            boost::asio::any_io_executor executor,
-            std::optional<std::string> name,
-            int publicPort,
-            std::string hiddenHost,
-            int hiddenPort);
-
-        void createSession(std::string const& brokerHost, std::string const& token, std::string const& tunnelId);
-
-        std::string name() const;
-        int publicPort() const;
-        std::string const& hiddenHost() const;
-        int hiddenPort() const;
-
-        friend void to_json(nlohmann::json& j, const Service& v)
-        {
-            j = nlohmann::json{
-                {"name", v.name_},
-                {"publicPort", v.publicPort_},
-                {"hiddenHost", v.hiddenHost_},
-                {"hiddenPort", v.hiddenPort_}};
-        }
-
-        friend void from_json(const nlohmann::json& j, Service& v)
-        {
-            j.at("name").get_to(v.name_);
-            j.at("publicPort").get_to(v.publicPort_);
-            j.at("hiddenHost").get_to(v.hiddenHost_);
-            j.at("hiddenPort").get_to(v.hiddenPort_);
-        }
-
-      private:
-        boost::asio::any_io_executor executor_;
-        std::optional<std::string> name_;
-        int publicPort_;
-        std::string hiddenHost_;
-        int hiddenPort_;
-        std::recursive_mutex sessionGuard_;
-        std::unordered_map<std::string, ServiceSessionPair> sessions_;
-    };
+#pragma once
+
+#include <publisherpp/backend_pool.hpp>
+#include <publisherpp/service_session.hpp>
+
+#include <sharedpp/data_link_tls.hpp>
+#include <sharedpp/json.hpp>
+#include <sharedpp/io_engine.hpp>
+#include <sharedpp/stream_compression.hpp>
+#include <sharedpp/tunnel_trace.hpp>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace TunnelBore::Publisher
+{
+    class Service : public std::enable_shared_from_this<Service>
+    {
+        struct ServiceSessionPair
+        {
+            std::shared_ptr<ServiceSession> inward;
+            std::shared_ptr<ServiceSession> outward;
+            std::shared_ptr<PipeOperation<ServiceSession>> inwardPipe;
+            std::shared_ptr<PipeOperation<ServiceSession>> outwardPipe;
+            bool compressed;
+            /// Counts the tunnel on its backend, see BackendPool::connected.
+            std::shared_ptr<void> backendLease;
+        };
+
+      public:
+        /// Resolving and connecting to the broker fails after this long, backends have their own, see BackendPool.
+        constexpr static std::chrono::seconds ConnectTimeout{10};
+
+        /**
+         * @param backends Where tunnels are connected to, hiddenHost and hiddenPort only identify the service.
+         * @param compression Name of the compression for tunnels to the broker, ignored if not supported.
+         */
+        Service(
+            std::shared_ptr<IoEngine> engine,
+            std::optional<std::string> name,
+            int publicPort,
+            std::string hiddenHost,
+            int hiddenPort,
+            std::shared_ptr<BackendPool> backends,
+            std::optional<std::string> const& compression = std::nullopt,
+            int compressionLevel = defaultCompressionLevel);
+
+        /**
+         * @param brokerPort Where the broker listens for this service, usually the public port.
+         * @param trace Marked with the stages of the setup.
+         * @param onPiping Called with the trace once both connections are piped into each other.
+         *
+         * Returns right away, the connections are made on the shard of the tunnel.
+         */
+        void createSession(
+            std::string const& brokerHost,
+            int brokerPort,
+            std::string const& token,
+            std::string const& tunnelId,
+            std::shared_ptr<TunnelTrace> trace,
+            std::function<void(TunnelTrace const&)> onPiping);
+
+        /**
+         * @brief Tunnels are only compressed if the broker supports the compression as well.
+         */
+        void setBrokerCompressions(std::vector<std::string> const& compressions);
+
+        /**
+         * @brief Tunnel connections to the broker are encrypted with the context, if not null.
+         */
+        void setDataLinkTls(std::shared_ptr<boost::asio::ssl::context> context);
+
+        /**
+         * @brief Starts probing the backends, the handler is called whenever the service becomes usable or unusable.
+         */
+        void watchHealth(std::function<void(bool)> onHealthChanged);
+
+        /**
+         * @return Whether any backend is usable. Services that are not are withdrawn from the broker.
+         */
+        bool healthy() const;
+
+        std::string name() const;
+        int publicPort() const;
+        std::string const& hiddenHost() const;
+        int hiddenPort() const;
+
+        friend void to_json(nlohmann::json& j, const Service& v)
+        {
+            j = nlohmann::json{
+                {"name", v.name_},
+                {"publicPort", v.publicPort_},
+                {"hiddenHost", v.hiddenHost_},
+                {"hiddenPort", v.hiddenPort_}};
+            if (v.compression_)
+            {
+                j["compression"] = toString(*v.compression_);
+                j["compressionLevel"] = v.compressionLevel_;
+            }
+        }
+
+        friend void from_json(const nlohmann::json& j, Service& v)
+        {
+            j.at("name").get_to(v.name_);
+            j.at("publicPort").get_to(v.publicPort_);
+            j.at("hiddenHost").get_to(v.hiddenHost_);
+            j.at("hiddenPort").get_to(v.hiddenPort_);
+        }
+
+      private:
+        using ConnectHandler = std::function<void(std::shared_ptr<ServiceSession>)>;
+
+        /**
+         * @brief Resolves and connects without blocking, the handler is called with null on failure or timeout.
+         */
+        void connect(
+            boost::asio::any_io_executor const& executor,
+            std::string const& host,
+            int port,
+            std::chrono::seconds timeout,
+            std::string const& tunnelId,
+            ConnectHandler onConnected);
+        std::shared_ptr<ServiceSession>
+        makeSession(boost::asio::ip::tcp::socket&& socket, std::string const& tunnelId);
+        /**
+         * @brief Sends the token to the broker, through TLS if data links are encrypted, then connects a backend.
+         */
+        void sendToken(
+            boost::asio::any_io_executor const& executor,
+            std::shared_ptr<ServiceSession> const& outwards,
+            std::string const& tunnelId,
+            std::shared_ptr<std::string> const& prefixedToken,
+            std::shared_ptr<TunnelTrace> const& trace,
+            std::function<void(TunnelTrace const&)> const& onPiping);
+        /**
+         * @brief Connects to a backend not tried yet for this tunnel, the next one is tried when it fails.
+         */
+        void connectBackend(
+            boost::asio::any_io_executor const& executor,
+            std::shared_ptr<ServiceSession> const& outwards,
+            std::string const& tunnelId,
+            std::shared_ptr<TunnelTrace> const& trace,
+            std::function<void(TunnelTrace const&)> const& onPiping,
+            std::vector<std::size_t> tried);
+        /**
+         * @brief Pipes the connections to the broker and to the backend into each other.
+         */
+        void link(
+            std::shared_ptr<ServiceSession> const& outwards,
+            std::shared_ptr<ServiceSession> const& inwards,
+            std::string const& tunnelId,
+            std::shared_ptr<void> backendLease,
+            std::shared_ptr<TunnelTrace> const& trace,
+            std::function<void(TunnelTrace const&)> const& onPiping);
+
+      private:
+        std::shared_ptr<IoEngine> engine_;
+        std::optional<std::string> name_;
+        int publicPort_;
+        std::string hiddenHost_;
+        int hiddenPort_;
+        std::shared_ptr<BackendPool> backends_;
+        std::optional<StreamCompression> compression_;
+        int compressionLevel_;
+        std::atomic_bool brokerCompresses_;
+        std::shared_ptr<CompressionStats> towardsBroker_;
+        std::shared_ptr<CompressionStats> fromBroker_;
+        std::atomic<std::shared_ptr<boost::asio::ssl::context>> dataLinkTls_;
+        std::recursive_mutex sessionGuard_;
+        std::unordered_map<std::string, ServiceSessionPair> sessions_;
+    };
 }
\ No newline at end of file
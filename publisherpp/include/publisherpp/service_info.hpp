@@ -1,19 +1,92 @@
-#pragma once
-
-#include <sharedpp/json.hpp>
-
-#include <string>
-#include <optional>
-
-namespace TunnelBore::Publisher
-{
-    struct ServiceInfo
-    {
-        std::optional<std::string> name;
-        std::string socketType;
-        int hiddenPort;
-        int publicPort;
-        std::optional<std::string> hiddenHost;
-    };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ServiceInfo, name, socketType, hiddenPort, publicPort, hiddenHost)
-}
\ No newline at end of file
+#pragma once
+
+#include <sharedpp/json.hpp>
+#include <sharedpp/stream_compression.hpp>
+
+#include <string>
+#include <optional>
+#include <vector>
+
+namespace TunnelBore::Publisher
+{
+    struct BackendInfo
+    {
+        std::string host;
+        int port;
+
+        bool operator==(BackendInfo const&) const = default;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BackendInfo, host, port)
+
+    struct ServiceInfo
+    {
+        std::optional<std::string> name;
+        std::string socketType;
+        int hiddenPort;
+        int publicPort;
+        std::optional<std::string> hiddenHost;
+        /// Compresses the tunnels to the broker, like "zstd". Only used if the broker supports it.
+        std::optional<std::string> compression = std::nullopt;
+        int compressionLevel = defaultCompressionLevel;
+        /// More backends tunnels are spread over, besides hiddenHost and hiddenPort.
+        std::vector<BackendInfo> backends = {};
+        /// "leastConnections" or "latency", see BalancingPolicy.
+        std::string balancing = "leastConnections";
+        /// Every backend is probed this often, 0 to not probe.
+        int healthCheckSeconds = 10;
+        /// A backend failing to connect this often in a row is skipped for ejectionSeconds, 0 to never skip it.
+        int maxConnectFailures = 3;
+        int ejectionSeconds = 30;
+        /// A tunnel falls back to the next backend if one does not connect within this time.
+        int connectTimeoutSeconds = 3;
+        /// Hosts the broker routes to this service on its shared HTTP listener, if it runs one.
+        std::vector<std::string> httpHosts = {};
+        /// Server names the broker routes to this service on its shared TLS listener, if it runs one.
+        std::vector<std::string> tlsServerNames = {};
+        /// Lets publishers of other identities serve the public port as replicas, they have to set it as well.
+        bool shareable = false;
+
+        bool operator==(ServiceInfo const&) const = default;
+    };
+
+    inline void to_json(json& j, ServiceInfo const& info)
+    {
+        j = json{
+            {"name", info.name},
+            {"socketType", info.socketType},
+            {"hiddenPort", info.hiddenPort},
+            {"publicPort", info.publicPort},
+            {"hiddenHost", info.hiddenHost},
+            {"compression", info.compression},
+            {"compressionLevel", info.compressionLevel},
+            {"backends", info.backends},
+            {"balancing", info.balancing},
+            {"healthCheckSeconds", info.healthCheckSeconds},
+            {"maxConnectFailures", info.maxConnectFailures},
+            {"ejectionSeconds", info.ejectionSeconds},
+            {"connectTimeoutSeconds", info.connectTimeoutSeconds},
+            {"httpHosts", info.httpHosts},
+            {"tlsServerNames", info.tlsServerNames},
+            {"shareable", info.shareable},
+        };
+    }
+    inline void from_json(json const& j, ServiceInfo& info)
+    {
+        j.at("name").get_to(info.name);
+        j.at("socketType").get_to(info.socketType);
+        j.at("hiddenPort").get_to(info.hiddenPort);
+        j.at("publicPort").get_to(info.publicPort);
+        j.at("hiddenHost").get_to(info.hiddenHost);
+        info.compression = j.value("compression", std::optional<std::string>{});
+        info.compressionLevel = j.value("compressionLevel", defaultCompressionLevel);
+        info.backends = j.value("backends", std::vector<BackendInfo>{});
+        info.balancing = j.value("balancing", "leastConnections");
+        info.healthCheckSeconds = j.value("healthCheckSeconds", 10);
+        info.maxConnectFailures = j.value("maxConnectFailures", 3);
+        info.ejectionSeconds = j.value("ejectionSeconds", 30);
+        info.connectTimeoutSeconds = j.value("connectTimeoutSeconds", 3);
+        info.httpHosts = j.value("httpHosts", std::vector<std::string>{});
+        info.tlsServerNames = j.value("tlsServerNames", std::vector<std::string>{});
+        info.shareable = j.value("shareable", false);
+    }
+}
@@ -1,34 +1,45 @@
-#pragma once
-
-#include <sharedpp/pipe_operation.hpp>
-
-#include <boost/asio/ip/tcp.hpp>
-
-#include <memory>
-#include <string>
-
-namespace TunnelBore::Publisher
-{
-    class ServiceSession : public std::enable_shared_from_this<ServiceSession>
-    {
-      public:
-        ServiceSession(boost::asio::ip::tcp::socket&& socket);
-        ~ServiceSession();
-        ServiceSession(ServiceSession const&) = delete;
-        ServiceSession(ServiceSession&&);
-        ServiceSession& operator=(ServiceSession const&) = delete;
-        ServiceSession& operator=(ServiceSession&&);
-        void setOnClose(std::function<void()> onClose);
-
-        void close();
-        void resetTimer();
-        boost::asio::ip::tcp::socket& socket();
-        std::string remoteAddress();
-        [[nodiscard]] std::shared_ptr<PipeOperation<ServiceSession>> pipeTo(ServiceSession& other);
-        bool active();
-
-      private:
-        struct Implementation;
-        std::unique_ptr<Implementation> impl_;
-    };
+#pragma once
+
+#include <sharedpp/data_link_tls.hpp>
+#include <sharedpp/pipe_operation.hpp>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include <memory>
+#include <string>
+
+namespace TunnelBore::Publisher
+{
+    class ServiceSession : public std::enable_shared_from_this<ServiceSession>
+    {
+      public:
+        ServiceSession(boost::asio::ip::tcp::socket&& socket);
+        ~ServiceSession();
+        ServiceSession(ServiceSession const&) = delete;
+        ServiceSession(ServiceSession&&);
+        ServiceSession& operator=(ServiceSession const&) = delete;
+        ServiceSession& operator=(ServiceSession&&);
+        void setOnClose(std::function<void()> onClose);
+
+        void close();
+        void resetTimer();
+        boost::asio::ip::tcp::socket& socket();
+        std::string remoteAddress();
+        /**
+         * @param transform Applied to everything read from this session before it is written to the other.
+         */
+        [[nodiscard]] std::shared_ptr<PipeOperation<ServiceSession>>
+        pipeTo(ServiceSession& other, PipeTransform transform = {});
+        bool active();
+
+        /**
+         * @brief Reads and writes of this session go through the TLS from now on, unless the kernel took it over.
+         */
+        void setDataLinkTls(std::shared_ptr<DataLinkTls> tls);
+        std::shared_ptr<DataLinkTls> userspaceTls() const;
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
 }
\ No newline at end of file
@@ -0,0 +1,302 @@
+#include <publisherpp/authority_client.hpp>
+
+#include <roar/utility/base64.hpp>
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+#include <spdlog/spdlog.h>
+
+#include <charconv>
+#include <cstdint>
+
+using namespace std::string_literals;
+
+namespace TunnelBore::Publisher
+{
+    namespace http = boost::beast::http;
+
+    namespace
+    {
+        /**
+         * @return The delay of a Retry-After header, the http date form is not understood.
+         */
+        std::optional<std::chrono::seconds> retryAfterOf(http::response<http::string_body> const& response)
+        {
+            const auto header = response.find(http::field::retry_after);
+            if (header == response.end())
+                return std::nullopt;
+            const auto value = header->value();
+            std::uint32_t seconds = 0;
+            const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+            if (ec != std::errc{} || end != value.data() + value.size())
+                return std::nullopt;
+            return std::chrono::seconds{seconds};
+        }
+    }
+    // #####################################################################################################################
+    struct AuthorityClient::Connection
+    {
+        Stream stream;
+        boost::beast::flat_buffer buffer;
+        http::request<http::string_body> request;
+        http::response<http::string_body> response;
+        /// Set once a request was answered, so a failure can be blamed on the server having closed it meanwhile.
+        bool reused;
+
+        template <typename... Args>
+        explicit Connection(Args&&... args)
+            : stream{std::forward<Args>(args)...}
+            , buffer{}
+            , request{}
+            , response{}
+            , reused{false}
+        {}
+    };
+    // #####################################################################################################################
+    AuthorityClient::AuthorityClient(boost::asio::any_io_executor executor, Config const& cfg)
+        : AuthorityClient{
+              std::move(executor),
+              cfg.authorityHost,
+              std::to_string(cfg.authorityPort),
+              cfg.ssl,
+              "Basic "s + Roar::base64Encode(cfg.identity + ":" + cfg.passHashed)}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    AuthorityClient::AuthorityClient(
+        boost::asio::any_io_executor executor,
+        std::string host,
+        std::string port,
+        bool ssl,
+        std::string authorization)
+        : strand_{boost::asio::make_strand(executor)}
+        , host_{std::move(host)}
+        , port_{std::move(port)}
+        , authorization_{std::move(authorization)}
+        , sslContext_{[ssl]() -> std::optional<boost::asio::ssl::context> {
+            if (!ssl)
+                return std::nullopt;
+            boost::asio::ssl::context sslContext{boost::asio::ssl::context::tls_client};
+            sslContext.set_verify_mode(boost::asio::ssl::verify_none);
+            return sslContext;
+        }()}
+        , resolver_{strand_}
+        , queue_{}
+        , idle_{}
+        , inFlight_{0}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    AuthorityClient::~AuthorityClient() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::request(
+        boost::beast::http::verb verb,
+        std::string target,
+        std::string body,
+        CompletionHandler handler)
+    {
+        request(verb, std::move(target), std::move(body), {}, std::move(handler));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::request(
+        boost::beast::http::verb verb,
+        std::string target,
+        std::string body,
+        std::string authorization,
+        CompletionHandler handler)
+    {
+        PendingRequest pending{
+            verb, std::move(target), std::move(body), std::move(authorization), std::move(handler), false};
+        boost::asio::post(strand_, [weak = weak_from_this(), request = std::move(pending)]() mutable {
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            self->queue_.push_back(std::move(request));
+            self->pump();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::pump()
+    {
+        while (inFlight_ < MaxInFlight && !queue_.empty())
+        {
+            auto request = std::move(queue_.front());
+            queue_.pop_front();
+            ++inFlight_;
+
+            if (!idle_.empty())
+            {
+                auto connection = std::move(idle_.back());
+                idle_.pop_back();
+                write(std::move(connection), std::move(request));
+            }
+            else if (sslContext_)
+            {
+                connect(
+                    std::make_shared<Connection>(
+                        std::in_place_type<boost::beast::ssl_stream<boost::beast::tcp_stream>>, strand_, *sslContext_),
+                    std::move(request));
+            }
+            else
+            {
+                connect(
+                    std::make_shared<Connection>(std::in_place_type<boost::beast::tcp_stream>, strand_),
+                    std::move(request));
+            }
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::connect(std::shared_ptr<Connection> connection, PendingRequest request)
+    {
+        resolver_.async_resolve(
+            host_,
+            port_,
+            [weak = weak_from_this(), connection, request = std::move(request)](
+                boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type results) mutable {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                if (ec)
+                    return self->finish(connection, std::move(request), ec, {}, false);
+
+                auto& lowest = std::visit(
+                    [](auto& stream) -> boost::beast::tcp_stream& {
+                        return boost::beast::get_lowest_layer(stream);
+                    },
+                    connection->stream);
+                lowest.expires_after(RequestTimeout);
+                lowest.async_connect(
+                    results,
+                    [weak, connection, request = std::move(request)](
+                        boost::system::error_code ec, boost::asio::ip::tcp::endpoint const&) mutable {
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+
+                        if (ec)
+                            return self->finish(connection, std::move(request), ec, {}, false);
+
+                        auto* sslStream = std::get_if<1>(&connection->stream);
+                        if (!sslStream)
+                            return self->write(connection, std::move(request));
+
+                        if (!SSL_set_tlsext_host_name(sslStream->native_handle(), self->host_.c_str()))
+                            spdlog::warn("Could not set SNI host name for the authority.");
+
+                        sslStream->async_handshake(
+                            boost::asio::ssl::stream_base::client,
+                            [weak, connection, request = std::move(request)](boost::system::error_code ec) mutable {
+                                auto self = weak.lock();
+                                if (!self)
+                                    return;
+
+                                if (ec)
+                                    return self->finish(connection, std::move(request), ec, {}, false);
+
+                                self->write(connection, std::move(request));
+                            });
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::write(std::shared_ptr<Connection> connection, PendingRequest request)
+    {
+        connection->request = {request.verb, request.target, 11};
+        connection->request.set(http::field::host, host_);
+        connection->request.set(
+            http::field::authorization, request.authorization.empty() ? authorization_ : request.authorization);
+        connection->request.keep_alive(true);
+        if (!request.body.empty())
+        {
+            connection->request.set(http::field::content_type, "application/json");
+            connection->request.body() = request.body;
+        }
+        connection->request.prepare_payload();
+        connection->response = {};
+
+        std::visit(
+            [&](auto& stream) {
+                boost::beast::get_lowest_layer(stream).expires_after(RequestTimeout);
+                http::async_write(
+                    stream,
+                    connection->request,
+                    [weak = weak_from_this(), connection, request = std::move(request), &stream](
+                        boost::system::error_code ec, std::size_t) mutable {
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+
+                        if (ec)
+                            return self->finish(connection, std::move(request), ec, {}, false);
+
+                        http::async_read(
+                            stream,
+                            connection->buffer,
+                            connection->response,
+                            [weak, connection, request = std::move(request)](
+                                boost::system::error_code ec, std::size_t) mutable {
+                                auto self = weak.lock();
+                                if (!self)
+                                    return;
+
+                                if (ec)
+                                    return self->finish(connection, std::move(request), ec, {}, false);
+
+                                self->finish(
+                                    connection,
+                                    std::move(request),
+                                    {},
+                                    {connection->response.result(),
+                                     std::move(connection->response.body()),
+                                     retryAfterOf(connection->response)},
+                                    connection->response.keep_alive());
+                            });
+                    });
+            },
+            connection->stream);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void AuthorityClient::finish(
+        std::shared_ptr<Connection> const& connection,
+        PendingRequest request,
+        boost::system::error_code ec,
+        AuthorityResponse response,
+        bool keepAlive)
+    {
+        // The authority may have closed an idle keep alive connection, which only shows when it is used again.
+        if (ec && connection->reused && !request.retried)
+        {
+            spdlog::debug("Reused authority connection failed with '{}', retrying on a new one.", ec.message());
+            request.retried = true;
+            --inFlight_;
+            // Other idle connections are likely just as stale.
+            idle_.clear();
+            queue_.push_front(std::move(request));
+            return pump();
+        }
+
+        --inFlight_;
+        if (!ec && keepAlive)
+        {
+            connection->reused = true;
+            idle_.push_back(connection);
+        }
+        else if (ec)
+        {
+            spdlog::error("Request to authority failed: '{}'", ec.message());
+        }
+
+        pump();
+        // Off the strand, so that a slow handler does not hold up the other requests.
+        boost::asio::post(
+            strand_.get_inner_executor(),
+            [handler = std::move(request.handler), ec, response = std::move(response)]() mutable {
+                handler(ec, std::move(response));
+            });
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,276 @@
+#include <publisherpp/backend_pool.hpp>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace TunnelBore::Publisher
+{
+    // #####################################################################################################################
+    std::optional<BalancingPolicy> balancingPolicyFromString(std::string_view name)
+    {
+        if (name == "leastConnections")
+            return BalancingPolicy::LeastConnections;
+        if (name == "latency")
+            return BalancingPolicy::Latency;
+        return std::nullopt;
+    }
+    // #####################################################################################################################
+    BackendPool::BackendPool(boost::asio::any_io_executor executor, std::vector<BackendInfo> backends, Options options)
+        : executor_{executor}
+        , options_{options}
+        , guard_{}
+        , backends_{}
+        , lastHealthy_{true}
+        , onHealthChanged_{}
+        , probeTimer_{executor}
+        , notifyStrand_{boost::asio::make_strand(executor)}
+    {
+        backends_.reserve(backends.size());
+        for (auto& info : backends)
+            backends_.push_back(Backend{.info = std::move(info), .ejectionTimer = boost::asio::steady_timer{executor}});
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    BackendPool::~BackendPool() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::start()
+    {
+        if (options_.healthCheckInterval.count() > 0)
+            probeAll();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool BackendPool::usable(Backend const& backend, std::chrono::steady_clock::time_point now) const
+    {
+        return backend.probeHealthy && backend.ejectedUntil <= now;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool BackendPool::healthyLocked(std::chrono::steady_clock::time_point now) const
+    {
+        return std::any_of(backends_.begin(), backends_.end(), [this, now](auto const& backend) {
+            return usable(backend, now);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::chrono::seconds BackendPool::connectTimeout() const
+    {
+        return options_.connectTimeout;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool BackendPool::healthy() const
+    {
+        std::scoped_lock lock{guard_};
+        return healthyLocked(std::chrono::steady_clock::now());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<BackendPool::Pick> BackendPool::pick(std::vector<std::size_t> const& skip) const
+    {
+        std::scoped_lock lock{guard_};
+        const auto now = std::chrono::steady_clock::now();
+        std::optional<std::size_t> best;
+        double bestScore = std::numeric_limits<double>::max();
+        for (std::size_t i = 0; i != backends_.size(); ++i)
+        {
+            auto const& backend = backends_[i];
+            if (!usable(backend, now) || std::find(skip.begin(), skip.end(), i) != skip.end())
+                continue;
+
+            auto score = static_cast<double>(backend.tunnels);
+            // Backends without a measured latency yet are tried first, so that they get one.
+            if (options_.policy == BalancingPolicy::Latency)
+                score = static_cast<double>(backend.latency.count()) * static_cast<double>(backend.tunnels + 1);
+            if (score < bestScore)
+            {
+                bestScore = score;
+                best = i;
+            }
+        }
+        if (!best)
+            return std::nullopt;
+        return Pick{.index = *best, .host = backends_[*best].info.host, .port = backends_[*best].info.port};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::recordLatency(Backend& backend, std::chrono::microseconds latency)
+    {
+        if (backend.latency.count() == 0)
+            backend.latency = latency;
+        else
+            backend.latency = (backend.latency * 7 + latency) / 8;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<void> BackendPool::connected(std::size_t index, std::chrono::microseconds latency)
+    {
+        {
+            std::scoped_lock lock{guard_};
+            auto& backend = backends_[index];
+            ++backend.tunnels;
+            backend.consecutiveFailures = 0;
+            recordLatency(backend, latency);
+        }
+        return std::shared_ptr<void>{nullptr, [weak = weak_from_this(), index](void*) {
+                                         auto self = weak.lock();
+                                         if (!self)
+                                             return;
+                                         std::scoped_lock lock{self->guard_};
+                                         --self->backends_[index].tunnels;
+                                     }};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::connectFailed(std::size_t index)
+    {
+        {
+            std::scoped_lock lock{guard_};
+            auto& backend = backends_[index];
+            ++backend.consecutiveFailures;
+            if (options_.maxConnectFailures <= 0 || backend.consecutiveFailures < options_.maxConnectFailures)
+                return;
+
+            spdlog::warn(
+                "Backend '{}:{}' failed to connect {} times in a row, ejecting it for {} seconds.",
+                backend.info.host,
+                backend.info.port,
+                backend.consecutiveFailures,
+                options_.ejectionTime.count());
+            backend.consecutiveFailures = 0;
+            backend.ejectedUntil = std::chrono::steady_clock::now() + options_.ejectionTime;
+
+            // Nothing else looks at the pool again once the broker stopped sending tunnels for it.
+            backend.ejectionTimer.expires_after(options_.ejectionTime);
+            backend.ejectionTimer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+                if (ec)
+                    return;
+                if (auto self = weak.lock(); self)
+                    self->updateHealth();
+            });
+        }
+        updateHealth();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::onHealthChanged(std::function<void(bool)> handler)
+    {
+        std::scoped_lock lock{guard_};
+        onHealthChanged_ = std::move(handler);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::updateHealth()
+    {
+        // Updates race between probes, tunnels and timers. Reading the state on the strand instead of passing it
+        // keeps a stale state from being notified after a newer one.
+        boost::asio::post(notifyStrand_, [weak = weak_from_this()]() {
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::function<void(bool)> handler;
+            bool healthy = false;
+            {
+                std::scoped_lock lock{self->guard_};
+                healthy = self->healthyLocked(std::chrono::steady_clock::now());
+                if (healthy == self->lastHealthy_)
+                    return;
+                self->lastHealthy_ = healthy;
+                handler = self->onHealthChanged_;
+            }
+            if (handler)
+                handler(healthy);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::probeAll()
+    {
+        for (std::size_t i = 0; i != backends_.size(); ++i)
+            probe(i);
+
+        probeTimer_.expires_after(options_.healthCheckInterval);
+        probeTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            if (auto self = weak.lock(); self)
+                self->probeAll();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::probe(std::size_t index)
+    {
+        struct Probe
+        {
+            boost::asio::ip::tcp::resolver resolver;
+            boost::asio::ip::tcp::socket socket;
+            boost::asio::steady_timer timeout;
+            std::chrono::steady_clock::time_point startedAt;
+        };
+        auto probe = std::make_shared<Probe>(
+            Probe{
+                .resolver = boost::asio::ip::tcp::resolver{executor_},
+                .socket = boost::asio::ip::tcp::socket{executor_},
+                .timeout = boost::asio::steady_timer{executor_},
+                .startedAt = std::chrono::steady_clock::now(),
+            });
+
+        probe->timeout.expires_after(ProbeTimeout);
+        probe->timeout.async_wait([probe](boost::system::error_code ec) {
+            if (ec)
+                return;
+            probe->resolver.cancel();
+            boost::system::error_code ignore;
+            probe->socket.close(ignore);
+        });
+
+        // Only a connect is tried, the backend may speak anything.
+        auto const& info = backends_[index].info;
+        probe->resolver.async_resolve(
+            info.host,
+            std::to_string(info.port),
+            [weak = weak_from_this(), probe, index](
+                boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                if (ec)
+                {
+                    probe->timeout.cancel();
+                    return self->onProbeResult(index, false, {});
+                }
+                boost::asio::async_connect(
+                    probe->socket, endpoints, [weak, probe, index](boost::system::error_code ec, auto const&) {
+                        probe->timeout.cancel();
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+                        self->onProbeResult(
+                            index,
+                            !ec,
+                            std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - probe->startedAt));
+                        boost::system::error_code ignore;
+                        probe->socket.close(ignore);
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void BackendPool::onProbeResult(std::size_t index, bool success, std::chrono::microseconds latency)
+    {
+        {
+            std::scoped_lock lock{guard_};
+            auto& backend = backends_[index];
+            if (success != backend.probeHealthy)
+            {
+                spdlog::info(
+                    "Backend '{}:{}' is {}.", backend.info.host, backend.info.port, success ? "back up" : "down");
+            }
+            backend.probeHealthy = success;
+            if (success)
+            {
+                // Only backends that are reachable again are let back in early.
+                backend.consecutiveFailures = 0;
+                backend.ejectedUntil = {};
+                recordLatency(backend, latency);
+            }
+        }
+        updateHealth();
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,110 @@
+#include <publisherpp/control_tls.hpp>
+
+#include <openssl/ssl.h>
+
+#include <mutex>
+
+namespace TunnelBore::Publisher
+{
+    namespace
+    {
+        /**
+         * The last session of the broker, owned by the SSL_CTX, so that it stays valid as long as any connection
+         * using the context.
+         */
+        struct SessionSlot
+        {
+            std::mutex guard{};
+            SSL_SESSION* session = nullptr;
+
+            ~SessionSlot()
+            {
+                if (session != nullptr)
+                    SSL_SESSION_free(session);
+            }
+        };
+
+        void freeSessionSlot(void*, void* slot, CRYPTO_EX_DATA*, int, long, void*)
+        {
+            delete static_cast<SessionSlot*>(slot);
+        }
+
+        int sessionSlotIndex()
+        {
+            static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, &freeSessionSlot);
+            return index;
+        }
+
+        SessionSlot* sessionSlotOf(SSL_CTX const* context)
+        {
+            return static_cast<SessionSlot*>(SSL_CTX_get_ex_data(context, sessionSlotIndex()));
+        }
+
+        int onNewSession(SSL* ssl, SSL_SESSION* session)
+        {
+            auto* slot = sessionSlotOf(SSL_get_SSL_CTX(ssl));
+            if (slot == nullptr)
+                return 0;
+            // Connections that end without close_notify spoil their session, so only copies are handed out.
+            auto* copy = SSL_SESSION_dup(session);
+            if (copy == nullptr)
+                return 0;
+            std::scoped_lock lock{slot->guard};
+            if (slot->session != nullptr)
+                SSL_SESSION_free(slot->session);
+            slot->session = copy;
+            return 0;
+        }
+
+        /**
+         * The websocket client creates the SSL objects, so the session is handed to them right before the
+         * ClientHello is written.
+         */
+        void onInfo(SSL const* ssl, int where, int)
+        {
+            if ((where & SSL_CB_HANDSHAKE_START) == 0 || SSL_is_server(ssl) || SSL_get_session(ssl) != nullptr)
+                return;
+            auto* slot = sessionSlotOf(SSL_get_SSL_CTX(ssl));
+            if (slot == nullptr)
+                return;
+            std::scoped_lock lock{slot->guard};
+            if (slot->session == nullptr || !SSL_SESSION_is_resumable(slot->session))
+                return;
+            auto* copy = SSL_SESSION_dup(slot->session);
+            if (copy == nullptr)
+                return;
+            SSL_set_session(const_cast<SSL*>(ssl), copy);
+            SSL_SESSION_free(copy);
+        }
+    }
+    // #####################################################################################################################
+    ControlTls::ControlTls()
+        : context_{boost::asio::ssl::context::tlsv13_client}
+    {
+        context_.set_verify_mode(boost::asio::ssl::verify_none);
+        context_.set_options(
+            boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 |
+            boost::asio::ssl::context::single_dh_use);
+
+        auto* native = context_.native_handle();
+        SSL_CTX_set_ex_data(native, sessionSlotIndex(), new SessionSlot{});
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(native, &onNewSession);
+        SSL_CTX_set_info_callback(native, &onInfo);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::asio::ssl::context ControlTls::makeContext() const
+    {
+        auto* native = const_cast<boost::asio::ssl::context&>(context_).native_handle();
+        SSL_CTX_up_ref(native);
+        return boost::asio::ssl::context{native};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool ControlTls::hasSession() const
+    {
+        auto* slot = sessionSlotOf(const_cast<boost::asio::ssl::context&>(context_).native_handle());
+        std::scoped_lock lock{slot->guard};
+        return slot->session != nullptr && SSL_SESSION_is_resumable(slot->session);
+    }
+    // #####################################################################################################################
+}
@@ -3,6 +3,7 @@
 
 #include <publisherpp/publisher.hpp>
 
+#include <sharedpp/io_engine.hpp>
 #include <sharedpp/load_home_file.hpp>
 #include <roar/utility/scope_exit.hpp>
 #include <roar/utility/shutdown_barrier.hpp>
@@ -14,7 +15,8 @@
 
 #include <iostream>
 
-constexpr static auto IoContextThreadPoolSize = 16;
+/// Only serves the control line and the authority requests. Tunnels run on the io engine.
+constexpr static auto ControlThreadPoolSize = 4;
 
 int main()
 {
@@ -35,7 +37,7 @@ int main()
         spdlog::set_level(spdlog::level::info);
         spdlog::flush_every(std::chrono::seconds(10));
 
-        boost::asio::thread_pool pool{IoContextThreadPoolSize};
+        boost::asio::thread_pool pool{ControlThreadPoolSize};
         const auto shutdownPool = Roar::ScopeExit{[&pool]() {
             pool.stop();
             pool.join();
@@ -48,8 +50,13 @@ int main()
         if (!config.ssl)
             spdlog::warn("SSL is disabled! This is only for testing purposes!");
 
-        auto publisher = std::make_shared<class Publisher>(pool.executor(), config);
-        publisher->authenticate();
+        auto engine = std::make_shared<IoEngine>(IoEngine::Options{
+            .threads = config.ioThreads,
+            .pinThreads = config.pinIoThreads,
+        });
+
+        auto publisher = std::make_shared<class Publisher>(pool.executor(), engine, config);
+        publisher->start();
 
         // Wait for signal:
         Roar::shutdownBarrier.wait();
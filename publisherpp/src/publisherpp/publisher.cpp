@@ -1,347 +1,860 @@
-#include <boost/asio.hpp>
-
-#include <publisherpp/publisher.hpp>
-
-#include <sharedpp/json.hpp>
-#include <roar/ssl/make_ssl_context.hpp>
-#include <roar/curl/request.hpp>
-#include <roar/utility/base64.hpp>
-#include <spdlog/spdlog.h>
-
-using namespace std::string_literals;
-using namespace std::chrono_literals;
-
-namespace TunnelBore::Publisher
-{
-    // #####################################################################################################################
-    Publisher::Publisher(boost::asio::any_io_executor exec, Config cfg)
-        : cfg_{std::move(cfg)}
-        , exec_{exec}
-        , ws_{Publisher::createWebsocketClient(exec, cfg_)}
-        , services_{[this, &exec]() {
-            std::vector<std::shared_ptr<Service>> services;
-            for (auto const& serviceInfo : cfg_.services)
-            {
-                services.push_back(std::make_shared<Service>(
-                    exec,
-                    serviceInfo.name,
-                    serviceInfo.publicPort,
-                    serviceInfo.hiddenHost ? *serviceInfo.hiddenHost : "localhost",
-                    serviceInfo.hiddenPort));
-            }
-            return services;
-        }()}
-        , authToken_{}
-        , tokenCreationTime_{}
-        , reconnectTimer_{exec}
-        , reconnectTime_{1}
-        , isReconnecting_{false}
-        , reconnectMutex_{}
-        , pingAliveTimer_{exec}
-        , controlSendQueueMutex_{}
-        , controlSendOperations_{}
-        , sendInProgress_{false}
-    {}
-    //---------------------------------------------------------------------------------------------------------------------
-    Publisher::~Publisher()
-    {
-        spdlog::info("Publisher shutting down");
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    std::shared_ptr<Roar::WebsocketClient>
-    Publisher::createWebsocketClient(boost::asio::any_io_executor exec, Config const& cfg)
-    {
-        return std::make_shared<Roar::WebsocketClient>(Roar::WebsocketClient::ConstructionArguments{
-            .executor = exec,
-            .sslContext = [&cfg] -> std::optional<boost::asio::ssl::context> {
-                if (!cfg.ssl)
-                    return std::nullopt;
-                boost::asio::ssl::context sslContext{boost::asio::ssl::context::tlsv13_client};
-                sslContext.set_verify_mode(boost::asio::ssl::verify_none);
-                sslContext.set_options(
-                    boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 |
-                    boost::asio::ssl::context::single_dh_use);
-                return sslContext;
-            }(),
-        });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::authenticate()
-    {
-        authToken_.clear();
-        const auto response = Roar::Curl::Request{}
-                                  .basicAuth(cfg_.identity, cfg_.passHashed)
-                                  .verifyPeer(false)
-                                  .verifyHost(false)
-                                  .sink(authToken_)
-                                  .get(
-                                      "http"s + (cfg_.ssl ? "s" : "") + "://" + cfg_.authorityHost + ":"s +
-                                      std::to_string(cfg_.authorityPort) + "/api/auth"s);
-
-        if (response.result() != 0)
-        {
-            spdlog::error("Curl error in authentication attempt: '{}'", static_cast<int>(response.result()));
-            retryConnect();
-            return;
-        }
-
-        if (response.code() != boost::beast::http::status::ok)
-        {
-            spdlog::error(
-                "Failed to authenticate with the authority. Response code: {}", static_cast<int>(response.code()));
-            retryConnect();
-            return;
-        }
-        spdlog::info("Authentication successful");
-
-        tokenCreationTime_ = std::chrono::system_clock::now();
-
-        connectToBroker();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::retryConnect()
-    {
-        std::scoped_lock lock{reconnectMutex_};
-        stopAliveTimer();
-        if (isReconnecting_)
-        {
-            spdlog::info("Already reconnecting, ignoring retry request");
-            return;
-        }
-        // close first:
-        ws_->close();
-
-        spdlog::info("Retrying connection in {} seconds", reconnectTime_.count());
-        isReconnecting_ = true;
-        reconnectTimer_.expires_from_now(boost::posix_time::seconds(reconnectTime_.count()));
-        reconnectTime_ *= 2;
-        if (reconnectTime_.count() > 60)
-            reconnectTime_ = 60s;
-        reconnectTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
-            if (ec)
-                return;
-            auto self = weak.lock();
-            if (!self)
-                return;
-
-            std::scoped_lock lock{self->reconnectMutex_};
-            self->isReconnecting_ = false;
-            self->authenticate();
-        });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::connectToBroker()
-    {
-        spdlog::info("Connecting to broker control line '{}:{}'", cfg_.host, cfg_.port);
-        ws_ = Publisher::createWebsocketClient(exec_, cfg_);
-
-        ws_->connect({
-                         .host = cfg_.host,
-                         .port = std::to_string(cfg_.port),
-                         .path = "/api/ws/publisher",
-                         .timeout = std::chrono::seconds{5},
-                         .headers = {{
-                             boost::beast::http::field::authorization,
-                             "Bearer "s + Roar::base64Encode(authToken_),
-                         }},
-                     })
-            .then([weak = weak_from_this()]() {
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                spdlog::info("Connected to broker control line");
-                {
-                    std::scoped_lock lock{self->reconnectMutex_};
-                    self->startAliveTimer();
-                    self->reconnectTime_ = 1s;
-                }
-                self->doControlReading();
-                json handshake = {
-                    {"type", "Handshake"}, {"identity", self->cfg_.identity}, {"services", self->services_}};
-                self->sendQueued(std::move(handshake));
-            })
-            .fail([weak = weak_from_this()](auto&& err) {
-                spdlog::error("Failed to connect to broker: {}", err.toString());
-                auto self = weak.lock();
-                if (!self)
-                    return;
-                self->retryConnect();
-            });
-    }
-    //--------------------------------------------------------------------------------------------------------------------
-    void Publisher::stopAliveTimer()
-    {
-        pingAliveTimer_.cancel();
-    }
-    //--------------------------------------------------------------------------------------------------------------------
-    void Publisher::startAliveTimer()
-    {
-        pingAliveTimer_.expires_from_now(boost::posix_time::seconds{1});
-        pingAliveTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
-            if (ec)
-                return;
-            auto self = weak.lock();
-            if (!self)
-                return;
-
-            self->sendQueued({{"type", "Ping"}, {"ref", "Ping"}});
-            spdlog::debug("Ping");
-            self->startAliveTimer();
-        });
-    }
-    //--------------------------------------------------------------------------------------------------------------------
-    void Publisher::doControlReading()
-    {
-        ws_->read()
-            .then([weak = weak_from_this()](auto msg) {
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                self->onControlRead(std::move(msg));
-                self->doControlReading();
-            })
-            .fail([weak = weak_from_this()](auto const& err) {
-                spdlog::error("Failed to read from broker: '{}'", err.toString());
-                auto self = weak.lock();
-                if (!self)
-                    return;
-                self->retryConnect();
-            });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::sendOnceFromQueue()
-    {
-        std::scoped_lock lock{controlSendQueueMutex_};
-        if (controlSendOperations_.empty())
-        {
-            sendInProgress_ = false;
-            return;
-        }
-        sendInProgress_ = true;
-
-        auto op = std::move(controlSendOperations_.front());
-        controlSendOperations_.pop_front();
-
-        ws_->send(op.payload.dump())
-            .then([cb = std::move(op.callback), weak = weak_from_this()](auto&&) {
-                cb();
-
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                self->sendOnceFromQueue();
-            })
-            .fail([weak = weak_from_this()](auto const& err) {
-                spdlog::error("Failed to send to broker: '{}'", err.toString());
-                auto self = weak.lock();
-                if (!self)
-                    return;
-                self->retryConnect();
-            });
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::sendQueued(json&& j)
-    {
-        std::scoped_lock lock{controlSendQueueMutex_};
-        controlSendOperations_.emplace_back(ControlSendOperation{std::move(j), []() {}});
-        if (!sendInProgress_)
-            sendOnceFromQueue();
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::onControlRead(Roar::WebsocketReadResult message)
-    {
-        json j = json::parse(message.message);
-        const auto type = j["type"].get<std::string>();
-        if (type == "NewTunnel")
-        {
-            spdlog::info("Received NewTunnel message from broker");
-            onNewTunnel(
-                j["serviceId"].get<std::string>(),
-                j["tunnelId"].get<std::string>(),
-                j["hiddenPort"].get<int>(),
-                j["publicPort"].get<int>(),
-                j["socketType"].get<std::string>());
-        }
-        else if (type == "Error")
-        {
-            spdlog::error("Received Error message from broker: {}", j.dump());
-        }
-        else if (type == "ServiceStartResult")
-        {
-            const auto result = j["result"].get<bool>();
-            if (!result)
-                spdlog::error("Failed to start service: {}", j.dump());
-        }
-        else if (type == "Pong")
-        {
-            spdlog::debug("Pong");
-            // ignore to avoid logspam
-        }
-        else
-        {
-            spdlog::error("Received unknown message from broker: {}", j.dump());
-        }
-    }
-    //---------------------------------------------------------------------------------------------------------------------
-    void Publisher::onNewTunnel(
-        std::string const& serviceId,
-        std::string const& tunnelId,
-        int hiddenPort,
-        int publicPort,
-        std::string const& socketType)
-    {
-        spdlog::info("Creating new tunnel for service '{}' with id '{}'", serviceId, tunnelId);
-
-        auto respondWithFailure = [&](std::string const& reason) {
-            sendQueued({
-                {"type", "NewTunnelFailed"},
-                {"serviceId", serviceId},
-                {"tunnelId", tunnelId},
-                {"hiddenPort", hiddenPort},
-                {"publicPort", publicPort},
-                {"socketType", socketType},
-                {"reason", reason},
-            });
-        };
-
-        auto service = std::find_if(services_.begin(), services_.end(), [&](auto const& service) {
-            return service->hiddenPort() == hiddenPort && service->publicPort() == publicPort;
-        });
-        if (service == services_.end())
-        {
-            spdlog::error("Received NewTunnel message for unknown service '{}'", serviceId);
-            respondWithFailure("Unknown service");
-            return;
-        }
-
-        std::string body;
-        const auto response =
-            Roar::Curl::Request{}
-                .verifyPeer(false)
-                .verifyHost(false)
-                .basicAuth(cfg_.identity, cfg_.passHashed)
-                .source(json{
-                    {"tunnelId", tunnelId},
-                    {"serviceId", serviceId},
-                    {"hiddenPort", hiddenPort},
-                    {"publicPort", publicPort}}
-                            .dump())
-                .sink(body)
-                .post(
-                    //"https://"s + cfg_.authorityHost + ":" + std::to_string(cfg_.authorityPort) +
-                    "http://"s + cfg_.authorityHost + ":" + std::to_string(cfg_.authorityPort) + "/api/auth/sign-json");
-
-        if (response.code() != boost::beast::http::status::ok)
-        {
-            spdlog::error("Failed to sign tunnel request: {}", body);
-            respondWithFailure("Failed to sign tunnel request");
-            return;
-        }
-        const auto tunnelToken = json::parse(body)["token"].get<std::string>();
-        (*service)->createSession(cfg_.host, tunnelToken, tunnelId);
-    }
-    // #####################################################################################################################
+#include <boost/asio.hpp>
+
+#include <publisherpp/publisher.hpp>
+
+#include <sharedpp/json.hpp>
+#include <roar/ssl/make_ssl_context.hpp>
+#include <roar/utility/base64.hpp>
+#include <spdlog/spdlog.h>
+
+#include <boost/beast/websocket/error.hpp>
+
+#include <algorithm>
+#include <optional>
+#include <unordered_map>
+#include <variant>
+
+using namespace std::string_literals;
+using namespace std::chrono_literals;
+
+namespace TunnelBore::Publisher
+{
+    namespace
+    {
+        /**
+         * Reads the expiry of a token without verifying it, only the broker can do that.
+         */
+        std::optional<std::chrono::system_clock::time_point> expiryOf(std::string const& token)
+        {
+            const auto payloadBegin = token.find('.');
+            const auto payloadEnd = token.find('.', payloadBegin + 1);
+            if (payloadBegin == std::string::npos || payloadEnd == std::string::npos)
+                return std::nullopt;
+
+            // base64url without padding.
+            auto payload = token.substr(payloadBegin + 1, payloadEnd - payloadBegin - 1);
+            std::replace(payload.begin(), payload.end(), '-', '+');
+            std::replace(payload.begin(), payload.end(), '_', '/');
+            payload.append((4 - payload.size() % 4) % 4, '=');
+
+            const auto claims = json::parse(Roar::base64Decode(payload), nullptr, false);
+            if (claims.is_discarded() || !claims.is_object() || !claims.contains("exp") ||
+                !claims["exp"].is_number_integer())
+                return std::nullopt;
+            return std::chrono::system_clock::time_point{std::chrono::seconds{claims["exp"].get<long long>()}};
+        }
+
+        /**
+         * The broker answered the upgrade, but not with a websocket. It rejected the token or is busy.
+         */
+        template <typename ErrorT>
+        bool upgradeDeclined(ErrorT const& err)
+        {
+            auto const* ec = std::get_if<boost::system::error_code>(&err.error);
+            return ec != nullptr && *ec == boost::beast::websocket::error::upgrade_declined;
+        }
+    }
+    // #####################################################################################################################
+    Publisher::Publisher(boost::asio::any_io_executor exec, std::shared_ptr<IoEngine> engine, Config cfg)
+        : cfg_{std::move(cfg)}
+        , exec_{exec}
+        , controlTls_{cfg_.ssl ? std::make_shared<ControlTls>() : nullptr}
+        , ws_{Publisher::createWebsocketClient(exec, controlTls_)}
+        , authorityClient_{std::make_shared<AuthorityClient>(exec, cfg_)}
+        , brokerClient_{std::make_shared<AuthorityClient>(exec, cfg_.host, std::to_string(cfg_.port), cfg_.ssl, "")}
+        , engine_{std::move(engine)}
+        , servicesMutex_{}
+        , serviceInfos_{cfg_.services}
+        , services_{[this]() {
+            std::vector<std::shared_ptr<Service>> services;
+            for (auto const& serviceInfo : serviceInfos_)
+                services.push_back(makeService(serviceInfo));
+            return services;
+        }()}
+        , authToken_{}
+        , tokenCreationTime_{}
+        , tokenExpiry_{}
+        , declinedTokenReuses_{0}
+        , setupStats_{std::chrono::milliseconds{cfg_.slowTunnelSetupMs}}
+        , reconnectTimer_{exec}
+        , reconnectDelay_{MinReconnectDelay}
+        , reconnectRandom_{std::random_device{}()}
+        , isReconnecting_{false}
+        , reconnectMutex_{}
+        , pingAliveTimer_{exec}
+        , lastControlSend_{}
+        , lastControlReceive_{}
+        , controlSendQueueMutex_{}
+        , controlSendOperations_{}
+        , controlSendBytes_{0}
+        , sendInProgress_{false}
+        , brokerBatching_{false}
+        , brokerTunnelTraces_{false}
+        , brokerCompressions_{}
+        , brokerDataLinkTls_{}
+        , brokerServicesUpdates_{}
+        , handshakeSent_{false}
+        , unconfirmedServicesUpdate_{false}
+        , dataLinkTls_{cfg_.ssl && cfg_.dataLinkTls ? DataLinkTls::makeClientContext() : nullptr}
+        , controlEncoding_{WireEncoding::Json}
+        , sendBatchScheduled_{false}
+        , sendBatchTimer_{exec}
+        , configWatchTimer_{exec}
+        , configWriteTime_{}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    Publisher::~Publisher()
+    {
+        spdlog::info("Publisher shutting down");
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Roar::WebsocketClient>
+    Publisher::createWebsocketClient(boost::asio::any_io_executor exec, std::shared_ptr<ControlTls> const& controlTls)
+    {
+        return std::make_shared<Roar::WebsocketClient>(Roar::WebsocketClient::ConstructionArguments{
+            .executor = exec,
+            .sslContext = [&controlTls] -> std::optional<boost::asio::ssl::context> {
+                if (!controlTls)
+                    return std::nullopt;
+                return controlTls->makeContext();
+            }(),
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::authenticate()
+    {
+        authToken_.clear();
+        authorityClient_->request(
+            boost::beast::http::verb::get,
+            "/api/auth",
+            {},
+            [weak = weak_from_this()](boost::system::error_code ec, AuthorityResponse response) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                if (ec)
+                {
+                    spdlog::error("Error in authentication attempt: '{}'", ec.message());
+                    self->retryConnect();
+                    return;
+                }
+
+                if (response.status != boost::beast::http::status::ok)
+                {
+                    spdlog::error(
+                        "Failed to authenticate with the authority. Response code: {}",
+                        static_cast<int>(response.status));
+                    // A busy authority tells when to come back.
+                    self->retryConnect(response.retryAfter.value_or(std::chrono::seconds{0}));
+                    return;
+                }
+                spdlog::info("Authentication successful");
+
+                self->authToken_ = std::move(response.body);
+                self->tokenCreationTime_ = std::chrono::system_clock::now();
+                self->tokenExpiry_ =
+                    expiryOf(self->authToken_).value_or(self->tokenCreationTime_ + TokenRenewalMargin);
+                self->declinedTokenReuses_ = 0;
+
+                self->connectToBroker();
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::retryConnect(std::chrono::milliseconds notBefore)
+    {
+        std::scoped_lock lock{reconnectMutex_};
+        stopAliveTimer();
+        if (isReconnecting_)
+        {
+            spdlog::info("Already reconnecting, ignoring retry request");
+            return;
+        }
+        // close first:
+        ws_->close();
+
+        // Decorrelated jitter, publishers that lost the broker at the same time do not come back at the same time.
+        reconnectDelay_ = std::min(
+            MaxReconnectDelay,
+            std::chrono::milliseconds{std::uniform_int_distribution<std::chrono::milliseconds::rep>{
+                MinReconnectDelay.count(), reconnectDelay_.count() * 3}(reconnectRandom_)});
+        const auto delay = std::max(reconnectDelay_, notBefore);
+        spdlog::info("Retrying connection in {} ms", delay.count());
+        isReconnecting_ = true;
+        reconnectTimer_.expires_from_now(boost::posix_time::milliseconds(delay.count()));
+        reconnectTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::scoped_lock lock{self->reconnectMutex_};
+            self->isReconnecting_ = false;
+            self->reconnect();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::reconnect()
+    {
+        if (!tokenReusable())
+            return authenticate();
+        spdlog::info("Reusing the token for the control line.");
+        connectToBroker();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Publisher::tokenReusable() const
+    {
+        return !authToken_.empty() && declinedTokenReuses_ < MaxDeclinedTokenReuses &&
+            std::chrono::system_clock::now() + TokenRenewalMargin < tokenExpiry_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string Publisher::controlPath() const
+    {
+        return cfg_.instance.empty() ? "/api/ws/publisher"s : "/api/ws/publisher?instance="s + cfg_.instance;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::connectToBroker()
+    {
+        spdlog::info("Connecting to broker control line '{}:{}'", cfg_.host, cfg_.port);
+        if (controlTls_ && controlTls_->hasSession())
+            spdlog::info("Resuming the tls session of the control line.");
+        ws_ = Publisher::createWebsocketClient(exec_, controlTls_);
+        {
+            // The broker has to accept batching and the encoding again on the new connection.
+            std::scoped_lock lock{controlSendQueueMutex_};
+            brokerBatching_ = false;
+            controlEncoding_ = WireEncoding::Json;
+            brokerServicesUpdates_.reset();
+            handshakeSent_ = false;
+            unconfirmedServicesUpdate_ = false;
+        }
+
+        ws_->connect({
+                         .host = cfg_.host,
+                         .port = std::to_string(cfg_.port),
+                         .path = controlPath(),
+                         .timeout = std::chrono::seconds{5},
+                         .headers = {{
+                             boost::beast::http::field::authorization,
+                             "Bearer "s + Roar::base64Encode(authToken_),
+                         }},
+                     })
+            .then([weak = weak_from_this()]() {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                spdlog::info("Connected to broker control line");
+                self->lastControlSend_ = std::chrono::steady_clock::now();
+                self->lastControlReceive_ = std::chrono::steady_clock::now();
+                {
+                    std::scoped_lock lock{self->reconnectMutex_};
+                    self->startAliveTimer();
+                    self->reconnectDelay_ = MinReconnectDelay;
+                    self->declinedTokenReuses_ = 0;
+                }
+                self->doControlReading();
+
+                // Services reloaded from now on are sent as ServicesUpdate, see reloadServices.
+                std::scoped_lock lock{self->controlSendQueueMutex_};
+                json handshake;
+                {
+                    std::scoped_lock servicesLock{self->servicesMutex_};
+                    // Services without a usable backend are announced once one is back, see onServiceHealthChanged.
+                    json services = json::array();
+                    for (auto const& service : self->services_)
+                    {
+                        if (service->healthy())
+                            services.push_back(*service);
+                    }
+                    handshake = {
+                        {"type", "Handshake"},
+                        {"identity", self->cfg_.identity},
+                        {"services", std::move(services)},
+                        {"batching", true},
+                        {"tunnelTraces", true},
+                        {"encodings", supportedWireEncodings()},
+                        {"heartbeatIntervalSeconds", self->cfg_.heartbeatIntervalSeconds}};
+                }
+                self->handshakeSent_ = true;
+                self->sendQueued(std::move(handshake));
+            })
+            .fail([weak = weak_from_this()](auto&& err) {
+                spdlog::error("Failed to connect to broker: {}", err.toString());
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                // Unreachable brokers do not say anything about the token, a declined upgrade may.
+                if (upgradeDeclined(err))
+                    return self->probeDeclinedUpgrade();
+                self->retryConnect();
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::probeDeclinedUpgrade()
+    {
+        // The websocket client does not tell the status of a declined upgrade, the same request without upgrade does.
+        brokerClient_->request(
+            boost::beast::http::verb::get,
+            controlPath(),
+            {},
+            "Bearer "s + Roar::base64Encode(authToken_),
+            [weak = weak_from_this()](boost::system::error_code ec, AuthorityResponse response) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                if (ec)
+                    return self->retryConnect();
+
+                switch (response.status)
+                {
+                    case boost::beast::http::status::unauthorized:
+                    case boost::beast::http::status::forbidden:
+                        ++self->declinedTokenReuses_;
+                        spdlog::warn("Broker declined the token, {} time(s) in a row.", self->declinedTokenReuses_);
+                        return self->retryConnect();
+                    case boost::beast::http::status::service_unavailable:
+                        spdlog::info(
+                            "Broker is busy, it asked to retry after {} s.",
+                            response.retryAfter.value_or(std::chrono::seconds{0}).count());
+                        return self->retryConnect(response.retryAfter.value_or(std::chrono::seconds{0}));
+                    default:
+                        return self->retryConnect();
+                }
+            });
+    }
+    //--------------------------------------------------------------------------------------------------------------------
+    void Publisher::stopAliveTimer()
+    {
+        pingAliveTimer_.cancel();
+    }
+    //--------------------------------------------------------------------------------------------------------------------
+    void Publisher::startAliveTimer()
+    {
+        // Checking at half the interval keeps the distance between two pings below one and a half intervals.
+        const auto interval = std::chrono::seconds{std::max(1, cfg_.heartbeatIntervalSeconds)};
+        const auto checkPeriod = std::max(std::chrono::milliseconds{500}, std::chrono::milliseconds{interval} / 2);
+        pingAliveTimer_.expires_from_now(boost::posix_time::milliseconds{checkPeriod.count()});
+        pingAliveTimer_.async_wait([weak = weak_from_this(), interval](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            const auto now = std::chrono::steady_clock::now();
+            const auto sinceReceive = now - self->lastControlReceive_.load();
+            const auto timeout = std::chrono::seconds{std::max(1, self->cfg_.heartbeatTimeoutSeconds)};
+            if (sinceReceive >= timeout)
+            {
+                spdlog::warn("Nothing received from broker for {} seconds, reconnecting.", timeout.count());
+                self->retryConnect();
+                return;
+            }
+
+            // Other control traffic proves liveness just as well, so pings only fill silence in either direction.
+            if (now - self->lastControlSend_.load() >= interval || sinceReceive >= interval)
+            {
+                self->sendQueued({{"type", "Ping"}, {"ref", "Ping"}});
+                spdlog::debug("Ping");
+            }
+            self->startAliveTimer();
+        });
+    }
+    //--------------------------------------------------------------------------------------------------------------------
+    void Publisher::doControlReading()
+    {
+        ws_->read()
+            .then([weak = weak_from_this()](auto msg) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                self->onControlRead(std::move(msg));
+                self->doControlReading();
+            })
+            .fail([weak = weak_from_this()](auto const& err) {
+                spdlog::error("Failed to read from broker: '{}'", err.toString());
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                self->retryConnect();
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::sendOnceFromQueue()
+    {
+        std::scoped_lock lock{controlSendQueueMutex_};
+        if (controlSendOperations_.empty())
+        {
+            sendInProgress_ = false;
+            return;
+        }
+        sendInProgress_ = true;
+
+        // Only messages of the same encoding can share a frame, the encoding changes after the handshake.
+        const auto encoding = controlSendOperations_.front().encoding;
+        std::vector<std::string> batch;
+        std::vector<std::function<void()>> callbacks;
+        std::size_t batchBytes = 0;
+        while (!controlSendOperations_.empty())
+        {
+            auto& op = controlSendOperations_.front();
+            if (!batch.empty() && (!brokerBatching_ || op.encoding != encoding || batchBytes >= MaxBatchBytes))
+                break;
+            batchBytes += op.payload.size();
+            batch.push_back(std::move(op.payload));
+            callbacks.push_back(std::move(op.callback));
+            controlSendOperations_.pop_front();
+        }
+        auto frame = joinEncodedMessages(std::move(batch), encoding);
+        controlSendBytes_ = 0;
+        for (auto const& op : controlSendOperations_)
+            controlSendBytes_ += op.payload.size();
+
+        ws_->binary(isBinary(encoding));
+        ws_->send(std::move(frame))
+            .then([callbacks = std::move(callbacks), weak = weak_from_this()](auto&&) {
+                for (auto const& cb : callbacks)
+                    cb();
+
+                auto self = weak.lock();
+                if (!self)
+                    return;
+
+                self->lastControlSend_ = std::chrono::steady_clock::now();
+
+                self->sendOnceFromQueue();
+            })
+            .fail([weak = weak_from_this()](auto const& err) {
+                spdlog::error("Failed to send to broker: '{}'", err.toString());
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                self->retryConnect();
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::scheduleSendBatch()
+    {
+        sendBatchTimer_.expires_from_now(boost::posix_time::microseconds{MaxBatchDelay.count()});
+        sendBatchTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::scoped_lock lock{self->controlSendQueueMutex_};
+            self->sendBatchScheduled_ = false;
+            if (!self->sendInProgress_)
+                self->sendOnceFromQueue();
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::sendQueued(json&& j)
+    {
+        std::scoped_lock lock{controlSendQueueMutex_};
+        auto payload = encodeMessage(j, controlEncoding_);
+        controlSendBytes_ += payload.size();
+        controlSendOperations_.emplace_back(ControlSendOperation{std::move(payload), controlEncoding_, []() {}});
+
+        // Messages queued while a frame is in flight are batched into the next one anyway.
+        if (sendInProgress_)
+            return;
+
+        if (brokerBatching_ && controlSendBytes_ < MaxBatchBytes)
+        {
+            if (!sendBatchScheduled_)
+            {
+                sendBatchScheduled_ = true;
+                scheduleSendBatch();
+            }
+            return;
+        }
+
+        if (sendBatchScheduled_)
+        {
+            sendBatchScheduled_ = false;
+            sendBatchTimer_.cancel();
+        }
+        sendOnceFromQueue();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onControlRead(Roar::WebsocketReadResult message)
+    {
+        lastControlReceive_ = std::chrono::steady_clock::now();
+
+        WireEncoding encoding = WireEncoding::Json;
+        if (message.isBinary)
+        {
+            std::scoped_lock lock{controlSendQueueMutex_};
+            encoding = controlEncoding_;
+        }
+
+        // The broker may batch several messages into one frame.
+        forEachMessageInFrame(message.message, encoding, [this](json const& j) {
+            onControlMessage(j);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onControlMessage(json const& j)
+    {
+        const auto type = j["type"].get<std::string>();
+        if (type == "NewTunnel")
+        {
+            spdlog::info("Received NewTunnel message from broker");
+            onNewTunnel(
+                j["serviceId"].get<std::string>(),
+                j["tunnelId"].get<std::string>(),
+                j["hiddenPort"].get<int>(),
+                j["publicPort"].get<int>(),
+                // Brokers sharing a host in a cluster bind the public port with an offset.
+                j.value("connectPort", j["publicPort"].get<int>()),
+                j["socketType"].get<std::string>());
+        }
+        else if (type == "HandshakeAccepted")
+        {
+            bool reconnect = false;
+            {
+                std::scoped_lock lock{controlSendQueueMutex_};
+                brokerBatching_ = j.value("batching", false);
+                brokerTunnelTraces_ = j.value("tunnelTraces", false);
+                brokerCompressions_ = j.value("compressions", std::vector<std::string>{});
+                // Older brokers do not know the marker of encrypted tunnels.
+                brokerDataLinkTls_ = j.value("dataLinkTls", false) ? dataLinkTls_ : nullptr;
+                brokerServicesUpdates_ = j.value("servicesUpdate", false);
+                {
+                    std::scoped_lock servicesLock{servicesMutex_};
+                    for (auto const& service : services_)
+                    {
+                        service->setBrokerCompressions(brokerCompressions_);
+                        service->setDataLinkTls(brokerDataLinkTls_);
+                    }
+                }
+                controlEncoding_ = wireEncodingFromString(j.value("encoding", "json")).value_or(WireEncoding::Json);
+                spdlog::info(
+                    "Handshake accepted by broker, batching: {}, encoding: {}, encrypted tunnels: {}",
+                    brokerBatching_,
+                    toString(controlEncoding_),
+                    brokerDataLinkTls_ != nullptr);
+                reconnect = unconfirmedServicesUpdate_ && !*brokerServicesUpdates_;
+                unconfirmedServicesUpdate_ = false;
+            }
+            if (reconnect)
+            {
+                spdlog::info("Broker does not take service updates, reconnecting to announce the services.");
+                retryConnect();
+            }
+        }
+        else if (type == "Error")
+        {
+            spdlog::error("Received Error message from broker: {}", j.dump());
+        }
+        else if (type == "ServiceStartResult")
+        {
+            const auto result = j["result"].get<bool>();
+            if (!result)
+                spdlog::error("Failed to start service: {}", j.dump());
+        }
+        else if (type == "Pong")
+        {
+            spdlog::debug("Pong");
+            // ignore to avoid logspam
+        }
+        else
+        {
+            spdlog::error("Received unknown message from broker: {}", j.dump());
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onNewTunnel(
+        std::string const& serviceId,
+        std::string const& tunnelId,
+        int hiddenPort,
+        int publicPort,
+        int connectPort,
+        std::string const& socketType)
+    {
+        spdlog::info("Creating new tunnel for service '{}' with id '{}'", serviceId, tunnelId);
+        auto trace = std::make_shared<TunnelTrace>(tunnelId, TunnelStage::NewTunnelReceived);
+
+        auto respondWithFailure = [this, serviceId, tunnelId, hiddenPort, publicPort, socketType](
+                                      std::string const& reason) {
+            sendQueued({
+                {"type", "NewTunnelFailed"},
+                {"serviceId", serviceId},
+                {"tunnelId", tunnelId},
+                {"hiddenPort", hiddenPort},
+                {"publicPort", publicPort},
+                {"socketType", socketType},
+                {"reason", reason},
+            });
+        };
+
+        std::shared_ptr<Service> service;
+        {
+            std::scoped_lock lock{servicesMutex_};
+            auto iter = std::find_if(services_.begin(), services_.end(), [&](auto const& service) {
+                return service->hiddenPort() == hiddenPort && service->publicPort() == publicPort;
+            });
+            if (iter != services_.end())
+                service = *iter;
+        }
+        if (!service)
+        {
+            spdlog::error("Received NewTunnel message for unknown service '{}'", serviceId);
+            respondWithFailure("Unknown service");
+            return;
+        }
+
+        // The tunnel is created when the authority answers, nothing waits for it here.
+        authorityClient_->request(
+            boost::beast::http::verb::post,
+            "/api/auth/sign-json",
+            json{{"tunnelId", tunnelId}, {"serviceId", serviceId}, {"hiddenPort", hiddenPort}, {"publicPort", publicPort}}
+                .dump(),
+            [weak = weak_from_this(), service, tunnelId, connectPort, respondWithFailure, trace](
+                boost::system::error_code ec, AuthorityResponse response) {
+                auto self = weak.lock();
+                if (!self)
+                    return;
+                trace->mark(TunnelStage::Signed);
+
+                if (ec || response.status != boost::beast::http::status::ok)
+                {
+                    spdlog::error("Failed to sign tunnel request: {}", ec ? ec.message() : response.body);
+                    respondWithFailure("Failed to sign tunnel request");
+                    return;
+                }
+
+                std::string tunnelToken;
+                try
+                {
+                    tunnelToken = json::parse(response.body)["token"].get<std::string>();
+                }
+                catch (json::exception const& exc)
+                {
+                    spdlog::error("Authority answered sign request with malformed json: {}", exc.what());
+                    respondWithFailure("Failed to sign tunnel request");
+                    return;
+                }
+                service->createSession(
+                    self->cfg_.host, connectPort, tunnelToken, tunnelId, trace, [weak](TunnelTrace const& trace) {
+                        auto self = weak.lock();
+                        if (!self)
+                            return;
+                        self->onTunnelPiping(trace);
+                    });
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onTunnelPiping(TunnelTrace const& trace)
+    {
+        setupStats_.record(trace);
+
+        bool brokerTunnelTraces = false;
+        {
+            std::scoped_lock lock{controlSendQueueMutex_};
+            brokerTunnelTraces = brokerTunnelTraces_;
+        }
+        // Older brokers would answer the unknown message with an error.
+        if (brokerTunnelTraces)
+            sendQueued({{"type", "TunnelTrace"}, {"trace", trace}});
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<Service> Publisher::makeService(ServiceInfo const& serviceInfo) const
+    {
+        const auto hiddenHost = serviceInfo.hiddenHost ? *serviceInfo.hiddenHost : "localhost"s;
+        std::vector<BackendInfo> backends{{.host = hiddenHost, .port = serviceInfo.hiddenPort}};
+        backends.insert(backends.end(), serviceInfo.backends.begin(), serviceInfo.backends.end());
+
+        const auto policy = balancingPolicyFromString(serviceInfo.balancing);
+        if (!policy)
+        {
+            spdlog::error(
+                "Balancing '{}' of service on public port '{}' is unknown, using leastConnections.",
+                serviceInfo.balancing,
+                serviceInfo.publicPort);
+        }
+        auto pool = std::make_shared<BackendPool>(
+            engine_->nextExecutor(),
+            std::move(backends),
+            BackendPool::Options{
+                .policy = policy.value_or(BalancingPolicy::LeastConnections),
+                .healthCheckInterval = std::chrono::seconds{serviceInfo.healthCheckSeconds},
+                .maxConnectFailures = serviceInfo.maxConnectFailures,
+                .ejectionTime = std::chrono::seconds{serviceInfo.ejectionSeconds},
+                .connectTimeout = std::chrono::seconds{std::max(1, serviceInfo.connectTimeoutSeconds)},
+            });
+
+        return std::make_shared<Service>(
+            engine_,
+            serviceInfo.name,
+            serviceInfo.publicPort,
+            hiddenHost,
+            serviceInfo.hiddenPort,
+            std::move(pool),
+            serviceInfo.compression,
+            serviceInfo.compressionLevel);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::start()
+    {
+        {
+            std::scoped_lock lock{servicesMutex_};
+            for (auto const& service : services_)
+                watchServiceHealth(service);
+        }
+        watchConfig();
+        authenticate();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::watchServiceHealth(std::shared_ptr<Service> const& service)
+    {
+        service->watchHealth([weak = weak_from_this(), weakService = std::weak_ptr<Service>{service}](bool healthy) {
+            if (auto self = weak.lock(); self)
+                self->onServiceHealthChanged(weakService, healthy);
+        });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::onServiceHealthChanged(std::weak_ptr<Service> const& weakService, bool healthy)
+    {
+        auto service = weakService.lock();
+        if (!service)
+            return;
+
+        std::scoped_lock lock{controlSendQueueMutex_};
+        {
+            // Replaced by a reload in the meantime.
+            std::scoped_lock servicesLock{servicesMutex_};
+            if (std::find(services_.begin(), services_.end(), service) == services_.end())
+                return;
+        }
+
+        json added = json::array();
+        json removed = json::array();
+        if (healthy)
+        {
+            spdlog::info("Service '{}' is usable again, announcing it to the broker.", service->name());
+            added.push_back(*service);
+        }
+        else
+        {
+            spdlog::warn("No backend of service '{}' is usable, withdrawing it from the broker.", service->name());
+            removed.push_back(service->publicPort());
+        }
+        if (!sendServicesUpdate(std::move(added), std::move(removed)))
+            spdlog::warn("Broker does not take service updates, it keeps accepting for '{}'.", service->name());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool Publisher::sendServicesUpdate(json&& added, json&& removed)
+    {
+        std::scoped_lock lock{controlSendQueueMutex_};
+        // Not connected, the next handshake announces the services.
+        if (!handshakeSent_)
+            return true;
+        if (brokerServicesUpdates_ && !*brokerServicesUpdates_)
+            return false;
+
+        // The broker has not answered the handshake yet, it is still unknown whether it understands this.
+        if (!brokerServicesUpdates_)
+            unconfirmedServicesUpdate_ = true;
+        sendQueued({{"type", "ServicesUpdate"}, {"added", std::move(added)}, {"removed", std::move(removed)}});
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::reloadServices(std::vector<ServiceInfo> const& services)
+    {
+        bool reconnect = false;
+        {
+            std::scoped_lock lock{controlSendQueueMutex_};
+            json added = json::array();
+            json removed = json::array();
+            {
+                std::scoped_lock servicesLock{servicesMutex_};
+                std::unordered_map<int, std::size_t> previous;
+                for (std::size_t i = 0; i != serviceInfos_.size(); ++i)
+                    previous[serviceInfos_[i].publicPort] = i;
+
+                std::vector<std::shared_ptr<Service>> nextServices;
+                nextServices.reserve(services.size());
+                for (auto const& serviceInfo : services)
+                {
+                    if (auto iter = previous.find(serviceInfo.publicPort); iter != previous.end())
+                    {
+                        const auto index = iter->second;
+                        previous.erase(iter);
+                        // Tunnels of a changed service run on until they end, new ones use the new config.
+                        if (serviceInfos_[index] == serviceInfo)
+                        {
+                            nextServices.push_back(services_[index]);
+                            continue;
+                        }
+                    }
+                    auto service = makeService(serviceInfo);
+                    service->setBrokerCompressions(brokerCompressions_);
+                    service->setDataLinkTls(brokerDataLinkTls_);
+                    watchServiceHealth(service);
+                    added.push_back(*service);
+                    nextServices.push_back(std::move(service));
+                }
+                for (auto const& [publicPort, index] : previous)
+                    removed.push_back(publicPort);
+
+                serviceInfos_ = services;
+                services_ = std::move(nextServices);
+            }
+            if (added.empty() && removed.empty())
+                return;
+            spdlog::info("Services reloaded, {} added or changed, {} removed.", added.size(), removed.size());
+            reconnect = !sendServicesUpdate(std::move(added), std::move(removed));
+        }
+        if (reconnect)
+        {
+            spdlog::info("Broker does not take service updates, reconnecting to announce the services.");
+            retryConnect();
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::watchConfig()
+    {
+        if (cfg_.configReloadSeconds <= 0)
+            return;
+        std::error_code ec;
+        configWriteTime_ = std::filesystem::last_write_time(configPath(), ec);
+        checkConfig();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void Publisher::checkConfig()
+    {
+        configWatchTimer_.expires_from_now(boost::posix_time::seconds{cfg_.configReloadSeconds});
+        configWatchTimer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::error_code writeTimeError;
+            const auto writeTime = std::filesystem::last_write_time(configPath(), writeTimeError);
+            if (!writeTimeError && writeTime != self->configWriteTime_)
+            {
+                self->configWriteTime_ = writeTime;
+                try
+                {
+                    // Only the services are applied, everything else needs a restart.
+                    self->reloadServices(loadConfig().services);
+                }
+                catch (std::exception const& exc)
+                {
+                    spdlog::error("Could not reload the config, keeping the services: {}", exc.what());
+                }
+            }
+            self->checkConfig();
+        });
+    }
+    // #####################################################################################################################
 }
\ No newline at end of file
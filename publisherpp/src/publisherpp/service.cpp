@@ -1,129 +1,376 @@
-#include <publisherpp/service.hpp>
-
-#include <sharedpp/constants.hpp>
-
-#include <boost/asio.hpp>
-#include <spdlog/spdlog.h>
-
-namespace TunnelBore::Publisher
-{
-    Service::Service(
-        boost::asio::any_io_executor executor,
-        std::optional<std::string> name,
-        int publicPort,
-        std::string hiddenHost,
-        int hiddenPort)
-        : executor_{std::move(executor)}
-        , name_{std::move(name)}
-        , publicPort_{publicPort}
-        , hiddenHost_{std::move(hiddenHost)}
-        , hiddenPort_{hiddenPort}
-        , sessions_{}
-    {}
-    std::string Service::name() const
-    {
-        if (name_)
-            return name_.value();
-        return hiddenHost_ + ":" + std::to_string(hiddenPort_);
-    }
-    int Service::publicPort() const
-    {
-        return publicPort_;
-    }
-    std::string const& Service::hiddenHost() const
-    {
-        return hiddenHost_;
-    }
-    int Service::hiddenPort() const
-    {
-        return hiddenPort_;
-    }
-    void Service::createSession(std::string const& brokerHost, std::string const& token, std::string const& tunnelId)
-    {
-        auto createConnection = [weak = weak_from_this(), tunnelId](std::string const& host, int port) {
-            auto self = weak.lock();
-            if (!self)
-            {
-                spdlog::error("Service::createSession: weak.lock() failed");
-                return std::shared_ptr<ServiceSession>{};
-            }
-
-            // resolve remote
-            auto resolver = boost::asio::ip::tcp::resolver{self->executor_};
-            auto endpoints = resolver.resolve(host, std::to_string(port));
-
-            // create socket synchronously
-            auto socket = boost::asio::ip::tcp::socket{self->executor_};
-            boost::system::error_code ec;
-            boost::asio::connect(socket, endpoints, ec);
-            if (ec)
-            {
-                spdlog::error("Service::createSession: connect failed: {}", ec.message());
-                return std::shared_ptr<ServiceSession>{};
-            }
-
-            // create session
-            auto session = std::make_shared<ServiceSession>(std::move(socket));
-            session->setOnClose([weak = self->weak_from_this(), tunnelId]() {
-                auto self = weak.lock();
-                if (!self)
-                    return;
-
-                std::scoped_lock lock{self->sessionGuard_};
-
-                auto it = self->sessions_.find(tunnelId);
-                if (it == self->sessions_.end())
-                    return;
-
-                if (!it->second.inward->active() && !it->second.outward->active())
-                {
-                    spdlog::info("Service session closed: {}", tunnelId);
-                    auto& session = it->second;
-                    session.inwardPipe->close();
-                    session.outwardPipe->close();
-                    self->sessions_.erase(it);
-                }
-            });
-            return session;
-        };
-
-        auto prefixedToken = std::make_shared<std::string>(std::string{publisherToBrokerPrefix} + ":" + token);
-        auto outwards = createConnection(brokerHost, publicPort_);
-        if (!outwards)
-            return;
-        // write token to outwards:
-        boost::asio::async_write(
-            outwards->socket(),
-            boost::asio::buffer(*prefixedToken),
-            [weak = weak_from_this(), outwards, tunnelId, createConnection, prefixedToken](
-                boost::system::error_code ec, std::size_t) {
-                if (ec)
-                {
-                    spdlog::error("Failed to write token to outwards connection: {}", ec.message());
-                    return;
-                }
-
-                auto self = weak.lock();
-                if (!self)
-                {
-                    spdlog::error("Failed to write token to outwards connection: Service is dead");
-                    return;
-                }
-
-                auto inwards = createConnection(self->hiddenHost_, self->hiddenPort_);
-                if (!inwards)
-                {
-                    outwards->close();
-                    return;
-                }
-                {
-                    std::scoped_lock lock{self->sessionGuard_};
-                    auto elem = self->sessions_.emplace(tunnelId, ServiceSessionPair{inwards, outwards, {}, {}});
-
-                    spdlog::info("Connecting pipes");
-                    elem.first->second.inwardPipe = inwards->pipeTo(*outwards);
-                    elem.first->second.outwardPipe = outwards->pipeTo(*inwards);
-                }
-            });
-    }
+#include <publisherpp/service.hpp>
+
+#include <sharedpp/constants.hpp>
+
+#include <boost/asio.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+
+namespace TunnelBore::Publisher
+{
+    namespace
+    {
+        std::optional<StreamCompression> supportedCompression(std::optional<std::string> const& name)
+        {
+            if (!name)
+                return std::nullopt;
+            const auto supported = supportedStreamCompressions();
+            const auto compression = streamCompressionFromString(*name);
+            if (!compression || std::find(supported.begin(), supported.end(), *name) == supported.end())
+            {
+                spdlog::error("Compression '{}' is not supported, tunnels are not compressed.", *name);
+                return std::nullopt;
+            }
+            if (*compression == StreamCompression::None)
+                return std::nullopt;
+            return compression;
+        }
+    }
+
+    Service::Service(
+        std::shared_ptr<IoEngine> engine,
+        std::optional<std::string> name,
+        int publicPort,
+        std::string hiddenHost,
+        int hiddenPort,
+        std::shared_ptr<BackendPool> backends,
+        std::optional<std::string> const& compression,
+        int compressionLevel)
+        : engine_{std::move(engine)}
+        , name_{std::move(name)}
+        , publicPort_{publicPort}
+        , hiddenHost_{std::move(hiddenHost)}
+        , hiddenPort_{hiddenPort}
+        , backends_{std::move(backends)}
+        , compression_{supportedCompression(compression)}
+        , compressionLevel_{compressionLevel}
+        , brokerCompresses_{false}
+        , towardsBroker_{std::make_shared<CompressionStats>()}
+        , fromBroker_{std::make_shared<CompressionStats>()}
+        , dataLinkTls_{}
+        , sessions_{}
+    {}
+    void Service::setDataLinkTls(std::shared_ptr<boost::asio::ssl::context> context)
+    {
+        dataLinkTls_ = std::move(context);
+    }
+    void Service::setBrokerCompressions(std::vector<std::string> const& compressions)
+    {
+        brokerCompresses_ = compression_ &&
+            std::find(compressions.begin(), compressions.end(), toString(*compression_)) != compressions.end();
+    }
+    void Service::watchHealth(std::function<void(bool)> onHealthChanged)
+    {
+        backends_->onHealthChanged(std::move(onHealthChanged));
+        backends_->start();
+    }
+    bool Service::healthy() const
+    {
+        return backends_->healthy();
+    }
+    std::string Service::name() const
+    {
+        if (name_)
+            return name_.value();
+        return hiddenHost_ + ":" + std::to_string(hiddenPort_);
+    }
+    int Service::publicPort() const
+    {
+        return publicPort_;
+    }
+    std::string const& Service::hiddenHost() const
+    {
+        return hiddenHost_;
+    }
+    int Service::hiddenPort() const
+    {
+        return hiddenPort_;
+    }
+    void Service::createSession(
+        std::string const& brokerHost,
+        int brokerPort,
+        std::string const& token,
+        std::string const& tunnelId,
+        std::shared_ptr<TunnelTrace> trace,
+        std::function<void(TunnelTrace const&)> onPiping)
+    {
+        // Both connections of a tunnel share one shard, so the pipes between them never change threads.
+        auto executor = engine_->nextExecutor();
+        auto prefixedToken = std::make_shared<std::string>(std::string{publisherToBrokerPrefix} + ":" + token);
+        connect(
+            executor,
+            brokerHost,
+            brokerPort,
+            ConnectTimeout,
+            tunnelId,
+            [weak = weak_from_this(), executor, tunnelId, prefixedToken, trace, onPiping = std::move(onPiping)](
+                std::shared_ptr<ServiceSession> outwards) {
+                auto self = weak.lock();
+                if (!self || !outwards)
+                    return;
+                trace->mark(TunnelStage::BrokerConnected);
+                self->sendToken(executor, outwards, tunnelId, prefixedToken, trace, onPiping);
+            });
+    }
+    void Service::connect(
+        boost::asio::any_io_executor const& executor,
+        std::string const& host,
+        int port,
+        std::chrono::seconds timeout,
+        std::string const& tunnelId,
+        ConnectHandler onConnected)
+    {
+        struct Attempt
+        {
+            boost::asio::ip::tcp::resolver resolver;
+            boost::asio::ip::tcp::socket socket;
+            boost::asio::steady_timer timeout;
+            bool timedOut;
+        };
+        auto attempt = std::make_shared<Attempt>(
+            Attempt{
+                .resolver = boost::asio::ip::tcp::resolver{executor},
+                .socket = boost::asio::ip::tcp::socket{executor},
+                .timeout = boost::asio::steady_timer{executor},
+                .timedOut = false,
+            });
+
+        attempt->timeout.expires_after(timeout);
+        attempt->timeout.async_wait([attempt](boost::system::error_code ec) {
+            if (ec)
+                return;
+            attempt->timedOut = true;
+            attempt->resolver.cancel();
+            boost::system::error_code ignore;
+            attempt->socket.close(ignore);
+        });
+
+        attempt->resolver.async_resolve(
+            host,
+            std::to_string(port),
+            [weak = weak_from_this(), attempt, host, tunnelId, onConnected = std::move(onConnected)](
+                boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) mutable {
+                if (ec)
+                {
+                    attempt->timeout.cancel();
+                    spdlog::error(
+                        "Service::createSession: resolving '{}' failed: {}",
+                        host,
+                        attempt->timedOut ? "timed out" : ec.message());
+                    return onConnected({});
+                }
+                boost::asio::async_connect(
+                    attempt->socket,
+                    endpoints,
+                    [weak, attempt, host, tunnelId, onConnected = std::move(onConnected)](
+                        boost::system::error_code ec, auto const&) {
+                        attempt->timeout.cancel();
+                        if (ec)
+                        {
+                            spdlog::error(
+                                "Service::createSession: connecting to '{}' failed: {}",
+                                host,
+                                attempt->timedOut ? "timed out" : ec.message());
+                            return onConnected({});
+                        }
+                        auto self = weak.lock();
+                        if (!self)
+                        {
+                            spdlog::error("Service::createSession: weak.lock() failed");
+                            return onConnected({});
+                        }
+                        onConnected(self->makeSession(std::move(attempt->socket), tunnelId));
+                    });
+            });
+    }
+    std::shared_ptr<ServiceSession>
+    Service::makeSession(boost::asio::ip::tcp::socket&& socket, std::string const& tunnelId)
+    {
+        auto session = std::make_shared<ServiceSession>(std::move(socket));
+        session->setOnClose([weak = weak_from_this(), tunnelId]() {
+            auto self = weak.lock();
+            if (!self)
+                return;
+
+            std::scoped_lock lock{self->sessionGuard_};
+
+            auto it = self->sessions_.find(tunnelId);
+            if (it == self->sessions_.end())
+                return;
+
+            if (!it->second.inward->active() && !it->second.outward->active())
+            {
+                spdlog::info("Service session closed: {}", tunnelId);
+                if (it->second.compressed)
+                {
+                    spdlog::info(
+                        "Compression of service '{}' at level {}, towards broker: {}, from broker: {}",
+                        self->name(),
+                        self->compressionLevel_,
+                        self->towardsBroker_->toJson().dump(),
+                        self->fromBroker_->toJson().dump());
+                }
+                auto& session = it->second;
+                session.inwardPipe->close();
+                session.outwardPipe->close();
+                self->sessions_.erase(it);
+            }
+        });
+        return session;
+    }
+    void Service::sendToken(
+        boost::asio::any_io_executor const& executor,
+        std::shared_ptr<ServiceSession> const& outwards,
+        std::string const& tunnelId,
+        std::shared_ptr<std::string> const& prefixedToken,
+        std::shared_ptr<TunnelTrace> const& trace,
+        std::function<void(TunnelTrace const&)> const& onPiping)
+    {
+        auto onTokenSent = [weak = weak_from_this(), executor, outwards, tunnelId, prefixedToken, trace, onPiping](
+                               boost::system::error_code ec, std::size_t) {
+            if (ec)
+            {
+                spdlog::error("Failed to write token to outwards connection: {}", ec.message());
+                return;
+            }
+            trace->mark(TunnelStage::TokenSent);
+
+            auto self = weak.lock();
+            if (!self)
+            {
+                spdlog::error("Failed to write token to outwards connection: Service is dead");
+                return;
+            }
+            self->connectBackend(executor, outwards, tunnelId, trace, onPiping, {});
+        };
+
+        auto dataLinkTls = dataLinkTls_.load();
+        if (!dataLinkTls)
+        {
+            // write token to outwards:
+            boost::asio::async_write(outwards->socket(), boost::asio::buffer(*prefixedToken), std::move(onTokenSent));
+            return;
+        }
+
+        // The marker goes out in plain, then the token follows through TLS.
+        boost::asio::async_write(
+            outwards->socket(),
+            boost::asio::buffer(publisherToBrokerTlsPrefix),
+            [outwards, dataLinkTls, prefixedToken, trace, onTokenSent](boost::system::error_code ec, std::size_t) {
+                if (ec)
+                {
+                    spdlog::error("Failed to write TLS marker to outwards connection: {}", ec.message());
+                    outwards->close();
+                    return;
+                }
+                auto tls = std::make_shared<DataLinkTls>(dataLinkTls, DataLinkTls::Role::Client);
+                tls->asyncHandshake(
+                    outwards->socket(),
+                    [outwards, tls, prefixedToken, trace, onTokenSent](boost::system::error_code ec) {
+                        if (ec)
+                        {
+                            spdlog::error("TLS handshake on outwards connection failed: {}", ec.message());
+                            outwards->close();
+                            return;
+                        }
+                        trace->mark(TunnelStage::LinkEncrypted);
+                        spdlog::info(
+                            "Outwards connection is encrypted {}.",
+                            tls->offloaded() ? "by the kernel" : "in userspace");
+                        outwards->setDataLinkTls(tls);
+                        if (auto userspaceTls = outwards->userspaceTls(); userspaceTls)
+                        {
+                            userspaceTls->asyncWrite(
+                                outwards->socket(), boost::asio::buffer(*prefixedToken), onTokenSent);
+                            return;
+                        }
+                        boost::asio::async_write(
+                            outwards->socket(), boost::asio::buffer(*prefixedToken), onTokenSent);
+                    });
+            });
+    }
+    void Service::connectBackend(
+        boost::asio::any_io_executor const& executor,
+        std::shared_ptr<ServiceSession> const& outwards,
+        std::string const& tunnelId,
+        std::shared_ptr<TunnelTrace> const& trace,
+        std::function<void(TunnelTrace const&)> const& onPiping,
+        std::vector<std::size_t> tried)
+    {
+        // A backend that fails is ejected after a few tries, until then the tunnel falls back to the others.
+        const auto backend = backends_->pick(tried);
+        if (!backend)
+        {
+            spdlog::error("No backend of service '{}' is reachable.", name());
+            outwards->close();
+            return;
+        }
+        const auto connectStart = std::chrono::steady_clock::now();
+        connect(
+            executor,
+            backend->host,
+            backend->port,
+            // Per attempt, a blackholed backend must not use up the time the next one would need.
+            backends_->connectTimeout(),
+            tunnelId,
+            [weak = weak_from_this(),
+             executor,
+             outwards,
+             tunnelId,
+             trace,
+             onPiping,
+             tried = std::move(tried),
+             index = backend->index,
+             connectStart](std::shared_ptr<ServiceSession> inwards) mutable {
+                auto self = weak.lock();
+                if (!self)
+                {
+                    outwards->close();
+                    return;
+                }
+                if (!inwards)
+                {
+                    self->backends_->connectFailed(index);
+                    tried.push_back(index);
+                    return self->connectBackend(executor, outwards, tunnelId, trace, onPiping, std::move(tried));
+                }
+                auto backendLease = self->backends_->connected(
+                    index,
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - connectStart));
+                self->link(outwards, inwards, tunnelId, std::move(backendLease), trace, onPiping);
+            });
+    }
+    void Service::link(
+        std::shared_ptr<ServiceSession> const& outwards,
+        std::shared_ptr<ServiceSession> const& inwards,
+        std::string const& tunnelId,
+        std::shared_ptr<void> backendLease,
+        std::shared_ptr<TunnelTrace> const& trace,
+        std::function<void(TunnelTrace const&)> const& onPiping)
+    {
+        trace->mark(TunnelStage::HiddenConnected);
+        // Decided per tunnel, the broker makes the same decision when it links the tunnel.
+        const bool compressed = compression_ && brokerCompresses_;
+        PipeTransform towardsBroker{};
+        PipeTransform fromBroker{};
+        if (compressed)
+        {
+            towardsBroker = compressingTransform(*compression_, compressionLevel_, towardsBroker_);
+            fromBroker = decompressingTransform(*compression_, fromBroker_);
+        }
+        {
+            std::scoped_lock lock{sessionGuard_};
+            auto elem = sessions_.emplace(
+                tunnelId, ServiceSessionPair{inwards, outwards, {}, {}, compressed, std::move(backendLease)});
+
+            spdlog::info("Connecting pipes");
+            elem.first->second.inwardPipe = inwards->pipeTo(*outwards, std::move(towardsBroker));
+            elem.first->second.outwardPipe = outwards->pipeTo(*inwards, std::move(fromBroker));
+        }
+        trace->mark(TunnelStage::Piping);
+        if (onPiping)
+            onPiping(*trace);
+    }
 }
\ No newline at end of file
@@ -1,10 +1,10 @@
-import { ServiceInfo } from "../service";
-
-interface HandshakeMessage
-{
-    type: 'Handshake';
-    identity: string;
-    services: Array<ServiceInfo>
-}
-
+import { ServiceInfo } from "../service";
+
+interface HandshakeMessage
+{
+    type: 'Handshake';
+    identity: string;
+    services: Array<ServiceInfo>
+}
+
 export {HandshakeMessage};
\ No newline at end of file
@@ -0,0 +1,10 @@
+import { ServiceInfo } from "../service";
+
+interface ServicesUpdateMessage
+{
+    type: 'ServicesUpdate';
+    added: Array<ServiceInfo>;
+    removed: Array<number>;
+}
+
+export {ServicesUpdateMessage};
\ No newline at end of file
@@ -5,6 +5,9 @@ interface ServiceInfo
     hiddenPort: number;
     publicPort: number;
     hiddenHost?: string;
+    httpHosts?: Array<string>;
+    tlsServerNames?: Array<string>;
+    shareable?: boolean;
 }
 
 export {
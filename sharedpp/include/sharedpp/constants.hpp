@@ -3,4 +3,6 @@
 namespace TunnelBore
 {
     constexpr std::string_view publisherToBrokerPrefix = "TUNNEL_BORE_P2B";
+    /// Sent in plain by publishers before the TLS handshake of an encrypted data link, see DataLinkTls.
+    constexpr std::string_view publisherToBrokerTlsPrefix = "TUNNEL_BORE_TLS:";
 }
\ No newline at end of file
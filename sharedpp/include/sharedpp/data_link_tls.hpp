@@ -0,0 +1,143 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+
+namespace TunnelBore
+{
+    /**
+     * TLS on a data link between publisher and broker. OpenSSL runs the handshake directly on the socket and hands
+     * the record layer to the kernel (kTLS) where it can. Once both directions are offloaded, the socket carries plain
+     * data for this process and is used like any other, so splicing and the pipes stay as they are.
+     * Otherwise everything has to go through asyncReadSome and asyncWrite, which encrypt in userspace.
+     *
+     * Not thread safe, all operations have to run on the executor of the socket.
+     */
+    class DataLinkTls : public std::enable_shared_from_this<DataLinkTls>
+    {
+      public:
+        enum class Role
+        {
+            Client,
+            Server
+        };
+
+        /**
+         * @brief Context for the broker side, with the certificate it serves its api with.
+         * @throws boost::system::system_error if the certificate or key cannot be loaded.
+         */
+        static std::shared_ptr<boost::asio::ssl::context>
+        makeServerContext(std::filesystem::path const& certificate, std::filesystem::path const& key);
+
+        /**
+         * @brief Context for the publisher side. Like the control line, the certificate of the broker is not verified.
+         */
+        static std::shared_ptr<boost::asio::ssl::context> makeClientContext();
+
+        /// Whether the OpenSSL of this build can offload to the kernel at all.
+        static bool kernelOffloadSupported();
+
+        DataLinkTls(std::shared_ptr<boost::asio::ssl::context> context, Role role);
+        ~DataLinkTls();
+        DataLinkTls(DataLinkTls const&) = delete;
+        DataLinkTls(DataLinkTls&&) = delete;
+        DataLinkTls& operator=(DataLinkTls const&) = delete;
+        DataLinkTls& operator=(DataLinkTls&&) = delete;
+
+        /**
+         * @brief Makes the socket non blocking and runs the handshake on it. Nothing may be read from or written to
+         * the socket meanwhile.
+         */
+        void asyncHandshake(
+            boost::asio::ip::tcp::socket& socket,
+            std::function<void(boost::system::error_code)> onHandshake);
+
+        /**
+         * @brief Both directions are encrypted by the kernel after the handshake.
+         */
+        bool offloaded() const;
+
+        /**
+         * @brief Like socket.async_read_some, decrypting. End of stream is reported as boost::asio::error::eof.
+         */
+        template <typename Handler>
+        void asyncReadSome(boost::asio::ip::tcp::socket& socket, boost::asio::mutable_buffer buffer, Handler handler)
+        {
+            const auto progress = readSome(buffer);
+            if (progress.wants == Wants::Nothing)
+            {
+                // Never completes inline, so that read loops cannot recurse.
+                return boost::asio::post(
+                    socket.get_executor(), [handler = std::move(handler), progress]() mutable {
+                        handler(progress.ec, progress.bytes);
+                    });
+            }
+            socket.async_wait(
+                waitTypeFor(progress.wants),
+                [self = shared_from_this(), &socket, buffer, handler = std::move(handler)](
+                    boost::system::error_code ec) mutable {
+                    if (ec)
+                        return handler(ec, std::size_t{0});
+                    self->asyncReadSome(socket, buffer, std::move(handler));
+                });
+        }
+
+        /**
+         * @brief Like boost::asio::async_write, encrypting.
+         */
+        template <typename Handler>
+        void asyncWrite(boost::asio::ip::tcp::socket& socket, boost::asio::const_buffer buffer, Handler handler)
+        {
+            const auto progress = write(buffer);
+            if (progress.wants == Wants::Nothing)
+            {
+                return boost::asio::post(
+                    socket.get_executor(), [handler = std::move(handler), progress]() mutable {
+                        handler(progress.ec, progress.bytes);
+                    });
+            }
+            // OpenSSL wants the very same buffer again once the socket is ready.
+            socket.async_wait(
+                waitTypeFor(progress.wants),
+                [self = shared_from_this(), &socket, buffer, handler = std::move(handler)](
+                    boost::system::error_code ec) mutable {
+                    if (ec)
+                        return handler(ec, std::size_t{0});
+                    self->asyncWrite(socket, buffer, std::move(handler));
+                });
+        }
+
+      private:
+        enum class Wants
+        {
+            Nothing,
+            Read,
+            Write
+        };
+        struct Progress
+        {
+            Wants wants;
+            boost::system::error_code ec;
+            std::size_t bytes;
+        };
+
+        static boost::asio::socket_base::wait_type waitTypeFor(Wants wants);
+        Progress readSome(boost::asio::mutable_buffer buffer);
+        Progress write(boost::asio::const_buffer buffer);
+        void continueHandshake(
+            boost::asio::ip::tcp::socket& socket,
+            std::function<void(boost::system::error_code)> onHandshake);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
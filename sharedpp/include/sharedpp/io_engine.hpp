@@ -0,0 +1,55 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+
+#include <cstddef>
+#include <memory>
+
+namespace TunnelBore
+{
+    /**
+     * A set of io_contexts, each run by exactly one thread.
+     *
+     * Handlers of one shard never run concurrently and stay on the same core, so everything belonging to one
+     * connection (or one pair of linked connections) should be placed on the same shard.
+     */
+    class IoEngine
+    {
+      public:
+        struct Options
+        {
+            /// Number of shards, 0 for one per hardware thread.
+            std::size_t threads = 0;
+            /// Pins the thread of shard i to cpu i. Only supported on linux, ignored elsewhere.
+            bool pinThreads = false;
+        };
+
+        explicit IoEngine(Options const& options);
+        ~IoEngine();
+        IoEngine(IoEngine const&) = delete;
+        IoEngine(IoEngine&&) = delete;
+        IoEngine& operator=(IoEngine const&) = delete;
+        IoEngine& operator=(IoEngine&&) = delete;
+
+        std::size_t shardCount() const;
+
+        /**
+         * @brief The executor of a specific shard.
+         */
+        boost::asio::any_io_executor executor(std::size_t shard) const;
+
+        /**
+         * @brief The executor of the next shard in round robin order, for new connections.
+         */
+        boost::asio::any_io_executor nextExecutor();
+
+        /**
+         * @brief Stops all shards and waits for their threads. Called by the destructor.
+         */
+        void stop();
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+}
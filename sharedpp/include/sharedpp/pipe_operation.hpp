@@ -6,19 +6,36 @@
 
 #include <string>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <string_view>
+#include <utility>
 
 namespace TunnelBore
 {
+    /**
+     * Turns what was read from one side into what is written to the other, like compressing it.
+     * Returns false if the stream cannot be continued.
+     */
+    using PipeTransform = std::function<bool(std::string_view input, std::string& output)>;
+
+    /**
+     * Pipes everything read from one side into the other. Sides having countReceived(std::size_t) are told about
+     * every read. Sides having userspaceTls() are read and written through it when it returns a DataLinkTls.
+     */
     template <typename TunnelSession>
     class PipeOperation : public std::enable_shared_from_this<PipeOperation<TunnelSession>>
     {
       public:
-        PipeOperation(std::weak_ptr<TunnelSession> sideOriginal, std::weak_ptr<TunnelSession> sideOther)
+        PipeOperation(
+            std::weak_ptr<TunnelSession> sideOriginal,
+            std::weak_ptr<TunnelSession> sideOther,
+            PipeTransform transform = {})
             : sideOriginal_(sideOriginal)
             , sideOther_(sideOther)
-            , state_(std::make_shared<State>([]() {
-                return State{.buffer = std::string(4096, '\0'), .totalTransfer = 0};
+            , state_(std::make_shared<State>([&transform]() {
+                return State{
+                    .buffer = std::string(4096, '\0'), .totalTransfer = 0, .transform = std::move(transform)};
             }()))
         {}
         ~PipeOperation()
@@ -36,6 +53,19 @@ namespace TunnelBore
             read();
         }
 
+        /**
+         * @brief Stops piping once the read or write in flight completes, without closing either side.
+         * The operation in flight has to be aborted by cancelling the sockets, or it completes normally.
+         *
+         * @param onSuspended Receives what was read from the original side, but not yet written to the other, and
+         * whether the pipe ended meanwhile, because a side reached its end or failed.
+         */
+        void suspend(std::function<void(std::string unsent, bool ended)> onSuspended)
+        {
+            state_->suspended = true;
+            state_->onSuspended = std::move(onSuspended);
+        }
+
         void close()
         {
             auto sideOriginal = sideOriginal_.lock();
@@ -54,32 +84,64 @@ namespace TunnelBore
             if (!sideOriginal)
                 return;
 
-            sideOriginal->socket().async_read_some(
-                boost::asio::buffer(state_->buffer),
-                [weakOperation = this->weak_from_this(),
-                 state = this->state_](auto const& ec, std::size_t bytesTransferred) {
-                    auto operation = weakOperation.lock();
-                    if (!operation)
-                    {
-                        spdlog::error("Pipe operation died while piping (weakOperation::lock)");
-                        return;
-                    }
+            auto onRead = [weakOperation = this->weak_from_this(),
+                           state = this->state_](auto const& ec, std::size_t bytesTransferred) {
+                auto operation = weakOperation.lock();
+                if (!operation)
+                {
+                    spdlog::error("Pipe operation died while piping (weakOperation::lock)");
+                    return;
+                }
 
-                    state->totalTransfer += bytesTransferred;
+                state->totalTransfer += bytesTransferred;
 
-                    auto sideOriginal = operation->sideOriginal_.lock();
+                if (state->suspended)
+                {
+                    return operation->finishSuspension(
+                        std::string(state->buffer.data(), bytesTransferred),
+                        ec && ec != boost::asio::error::operation_aborted);
+                }
 
-                    if (!sideOriginal)
-                        return;
-                    else
+                auto sideOriginal = operation->sideOriginal_.lock();
+
+                if (!sideOriginal)
+                    return;
+                else
+                {
+                    sideOriginal->resetTimer();
+                    if constexpr (requires(TunnelSession& side) { side.countReceived(bytesTransferred); })
+                        sideOriginal->countReceived(bytesTransferred);
+                    if (ec && ec != boost::asio::error::eof)
+                        spdlog::warn(
+                            "Error in pipeTo(1) in tunnel '{}': '{}'", sideOriginal->remoteAddress(), ec.message());
+                }
+
+                if (state->transform && bytesTransferred > 0)
+                {
+                    const auto input = std::string_view{state->buffer.data(), bytesTransferred};
+                    state->transformed.clear();
+                    if (!state->transform(input, state->transformed))
                     {
-                        sideOriginal->resetTimer();
-                        if (ec && ec != boost::asio::error::eof)
-                            spdlog::warn(
-                                "Error in pipeTo(1) in tunnel '{}': '{}'", sideOriginal->remoteAddress(), ec.message());
+                        spdlog::warn("Could not transform data in tunnel '{}'.", sideOriginal->remoteAddress());
+                        return operation->close();
                     }
-                    operation->write(bytesTransferred, ec.operator bool());
-                });
+                    // Nothing complete to pass on yet, like a partial frame.
+                    if (state->transformed.empty() && !ec)
+                        return operation->read();
+                    return operation->write(state->transformed.size(), ec.operator bool());
+                }
+                operation->write(bytesTransferred, ec.operator bool());
+            };
+
+            if constexpr (requires(TunnelSession& side) { side.userspaceTls(); })
+            {
+                if (auto tls = sideOriginal->userspaceTls(); tls)
+                {
+                    return tls->asyncReadSome(
+                        sideOriginal->socket(), boost::asio::buffer(state_->buffer), std::move(onRead));
+                }
+            }
+            sideOriginal->socket().async_read_some(boost::asio::buffer(state_->buffer), std::move(onRead));
         }
         void write(std::size_t bytesTransferred, bool close, std::size_t cumulativeOffset = 0, int retries = 0)
         {
@@ -100,9 +162,9 @@ namespace TunnelBore
                 return;
             }
 
-            if (bytesTransferred > state_->buffer.size() || bytesTransferred == 0)
+            if (bytesTransferred > state_->outgoing().size() || bytesTransferred == 0)
             {
-                if (bytesTransferred > state_->buffer.size())
+                if (bytesTransferred > state_->outgoing().size())
                     spdlog::error("bytesTransferred is too large, killing pipe: {}", bytesTransferred);
 
                 if (sideOriginal)
@@ -115,75 +177,94 @@ namespace TunnelBore
             if (!sideOther)
                 return;
 
-            boost::asio::async_write(
-                sideOther->socket(),
-                boost::asio::buffer(state_->buffer.data() + cumulativeOffset, bytesTransferred),
-                [weakOperation = this->weak_from_this(),
-                 state = this->state_,
-                 close,
-                 expectedWrittenAmount = bytesTransferred,
-                 cumulativeOffset,
-                 retries](auto const& ec, std::size_t bytesWritten) {
-                    auto operation = weakOperation.lock();
-                    if (!operation)
-                    {
-                        spdlog::error("Pipe operation died while piping (weakOperation::lock)");
-                        return;
-                    }
+            auto onWritten = [weakOperation = this->weak_from_this(),
+                              state = this->state_,
+                              close,
+                              expectedWrittenAmount = bytesTransferred,
+                              cumulativeOffset,
+                              retries](auto const& ec, std::size_t bytesWritten) {
+                auto operation = weakOperation.lock();
+                if (!operation)
+                {
+                    spdlog::error("Pipe operation died while piping (weakOperation::lock)");
+                    return;
+                }
 
-                    auto sideOriginal = operation->sideOriginal_.lock();
-                    auto sideOther = operation->sideOther_.lock();
+                if (state->suspended)
+                {
+                    const auto written = std::min(bytesWritten, expectedWrittenAmount);
+                    return operation->finishSuspension(
+                        state->outgoing().substr(cumulativeOffset + written, expectedWrittenAmount - written),
+                        close || (ec && ec != boost::asio::error::operation_aborted));
+                }
 
-                    if (bytesWritten > expectedWrittenAmount)
-                    {
-                        spdlog::error("bytesWritten is too large, killing pipe: {}", bytesWritten);
-                        if (sideOriginal)
-                            sideOriginal->close();
-                        if (sideOther)
-                            sideOther->close();
-                        return;
-                    }
+                auto sideOriginal = operation->sideOriginal_.lock();
+                auto sideOther = operation->sideOther_.lock();
 
-                    if (expectedWrittenAmount != bytesWritten)
-                    {
-                        spdlog::warn(
-                            "Expected to write {} bytes, but only wrote {} bytes, retrying",
-                            expectedWrittenAmount,
-                            bytesWritten);
-                        operation->write(
-                            expectedWrittenAmount - bytesWritten, close, cumulativeOffset + bytesWritten, retries + 1);
-                        return;
-                    }
+                if (bytesWritten > expectedWrittenAmount)
+                {
+                    spdlog::error("bytesWritten is too large, killing pipe: {}", bytesWritten);
+                    if (sideOriginal)
+                        sideOriginal->close();
+                    if (sideOther)
+                        sideOther->close();
+                    return;
+                }
 
-                    if (!sideOriginal)
-                    {
-                        spdlog::error("Tunnel session died while piping (sideOriginal::write)");
-                    }
-                    if (!sideOther)
-                    {
-                        spdlog::error("Tunnel session died while piping (sideOther::write)");
-                    }
+                if (expectedWrittenAmount != bytesWritten)
+                {
+                    spdlog::warn(
+                        "Expected to write {} bytes, but only wrote {} bytes, retrying",
+                        expectedWrittenAmount,
+                        bytesWritten);
+                    operation->write(
+                        expectedWrittenAmount - bytesWritten, close, cumulativeOffset + bytesWritten, retries + 1);
+                    return;
+                }
 
-                    if (ec || close)
-                    {
-                        if (ec && sideOther)
-                            spdlog::warn(
-                                "Error in pipeTo(2) in tunnel '{}': '{}'", sideOther->remoteAddress(), ec.message());
-
-                        if (sideOriginal)
-                            sideOriginal->close();
-                        if (sideOther)
-                            sideOther->close();
-                        return;
-                    }
+                if (!sideOriginal)
+                {
+                    spdlog::error("Tunnel session died while piping (sideOriginal::write)");
+                }
+                if (!sideOther)
+                {
+                    spdlog::error("Tunnel session died while piping (sideOther::write)");
+                }
+
+                if (ec || close)
+                {
+                    if (ec && sideOther)
+                        spdlog::warn(
+                            "Error in pipeTo(2) in tunnel '{}': '{}'", sideOther->remoteAddress(), ec.message());
 
                     if (sideOriginal)
-                        sideOriginal->resetTimer();
+                        sideOriginal->close();
                     if (sideOther)
-                        sideOther->resetTimer();
+                        sideOther->close();
+                    return;
+                }
+
+                if (sideOriginal)
+                    sideOriginal->resetTimer();
+                if (sideOther)
+                    sideOther->resetTimer();
+
+                operation->read();
+            };
+
+            const auto outgoing = boost::asio::buffer(state_->outgoing().data() + cumulativeOffset, bytesTransferred);
+            if constexpr (requires(TunnelSession& side) { side.userspaceTls(); })
+            {
+                if (auto tls = sideOther->userspaceTls(); tls)
+                    return tls->asyncWrite(sideOther->socket(), outgoing, std::move(onWritten));
+            }
+            boost::asio::async_write(sideOther->socket(), outgoing, std::move(onWritten));
+        }
 
-                    operation->read();
-                });
+        void finishSuspension(std::string unsent, bool ended)
+        {
+            if (auto onSuspended = std::exchange(state_->onSuspended, {}); onSuspended)
+                onSuspended(std::move(unsent), ended);
         }
 
       private:
@@ -193,6 +274,16 @@ namespace TunnelBore
         {
             std::string buffer;
             MemoryUnit totalTransfer;
+            PipeTransform transform = {};
+            std::string transformed = {};
+            bool suspended = false;
+            std::function<void(std::string, bool)> onSuspended = {};
+
+            /// What is written to the other side.
+            std::string& outgoing()
+            {
+                return transform ? transformed : buffer;
+            }
         };
         std::shared_ptr<State> state_;
     };
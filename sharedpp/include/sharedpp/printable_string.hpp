@@ -1,6 +1,6 @@
-#pragma once
-
-#include <string>
-#include <string_view>
-
+#pragma once
+
+#include <string>
+#include <string_view>
+
 std::string makePrintableString(std::string_view input);
\ No newline at end of file
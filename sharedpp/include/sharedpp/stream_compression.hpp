@@ -0,0 +1,147 @@
+#pragma once
+
+#include <sharedpp/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TunnelBore
+{
+    /**
+     * Compression of the tunnel leg between publisher and broker. The side reading from the client or the hidden
+     * service compresses, the other side decompresses.
+     */
+    enum class StreamCompression
+    {
+        None,
+        Zstd
+    };
+
+    std::string_view toString(StreamCompression compression);
+    std::optional<StreamCompression> streamCompressionFromString(std::string_view name);
+
+    constexpr int defaultCompressionLevel = 3;
+
+    /// Compressions this build can speak, without none.
+    std::vector<std::string> supportedStreamCompressions();
+
+    /**
+     * Counters for one direction of the compressed tunnels of a service, updated with relaxed atomics.
+     */
+    class CompressionStats
+    {
+      public:
+        /**
+         * @param plainBytes Size of the stream before compression.
+         * @param framedBytes Size of the frames it was compressed to, including their headers.
+         * @param spent Time spent in the codec, which is cpu time as it never waits.
+         */
+        void record(std::size_t plainBytes, std::size_t framedBytes, std::chrono::nanoseconds spent);
+
+        /// Bytes the compressor passed on uncompressed, because compressing them did not pay off.
+        void recordPassedThrough(std::size_t bytes);
+        void recordDisabled();
+
+        /**
+         * @return plainBytes, framedBytes, ratio (framed / plain), passedThroughBytes, timesDisabled and cpuMs.
+         */
+        json toJson() const;
+
+      private:
+        std::atomic<std::uint64_t> plainBytes_{0};
+        std::atomic<std::uint64_t> framedBytes_{0};
+        std::atomic<std::uint64_t> passedThroughBytes_{0};
+        std::atomic<std::uint64_t> timesDisabled_{0};
+        std::atomic<std::uint64_t> codecNanoseconds_{0};
+    };
+
+    /**
+     * Turns a byte stream into frames of a 4 byte header (kind, 24 bit big endian length) and payload. Every call
+     * flushes, so nothing is held back from the other side.
+     *
+     * The compression ratio is probed every ProbeBytes. When it is worse than PoorRatio, the following
+     * UncompressedBytes are sent as uncompressed frames, then it is probed again.
+     */
+    class StreamCompressor
+    {
+      public:
+        constexpr static std::size_t ProbeBytes = 256 * 1024;
+        constexpr static double PoorRatio = 0.9;
+        constexpr static std::size_t UncompressedBytes = 16 * 1024 * 1024;
+
+        /**
+         * @throws std::invalid_argument if the compression is not supported by this build.
+         */
+        StreamCompressor(StreamCompression compression, int level, std::shared_ptr<CompressionStats> stats);
+        ~StreamCompressor();
+        StreamCompressor(StreamCompressor const&) = delete;
+        StreamCompressor(StreamCompressor&&);
+        StreamCompressor& operator=(StreamCompressor const&) = delete;
+        StreamCompressor& operator=(StreamCompressor&&);
+
+        /**
+         * @brief Appends the frames for the input to output.
+         * @return false if the codec failed, the stream cannot be continued then.
+         */
+        bool compress(std::string_view input, std::string& output);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+
+    /**
+     * Inverse of StreamCompressor, takes frames split at arbitrary points.
+     *
+     * The peer is not trusted to be a StreamCompressor: a frame decoding to more than one slice of the compressor,
+     * a call decoding to more than MaxOutputPerCall or a window larger than the compressor uses fail the stream.
+     */
+    class StreamDecompressor
+    {
+      public:
+        /// Bytes one zstd frame may decode to, the compressor never puts more into one.
+        constexpr static std::size_t MaxFrameOutput = 64 * 1024;
+        /// Bytes one call may decode to. Tunnels pass a few KiB per call, which honest frames stay far below.
+        constexpr static std::size_t MaxOutputPerCall = 4 * 1024 * 1024;
+
+        /**
+         * @throws std::invalid_argument if the compression is not supported by this build.
+         */
+        StreamDecompressor(StreamCompression compression, std::shared_ptr<CompressionStats> stats);
+        ~StreamDecompressor();
+        StreamDecompressor(StreamDecompressor const&) = delete;
+        StreamDecompressor(StreamDecompressor&&);
+        StreamDecompressor& operator=(StreamDecompressor const&) = delete;
+        StreamDecompressor& operator=(StreamDecompressor&&);
+
+        /**
+         * @brief Appends everything that could be decoded from the input so far to output.
+         * @return false if the stream is corrupt or exceeds the limits above.
+         */
+        bool decompress(std::string_view input, std::string& output);
+
+      private:
+        struct Implementation;
+        std::unique_ptr<Implementation> impl_;
+    };
+
+    /**
+     * @brief A new compressor as transform for a PipeOperation.
+     */
+    std::function<bool(std::string_view, std::string&)>
+    compressingTransform(StreamCompression compression, int level, std::shared_ptr<CompressionStats> stats);
+
+    /**
+     * @brief A new decompressor as transform for a PipeOperation.
+     */
+    std::function<bool(std::string_view, std::string&)>
+    decompressingTransform(StreamCompression compression, std::shared_ptr<CompressionStats> stats);
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <sharedpp/json.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace TunnelBore
+{
+    /**
+     * Stages of setting up one tunnel, in the order they happen. The broker side starts with Accepted, the
+     * publisher side with NewTunnelReceived. Both sides use the tunnel id of the client connection.
+     */
+    enum class TunnelStage : std::size_t
+    {
+        // Broker
+        Accepted,
+        ClientRead,
+        PublisherInformed,
+        PublisherArrived,
+        Linked,
+        // Publisher
+        NewTunnelReceived,
+        Signed,
+        BrokerConnected,
+        /// Only for encrypted data links.
+        LinkEncrypted,
+        TokenSent,
+        HiddenConnected,
+        Piping,
+        Count
+    };
+
+    constexpr std::size_t tunnelStageCount = static_cast<std::size_t>(TunnelStage::Count);
+
+    constexpr std::array<std::string_view, tunnelStageCount> tunnelStageNames{
+        "Accepted",
+        "ClientRead",
+        "PublisherInformed",
+        "PublisherArrived",
+        "Linked",
+        "NewTunnelReceived",
+        "Signed",
+        "BrokerConnected",
+        "LinkEncrypted",
+        "TokenSent",
+        "HiddenConnected",
+        "Piping",
+    };
+
+    constexpr std::string_view toString(TunnelStage stage)
+    {
+        return tunnelStageNames[static_cast<std::size_t>(stage)];
+    }
+
+    constexpr std::optional<TunnelStage> tunnelStageFromString(std::string_view name)
+    {
+        for (std::size_t i = 0; i != tunnelStageNames.size(); ++i)
+        {
+            if (tunnelStageNames[i] == name)
+                return static_cast<TunnelStage>(i);
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Monotonic timestamps of the stages one side went through, relative to the first one. Thread safe, the stages
+     * of a tunnel are marked from the acceptor, the shards and the control session.
+     */
+    class TunnelTrace
+    {
+      public:
+        TunnelTrace(std::string tunnelId, TunnelStage origin);
+        TunnelTrace(TunnelTrace const& other);
+        TunnelTrace& operator=(TunnelTrace const& other);
+
+        /**
+         * @brief Records that the stage was reached now. Stages marked twice keep the first time.
+         */
+        void mark(TunnelStage stage);
+
+        std::string const& tunnelId() const;
+
+        /// Time from the origin to the stage, if it was reached.
+        std::optional<std::chrono::nanoseconds> sinceOrigin(TunnelStage stage) const;
+
+        /// Time from the previous reached stage to this one, which is what the stage cost.
+        std::optional<std::chrono::nanoseconds> latencyOf(TunnelStage stage) const;
+
+        /// Time from the origin to the last reached stage.
+        std::chrono::nanoseconds total() const;
+
+        TunnelStage origin() const;
+
+        /**
+         * @brief Whether all reached stages belong to the side the trace originates from.
+         */
+        bool isOneSided() const;
+
+        friend void to_json(json& j, TunnelTrace const& trace);
+        friend void from_json(json const& j, TunnelTrace& trace);
+
+      private:
+        mutable std::mutex guard_;
+        std::string tunnelId_;
+        TunnelStage origin_;
+        std::chrono::steady_clock::time_point start_;
+        std::array<std::optional<std::chrono::nanoseconds>, tunnelStageCount> offsets_;
+    };
+
+    /**
+     * Latencies in power of two microsecond buckets. Recording is lock free.
+     */
+    class LatencyHistogram
+    {
+      public:
+        /// The last bucket takes everything from 2^(BucketCount - 2) microseconds (~67s) on.
+        constexpr static std::size_t BucketCount = 28;
+
+        void record(std::chrono::nanoseconds latency);
+
+        /**
+         * @return count, sum and estimated percentiles, plus the non empty buckets by their upper bound.
+         */
+        json toJson() const;
+
+      private:
+        std::array<std::atomic<std::uint64_t>, BucketCount> buckets_{};
+        std::atomic<std::uint64_t> count_{0};
+        std::atomic<std::uint64_t> sumMicroseconds_{0};
+    };
+
+    /**
+     * Histograms of every stage and of the whole setup per side, fed with finished traces.
+     * Traces that took longer than the slow threshold are logged with all their stages.
+     *
+     * When pairing, the traces of both sides of a tunnel are joined by its id. The time the broker waited for the
+     * publisher, less what the publisher spent until it sent its token, is recorded as transit, and slow setups are
+     * logged with both sides. A trace whose other side does not arrive is logged alone after PairingTimeout.
+     */
+    class TunnelSetupStats
+    {
+      public:
+        /// A trace waits this long for the trace of the other side of its tunnel.
+        constexpr static std::chrono::seconds PairingTimeout{10};
+        /// Traces waiting for the other side beyond this are given up on, oldest first.
+        constexpr static std::size_t MaxUnpairedTraces = 4096;
+
+        /**
+         * @param slowThreshold Setups taking longer are logged, 0 disables the log.
+         * @param pairSides Whether traces of both sides are recorded here and should be joined.
+         */
+        explicit TunnelSetupStats(
+            std::chrono::milliseconds slowThreshold = std::chrono::milliseconds{0},
+            bool pairSides = false);
+
+        void record(TunnelTrace const& trace);
+
+        json toJson() const;
+
+      private:
+        /**
+         * @param broker,publisher Null for a side without a trace.
+         */
+        void logIfSlow(TunnelTrace const* broker, TunnelTrace const* publisher) const;
+
+      private:
+        struct Unpaired
+        {
+            TunnelTrace trace;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        std::chrono::milliseconds slowThreshold_;
+        bool pairSides_;
+        std::array<LatencyHistogram, tunnelStageCount> stages_;
+        LatencyHistogram brokerTotal_;
+        LatencyHistogram publisherTotal_;
+        LatencyHistogram transit_;
+
+        std::mutex pairingGuard_;
+        std::unordered_map<std::string, Unpaired> unpaired_;
+        /// Tunnel ids in the order they became unpaired, ids paired meanwhile are skipped.
+        std::deque<std::string> unpairedOrder_;
+    };
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sharedpp/json.hpp>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TunnelBore
+{
+    /**
+     * Encodings for control messages. Json is always understood and is used until the handshake selected
+     * another one. The binary encodings are sent as binary websocket frames.
+     */
+    enum class WireEncoding
+    {
+        Json,
+        Cbor,
+        MessagePack
+    };
+
+    std::string_view toString(WireEncoding encoding);
+    std::optional<WireEncoding> wireEncodingFromString(std::string_view name);
+
+    /// Encodings this build can speak, in order of preference.
+    std::vector<std::string> supportedWireEncodings();
+
+    /**
+     * @brief Picks the first encoding of the peers preference list that is supported here.
+     */
+    WireEncoding selectWireEncoding(std::vector<std::string> const& peerPreference);
+
+    bool isBinary(WireEncoding encoding);
+
+    std::string encodeMessage(json const& message, WireEncoding encoding);
+    json decodeMessage(std::string_view data, WireEncoding encoding);
+
+    /**
+     * @brief Joins already encoded messages into one frame.
+     *
+     * Json messages are separated by newlines. For the binary encodings an array header is put in front,
+     * which makes the frame a valid array of the messages without re-encoding them.
+     */
+    std::string joinEncodedMessages(std::vector<std::string>&& messages, WireEncoding encoding);
+
+    /**
+     * A message waiting to be written, encoded with the encoding of the session at the time.
+     */
+    struct EncodedMessage
+    {
+        std::string payload;
+        WireEncoding encoding;
+    };
+
+    struct EncodedFrame
+    {
+        std::string data;
+        WireEncoding encoding;
+        /// Messages joined into the frame.
+        std::size_t messages;
+    };
+
+    /**
+     * @brief Joins the messages at the front of the queue into a frame and removes them from the queue.
+     * Only messages of the same encoding share a frame, and only until it holds maxBytes.
+     *
+     * @param queue Must not be empty.
+     * @param batching false to put only the first message into the frame.
+     */
+    EncodedFrame takeFrame(std::vector<EncodedMessage>& queue, std::size_t maxBytes, bool batching);
+
+    /**
+     * @brief Inverse of joinEncodedMessages, calls the consumer for every message within the frame.
+     */
+    template <typename FunctionT>
+    void forEachMessageInFrame(std::string_view frame, WireEncoding encoding, FunctionT&& consumer)
+    {
+        if (!isBinary(encoding))
+        {
+            while (!frame.empty())
+            {
+                const auto lineEnd = frame.find('\n');
+                const auto line = frame.substr(0, lineEnd);
+                if (!line.empty())
+                    consumer(decodeMessage(line, encoding));
+                if (lineEnd == std::string_view::npos)
+                    break;
+                frame.remove_prefix(lineEnd + 1);
+            }
+            return;
+        }
+
+        auto decoded = decodeMessage(frame, encoding);
+        if (!decoded.is_array())
+            return consumer(std::move(decoded));
+        for (auto& message : decoded)
+            consumer(std::move(message));
+    }
+}
@@ -0,0 +1,209 @@
+#include <sharedpp/data_link_tls.hpp>
+
+#include <boost/asio/ssl/error.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <cerrno>
+#include <new>
+
+namespace TunnelBore
+{
+    namespace
+    {
+        boost::system::error_code lastSslError()
+        {
+            return {static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category()};
+        }
+
+        /**
+         * Options both sides share: no renegotiation, which kTLS cannot follow, and a missing close_notify counts as
+         * end of stream, as the pipes only shut down the socket.
+         */
+        void applyCommonOptions(SSL_CTX* context)
+        {
+            SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+            SSL_CTX_set_options(context, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifndef OPENSSL_NO_KTLS
+            SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+            // Ciphers the kernel can take over.
+            SSL_CTX_set_cipher_list(
+                context,
+                "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384");
+            SSL_CTX_set_ciphersuites(context, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+            // Idle links do not need to keep their record buffers.
+            SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS);
+        }
+    }
+    // #####################################################################################################################
+    struct DataLinkTls::Implementation
+    {
+        std::shared_ptr<boost::asio::ssl::context> context;
+        std::unique_ptr<SSL, decltype(&SSL_free)> ssl;
+        bool offloaded;
+
+        Implementation(std::shared_ptr<boost::asio::ssl::context> context)
+            : context{std::move(context)}
+            , ssl{SSL_new(this->context->native_handle()), &SSL_free}
+            , offloaded{false}
+        {
+            if (!ssl)
+                throw std::bad_alloc{};
+        }
+
+        Progress progressOf(int result)
+        {
+            switch (SSL_get_error(ssl.get(), result))
+            {
+                case SSL_ERROR_WANT_READ:
+                    return {.wants = Wants::Read, .ec = {}, .bytes = 0};
+                case SSL_ERROR_WANT_WRITE:
+                    return {.wants = Wants::Write, .ec = {}, .bytes = 0};
+                case SSL_ERROR_ZERO_RETURN:
+                    return {.wants = Wants::Nothing, .ec = boost::asio::error::eof, .bytes = 0};
+                case SSL_ERROR_SYSCALL:
+                    if (errno == 0)
+                        return {.wants = Wants::Nothing, .ec = boost::asio::error::eof, .bytes = 0};
+                    return {
+                        .wants = Wants::Nothing,
+                        .ec = boost::system::error_code{errno, boost::system::system_category()},
+                        .bytes = 0};
+                default:
+                    return {.wants = Wants::Nothing, .ec = lastSslError(), .bytes = 0};
+            }
+        }
+    };
+    // #####################################################################################################################
+    std::shared_ptr<boost::asio::ssl::context>
+    DataLinkTls::makeServerContext(std::filesystem::path const& certificate, std::filesystem::path const& key)
+    {
+        auto context = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::tls_server);
+        applyCommonOptions(context->native_handle());
+        // Tickets are sent after the handshake, when the kernel might already be receiving on the other side.
+        SSL_CTX_set_num_tickets(context->native_handle(), 0);
+        SSL_CTX_set_session_cache_mode(context->native_handle(), SSL_SESS_CACHE_OFF);
+        context->use_certificate_chain_file(certificate.string());
+        context->use_private_key_file(key.string(), boost::asio::ssl::context::pem);
+        return context;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::shared_ptr<boost::asio::ssl::context> DataLinkTls::makeClientContext()
+    {
+        auto context = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::tls_client);
+        applyCommonOptions(context->native_handle());
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+        // Older OpenSSL only offloads receiving for TLS 1.2.
+        SSL_CTX_set_max_proto_version(context->native_handle(), TLS1_2_VERSION);
+#endif
+        context->set_verify_mode(boost::asio::ssl::verify_none);
+        return context;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool DataLinkTls::kernelOffloadSupported()
+    {
+#ifndef OPENSSL_NO_KTLS
+        return true;
+#else
+        return false;
+#endif
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::asio::socket_base::wait_type DataLinkTls::waitTypeFor(Wants wants)
+    {
+        return wants == Wants::Write ? boost::asio::socket_base::wait_write : boost::asio::socket_base::wait_read;
+    }
+    // #####################################################################################################################
+    DataLinkTls::DataLinkTls(std::shared_ptr<boost::asio::ssl::context> context, Role role)
+        : impl_{std::make_unique<Implementation>(std::move(context))}
+    {
+        if (role == Role::Client)
+            SSL_set_connect_state(impl_->ssl.get());
+        else
+            SSL_set_accept_state(impl_->ssl.get());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    DataLinkTls::~DataLinkTls() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    void DataLinkTls::asyncHandshake(
+        boost::asio::ip::tcp::socket& socket,
+        std::function<void(boost::system::error_code)> onHandshake)
+    {
+        boost::system::error_code ec;
+        socket.non_blocking(true, ec);
+        if (!ec && SSL_set_fd(impl_->ssl.get(), static_cast<int>(socket.native_handle())) != 1)
+            ec = lastSslError();
+        if (ec)
+        {
+            return boost::asio::post(socket.get_executor(), [onHandshake = std::move(onHandshake), ec]() {
+                onHandshake(ec);
+            });
+        }
+        continueHandshake(socket, std::move(onHandshake));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void DataLinkTls::continueHandshake(
+        boost::asio::ip::tcp::socket& socket,
+        std::function<void(boost::system::error_code)> onHandshake)
+    {
+        ERR_clear_error();
+        const auto result = SSL_do_handshake(impl_->ssl.get());
+        if (result == 1)
+        {
+#ifndef OPENSSL_NO_KTLS
+            impl_->offloaded = BIO_get_ktls_send(SSL_get_wbio(impl_->ssl.get())) &&
+                BIO_get_ktls_recv(SSL_get_rbio(impl_->ssl.get()));
+#endif
+            return boost::asio::post(socket.get_executor(), [onHandshake = std::move(onHandshake)]() {
+                onHandshake({});
+            });
+        }
+
+        const auto progress = impl_->progressOf(result);
+        if (progress.wants == Wants::Nothing)
+        {
+            return boost::asio::post(socket.get_executor(), [onHandshake = std::move(onHandshake), progress]() {
+                onHandshake(progress.ec);
+            });
+        }
+        socket.async_wait(
+            waitTypeFor(progress.wants),
+            [self = shared_from_this(), &socket, onHandshake = std::move(onHandshake)](boost::system::error_code ec) {
+                if (ec)
+                    return onHandshake(ec);
+                self->continueHandshake(socket, std::move(onHandshake));
+            });
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool DataLinkTls::offloaded() const
+    {
+        return impl_->offloaded;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    DataLinkTls::Progress DataLinkTls::readSome(boost::asio::mutable_buffer buffer)
+    {
+        if (buffer.size() == 0)
+            return {.wants = Wants::Nothing, .ec = {}, .bytes = 0};
+        ERR_clear_error();
+        std::size_t bytes = 0;
+        const auto result = SSL_read_ex(impl_->ssl.get(), buffer.data(), buffer.size(), &bytes);
+        if (result == 1)
+            return {.wants = Wants::Nothing, .ec = {}, .bytes = bytes};
+        return impl_->progressOf(result);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    DataLinkTls::Progress DataLinkTls::write(boost::asio::const_buffer buffer)
+    {
+        if (buffer.size() == 0)
+            return {.wants = Wants::Nothing, .ec = {}, .bytes = 0};
+        ERR_clear_error();
+        std::size_t bytes = 0;
+        // Without partial writes, OpenSSL writes everything or nothing.
+        const auto result = SSL_write_ex(impl_->ssl.get(), buffer.data(), buffer.size(), &bytes);
+        if (result == 1)
+            return {.wants = Wants::Nothing, .ec = {}, .bytes = bytes};
+        return impl_->progressOf(result);
+    }
+    // #####################################################################################################################
+}
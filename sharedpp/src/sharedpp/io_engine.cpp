@@ -0,0 +1,109 @@
+#include <sharedpp/io_engine.hpp>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if __linux__
+#    include <pthread.h>
+#    include <sched.h>
+#endif
+
+namespace TunnelBore
+{
+    namespace
+    {
+        void pinCurrentThread(std::size_t cpu)
+        {
+#if __linux__
+            cpu_set_t cpuSet;
+            CPU_ZERO(&cpuSet);
+            CPU_SET(cpu % CPU_SETSIZE, &cpuSet);
+            if (const auto result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet); result != 0)
+                spdlog::warn("Could not pin io thread to cpu {}: {}", cpu, result);
+#else
+            (void)cpu;
+#endif
+        }
+    }
+    // #####################################################################################################################
+    struct IoEngine::Implementation
+    {
+        struct Shard
+        {
+            boost::asio::io_context context{1};
+            boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work{context.get_executor()};
+            std::thread thread{};
+        };
+
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::atomic_size_t next;
+
+        Implementation(Options const& options)
+            : shards{}
+            , next{0}
+        {
+            const auto count = options.threads != 0
+                ? options.threads
+                : std::max(std::size_t{1}, static_cast<std::size_t>(std::thread::hardware_concurrency()));
+
+            shards.reserve(count);
+            for (std::size_t i = 0; i != count; ++i)
+                shards.push_back(std::make_unique<Shard>());
+
+            for (std::size_t i = 0; i != count; ++i)
+            {
+                shards[i]->thread = std::thread{[shard = shards[i].get(), i, pin = options.pinThreads]() {
+                    if (pin)
+                        pinCurrentThread(i);
+                    shard->context.run();
+                }};
+            }
+            spdlog::info("Io engine started with {} shard(s){}.", count, options.pinThreads ? ", pinned" : "");
+        }
+    };
+    // #####################################################################################################################
+    IoEngine::IoEngine(Options const& options)
+        : impl_{std::make_unique<Implementation>(options)}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    IoEngine::~IoEngine()
+    {
+        stop();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::size_t IoEngine::shardCount() const
+    {
+        return impl_->shards.size();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::asio::any_io_executor IoEngine::executor(std::size_t shard) const
+    {
+        return impl_->shards[shard % impl_->shards.size()]->context.get_executor();
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    boost::asio::any_io_executor IoEngine::nextExecutor()
+    {
+        return executor(impl_->next.fetch_add(1, std::memory_order_relaxed));
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void IoEngine::stop()
+    {
+        for (auto& shard : impl_->shards)
+        {
+            shard->work.reset();
+            shard->context.stop();
+        }
+        for (auto& shard : impl_->shards)
+        {
+            if (shard->thread.joinable())
+                shard->thread.join();
+        }
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,339 @@
+#include <sharedpp/stream_compression.hpp>
+
+#ifdef TUNNELBORE_HAS_ZSTD
+#    include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+namespace TunnelBore
+{
+    namespace
+    {
+        enum class FrameKind : unsigned char
+        {
+            Uncompressed = 0,
+            Zstd = 1
+        };
+
+        constexpr std::size_t frameHeaderSize = 4;
+        constexpr std::size_t maxFramePayload = (std::size_t{1} << 24) - 1;
+        /// Input is compressed in slices of this size, so that no frame can exceed the maximum payload.
+        constexpr std::size_t maxSliceSize = StreamDecompressor::MaxFrameOutput;
+        /// Bounds the memory every compressed tunnel holds on both sides.
+        constexpr int zstdWindowLog = 17;
+
+        std::size_t beginFrame(std::string& output)
+        {
+            const auto start = output.size();
+            output.append(frameHeaderSize, '\0');
+            return start;
+        }
+
+        bool endFrame(std::string& output, std::size_t start, FrameKind kind)
+        {
+            const auto payload = output.size() - start - frameHeaderSize;
+            if (payload > maxFramePayload)
+                return false;
+            output[start] = static_cast<char>(kind);
+            output[start + 1] = static_cast<char>((payload >> 16) & 0xFF);
+            output[start + 2] = static_cast<char>((payload >> 8) & 0xFF);
+            output[start + 3] = static_cast<char>(payload & 0xFF);
+            return true;
+        }
+
+        void requireSupported(StreamCompression compression)
+        {
+            const auto supported = supportedStreamCompressions();
+            if (std::find(supported.begin(), supported.end(), toString(compression)) == supported.end())
+                throw std::invalid_argument("Stream compression is not supported by this build.");
+        }
+    }
+    // #####################################################################################################################
+    std::string_view toString(StreamCompression compression)
+    {
+        switch (compression)
+        {
+            case StreamCompression::Zstd:
+                return "zstd";
+            case StreamCompression::None:
+            default:
+                return "none";
+        }
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<StreamCompression> streamCompressionFromString(std::string_view name)
+    {
+        if (name == "none")
+            return StreamCompression::None;
+        if (name == "zstd")
+            return StreamCompression::Zstd;
+        return std::nullopt;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::vector<std::string> supportedStreamCompressions()
+    {
+#ifdef TUNNELBORE_HAS_ZSTD
+        return {"zstd"};
+#else
+        return {};
+#endif
+    }
+    // #####################################################################################################################
+    void CompressionStats::record(std::size_t plainBytes, std::size_t framedBytes, std::chrono::nanoseconds spent)
+    {
+        plainBytes_.fetch_add(plainBytes, std::memory_order_relaxed);
+        framedBytes_.fetch_add(framedBytes, std::memory_order_relaxed);
+        codecNanoseconds_.fetch_add(static_cast<std::uint64_t>(spent.count()), std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void CompressionStats::recordPassedThrough(std::size_t bytes)
+    {
+        passedThroughBytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void CompressionStats::recordDisabled()
+    {
+        timesDisabled_.fetch_add(1, std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    json CompressionStats::toJson() const
+    {
+        const auto plainBytes = plainBytes_.load(std::memory_order_relaxed);
+        const auto framedBytes = framedBytes_.load(std::memory_order_relaxed);
+        return json{
+            {"plainBytes", plainBytes},
+            {"framedBytes", framedBytes},
+            {"ratio", plainBytes == 0 ? 1. : static_cast<double>(framedBytes) / static_cast<double>(plainBytes)},
+            {"passedThroughBytes", passedThroughBytes_.load(std::memory_order_relaxed)},
+            {"timesDisabled", timesDisabled_.load(std::memory_order_relaxed)},
+            {"cpuMs", static_cast<double>(codecNanoseconds_.load(std::memory_order_relaxed)) / 1'000'000.},
+        };
+    }
+    // #####################################################################################################################
+    struct StreamCompressor::Implementation
+    {
+        std::shared_ptr<CompressionStats> stats;
+#ifdef TUNNELBORE_HAS_ZSTD
+        std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context{ZSTD_createCCtx(), &ZSTD_freeCCtx};
+#endif
+        std::size_t probedIn = 0;
+        std::size_t probedOut = 0;
+        std::size_t uncompressedLeft = 0;
+
+        bool compressSlice(std::string_view slice, std::string& output)
+        {
+            const auto frame = beginFrame(output);
+            if (uncompressedLeft > 0)
+            {
+                output.append(slice);
+                uncompressedLeft -= std::min(uncompressedLeft, slice.size());
+                stats->recordPassedThrough(slice.size());
+                return endFrame(output, frame, FrameKind::Uncompressed);
+            }
+
+#ifdef TUNNELBORE_HAS_ZSTD
+            // Once given to zstd, the data is part of the history both sides share, so it has to be sent compressed.
+            ZSTD_inBuffer in{slice.data(), slice.size(), 0};
+            std::size_t remaining = 0;
+            do
+            {
+                const auto offset = output.size();
+                output.resize(offset + ZSTD_CStreamOutSize());
+                ZSTD_outBuffer out{output.data() + offset, ZSTD_CStreamOutSize(), 0};
+                remaining = ZSTD_compressStream2(context.get(), &out, &in, ZSTD_e_flush);
+                output.resize(offset + out.pos);
+                if (ZSTD_isError(remaining))
+                    return false;
+            } while (remaining != 0);
+#endif
+
+            probedIn += slice.size();
+            probedOut += output.size() - frame;
+            if (probedIn >= ProbeBytes)
+            {
+                if (static_cast<double>(probedOut) / static_cast<double>(probedIn) > PoorRatio)
+                {
+                    uncompressedLeft = UncompressedBytes;
+                    stats->recordDisabled();
+                }
+                probedIn = 0;
+                probedOut = 0;
+            }
+            return endFrame(output, frame, FrameKind::Zstd);
+        }
+    };
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamCompressor::StreamCompressor(
+        StreamCompression compression,
+        int level,
+        std::shared_ptr<CompressionStats> stats)
+        : impl_{[&]() {
+            requireSupported(compression);
+            auto impl = std::make_unique<Implementation>();
+            impl->stats = std::move(stats);
+#ifdef TUNNELBORE_HAS_ZSTD
+            if (!impl->context)
+                throw std::bad_alloc{};
+            ZSTD_CCtx_setParameter(impl->context.get(), ZSTD_c_compressionLevel, level);
+            ZSTD_CCtx_setParameter(impl->context.get(), ZSTD_c_windowLog, zstdWindowLog);
+#else
+            static_cast<void>(level);
+#endif
+            return impl;
+        }()}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamCompressor::~StreamCompressor() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamCompressor::StreamCompressor(StreamCompressor&&) = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamCompressor& StreamCompressor::operator=(StreamCompressor&&) = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    bool StreamCompressor::compress(std::string_view input, std::string& output)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto sizeBefore = output.size();
+        const auto inputSize = input.size();
+        bool ok = true;
+        while (ok && !input.empty())
+        {
+            const auto slice = input.substr(0, maxSliceSize);
+            ok = impl_->compressSlice(slice, output);
+            input.remove_prefix(slice.size());
+        }
+        impl_->stats->record(inputSize, output.size() - sizeBefore, std::chrono::steady_clock::now() - start);
+        return ok;
+    }
+    // #####################################################################################################################
+    struct StreamDecompressor::Implementation
+    {
+        std::shared_ptr<CompressionStats> stats;
+#ifdef TUNNELBORE_HAS_ZSTD
+        std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context{ZSTD_createDCtx(), &ZSTD_freeDCtx};
+#endif
+        std::string header;
+        FrameKind kind = FrameKind::Uncompressed;
+        std::size_t payloadLeft = 0;
+        /// Decoded from the current frame so far.
+        std::size_t frameOutput = 0;
+
+        /**
+         * @param budget Bytes the payload may decode to, more fails.
+         */
+        bool decompressPayload(std::string_view payload, std::string& output, std::size_t budget)
+        {
+#ifdef TUNNELBORE_HAS_ZSTD
+            ZSTD_inBuffer in{payload.data(), payload.size(), 0};
+            while (true)
+            {
+                // One byte more than the budget tells exceeding it apart from using it up.
+                const auto chunk = std::min(ZSTD_DStreamOutSize(), budget + 1);
+                const auto offset = output.size();
+                output.resize(offset + chunk);
+                ZSTD_outBuffer out{output.data() + offset, chunk, 0};
+                const auto result = ZSTD_decompressStream(context.get(), &out, &in);
+                output.resize(offset + out.pos);
+                if (ZSTD_isError(result) || out.pos > budget)
+                    return false;
+                budget -= out.pos;
+                frameOutput += out.pos;
+                if (in.pos == in.size && out.pos < out.size)
+                    return true;
+            }
+#else
+            static_cast<void>(payload);
+            static_cast<void>(output);
+            static_cast<void>(budget);
+            return false;
+#endif
+        }
+    };
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamDecompressor::StreamDecompressor(StreamCompression compression, std::shared_ptr<CompressionStats> stats)
+        : impl_{[&]() {
+            requireSupported(compression);
+            auto impl = std::make_unique<Implementation>();
+            impl->stats = std::move(stats);
+#ifdef TUNNELBORE_HAS_ZSTD
+            if (!impl->context)
+                throw std::bad_alloc{};
+            // Frames asking for a larger window than the compressor uses are rejected instead of allocating it.
+            ZSTD_DCtx_setParameter(impl->context.get(), ZSTD_d_windowLogMax, zstdWindowLog);
+#endif
+            return impl;
+        }()}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamDecompressor::~StreamDecompressor() = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamDecompressor::StreamDecompressor(StreamDecompressor&&) = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    StreamDecompressor& StreamDecompressor::operator=(StreamDecompressor&&) = default;
+    //---------------------------------------------------------------------------------------------------------------------
+    bool StreamDecompressor::decompress(std::string_view input, std::string& output)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto sizeBefore = output.size();
+        const auto inputSize = input.size();
+        bool ok = true;
+        while (ok && !input.empty())
+        {
+            if (impl_->payloadLeft == 0)
+            {
+                const auto take = std::min(frameHeaderSize - impl_->header.size(), input.size());
+                impl_->header.append(input.substr(0, take));
+                input.remove_prefix(take);
+                if (impl_->header.size() < frameHeaderSize)
+                    break;
+
+                const auto byte = [this](std::size_t index) {
+                    return static_cast<std::size_t>(static_cast<unsigned char>(impl_->header[index]));
+                };
+                impl_->kind = static_cast<FrameKind>(byte(0));
+                impl_->payloadLeft = (byte(1) << 16) | (byte(2) << 8) | byte(3);
+                impl_->frameOutput = 0;
+                impl_->header.clear();
+                if (impl_->kind != FrameKind::Uncompressed && impl_->kind != FrameKind::Zstd)
+                    ok = false;
+                continue;
+            }
+
+            const auto payload = input.substr(0, impl_->payloadLeft);
+            if (impl_->kind == FrameKind::Uncompressed)
+                output.append(payload);
+            else
+            {
+                // Uncompressed frames count towards the call too, they can exceed it with a large input.
+                const auto produced = std::min(output.size() - sizeBefore, MaxOutputPerCall);
+                const auto budget = std::min(MaxFrameOutput - impl_->frameOutput, MaxOutputPerCall - produced);
+                ok = impl_->decompressPayload(payload, output, budget);
+            }
+            impl_->payloadLeft -= payload.size();
+            input.remove_prefix(payload.size());
+        }
+        impl_->stats->record(output.size() - sizeBefore, inputSize, std::chrono::steady_clock::now() - start);
+        return ok;
+    }
+    // #####################################################################################################################
+    std::function<bool(std::string_view, std::string&)>
+    compressingTransform(StreamCompression compression, int level, std::shared_ptr<CompressionStats> stats)
+    {
+        auto compressor = std::make_shared<StreamCompressor>(compression, level, std::move(stats));
+        return [compressor](std::string_view input, std::string& output) {
+            return compressor->compress(input, output);
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::function<bool(std::string_view, std::string&)>
+    decompressingTransform(StreamCompression compression, std::shared_ptr<CompressionStats> stats)
+    {
+        auto decompressor = std::make_shared<StreamDecompressor>(compression, std::move(stats));
+        return [decompressor](std::string_view input, std::string& output) {
+            return decompressor->decompress(input, output);
+        };
+    }
+    // #####################################################################################################################
+}
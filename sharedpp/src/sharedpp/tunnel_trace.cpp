@@ -0,0 +1,339 @@
+#include <sharedpp/tunnel_trace.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <stdexcept>
+
+namespace TunnelBore
+{
+    namespace
+    {
+        /// Offsets beyond a day are no setup, but a broken or hostile peer. Keeps the conversion in range.
+        constexpr double MaxOffsetMicroseconds = 24. * 60. * 60. * 1'000'000.;
+
+        double toMicroseconds(std::chrono::nanoseconds duration)
+        {
+            return std::chrono::duration<double, std::micro>(duration).count();
+        }
+
+        bool isPublisherStage(TunnelStage stage)
+        {
+            return stage >= TunnelStage::NewTunnelReceived;
+        }
+
+        std::uint64_t bucketUpperBound(std::size_t bucket)
+        {
+            return std::uint64_t{1} << bucket;
+        }
+    }
+    // #####################################################################################################################
+    TunnelTrace::TunnelTrace(std::string tunnelId, TunnelStage origin)
+        : guard_{}
+        , tunnelId_{std::move(tunnelId)}
+        , origin_{origin}
+        , start_{std::chrono::steady_clock::now()}
+        , offsets_{}
+    {
+        offsets_[static_cast<std::size_t>(origin)] = std::chrono::nanoseconds{0};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    TunnelTrace::TunnelTrace(TunnelTrace const& other)
+        : guard_{}
+        , tunnelId_{}
+        , origin_{}
+        , start_{}
+        , offsets_{}
+    {
+        *this = other;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    TunnelTrace& TunnelTrace::operator=(TunnelTrace const& other)
+    {
+        if (this == &other)
+            return *this;
+        std::scoped_lock lock{guard_, other.guard_};
+        tunnelId_ = other.tunnelId_;
+        origin_ = other.origin_;
+        start_ = other.start_;
+        offsets_ = other.offsets_;
+        return *this;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelTrace::mark(TunnelStage stage)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::scoped_lock lock{guard_};
+        auto& offset = offsets_[static_cast<std::size_t>(stage)];
+        if (!offset)
+            offset = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string const& TunnelTrace::tunnelId() const
+    {
+        return tunnelId_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    TunnelStage TunnelTrace::origin() const
+    {
+        return origin_;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool TunnelTrace::isOneSided() const
+    {
+        std::scoped_lock lock{guard_};
+        for (std::size_t i = 0; i != tunnelStageCount; ++i)
+        {
+            if (offsets_[i] && isPublisherStage(static_cast<TunnelStage>(i)) != isPublisherStage(origin_))
+                return false;
+        }
+        return true;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<std::chrono::nanoseconds> TunnelTrace::sinceOrigin(TunnelStage stage) const
+    {
+        std::scoped_lock lock{guard_};
+        return offsets_[static_cast<std::size_t>(stage)];
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<std::chrono::nanoseconds> TunnelTrace::latencyOf(TunnelStage stage) const
+    {
+        std::scoped_lock lock{guard_};
+        const auto index = static_cast<std::size_t>(stage);
+        if (!offsets_[index] || stage == origin_)
+            return std::nullopt;
+        for (auto previous = index; previous-- > static_cast<std::size_t>(origin_);)
+        {
+            if (offsets_[previous])
+                return *offsets_[index] - *offsets_[previous];
+        }
+        return *offsets_[index];
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::chrono::nanoseconds TunnelTrace::total() const
+    {
+        std::scoped_lock lock{guard_};
+        std::chrono::nanoseconds result{0};
+        for (auto const& offset : offsets_)
+        {
+            if (offset)
+                result = std::max(result, *offset);
+        }
+        return result;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void to_json(json& j, TunnelTrace const& trace)
+    {
+        std::scoped_lock lock{trace.guard_};
+        json sinceOrigin = json::object();
+        for (std::size_t i = 0; i != tunnelStageCount; ++i)
+        {
+            if (trace.offsets_[i])
+                sinceOrigin[std::string{tunnelStageNames[i]}] = toMicroseconds(*trace.offsets_[i]);
+        }
+        j = json{
+            {"tunnelId", trace.tunnelId_},
+            {"origin", toString(trace.origin_)},
+            {"sinceOriginUs", std::move(sinceOrigin)},
+        };
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void from_json(json const& j, TunnelTrace& trace)
+    {
+        const auto origin = tunnelStageFromString(j.at("origin").get<std::string>());
+        if (!origin)
+            throw std::invalid_argument("Unknown tunnel stage as trace origin.");
+
+        std::scoped_lock lock{trace.guard_};
+        trace.tunnelId_ = j.at("tunnelId").get<std::string>();
+        trace.origin_ = *origin;
+        trace.start_ = std::chrono::steady_clock::now();
+        trace.offsets_ = {};
+        trace.offsets_[static_cast<std::size_t>(*origin)] = std::chrono::nanoseconds{0};
+        for (auto const& [name, microseconds] : j.at("sinceOriginUs").items())
+        {
+            // Stages this build does not know are ignored, the peer may be newer.
+            const auto stage = tunnelStageFromString(name);
+            if (!stage || !microseconds.is_number())
+                continue;
+            const auto value = microseconds.get<double>();
+            if (!std::isfinite(value) || value < 0. || value > MaxOffsetMicroseconds)
+                throw std::invalid_argument("Tunnel stage offset out of range.");
+            trace.offsets_[static_cast<std::size_t>(*stage)] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double, std::micro>(value));
+        }
+    }
+    // #####################################################################################################################
+    void LatencyHistogram::record(std::chrono::nanoseconds latency)
+    {
+        const auto microseconds =
+            static_cast<std::uint64_t>(std::max(std::int64_t{0}, static_cast<std::int64_t>(latency.count() / 1000)));
+        // Bucket i holds (2^(i-1), 2^i] microseconds.
+        const auto bucket = microseconds <= 1
+            ? std::size_t{0}
+            : std::min(BucketCount - 1, static_cast<std::size_t>(std::bit_width(microseconds - 1)));
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sumMicroseconds_.fetch_add(microseconds, std::memory_order_relaxed);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    json LatencyHistogram::toJson() const
+    {
+        std::array<std::uint64_t, BucketCount> counts{};
+        for (std::size_t i = 0; i != BucketCount; ++i)
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        const auto count = count_.load(std::memory_order_relaxed);
+
+        // The upper bound of the bucket the quantile falls into, so estimates are at most twice the real value.
+        const auto estimate = [&counts, count](double quantile) -> std::uint64_t {
+            if (count == 0)
+                return 0;
+            const auto rank = static_cast<std::uint64_t>(quantile * static_cast<double>(count - 1)) + 1;
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i != BucketCount; ++i)
+            {
+                seen += counts[i];
+                if (seen >= rank)
+                    return bucketUpperBound(i);
+            }
+            return bucketUpperBound(BucketCount - 1);
+        };
+
+        json buckets = json::array();
+        for (std::size_t i = 0; i != BucketCount; ++i)
+        {
+            if (counts[i] == 0)
+                continue;
+            if (i == BucketCount - 1)
+                buckets.push_back(json{{"leUs", nullptr}, {"count", counts[i]}});
+            else
+                buckets.push_back(json{{"leUs", bucketUpperBound(i)}, {"count", counts[i]}});
+        }
+        return json{
+            {"count", count},
+            {"sumUs", sumMicroseconds_.load(std::memory_order_relaxed)},
+            {"p50Us", estimate(0.5)},
+            {"p99Us", estimate(0.99)},
+            {"p999Us", estimate(0.999)},
+            {"buckets", std::move(buckets)},
+        };
+    }
+    // #####################################################################################################################
+    TunnelSetupStats::TunnelSetupStats(std::chrono::milliseconds slowThreshold, bool pairSides)
+        : slowThreshold_{slowThreshold}
+        , pairSides_{pairSides}
+        , stages_{}
+        , brokerTotal_{}
+        , publisherTotal_{}
+        , transit_{}
+        , pairingGuard_{}
+        , unpaired_{}
+        , unpairedOrder_{}
+    {}
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSetupStats::record(TunnelTrace const& trace)
+    {
+        for (std::size_t i = 0; i != tunnelStageCount; ++i)
+        {
+            if (const auto latency = trace.latencyOf(static_cast<TunnelStage>(i)); latency)
+                stages_[i].record(*latency);
+        }
+
+        const auto publisherSide = isPublisherStage(trace.origin());
+        (publisherSide ? publisherTotal_ : brokerTotal_).record(trace.total());
+
+        if (!pairSides_)
+            return publisherSide ? logIfSlow(nullptr, &trace) : logIfSlow(&trace, nullptr);
+
+        std::vector<TunnelTrace> abandoned;
+        std::optional<TunnelTrace> other;
+        {
+            std::scoped_lock lock{pairingGuard_};
+            const auto now = std::chrono::steady_clock::now();
+            while (!unpairedOrder_.empty())
+            {
+                auto oldest = unpaired_.find(unpairedOrder_.front());
+                if (oldest != unpaired_.end())
+                {
+                    if (unpaired_.size() <= MaxUnpairedTraces && now - oldest->second.since < PairingTimeout)
+                        break;
+                    abandoned.push_back(std::move(oldest->second.trace));
+                    unpaired_.erase(oldest);
+                }
+                unpairedOrder_.pop_front();
+            }
+
+            auto waiting = unpaired_.find(trace.tunnelId());
+            if (waiting == unpaired_.end())
+            {
+                unpaired_.emplace(trace.tunnelId(), Unpaired{.trace = trace, .since = now});
+                unpairedOrder_.push_back(trace.tunnelId());
+            }
+            else if (isPublisherStage(waiting->second.trace.origin()) != publisherSide)
+            {
+                other = std::move(waiting->second.trace);
+                unpaired_.erase(waiting);
+            }
+        }
+
+        for (auto const& alone : abandoned)
+            isPublisherStage(alone.origin()) ? logIfSlow(nullptr, &alone) : logIfSlow(&alone, nullptr);
+        if (!other)
+            return;
+
+        auto const& broker = publisherSide ? *other : trace;
+        auto const& publisher = publisherSide ? trace : *other;
+        const auto waited = broker.latencyOf(TunnelStage::PublisherArrived);
+        const auto tokenSent = publisher.sinceOrigin(TunnelStage::TokenSent);
+        if (waited && tokenSent && *waited >= *tokenSent)
+            transit_.record(*waited - *tokenSent);
+        logIfSlow(&broker, &publisher);
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    void TunnelSetupStats::logIfSlow(TunnelTrace const* broker, TunnelTrace const* publisher) const
+    {
+        if (slowThreshold_.count() == 0)
+            return;
+        const auto brokerTotal = broker ? broker->total() : std::chrono::nanoseconds{0};
+        const auto publisherTotal = publisher ? publisher->total() : std::chrono::nanoseconds{0};
+        if (brokerTotal <= slowThreshold_ && publisherTotal <= slowThreshold_)
+            return;
+
+        const auto milliseconds = [](std::chrono::nanoseconds duration) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+        };
+        if (broker && publisher)
+        {
+            spdlog::warn(
+                "Slow tunnel setup for '{}', took {}ms on the broker and {}ms on the publisher side: {}",
+                broker->tunnelId(),
+                milliseconds(brokerTotal),
+                milliseconds(publisherTotal),
+                json{{"broker", *broker}, {"publisher", *publisher}}.dump());
+            return;
+        }
+        auto const& trace = broker ? *broker : *publisher;
+        spdlog::warn(
+            "Slow tunnel setup for '{}' on the {} side, took {}ms: {}",
+            trace.tunnelId(),
+            broker ? "broker" : "publisher",
+            milliseconds(trace.total()),
+            json(trace).dump());
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    json TunnelSetupStats::toJson() const
+    {
+        json stages = json::object();
+        for (std::size_t i = 0; i != tunnelStageCount; ++i)
+            stages[std::string{tunnelStageNames[i]}] = stages_[i].toJson();
+        return json{
+            {"stages", std::move(stages)},
+            {"brokerTotal", brokerTotal_.toJson()},
+            {"publisherTotal", publisherTotal_.toJson()},
+            {"transit", transit_.toJson()},
+        };
+    }
+    // #####################################################################################################################
+}
@@ -0,0 +1,173 @@
+#include <sharedpp/wire_encoding.hpp>
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std::string_literals;
+
+namespace TunnelBore
+{
+    namespace
+    {
+        constexpr std::array<std::string_view, 3> encodingNames{"json", "cbor", "msgpack"};
+
+        void appendBigEndian(std::string& target, std::uint64_t value, int bytes)
+        {
+            for (int i = bytes - 1; i >= 0; --i)
+                target.push_back(static_cast<char>((value >> (i * 8)) & 0xFF));
+        }
+
+        std::string arrayHeader(std::size_t count, WireEncoding encoding)
+        {
+            std::string header;
+            if (encoding == WireEncoding::Cbor)
+            {
+                // major type 4 (array)
+                if (count < 24)
+                    header.push_back(static_cast<char>(0x80 | count));
+                else if (count <= 0xFF)
+                {
+                    header.push_back(static_cast<char>(0x98));
+                    appendBigEndian(header, count, 1);
+                }
+                else if (count <= 0xFFFF)
+                {
+                    header.push_back(static_cast<char>(0x99));
+                    appendBigEndian(header, count, 2);
+                }
+                else
+                {
+                    header.push_back(static_cast<char>(0x9A));
+                    appendBigEndian(header, count, 4);
+                }
+            }
+            else if (encoding == WireEncoding::MessagePack)
+            {
+                if (count < 16)
+                    header.push_back(static_cast<char>(0x90 | count));
+                else if (count <= 0xFFFF)
+                {
+                    header.push_back(static_cast<char>(0xDC));
+                    appendBigEndian(header, count, 2);
+                }
+                else
+                {
+                    header.push_back(static_cast<char>(0xDD));
+                    appendBigEndian(header, count, 4);
+                }
+            }
+            return header;
+        }
+    }
+    //#####################################################################################################################
+    std::string_view toString(WireEncoding encoding)
+    {
+        return encodingNames[static_cast<std::size_t>(encoding)];
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::optional<WireEncoding> wireEncodingFromString(std::string_view name)
+    {
+        for (std::size_t i = 0; i != encodingNames.size(); ++i)
+        {
+            if (encodingNames[i] == name)
+                return static_cast<WireEncoding>(i);
+        }
+        return std::nullopt;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::vector<std::string> supportedWireEncodings()
+    {
+        return {"cbor", "msgpack", "json"};
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    WireEncoding selectWireEncoding(std::vector<std::string> const& peerPreference)
+    {
+        for (auto const& name : peerPreference)
+        {
+            if (auto encoding = wireEncodingFromString(name); encoding)
+                return *encoding;
+        }
+        return WireEncoding::Json;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    bool isBinary(WireEncoding encoding)
+    {
+        return encoding != WireEncoding::Json;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string encodeMessage(json const& message, WireEncoding encoding)
+    {
+        std::string result;
+        switch (encoding)
+        {
+            case WireEncoding::Json:
+                return message.dump();
+            case WireEncoding::Cbor:
+                json::to_cbor(message, result);
+                return result;
+            case WireEncoding::MessagePack:
+                json::to_msgpack(message, result);
+                return result;
+        }
+        throw std::invalid_argument("Unknown wire encoding.");
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    json decodeMessage(std::string_view data, WireEncoding encoding)
+    {
+        switch (encoding)
+        {
+            case WireEncoding::Json:
+                return json::parse(data.begin(), data.end());
+            case WireEncoding::Cbor:
+                return json::from_cbor(data.begin(), data.end());
+            case WireEncoding::MessagePack:
+                return json::from_msgpack(data.begin(), data.end());
+        }
+        throw std::invalid_argument("Unknown wire encoding.");
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    std::string joinEncodedMessages(std::vector<std::string>&& messages, WireEncoding encoding)
+    {
+        if (messages.empty())
+            return {};
+        if (messages.size() == 1)
+            return std::move(messages.front());
+
+        std::size_t size = 16;
+        for (auto const& message : messages)
+            size += message.size() + 1;
+
+        std::string frame = isBinary(encoding) ? arrayHeader(messages.size(), encoding) : std::string{};
+        frame.reserve(size);
+        for (std::size_t i = 0; i != messages.size(); ++i)
+        {
+            if (!isBinary(encoding) && i != 0)
+                frame.push_back('\n');
+            frame.append(messages[i]);
+        }
+        return frame;
+    }
+    //---------------------------------------------------------------------------------------------------------------------
+    EncodedFrame takeFrame(std::vector<EncodedMessage>& queue, std::size_t maxBytes, bool batching)
+    {
+        const auto encoding = queue.front().encoding;
+        std::vector<std::string> batch;
+        std::size_t batchBytes = 0;
+        for (auto& pending : queue)
+        {
+            if (!batch.empty() && (!batching || pending.encoding != encoding || batchBytes >= maxBytes))
+                break;
+            batchBytes += pending.payload.size();
+            batch.push_back(std::move(pending.payload));
+        }
+        const auto messages = batch.size();
+        queue.erase(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(messages));
+        return EncodedFrame{
+            .data = joinEncodedMessages(std::move(batch), encoding),
+            .encoding = encoding,
+            .messages = messages,
+        };
+    }
+    //#####################################################################################################################
+}
@@ -1,9 +1,9 @@
-import { writable } from 'svelte/store';
-
-export const sessionTokenPayloadDefault = {
-    exp: 0,
-    iat: 0,
-    identity: null,
-    iss: null,
-};
+import { writable } from 'svelte/store';
+
+export const sessionTokenPayloadDefault = {
+    exp: 0,
+    iat: 0,
+    identity: null,
+    iss: null,
+};
 export const sessionTokenPayload = writable(sessionTokenPayloadDefault);
\ No newline at end of file